@@ -8,12 +8,31 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "CoreStorage/block.h"
 
 //DMA buffer sizes
 #define FIS_SIZE 256
 #define CMD_BUF_SIZE 1024
+#define IDENTIFY_SIZE 512
+
+//Per port DMA block: command list, received FIS area and IDENTIFY buffer
+#define PORT_FIS_OFF (CMD_BUF_SIZE)
+#define PORT_IDENTIFY_OFF (CMD_BUF_SIZE + FIS_SIZE)
+#define PORT_DMA_SIZE (2 * CMD_BUF_SIZE)
+
+#define AHCI_SECTOR_SIZE 512
+#define AHCI_MAX_SECTORS 65535 //Per command, the 16-bit sector count
+#define AHCI_PRD_MAX_BYTES (4 * 1024 * 1024)
+
+//PRDTL allows 65535 entries, but entries are only ever split at page boundaries, so the largest
+//transfer a command can describe never needs more than one per page it touches
+#define AHCI_PRDT_MAX ((AHCI_MAX_SECTORS * AHCI_SECTOR_SIZE) / 4096 + 2)
+#define AHCI_CMDTABLE_SIZE (sizeof(ahci_cmdtable_t) + AHCI_PRDT_MAX * sizeof(ahci_prdt_t))
 
 //Register offsets
+#define HBA_CAP 0x0
 #define HBA_GHC 0x4
 #define HBA_IS 0x8
 #define HBA_PI 0xC
@@ -22,16 +41,22 @@
 #define HBA_PxSERR(x) (0x130 + 0x80 * x)
 #define HBA_PxTFD(x) (0x120 + 0x80 * x)
 #define HBA_PxSSTS(x) (0x128 + 0x80 * x)
+#define HBA_PxSCTL(x) (0x12C + 0x80 * x)
 #define HBA_PxCLB(x) (0x100 + 0x80 * x)
 #define HBA_PxCLBU(x) (0x104 + 0x80 * x)
 #define HBA_PxFB(x) (0x108 + 0x80 * x)
 #define HBA_PxFBU(x) (0x10C + 0x80 * x)
 #define HBA_PxIS(x) (0x110 + 0x80 * x)
 #define HBA_PxIE(x) (0x114 + 0x80 * x)
+#define HBA_PxSIG(x) (0x124 + 0x80 * x)
 #define HBA_PxSACT(x) (0x134 + 0x80 * x)
 #define HBA_PxCI(x) (0x138 + 0x80 * x)
 
 //Register bits and masks
+#define HBA_CAP_NCS(x) ((((x) >> 8) & 0x1F) + 1) //Command slots per port
+#define HBA_CAP_SNCQ (1u << 30)
+#define HBA_CAP_S64A (1u << 31)
+
 #define HBA_PxCMD_ST (1 << 0)
 #define HBA_PxCMD_CR (1 << 15)
 #define HBA_PxCMD_FR (1 << 14)
@@ -39,16 +64,34 @@
 
 #define HBA_PxTFD_BSY (1 << 7)
 #define HBA_PxTFD_DRQ (1 << 3)
+#define HBA_PxTFD_ERR (1 << 0)
 
 #define HBA_PxIS_DHRS (1 << 0)
 #define HBA_PxIS_DSS (1 << 2)
+#define HBA_PxIS_SDBS (1 << 3)
 #define HBA_PxIS_DPS (1 << 5)
+#define HBA_PxIS_IFS (1 << 27)
+#define HBA_PxIS_HBDS (1 << 28)
+#define HBA_PxIS_HBFS (1 << 29)
+#define HBA_PxIS_TFES (1 << 30)
+#define HBA_PxIS_ERRORS (HBA_PxIS_IFS | HBA_PxIS_HBDS | HBA_PxIS_HBFS | HBA_PxIS_TFES)
+
+#define HBA_PxSIG_ATA 0x00000101
 
 #define HBA_PxSSTS_DET_MASK 0xF
+#define HBA_PxSSTS_DET_PHY 3 //Device present and the link is up
+
+#define HBA_PxSCTL_DET_MASK 0xF
+#define HBA_PxSCTL_DET_INIT 1 //Hold the link in reset, i.e. COMRESET
 
 typedef enum
 {
-    ATA_CMD_READ_DMA_EXT = 0x25
+    ATA_CMD_READ_DMA_EXT = 0x25,
+    ATA_CMD_WRITE_DMA_EXT = 0x35,
+    ATA_CMD_READ_FPDMA_QUEUED = 0x60,
+    ATA_CMD_WRITE_FPDMA_QUEUED = 0x61,
+    ATA_CMD_FLUSH_CACHE_EXT = 0xEA,
+    ATA_CMD_IDENTIFY = 0xEC,
 } ATA_CMD;
 
 typedef enum
@@ -145,11 +188,9 @@ typedef struct
     uint32_t baseAddress;
     uint32_t baseAddressUpper;
     uint32_t rsv0;
-    union {
-        uint32_t byteCount : 22;
-        uint32_t rsv1 : 9;
-        uint32_t intCompletion : 1;
-    };
+    uint32_t byteCount : 22; //Bytes to transfer minus one
+    uint32_t rsv1 : 9;
+    uint32_t intCompletion : 1;
 } ahci_prdt_t;
 
 typedef struct
@@ -157,7 +198,7 @@ typedef struct
     uint8_t cmd_fis[64];
     uint8_t atapiCMD[16];
     uint8_t rsv[48];
-    ahci_prdt_t prdt[128];
+    ahci_prdt_t prdt[0]; //AHCI_PRDT_MAX entries
 } ahci_cmdtable_t;
 
 typedef struct
@@ -166,6 +207,41 @@ typedef struct
     uintptr_t virt_addr;
 } ahci_dma_addr_t;
 
+//Called from the interrupt handler once a command finishes, status is 0 on success and -1 if it failed
+typedef void (*ahci_callback_t)(void *arg, int status);
+
+typedef struct
+{
+    ahci_callback_t callback;
+    void *arg;
+} ahci_slot_t;
+
+typedef struct
+{
+    int index;
+    bool ncq;            //Both the HBA and the device do native command queueing
+    int slot_cnt;        //Command slots in use, the queue depth
+    uint64_t sector_cnt; //Device capacity in sectors, from IDENTIFY
+    bool rotational;     //Spinning media, requests are worth sorting
+    bool write_cache;    //Volatile write cache enabled, writes need a flush to be durable
+    void *block;         //Block layer handle, NULL until registered
+    bool offline;        //Error recovery couldn't bring the device back, every command is refused
+
+    ahci_dma_addr_t dma;
+    ahci_cmd_t *cmd_list;
+    ahci_dma_addr_t cmd_tables[32]; //One per slot, so commands can be built in parallel
+
+    //Slots owned by a submitter, and the subset of those already handed to the HBA
+    uint32_t reserved;
+    uint32_t issued;
+    uint32_t exclusive; //Slot of a non-queued command that owns an NCQ port, nothing may overlap it
+    ahci_slot_t slots[32];
+
+    uint64_t completions;
+    uint64_t errors;
+    int lock;
+} ahci_port_t;
+
 typedef struct ahci_instance
 {
     union {
@@ -173,13 +249,12 @@ typedef struct ahci_instance
         uintptr_t cfg;
     };
     int interrupt_vec;
+    uint32_t cap;
     uint32_t activeDevices;
     uint32_t implPortCnt;
-    uint32_t activeCmdBits[32];
-    uint32_t finishedCmdBits[32];
     int lock;
 
-    ahci_dma_addr_t port_dma;
+    ahci_port_t *ports[32];
 
     struct ahci_instance *next;
 } ahci_instance_t;
@@ -197,7 +272,30 @@ PRIVATE uint32_t ahci_readports(ahci_instance_t *inst);
 PRIVATE void ahci_obtainownership(ahci_instance_t *inst);
 PRIVATE void ahci_reportawareness(ahci_instance_t *inst);
 PRIVATE int ahci_initializeport(ahci_instance_t *inst, int index);
-PRIVATE int ahci_getcmdslot(ahci_instance_t *inst, int index);
+PRIVATE int ahci_getcmdslot(ahci_instance_t *inst, int index, bool exclusive);
+
+//Queue a transfer of len bytes (a sector multiple) at sector lba, callback runs once it finishes.
+//addr only needs to be 2 byte aligned, the buffer doesn't have to be physically contiguous.
+//Returns -2 if every command slot of the port is busy, -1 if the request is invalid.
+PRIVATE int ahci_submit(ahci_instance_t *inst, int index, bool write, uint64_t lba, void *addr, uint32_t len, ahci_callback_t callback, void *arg);
+
+//Queue a block layer request, read/write of all its segments or a flush, same returns as ahci_submit
+PRIVATE int ahci_submitreq(ahci_instance_t *inst, int index, block_request_t *req, ahci_callback_t callback, void *arg);
+
+//Queue a FLUSH CACHE EXT. On an NCQ port it needs the port to itself, -2 until the queue has drained.
+PRIVATE int ahci_flush(ahci_instance_t *inst, int index, ahci_callback_t callback, void *arg);
+
+//Retire finished commands and run their callbacks, called from the interrupt handler
+PRIVATE void ahci_port_interrupt(ahci_instance_t *inst, int index);
+
+//Synchronous versions, wait for a free slot and for the command to finish
 PRIVATE int ahci_readdev(ahci_instance_t *inst, int index, uint64_t loc, void *addr, uint32_t len);
+PRIVATE int ahci_writedev(ahci_instance_t *inst, int index, uint64_t loc, void *addr, uint32_t len);
+PRIVATE int ahci_flushdev(ahci_instance_t *inst, int index);
+
+PRIVATE ahci_instance_t *ahci_getinstances(void);
+
+//Make the port available through CoreStorage, once its interrupts are enabled
+PRIVATE int ahci_registerblock(ahci_instance_t *inst, int index);
 
 #endif
\ No newline at end of file
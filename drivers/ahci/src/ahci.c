@@ -7,9 +7,12 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <cardinal/local_spinlock.h>
 
 #include "SysVirtualMemory/vmem.h"
+#include "SysPhysicalMemory/phys_mem.h"
 #include "SysTaskMgr/task.h"
 #include "SysTimer/timer.h"
 
@@ -73,18 +76,108 @@ PRIVATE void ahci_reportawareness(ahci_instance_t *inst)
     ahci_write32(inst, HBA_GHC, (1 << 31));
 }
 
+//Wait for the given bits of a register to clear, false if they're still set after timeout_ns
+static bool ahci_waitclear(ahci_instance_t *inst, uint32_t off, uint32_t mask, uint64_t timeout_ns)
+{
+    uint64_t deadline = timer_timestamp_ns() + timeout_ns;
+    while (ahci_read32(inst, off) & mask)
+        if (timer_timestamp_ns() > deadline)
+            return false;
+    return true;
+}
+
+//Without 64-bit addressing every DMA structure has to live below 4GiB
+static physmem_alloc_flags_t ahci_dmaflags(ahci_instance_t *inst)
+{
+    physmem_alloc_flags_t flags = physmem_alloc_flags_zero | physmem_alloc_flags_data;
+    if (!(inst->cap & HBA_CAP_S64A))
+        flags |= physmem_alloc_flags_32bit;
+    return flags;
+}
+
+//Command tables are allocated separately per slot, each is large enough for any single command
+static int ahci_alloctable(ahci_instance_t *inst, ahci_port_t *port, int slot)
+{
+    ahci_dma_addr_t *table = &port->cmd_tables[slot];
+    table->phys_addr = (uint64_t)pagealloc_alloc(-1, -1, ahci_dmaflags(inst), AHCI_CMDTABLE_SIZE);
+    if (table->phys_addr == (uint64_t)-1)
+        return -1;
+    table->virt_addr = (uintptr_t)vmem_phystovirt(table->phys_addr, AHCI_CMDTABLE_SIZE, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
+
+    port->cmd_list[slot].PRDTL = 0;
+    port->cmd_list[slot].commandTableBaseAddress = (uint32_t)table->phys_addr;
+    port->cmd_list[slot].commandTableBaseAddressUpper = (uint32_t)(table->phys_addr >> 32);
+    return 0;
+}
+
+static void ahci_freeport(ahci_port_t *port)
+{
+    for (int i = 0; i < 32; i++)
+        if (port->cmd_tables[i].phys_addr != 0)
+            pagealloc_free(port->cmd_tables[i].phys_addr, AHCI_CMDTABLE_SIZE);
+    pagealloc_free(port->dma.phys_addr, PORT_DMA_SIZE);
+    free(port);
+}
+
+//Issue IDENTIFY DEVICE on slot 0 and wait for it, before the port's interrupts are enabled
+static int ahci_identify(ahci_instance_t *inst, ahci_port_t *port)
+{
+    int index = port->index;
+    uint64_t buf_phys = port->dma.phys_addr + PORT_IDENTIFY_OFF;
+    ahci_cmdtable_t *cmd_table = (ahci_cmdtable_t *)port->cmd_tables[0].virt_addr;
+
+    cmd_table->prdt[0].baseAddress = (uint32_t)buf_phys;
+    cmd_table->prdt[0].baseAddressUpper = (uint32_t)(buf_phys >> 32);
+    cmd_table->prdt[0].rsv0 = 0;
+    cmd_table->prdt[0].rsv1 = 0;
+    cmd_table->prdt[0].byteCount = IDENTIFY_SIZE - 1;
+    cmd_table->prdt[0].intCompletion = 0;
+
+    register_h2d_fis_t *fis = (register_h2d_fis_t *)cmd_table->cmd_fis;
+    memset(fis, 0, sizeof(register_h2d_fis_t));
+    fis->fisType = fis_type_RegisterH2D;
+    fis->cmd = 1;
+    fis->command = ATA_CMD_IDENTIFY;
+
+    ahci_cmd_info_t info;
+    memset(&info, 0, sizeof(info));
+    info.cfl = sizeof(register_h2d_fis_t) / sizeof(uint32_t);
+    port->cmd_list[0].info = info;
+    port->cmd_list[0].PRDTL = 1;
+    port->cmd_list[0].byteCount = 0;
+
+    ahci_write32(inst, HBA_PxCI(index), 1);
+    bool done = ahci_waitclear(inst, HBA_PxCI(index), 1, 1000 * 1000 * 1000ull);
+    ahci_write32(inst, HBA_PxIS(index), 0xFFFFFFFF);
+    if (!done || (ahci_read32(inst, HBA_PxTFD(index)) & HBA_PxTFD_ERR))
+        return -1;
+
+    uint16_t *id = (uint16_t *)(port->dma.virt_addr + PORT_IDENTIFY_OFF);
+    if (id[83] & (1 << 10)) //48-bit addressing
+        port->sector_cnt = (uint64_t)id[100] | ((uint64_t)id[101] << 16) | ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    else
+        port->sector_cnt = (uint64_t)id[60] | ((uint64_t)id[61] << 16);
+
+    //Queue depth is the smaller of what the HBA and the device can keep outstanding
+    port->slot_cnt = HBA_CAP_NCS(inst->cap);
+    port->ncq = (inst->cap & HBA_CAP_SNCQ) && (id[76] & (1 << 8));
+    port->rotational = (id[217] != 1); //Nominal media rotation rate, 1 for solid state
+    port->write_cache = (id[85] & (1 << 5)) != 0;
+    if (port->ncq)
+        port->slot_cnt = MIN(port->slot_cnt, (id[75] & 0x1F) + 1);
+    return 0;
+}
+
 PRIVATE int ahci_initializeport(ahci_instance_t *inst, int index)
 {
     uint32_t cmd = ahci_read32(inst, HBA_PxCMD(index));
 
-    uint32_t dma_base = (uint32_t)inst->port_dma.phys_addr;
-    uintptr_t dma_vaddr = inst->port_dma.virt_addr;
-
     //Ensure the device is idle before starting initialization
     if ((cmd & (HBA_PxCMD_FRE | HBA_PxCMD_FR | HBA_PxCMD_CR | HBA_PxCMD_ST)) != 0)
     {
         //Attempt to clear the offending bits
         cmd &= ~(HBA_PxCMD_ST | HBA_PxCMD_FRE);
+        ahci_write32(inst, HBA_PxCMD(index), cmd);
 
         for (int i = 0; i < 5; i++)
         {
@@ -100,24 +193,38 @@ PRIVATE int ahci_initializeport(ahci_instance_t *inst, int index)
     if (ahci_read32(inst, HBA_PxSACT(index)) != 0)
         PANIC("Expected 1!");
 
-    //Command buffer is 1024 bytes
-    ahci_write32(inst, HBA_PxCLB(index), dma_base + (index * CMD_BUF_SIZE));
-    ahci_write32(inst, HBA_PxCLBU(index), 0);
+    ahci_port_t *port = (ahci_port_t *)malloc(sizeof(ahci_port_t));
+    if (port == NULL)
+        return -1;
+    memset(port, 0, sizeof(ahci_port_t));
+    port->index = index;
 
-    //FIS buffer is 256 bytes
-    ahci_write32(inst, HBA_PxFB(index), dma_base + 32 * CMD_BUF_SIZE + (index * FIS_SIZE));
-    ahci_write32(inst, HBA_PxFBU(index), 0);
+    port->dma.phys_addr = (uint64_t)pagealloc_alloc(-1, -1, ahci_dmaflags(inst), PORT_DMA_SIZE);
+    if (port->dma.phys_addr == (uint64_t)-1)
+    {
+        free(port);
+        return -1;
+    }
+    port->dma.virt_addr = (uintptr_t)vmem_phystovirt(port->dma.phys_addr, PORT_DMA_SIZE, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
+    port->cmd_list = (ahci_cmd_t *)port->dma.virt_addr;
 
-    //Setup the first command table entry
-    ahci_cmd_t *cmd_entry = (ahci_cmd_t *)(dma_vaddr + (index * CMD_BUF_SIZE));
-    for (int i = 0; i < 32; i++)
+    //IDENTIFY runs on slot 0, the rest are set up once the queue depth is known
+    if (ahci_alloctable(inst, port, 0) != 0)
     {
-        cmd_entry->PRDTL = 64;
-        cmd_entry->commandTableBaseAddress = (dma_base + 32 * (CMD_BUF_SIZE + FIS_SIZE) + index * sizeof(ahci_cmdtable_t));
-        cmd_entry->commandTableBaseAddressUpper = 0;
-        cmd_entry++;
+        ahci_freeport(port);
+        return -1;
     }
 
+    uint64_t dma_base = port->dma.phys_addr;
+
+    //Command list is 1024 bytes
+    ahci_write32(inst, HBA_PxCLB(index), (uint32_t)dma_base);
+    ahci_write32(inst, HBA_PxCLBU(index), (uint32_t)(dma_base >> 32));
+
+    //FIS buffer is 256 bytes
+    ahci_write32(inst, HBA_PxFB(index), (uint32_t)(dma_base + PORT_FIS_OFF));
+    ahci_write32(inst, HBA_PxFBU(index), (uint32_t)((dma_base + PORT_FIS_OFF) >> 32));
+
     //Enable receiving FIS's
     ahci_write32(inst, HBA_PxCMD(index), ahci_read32(inst, HBA_PxCMD(index)) | HBA_PxCMD_FRE);
 
@@ -130,110 +237,455 @@ PRIVATE int ahci_initializeport(ahci_instance_t *inst, int index)
     //and enabling the HBA
 
     if ((tfd & (HBA_PxTFD_BSY | HBA_PxTFD_DRQ)) != 0)
+    {
+        ahci_freeport(port);
         return -2; //The device is not in functioning order, TODO we might want to report this
+    }
 
     uint32_t ssts = ahci_read32(inst, HBA_PxSSTS(index));
 
     if ((ssts & HBA_PxSSTS_DET_MASK) != 3)
+    {
+        ahci_freeport(port);
         return -3; //TODO report this, by writing to a virtual log file or something
+    }
+
+    //Only plain SATA disks for now, ATAPI and port multipliers need their own command sets
+    if (ahci_read32(inst, HBA_PxSIG(index)) != HBA_PxSIG_ATA)
+    {
+        ahci_freeport(port);
+        return -4;
+    }
+
+    ahci_write32(inst, HBA_PxCMD(index), ahci_read32(inst, HBA_PxCMD(index)) | HBA_PxCMD_ST);
+
+    if (ahci_identify(inst, port) != 0)
+    {
+        ahci_write32(inst, HBA_PxCMD(index), ahci_read32(inst, HBA_PxCMD(index)) & ~HBA_PxCMD_ST);
+        ahci_waitclear(inst, HBA_PxCMD(index), HBA_PxCMD_CR, 500 * 1000 * 1000ull);
+        ahci_freeport(port);
+        return -5;
+    }
 
-    //The device is functional, mark it as so and start it up
+    //Make do with fewer slots if memory runs short
+    for (int i = 1; i < port->slot_cnt; i++)
+        if (ahci_alloctable(inst, port, i) != 0)
+        {
+            port->slot_cnt = i;
+            break;
+        }
+
+    //The device is functional, mark it as so
     local_spinlock_lock(&inst->lock);
+    inst->ports[index] = port;
     inst->activeDevices |= (1 << index);
-    inst->activeCmdBits[index] = 0;
-    inst->finishedCmdBits[index] = 0;
     local_spinlock_unlock(&inst->lock);
 
-    ahci_write32(inst, HBA_PxCMD(index), ahci_read32(inst, HBA_PxCMD(index)) | HBA_PxCMD_ST);
+    {
+        char tmpbuf[20];
+        DEBUG_PRINT("[AHCI] Port ");
+        DEBUG_PRINT(itoa(index, tmpbuf, 10));
+        DEBUG_PRINT(" sectors: ");
+        DEBUG_PRINT(ltoa(port->sector_cnt, tmpbuf, 10));
+        DEBUG_PRINT(port->ncq ? " NCQ depth: " : " queue depth: ");
+        DEBUG_PRINT(itoa(port->slot_cnt, tmpbuf, 10));
+        DEBUG_PRINT("\r\n");
+    }
     return 0;
 }
 
-PRIVATE int ahci_getcmdslot(ahci_instance_t *inst, int index)
+//Reserve a free command slot of the port, -1 if none can be had right now.
+//On an NCQ port an exclusive slot is only handed out once the port is idle, and nothing else
+//is handed out until it completes.
+PRIVATE int ahci_getcmdslot(ahci_instance_t *inst, int index, bool exclusive)
 {
-    local_spinlock_lock(&inst->lock);
-    uint32_t cmd_slots = inst->activeCmdBits[index];
+    ahci_port_t *port = inst->ports[index];
+    uint32_t usable = (port->slot_cnt >= 32) ? 0xFFFFFFFF : ((1u << port->slot_cnt) - 1);
+    int slot = -1;
+
+    int cli_state = cli();
+    local_spinlock_lock(&port->lock);
+    uint32_t avail = ~port->reserved & usable;
+    if (port->exclusive != 0 || (exclusive && port->ncq && port->reserved != 0))
+        avail = 0;
+    if (avail != 0)
+    {
+        slot = __builtin_ctz(avail);
+        port->reserved |= (1u << slot);
+        if (exclusive && port->ncq)
+            port->exclusive = (1u << slot);
+    }
+    local_spinlock_unlock(&port->lock);
+    sti(cli_state);
 
-    for (int i = 0; i < 32; i++)
-        if (~cmd_slots & (1 << i))
-        {
-            local_spinlock_unlock(&inst->lock);
-            return i;
-        }
+    return slot;
+}
 
-    local_spinlock_unlock(&inst->lock);
-    return -1;
+static void ahci_putcmdslot(ahci_port_t *port, int slot)
+{
+    int cli_state = cli();
+    local_spinlock_lock(&port->lock);
+    port->reserved &= ~(1u << slot);
+    port->exclusive &= ~(1u << slot);
+    local_spinlock_unlock(&port->lock);
+    sti(cli_state);
 }
 
-PRIVATE int ahci_readdev(ahci_instance_t *inst, int index, uint64_t loc, void *addr, uint32_t len)
+static void ahci_setprd(ahci_prdt_t *prd, uint64_t phys, uint32_t len)
 {
+    prd->baseAddress = (uint32_t)phys;
+    prd->baseAddressUpper = (uint32_t)(phys >> 32);
+    prd->rsv0 = 0;
+    prd->rsv1 = 0;
+    prd->byteCount = len - 1;
+    prd->intCompletion = 0;
+}
 
-    uint32_t dma_base = (uint32_t)inst->port_dma.phys_addr;
-    uintptr_t dma_vaddr = inst->port_dma.virt_addr;
+//Describe the buffer in the slot's PRDT starting at entry cnt, returns the new entry count or -1 if
+//part of it isn't mapped. The buffer is walked a page at a time, runs of physically contiguous pages
+//share an entry up to the 4MiB a PRD can hold.
+static int ahci_fillprdt(ahci_cmdtable_t *cmd_table, int cnt, void *addr, uint32_t len)
+{
+    uintptr_t virt = (uintptr_t)addr;
+    uint64_t run_phys = 0;
+    uint32_t run_len = 0;
 
-    uint32_t target_len = len;
-    if (target_len % (32 * 1024))
-        target_len -= target_len % (32 * 1024);
+    while (len > 0)
+    {
+        uint64_t phys = 0;
+        if (vmem_virttophys(NULL, (intptr_t)virt, (intptr_t *)&phys) != 0)
+            return -1;
+        uint32_t chunk = MIN(len, KiB(4) - (virt & (KiB(4) - 1)));
 
-    //Clear interrupt flags
-    ahci_write32(inst, HBA_PxIS(index), 0xFFFFFFFF);
+        if (run_len != 0 && run_phys + run_len == phys && run_len + chunk <= AHCI_PRD_MAX_BYTES)
+            run_len += chunk;
+        else
+        {
+            if (run_len != 0)
+            {
+                if (cnt == AHCI_PRDT_MAX)
+                    return -1;
+                ahci_setprd(&cmd_table->prdt[cnt++], run_phys, run_len);
+            }
+            run_phys = phys;
+            run_len = chunk;
+        }
 
-    int slot = ahci_getcmdslot(inst, index);
+        virt += chunk;
+        len -= chunk;
+    }
 
-    ahci_cmd_t *ahci_cmd = (ahci_cmd_t *)(dma_vaddr + (index * CMD_BUF_SIZE));
-    ahci_cmd += slot;
+    if (run_len != 0)
+    {
+        if (cnt == AHCI_PRDT_MAX)
+            return -1;
+        ahci_setprd(&cmd_table->prdt[cnt++], run_phys, run_len);
+    }
+    return cnt;
+}
 
-    ahci_cmd->info.cfl = sizeof(register_h2d_fis_t) / sizeof(uint32_t);
-    ahci_cmd->info.write = 0;
-    ahci_cmd->info.atapi = 0;
+//Fill in the command header and hand the slot to the HBA
+//-1 if the port went offline since the slot was reserved, the slot is released again
+static int ahci_issue(ahci_instance_t *inst, ahci_port_t *port, int slot, bool write, bool queued, int prd_cnt, ahci_callback_t callback, void *arg)
+{
+    int index = port->index;
 
-    ahci_cmd->PRDTL = (target_len / (32 * 1024));
+    ahci_cmd_info_t info;
+    memset(&info, 0, sizeof(info));
+    info.cfl = sizeof(register_h2d_fis_t) / sizeof(uint32_t);
+    info.write = write ? 1 : 0;
 
-    ahci_cmdtable_t *cmd_table = (ahci_cmdtable_t *)(dma_vaddr + 32 * (CMD_BUF_SIZE + FIS_SIZE) + index * sizeof(ahci_cmdtable_t));
+    ahci_cmd_t *ahci_cmd = &port->cmd_list[slot];
+    ahci_cmd->info = info;
+    ahci_cmd->PRDTL = (uint16_t)prd_cnt;
+    ahci_cmd->byteCount = 0;
 
-    uint64_t p_addr = 0;
-    vmem_virttophys(NULL, (intptr_t)addr, (intptr_t *)&p_addr);
-    uint64_t p_curaddr = p_addr;
+    port->slots[slot].callback = callback;
+    port->slots[slot].arg = arg;
 
-    int i = 0;
-    for (; i < 127 && target_len > 32 * 1024; i++)
+    //Issued under the lock so the interrupt handler never sees a slot it doesn't know about
+    int cli_state = cli();
+    local_spinlock_lock(&port->lock);
+    if (port->offline)
     {
-        cmd_table->prdt[i].baseAddress = (uint32_t)p_curaddr;
-        cmd_table->prdt[i].baseAddressUpper = (uint32_t)(p_curaddr >> 32);
-        cmd_table->prdt[i].rsv0 = 0;
-        cmd_table->prdt[i].rsv1 = 0;
-        cmd_table->prdt[i].byteCount = 32 * 1024;
-        cmd_table->prdt[i].intCompletion = 0;
-
-        target_len -= 32 * 1024;
-        p_curaddr += 32 * 1024;
+        port->reserved &= ~(1u << slot);
+        port->exclusive &= ~(1u << slot);
+        local_spinlock_unlock(&port->lock);
+        sti(cli_state);
+        return -1;
     }
-    cmd_table->prdt[i].baseAddress = (uint32_t)p_curaddr;
-    cmd_table->prdt[i].baseAddressUpper = (uint32_t)(p_curaddr >> 32);
-    cmd_table->prdt[i].rsv0 = 0;
-    cmd_table->prdt[i].rsv1 = 0;
-    cmd_table->prdt[i].byteCount = target_len;
-    cmd_table->prdt[i].intCompletion = 0;
+    port->issued |= (1u << slot);
+    if (queued)
+        ahci_write32(inst, HBA_PxSACT(index), 1u << slot);
+    ahci_write32(inst, HBA_PxCI(index), 1u << slot);
+    local_spinlock_unlock(&port->lock);
+    sti(cli_state);
+    return 0;
+}
 
+static register_h2d_fis_t *ahci_initfis(ahci_port_t *port, int slot, uint8_t command)
+{
+    ahci_cmdtable_t *cmd_table = (ahci_cmdtable_t *)port->cmd_tables[slot].virt_addr;
     register_h2d_fis_t *fis = (register_h2d_fis_t *)cmd_table->cmd_fis;
+    memset(fis, 0, sizeof(register_h2d_fis_t));
     fis->fisType = fis_type_RegisterH2D;
     fis->cmd = 1;
-    fis->command = ATA_CMD_READ_DMA_EXT;
-    fis->lba_lo = (uint16_t)loc;
-    fis->lba_mid = (uint8_t)(loc >> 16);
-    fis->lba_mid_h = (uint16_t)(loc >> 24);
-    fis->lba_hi = (uint8_t)(loc >> 40);
-
+    fis->command = command;
     fis->device = 1 << 6; //LBA48 mode
-    fis->count = target_len / 512;
+    return fis;
+}
 
-    ahci_write32(inst, HBA_PxSACT(index), 1 << slot);
-    ahci_write32(inst, HBA_PxCI(index), 1 << slot);
+//Build the read/write FIS for a slot whose PRDT is filled in and hand it to the HBA
+static int ahci_startrw(ahci_instance_t *inst, ahci_port_t *port, int slot, bool write, uint64_t lba, uint32_t sectors, int prd_cnt, ahci_callback_t callback, void *arg)
+{
+    register_h2d_fis_t *fis;
+    if (port->ncq)
+    {
+        //The sector count moves to the feature field, the count field carries the tag
+        fis = ahci_initfis(port, slot, write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED);
+        fis->features_lo = (uint8_t)sectors;
+        fis->features_hi = (uint8_t)(sectors >> 8);
+        fis->count = (uint16_t)(slot << 3);
+    }
+    else
+    {
+        fis = ahci_initfis(port, slot, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+        fis->count = (uint16_t)sectors;
+    }
+    fis->lba_lo = (uint16_t)lba;
+    fis->lba_mid = (uint8_t)(lba >> 16);
+    fis->lba_mid_h = (uint16_t)(lba >> 24);
+    fis->lba_hi = (uint8_t)(lba >> 40);
 
-    local_spinlock_lock(&inst->lock);
-    inst->activeCmdBits[index] |= (1 << slot);
-    local_spinlock_unlock(&inst->lock);
+    return ahci_issue(inst, port, slot, write, port->ncq, prd_cnt, callback, arg);
+}
 
-    while (ahci_read32(inst, HBA_PxCI(index)) & (1 << slot))
-        DEBUG_PRINT("[AHCI] Read Pending\r\n");
-    return 0;
-}
\ No newline at end of file
+PRIVATE int ahci_submit(ahci_instance_t *inst, int index, bool write, uint64_t lba, void *addr, uint32_t len, ahci_callback_t callback, void *arg)
+{
+    ahci_port_t *port = (index >= 0 && index < 32) ? inst->ports[index] : NULL;
+    if (port == NULL || port->offline || callback == NULL || len == 0 || (len % AHCI_SECTOR_SIZE) != 0 || ((uintptr_t)addr & 1))
+        return -1;
+
+    uint32_t sectors = len / AHCI_SECTOR_SIZE;
+    if (sectors > AHCI_MAX_SECTORS || lba + sectors > port->sector_cnt)
+        return -1;
+
+    int slot = ahci_getcmdslot(inst, index, false);
+    if (slot < 0)
+        return -2;
+
+    int prd_cnt = ahci_fillprdt((ahci_cmdtable_t *)port->cmd_tables[slot].virt_addr, 0, addr, len);
+    if (prd_cnt < 0)
+    {
+        ahci_putcmdslot(port, slot);
+        return -1;
+    }
+
+    return ahci_startrw(inst, port, slot, write, lba, sectors, prd_cnt, callback, arg);
+}
+
+PRIVATE int ahci_submitreq(ahci_instance_t *inst, int index, block_request_t *req, ahci_callback_t callback, void *arg)
+{
+    ahci_port_t *port = (index >= 0 && index < 32) ? inst->ports[index] : NULL;
+    if (port == NULL || port->offline || callback == NULL)
+        return -1;
+    if (req->op == block_op_flush)
+        return ahci_flush(inst, index, callback, arg);
+    if (req->op != block_op_read && req->op != block_op_write)
+        return -1;
+    if (req->sectors == 0 || req->sectors > AHCI_MAX_SECTORS || req->lba + req->sectors > port->sector_cnt)
+        return -1;
+
+    int slot = ahci_getcmdslot(inst, index, false);
+    if (slot < 0)
+        return -2;
+
+    //Every segment of every bio goes into the one PRDT
+    ahci_cmdtable_t *cmd_table = (ahci_cmdtable_t *)port->cmd_tables[slot].virt_addr;
+    int prd_cnt = 0;
+    for (block_bio_t *bio = req->bios; bio != NULL && prd_cnt >= 0; bio = bio->next)
+        for (uint32_t i = 0; i < bio->seg_cnt && prd_cnt >= 0; i++)
+        {
+            if (((uintptr_t)bio->segs[i].addr & 1) || (bio->segs[i].len & 1))
+                prd_cnt = -1;
+            else
+                prd_cnt = ahci_fillprdt(cmd_table, prd_cnt, bio->segs[i].addr, bio->segs[i].len);
+        }
+    if (prd_cnt < 0)
+    {
+        ahci_putcmdslot(port, slot);
+        return -1;
+    }
+
+    return ahci_startrw(inst, port, slot, req->op == block_op_write, req->lba, req->sectors, prd_cnt, callback, arg);
+}
+
+PRIVATE int ahci_flush(ahci_instance_t *inst, int index, ahci_callback_t callback, void *arg)
+{
+    ahci_port_t *port = (index >= 0 && index < 32) ? inst->ports[index] : NULL;
+    if (port == NULL || port->offline || callback == NULL)
+        return -1;
+
+    int slot = ahci_getcmdslot(inst, index, true);
+    if (slot < 0)
+        return -2;
+
+    ahci_initfis(port, slot, ATA_CMD_FLUSH_CACHE_EXT);
+    return ahci_issue(inst, port, slot, false, false, 0, callback, arg);
+}
+
+//Reset the link of a stopped port whose device stays busy, runs from the interrupt handler so it
+//spins rather than sleeps. False if the device doesn't come back.
+static bool ahci_comreset(ahci_instance_t *inst, int index)
+{
+    //FIS receive has to be off while the link is down
+    ahci_write32(inst, HBA_PxCMD(index), ahci_read32(inst, HBA_PxCMD(index)) & ~HBA_PxCMD_FRE);
+    if (!ahci_waitclear(inst, HBA_PxCMD(index), HBA_PxCMD_FR, 500 * 1000 * 1000ull))
+        return false;
+
+    //DET=1 for at least 1ms sends COMRESET, clearing it lets the link renegotiate
+    uint32_t sctl = ahci_read32(inst, HBA_PxSCTL(index)) & ~HBA_PxSCTL_DET_MASK;
+    ahci_write32(inst, HBA_PxSCTL(index), sctl | HBA_PxSCTL_DET_INIT);
+    uint64_t until = timer_timestamp_ns() + 2 * 1000 * 1000ull;
+    while (timer_timestamp_ns() < until)
+        ;
+    ahci_write32(inst, HBA_PxSCTL(index), sctl);
+
+    uint64_t deadline = timer_timestamp_ns() + 1000 * 1000 * 1000ull;
+    while ((ahci_read32(inst, HBA_PxSSTS(index)) & HBA_PxSSTS_DET_MASK) != HBA_PxSSTS_DET_PHY)
+        if (timer_timestamp_ns() > deadline)
+            return false;
+
+    ahci_write32(inst, HBA_PxSERR(index), 0x07FF0F03);
+    ahci_write32(inst, HBA_PxCMD(index), ahci_read32(inst, HBA_PxCMD(index)) | HBA_PxCMD_FRE);
+
+    //The device reports its signature and drops BSY once it's done resetting
+    return ahci_waitclear(inst, HBA_PxTFD(index), HBA_PxTFD_BSY | HBA_PxTFD_DRQ, 5000 * 1000 * 1000ull);
+}
+
+//Stop and restart the command engine after an error, which drops everything still queued on the
+//port. A device still busy afterwards gets a COMRESET, false if even that doesn't recover it and
+//the command engine was left stopped.
+static bool ahci_recoverport(ahci_instance_t *inst, int index)
+{
+    ahci_write32(inst, HBA_PxCMD(index), ahci_read32(inst, HBA_PxCMD(index)) & ~HBA_PxCMD_ST);
+    if (!ahci_waitclear(inst, HBA_PxCMD(index), HBA_PxCMD_CR, 500 * 1000 * 1000ull))
+        return false;
+
+    ahci_write32(inst, HBA_PxSERR(index), 0x07FF0F03);
+    ahci_write32(inst, HBA_PxIS(index), 0xFFFFFFFF);
+
+    if ((ahci_read32(inst, HBA_PxTFD(index)) & (HBA_PxTFD_BSY | HBA_PxTFD_DRQ)) && !ahci_comreset(inst, index))
+        return false;
+
+    ahci_write32(inst, HBA_PxIS(index), 0xFFFFFFFF);
+    ahci_write32(inst, HBA_PxCMD(index), ahci_read32(inst, HBA_PxCMD(index)) | HBA_PxCMD_ST);
+    return true;
+}
+
+PRIVATE void ahci_port_interrupt(ahci_instance_t *inst, int index)
+{
+    uint32_t px_is = ahci_read32(inst, HBA_PxIS(index));
+    ahci_write32(inst, HBA_PxIS(index), px_is);
+
+    ahci_port_t *port = inst->ports[index];
+    if (port == NULL)
+        return;
+
+    ahci_slot_t done[32];
+    local_spinlock_lock(&port->lock);
+
+    //Issued commands the HBA no longer reports as outstanding have completed
+    uint32_t busy = ahci_read32(inst, HBA_PxSACT(index)) | ahci_read32(inst, HBA_PxCI(index));
+    uint32_t ok = port->issued & ~busy;
+    uint32_t failed = 0;
+    if (px_is & HBA_PxIS_ERRORS)
+    {
+        failed = port->issued & busy;
+        if (!ahci_recoverport(inst, index))
+        {
+            //The failed slots are everything still issued, refuse anything new on the stopped port
+            port->offline = true;
+            DEBUG_PRINT("[AHCI] Port failed to recover, taking it offline\r\n");
+        }
+    }
+
+    uint32_t finished = ok | failed;
+    for (int i = 0; i < 32; i++)
+        if (finished & (1u << i))
+            done[i] = port->slots[i];
+    port->issued &= ~finished;
+    port->reserved &= ~finished;
+    port->exclusive &= ~finished;
+    port->completions += __builtin_popcount(ok);
+    port->errors += __builtin_popcount(failed);
+    local_spinlock_unlock(&port->lock);
+
+    //Slots are free again by now, callbacks are welcome to submit the next command
+    for (int i = 0; i < 32; i++)
+        if (finished & (1u << i))
+            done[i].callback(done[i].arg, (failed & (1u << i)) ? -1 : 0);
+
+    //Slots freed by commands issued outside the block layer may be what it's waiting on
+    void *block = __atomic_load_n(&port->block, __ATOMIC_ACQUIRE);
+    if (block != NULL && finished != 0)
+        block_kick(block, 0);
+}
+
+typedef struct
+{
+    _Atomic uint32_t done;
+    int status;
+} ahci_sync_t;
+
+static void ahci_sync_callback(void *arg, int status)
+{
+    ahci_sync_t *sync = (ahci_sync_t *)arg;
+    sync->status = status;
+    __atomic_store_n(&sync->done, 1, __ATOMIC_SEQ_CST);
+    task_wake((uint32_t *)&sync->done, 1);
+}
+
+static int ahci_rwsync(ahci_instance_t *inst, int index, bool write, uint64_t loc, void *addr, uint32_t len)
+{
+    ahci_sync_t sync;
+    sync.done = 0;
+    sync.status = 0;
+
+    int ret;
+    while ((ret = ahci_submit(inst, index, write, loc, addr, len, ahci_sync_callback, &sync)) == -2)
+        task_yield();
+    if (ret != 0)
+        return ret;
+
+    while (__atomic_load_n(&sync.done, __ATOMIC_SEQ_CST) == 0)
+        task_wait((uint32_t *)&sync.done, 0);
+    return sync.status;
+}
+
+PRIVATE int ahci_readdev(ahci_instance_t *inst, int index, uint64_t loc, void *addr, uint32_t len)
+{
+    return ahci_rwsync(inst, index, false, loc, addr, len);
+}
+
+PRIVATE int ahci_writedev(ahci_instance_t *inst, int index, uint64_t loc, void *addr, uint32_t len)
+{
+    return ahci_rwsync(inst, index, true, loc, addr, len);
+}
+
+PRIVATE int ahci_flushdev(ahci_instance_t *inst, int index)
+{
+    ahci_sync_t sync;
+    sync.done = 0;
+    sync.status = 0;
+
+    int ret;
+    while ((ret = ahci_flush(inst, index, ahci_sync_callback, &sync)) == -2)
+        task_yield();
+    if (ret != 0)
+        return ret;
+
+    while (__atomic_load_n(&sync.done, __ATOMIC_SEQ_CST) == 0)
+        task_wait((uint32_t *)&sync.done, 0);
+    return sync.status;
+}
@@ -0,0 +1,205 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SysVirtualMemory/vmem.h"
+#include "SysPhysicalMemory/phys_mem.h"
+#include "SysTaskMgr/task.h"
+#include "SysTimer/timer.h"
+
+#include "ahci.h"
+
+// Random read IOPS at increasing queue depths, ahci_bench.
+// Each run keeps depth 4KiB reads outstanding per port, every completion submits the next read
+// straight from the interrupt handler. Ports are measured one at a time and then all together.
+// Under QEMU, attach disks with '-device ich9-ahci,id=ahci -drive if=none,id=d0,file=...
+// -device ide-hd,drive=d0,bus=ahci.0'.
+
+#define AHCI_BENCH_IOS (20000)
+#define AHCI_BENCH_BLOCK KiB(4)
+#define AHCI_BENCH_SPAN (GiB(1) / AHCI_SECTOR_SIZE) //Sectors the reads are spread over
+
+static const int bench_depths[] = {1, 2, 4, 8, 16, 32};
+
+struct ahci_bench;
+
+typedef struct
+{
+    struct ahci_bench *bench;
+    void *buf;
+    uint64_t seed;
+    uint64_t start;
+} ahci_bench_io_t;
+
+typedef struct ahci_bench
+{
+    ahci_instance_t *inst;
+    int port;
+    uint64_t span;
+    uint8_t *bufs;
+    uint64_t bufs_phys;
+
+    _Atomic uint32_t issued;
+    _Atomic uint32_t completed;
+    _Atomic uint32_t errors;
+    _Atomic uint64_t latency;
+    _Atomic uint32_t done;
+
+    ahci_bench_io_t ios[32];
+} ahci_bench_t;
+
+static void ahci_bench_print(const char *what, uint64_t val)
+{
+    char tmp[20];
+    DEBUG_PRINT(what);
+    DEBUG_PRINT(ltoa(val, tmp, 10));
+}
+
+static void ahci_bench_callback(void *arg, int status);
+
+//Count a finished read, true once it was the last one of the run
+static bool ahci_bench_complete(ahci_bench_t *b, int status, uint64_t start)
+{
+    if (status != 0)
+        __atomic_add_fetch(&b->errors, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->latency, timer_timestamp_ns() - start, __ATOMIC_RELAXED);
+
+    if (__atomic_add_fetch(&b->completed, 1, __ATOMIC_SEQ_CST) != AHCI_BENCH_IOS)
+        return false;
+    __atomic_store_n(&b->done, 1, __ATOMIC_SEQ_CST);
+    task_wake((uint32_t *)&b->done, 1);
+    return true;
+}
+
+//Submit the next read of the run on this io until one is accepted or the run has issued all of them
+static void ahci_bench_next(ahci_bench_io_t *io)
+{
+    ahci_bench_t *b = io->bench;
+    while (__atomic_add_fetch(&b->issued, 1, __ATOMIC_RELAXED) <= AHCI_BENCH_IOS)
+    {
+        //xorshift, 4KiB aligned offsets
+        io->seed ^= io->seed << 13;
+        io->seed ^= io->seed >> 7;
+        io->seed ^= io->seed << 17;
+        uint64_t lba = (io->seed % (b->span / 8)) * 8;
+
+        io->start = timer_timestamp_ns();
+        if (ahci_submit(b->inst, b->port, false, lba, io->buf, AHCI_BENCH_BLOCK, ahci_bench_callback, io) == 0)
+            return;
+        if (ahci_bench_complete(b, -1, io->start))
+            return;
+    }
+}
+
+static void ahci_bench_callback(void *arg, int status)
+{
+    ahci_bench_io_t *io = (ahci_bench_io_t *)arg;
+    if (!ahci_bench_complete(io->bench, status, io->start))
+        ahci_bench_next(io);
+}
+
+static int ahci_bench_setup(ahci_bench_t *b, ahci_instance_t *inst, int port)
+{
+    memset(b, 0, sizeof(ahci_bench_t));
+    b->inst = inst;
+    b->port = port;
+    b->span = MIN(inst->ports[port]->sector_cnt, AHCI_BENCH_SPAN);
+    if (b->span < 8)
+        return -1;
+
+    b->bufs_phys = (uint64_t)pagealloc_alloc(-1, -1, physmem_alloc_flags_data, 32 * AHCI_BENCH_BLOCK);
+    if (b->bufs_phys == (uint64_t)-1)
+        return -1;
+    b->bufs = (uint8_t *)vmem_phystovirt(b->bufs_phys, 32 * AHCI_BENCH_BLOCK, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+
+    for (int i = 0; i < 32; i++)
+    {
+        b->ios[i].bench = b;
+        b->ios[i].buf = b->bufs + i * AHCI_BENCH_BLOCK;
+        b->ios[i].seed = 0x9E3779B97F4A7C15ull * (i + 1) + port;
+    }
+    return 0;
+}
+
+//Run every port in mask at the given depth together, reports the combined rate
+static void ahci_bench_run(ahci_bench_t *benches, uint32_t mask, int depth)
+{
+    for (int p = 0; p < 32; p++)
+        if (mask & (1u << p))
+        {
+            ahci_bench_t *b = &benches[p];
+            b->issued = 0;
+            b->completed = 0;
+            b->errors = 0;
+            b->latency = 0;
+            b->done = 0;
+        }
+
+    uint64_t start = timer_timestamp_ns();
+    for (int p = 0; p < 32; p++)
+        if (mask & (1u << p))
+            for (int i = 0; i < MIN(depth, benches[p].inst->ports[p]->slot_cnt); i++)
+                ahci_bench_next(&benches[p].ios[i]);
+
+    uint64_t ios = 0;
+    uint64_t errors = 0;
+    uint64_t latency = 0;
+    for (int p = 0; p < 32; p++)
+        if (mask & (1u << p))
+        {
+            ahci_bench_t *b = &benches[p];
+            while (__atomic_load_n(&b->done, __ATOMIC_SEQ_CST) == 0)
+                task_wait((uint32_t *)&b->done, 0);
+            ios += AHCI_BENCH_IOS;
+            errors += b->errors;
+            latency += b->latency;
+        }
+    uint64_t ns = timer_timestamp_ns() - start;
+
+    ahci_bench_print("[AHCI] 4KiB random read ports=", __builtin_popcount(mask));
+    ahci_bench_print(" depth=", depth);
+    ahci_bench_print(" IOPS=", ns == 0 ? 0 : (ios * 1000000000ull) / ns);
+    ahci_bench_print(" MiB/s=", ns == 0 ? 0 : (ios * AHCI_BENCH_BLOCK * 1000000000ull) / ns / MiB(1));
+    ahci_bench_print(" avg latency us=", latency / ios / 1000);
+    ahci_bench_print(" errors=", errors);
+    DEBUG_PRINT("\r\n");
+}
+
+int ahci_bench()
+{
+    ahci_bench_t *benches = malloc(32 * sizeof(ahci_bench_t));
+    if (benches == NULL)
+        return -1;
+
+    for (ahci_instance_t *inst = ahci_getinstances(); inst != NULL; inst = inst->next)
+    {
+        uint32_t mask = 0;
+        for (int p = 0; p < 32; p++)
+            if (inst->ports[p] != NULL && ahci_bench_setup(&benches[p], inst, p) == 0)
+                mask |= (1u << p);
+
+        for (int p = 0; p < 32; p++)
+            if (mask & (1u << p))
+                for (size_t d = 0; d < sizeof(bench_depths) / sizeof(bench_depths[0]); d++)
+                    ahci_bench_run(benches, 1u << p, bench_depths[d]);
+
+        //Every port at full depth at once, shows whether the HBA keeps up with all of them
+        if (__builtin_popcount(mask) > 1)
+            ahci_bench_run(benches, mask, 32);
+
+        for (int p = 0; p < 32; p++)
+            if (mask & (1u << p))
+                pagealloc_free(benches[p].bufs_phys, 32 * AHCI_BENCH_BLOCK);
+    }
+
+    free(benches);
+    return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CoreStorage/block.h"
+
+#include "ahci.h"
+
+// CoreStorage glue.
+// Each port is one block device with a single hardware queue as deep as its command slots. The
+// block layer hands over merged requests whose segments all go into one command's PRDT, and the
+// completion callback passes them straight back from the interrupt handler.
+
+#define AHCI_BLOCK_MAX_SEGS (128)
+#define AHCI_BLOCK_MAX_SECTORS (MiB(16) / AHCI_SECTOR_SIZE) //Leaves PRDT room for every segment to straddle pages
+
+typedef struct
+{
+    ahci_instance_t *inst;
+    int index;
+} ahci_block_t;
+
+static int ahci_block_cnt = 0;
+
+static void ahci_block_callback(void *arg, int status)
+{
+    block_request_t *req = (block_request_t *)arg;
+    ahci_port_t *port = (ahci_port_t *)req->driver_data;
+    block_complete(port->block, req, status);
+}
+
+static int ahci_block_submit(void *state, int hwq, block_request_t *req)
+{
+    ahci_block_t *blk = (ahci_block_t *)state;
+    hwq = 0;
+
+    req->driver_data = (uintptr_t)blk->inst->ports[blk->index];
+    return ahci_submitreq(blk->inst, blk->index, req, ahci_block_callback, req);
+}
+
+PRIVATE int ahci_registerblock(ahci_instance_t *inst, int index)
+{
+    ahci_port_t *port = inst->ports[index];
+    ahci_block_t *blk = (ahci_block_t *)malloc(sizeof(ahci_block_t));
+    if (blk == NULL)
+        return -1;
+    blk->inst = inst;
+    blk->index = index;
+
+    block_device_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    strncpy(desc.name, "sata", sizeof(desc.name));
+    char tmp[10];
+    strncpy(desc.name + 4, itoa(__atomic_fetch_add(&ahci_block_cnt, 1, __ATOMIC_RELAXED), tmp, 10), sizeof(desc.name) - 5);
+    desc.state = blk;
+    desc.features = (port->rotational ? block_device_features_rotational : 0) | (port->write_cache ? block_device_features_flush : 0);
+    desc.sector_size = AHCI_SECTOR_SIZE;
+    desc.sector_cnt = port->sector_cnt;
+    desc.hwq_cnt = 1;
+    desc.queue_depth = port->slot_cnt;
+    desc.max_sectors = AHCI_BLOCK_MAX_SECTORS;
+    desc.max_segs = AHCI_BLOCK_MAX_SEGS;
+    desc.seg_boundary = 0;
+    desc.ops.submit = ahci_block_submit;
+    desc.ops.commit = NULL;
+
+    void *handle = NULL;
+    if (block_register(&desc, &handle) != 0)
+    {
+        free(blk);
+        return -1;
+    }
+    __atomic_store_n(&port->block, handle, __ATOMIC_RELEASE);
+    return 0;
+}
@@ -22,46 +22,24 @@ static int device_init_lock = 0;
 static ahci_instance_t *instance = NULL;
 static uint32_t device_count = 0;
 
-static void tmp_handler(int int_num)
+PRIVATE ahci_instance_t *ahci_getinstances(void)
+{
+    return instance;
+}
+
+static void ahci_handler(int int_num)
 {
-    //Handle appropriately
     ahci_instance_t *iter = instance;
     while (iter != NULL)
     {
         if (iter->interrupt_vec == int_num)
         {
-            //Check HBA_IS per port
+            //Check HBA_IS per port, the port's own status has to be cleared first
             uint32_t g_is = ahci_read32(iter, HBA_IS);
-            {
-                char tmpbuf[10];
-                DEBUG_PRINT("[AHCI] G_IS: ");
-                DEBUG_PRINT(itoa(g_is, tmpbuf, 16));
-                DEBUG_PRINT("\r\n");
-            }
             for (int p_idx = 0; p_idx < 32; p_idx++)
-                if (g_is & (1 << p_idx))
-                {
-                    //Check Px_IS to determine specific interrupt
-                    uint32_t px_is = ahci_read32(iter, HBA_PxIS(p_idx));
-                    if (px_is & HBA_PxIS_DHRS)
-                    {
-                        DEBUG_PRINT("[AHCI] D2H Register FIS\r\n");         //On receive
-                        ahci_write32(iter, HBA_PxIS(p_idx), HBA_PxIS_DHRS); //Clear interrupt
-
-                        uint32_t ci = ahci_read32(iter, HBA_PxCI(p_idx));
-
-                        // ci's bits are always a subset of activeCmdBits
-                        // thus, xor is bits where activeCmdBits is set, but ci is clear
-                        local_spinlock_lock(&iter->lock);
-                        uint32_t finishedCmds = iter->activeCmdBits[p_idx] ^ ci;
-                        iter->finishedCmdBits[p_idx] |= finishedCmds;
-                        iter->activeCmdBits[p_idx] = ci;
-                        local_spinlock_unlock(&iter->lock);
-
-                        //TODO: queue a notification to CoreStorage about finished tasks
-                    }
-                    ahci_write32(iter, HBA_IS, 1 << p_idx); //clear interrupt status
-                }
+                if (g_is & (1u << p_idx))
+                    ahci_port_interrupt(iter, p_idx);
+            ahci_write32(iter, HBA_IS, g_is); //clear interrupt status
         }
         iter = iter->next;
     }
@@ -112,7 +90,7 @@ int module_init(void *ecam_addr)
     //automatically handle
     ahci_instance_t *prev_inst = instance;
     instance = (ahci_instance_t *)malloc(sizeof(ahci_instance_t));
-    instance->lock = 0;
+    memset(instance, 0, sizeof(ahci_instance_t));
     local_spinlock_lock(&instance->lock);
     instance->cfg = (uintptr_t)vmem_phystovirt(bar, KiB(4), vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
     instance->interrupt_vec = int_val;
@@ -124,50 +102,37 @@ int module_init(void *ecam_addr)
     ahci_reportawareness(instance);
     ahci_resethba(instance);
     ahci_reportawareness(instance);
+    instance->cap = ahci_read32(instance, HBA_CAP);
 
     //Get implemented ports
     uint32_t ports = ahci_readports(instance);
-    uint32_t port_cnt = 32; //popcnt32(ports);
-    instance->implPortCnt = port_cnt;
-
-    //allocate dma memory
-    //32 * (CMD_BUF_SIZE + FIS_SIZE + sizeof(ahci_cmdtable_t))
-    size_t dma_sz = port_cnt * (CMD_BUF_SIZE + FIS_SIZE + sizeof(ahci_cmdtable_t));
-    instance->port_dma.phys_addr = (uint64_t)pagealloc_alloc(0, 0, physmem_alloc_flags_zero | physmem_alloc_flags_data, dma_sz);
-    instance->port_dma.virt_addr = (uint64_t)vmem_phystovirt(instance->port_dma.phys_addr, dma_sz, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
+    instance->implPortCnt = __builtin_popcount(ports);
 
-    //initialize ports
-    //register each active port to IO interface
+    //initialize ports, each allocates its own command list and per slot command tables
     for (int i = 0; i < 32; i++)
         if (ports & (1 << i))
             if (ahci_initializeport(instance, i) == 0)
             {
                 //Configure interrupts for the port
-                ahci_write32(instance, HBA_PxIS(i), 0);
-                ahci_write32(instance, HBA_IS, 0);
+                ahci_write32(instance, HBA_PxIS(i), 0xFFFFFFFF);
+                ahci_write32(instance, HBA_IS, 1u << i);
 
-                //Descriptor Processed Interrupt
-                //DMA Setup FIS Interrupt -
-                //Device to Host Register FIS Interrupt - Status/Error notification
-                ahci_write32(instance, HBA_PxIE(i), HBA_PxIS_DHRS);
-
-                //Register to IO interface
+                //Device to Host Register FIS Interrupt - Non-queued command completion
+                //Set Device Bits FIS Interrupt - NCQ command completion
+                //Task file and fatal errors, which abort the port's outstanding commands
+                ahci_write32(instance, HBA_PxIE(i), HBA_PxIS_DHRS | HBA_PxIS_SDBS | HBA_PxIS_ERRORS);
             }
     //Exit init state
     local_spinlock_unlock(&device_init_lock);
     sti(cli_state);
 
     //Enable interrupts
-    interrupt_registerhandler(int_val, tmp_handler);
+    interrupt_registerhandler(int_val, ahci_handler);
     ahci_write32(instance, HBA_GHC, ahci_read32(instance, HBA_GHC) | (1 << 1));
 
-    {
-        //uint64_t paddr = (uint64_t)pagealloc_alloc(0, 0, physmem_alloc_flags_zero | physmem_alloc_flags_data, KiB(32));
-        //uint64_t vaddr = (uint64_t)vmem_phystovirt(paddr, KiB(32), vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
-
-        //vmem_map(NULL, (intptr_t)vaddr, (intptr_t)paddr, KiB(32), vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw, 0);
-        //ahci_readdev(instance, 0, 0, (void *)vaddr, KiB(32));
-    }
-
+    //Register each active port to the IO interface
+    for (int i = 0; i < 32; i++)
+        if (instance->ports[i] != NULL && ahci_registerblock(instance, i) != 0)
+            DEBUG_PRINT("[AHCI] Failed to register port with CoreStorage\r\n");
     return 0;
 }
\ No newline at end of file
@@ -239,7 +239,7 @@ void iwifi_fw_dma(iwifi_dev_state_t *dev, fw_section_t *sect) {
     uint32_t chunk_sz = MIN(IWM_FH_MEM_TB_MAX_LENGTH, sect->len);
 
     //Allocate space for the chunk
-    uintptr_t buf_p = pagealloc_alloc(0, 0, physmem_alloc_flags_32bit | physmem_alloc_flags_data, IWM_FH_MEM_TB_MAX_LENGTH);
+    uintptr_t buf_p = pagealloc_alloc(-1, -1, physmem_alloc_flags_32bit | physmem_alloc_flags_data, IWM_FH_MEM_TB_MAX_LENGTH);
     uint8_t* buf_u8 = (uint8_t*)vmem_phystovirt((intptr_t)buf_p, IWM_FH_MEM_TB_MAX_LENGTH, vmem_flags_uncached | vmem_flags_rw | vmem_flags_kernel);
 
     //Submit the chunk to the FH dma
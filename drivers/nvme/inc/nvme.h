@@ -0,0 +1,226 @@
+// Copyright (c) 2019 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINAL_DRIVERS_NVME_H
+#define CARDINAL_DRIVERS_NVME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "CoreStorage/block.h"
+
+#define NVME_PAGE_SIZE KiB(4)           //Memory page size programmed into CC.MPS
+#define NVME_ADMIN_QUEUE_LEN 32
+#define NVME_IO_QUEUE_LEN 256
+#define NVME_MAX_QUEUES 16              //Interrupt driven I/O queues, one per core
+#define NVME_MAX_XFER KiB(128)          //Largest transfer, before MDTS is applied
+#define NVME_MAX_SEGS 16
+#define NVME_LIST_SIZE 1024             //Per command PRP list/SGL segment, 128 PRP entries or 64 SGL descriptors
+#define NVME_DONE_BATCH 32              //Completions reaped per pass
+#define NVME_ADMIN_TIMEOUT_NS (5000 * 1000 * 1000ull)
+
+//Controller registers
+#define NVME_REG_CAP 0x00
+#define NVME_REG_VS 0x08
+#define NVME_REG_INTMS 0x0C
+#define NVME_REG_INTMC 0x10
+#define NVME_REG_CC 0x14
+#define NVME_REG_CSTS 0x1C
+#define NVME_REG_AQA 0x24
+#define NVME_REG_ASQ 0x28
+#define NVME_REG_ACQ 0x30
+#define NVME_REG_DB 0x1000
+
+#define NVME_CAP_MQES(x) ((uint32_t)((x)&0xFFFF))
+#define NVME_CAP_TO(x) ((uint32_t)(((x) >> 24) & 0xFF)) //500ms units
+#define NVME_CAP_DSTRD(x) ((uint32_t)(((x) >> 32) & 0xF))
+
+#define NVME_CC_EN (1 << 0)
+#define NVME_CC_IOSQES (6 << 16) //64 byte submission entries
+#define NVME_CC_IOCQES (4 << 20) //16 byte completion entries
+
+#define NVME_CSTS_RDY (1 << 0)
+#define NVME_CSTS_CFS (1 << 1)
+
+//Admin opcodes
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_FEAT_NUM_QUEUES 0x07
+
+#define NVME_IDENTIFY_NS 0x00
+#define NVME_IDENTIFY_CTRL 0x01
+
+//NVM command set opcodes
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+#define NVME_CMD_WRITE_ZEROES 0x08
+#define NVME_CMD_DSM 0x09
+
+#define NVME_DSM_AD (1 << 2) //Dataset management deallocate, i.e. discard
+
+//Command dword 0 flags, PSDT selects SGLs for the data pointer
+#define NVME_CMD_FLAGS_SGL (1 << 6)
+
+//SGL descriptor types, in the upper nibble of the last byte
+#define NVME_SGL_DATA_BLOCK 0x00
+#define NVME_SGL_LAST_SEGMENT 0x30
+
+//Identify controller fields
+#define NVME_ID_MDTS 77
+#define NVME_ID_NN 516
+#define NVME_ID_ONCS 520
+#define NVME_ID_VWC 525
+#define NVME_ID_SGLS 536
+
+#define NVME_ONCS_DSM (1 << 2)
+#define NVME_ONCS_WRITE_ZEROES (1 << 3)
+
+typedef struct PACKED
+{
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t rsvd;
+    uint64_t mptr;
+    uint64_t dptr[2]; //PRP1/PRP2 or a single SGL descriptor
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} nvme_sqe_t;
+
+typedef struct PACKED
+{
+    uint32_t result;
+    uint32_t rsvd;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status; //Phase tag in bit 0, status code and type above it
+} nvme_cqe_t;
+
+typedef struct PACKED
+{
+    uint64_t addr;
+    uint32_t len;
+    uint8_t rsvd[3];
+    uint8_t type;
+} nvme_sgl_desc_t;
+
+typedef struct PACKED
+{
+    uint32_t cattr;
+    uint32_t nlb;
+    uint64_t slba;
+} nvme_dsm_range_t;
+
+typedef void (*nvme_callback_t)(void *arg, int status);
+
+//A submission/completion queue pair, qid 0 is the admin queue
+typedef struct
+{
+    int qid;
+    int entries;
+    int lock;
+    int vector; //MSI-X table entry, -1 if the completion queue doesn't interrupt
+
+    volatile nvme_sqe_t *sq;
+    volatile nvme_cqe_t *cq;
+    uintptr_t sq_phys;
+    uintptr_t cq_phys;
+    volatile uint32_t *sq_db;
+    volatile uint32_t *cq_db;
+
+    uint16_t sq_tail;
+    uint16_t sq_rung;   //Tail last written to the doorbell
+    uint16_t cq_head;
+    uint8_t phase;
+
+    //Command ids, one fewer than the entries so the submission queue never overflows
+    uint16_t free[NVME_IO_QUEUE_LEN];
+    int free_cnt;
+    nvme_callback_t callbacks[NVME_IO_QUEUE_LEN];
+    void *args[NVME_IO_QUEUE_LEN];
+
+    //PRP list or SGL segment of each command id
+    uint8_t *lists;
+    uintptr_t lists_phys;
+
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t doorbells;
+} nvme_queue_t;
+
+typedef struct nvme_ctrl
+{
+    int index;
+    uintptr_t regs;
+    uint64_t cap;
+    uint32_t db_stride;
+
+    int vector_base;    //Vector of MSI-X entry 0, every entry after it belongs to one I/O queue
+    int vector_cnt;
+
+    nvme_queue_t *admin;
+    int queue_cnt;
+    nvme_queue_t *queues[NVME_MAX_QUEUES];
+    nvme_queue_t *poll_queue; //Completion queue without interrupts, NULL if the controller ran out of queues
+
+    uint32_t nsid;
+    uint32_t lba_size;
+    uint64_t lba_cnt;
+    uint32_t max_xfer;
+    uint16_t oncs;
+    bool write_cache;
+    bool sgl;
+
+    void *block;
+
+    struct nvme_ctrl *next;
+} nvme_ctrl_t;
+
+PRIVATE uint32_t nvme_read32(nvme_ctrl_t *ctrl, uint32_t off);
+PRIVATE uint64_t nvme_read64(nvme_ctrl_t *ctrl, uint32_t off);
+PRIVATE void nvme_write32(nvme_ctrl_t *ctrl, uint32_t off, uint32_t val);
+PRIVATE void nvme_write64(nvme_ctrl_t *ctrl, uint32_t off, uint64_t val);
+
+//Allocate the queue memory and command ids, the controller side is created separately
+PRIVATE nvme_queue_t *nvme_allocqueue(nvme_ctrl_t *ctrl, int qid, int entries, int vector);
+
+//Put a command on the queue, the doorbell is only written when ring is set, or by nvme_ring.
+//data describes the transfer for reads and writes and may be NULL otherwise.
+//0 on success, -2 if every command id is in use, -1 if the data can't be described.
+PRIVATE int nvme_submit(nvme_ctrl_t *ctrl, nvme_queue_t *q, nvme_sqe_t *cmd, block_bio_t *data, bool ring, nvme_callback_t callback, void *arg);
+
+//Build the command for a block request and queue it without ringing the doorbell
+PRIVATE int nvme_submitreq(nvme_ctrl_t *ctrl, nvme_queue_t *q, block_request_t *req, nvme_callback_t callback, void *arg);
+
+//Tell the controller about everything queued since the last doorbell write
+PRIVATE void nvme_ring(nvme_queue_t *q);
+
+//Run the callbacks of every finished command on the queue, returns how many there were
+PRIVATE int nvme_reap(nvme_queue_t *q);
+
+//Synchronous admin command, spins on the admin completion queue. Returns the status, -1 on timeout.
+PRIVATE int nvme_admin(nvme_ctrl_t *ctrl, nvme_sqe_t *cmd, uintptr_t prp1, uint32_t *result);
+
+//Transfer on the polled queue, the caller spins on its completion instead of waiting for an
+//interrupt. Falls back to polling I/O queue 0 if there is no polled queue.
+PRIVATE int nvme_rw_polled(nvme_ctrl_t *ctrl, bool write, uint64_t lba, void *addr, uint32_t len);
+
+PRIVATE nvme_ctrl_t *nvme_getcontrollers(void);
+
+PRIVATE int nvme_registerblock(nvme_ctrl_t *ctrl);
+
+#endif
@@ -0,0 +1,276 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SysVirtualMemory/vmem.h"
+#include "SysPhysicalMemory/phys_mem.h"
+#include "SysTaskMgr/task.h"
+#include "SysTimer/timer.h"
+
+#include "CoreStorage/block.h"
+
+#include "nvme.h"
+
+// Random read IOPS and latency at queue depths 1 to 256, nvme_bench. The outstanding reads are spread round robin over the I/O queues, every
+// completion submits the next read on the same queue straight from the interrupt handler. Each
+// run's first reads are placed before any doorbell is written, so a queue starts with one MMIO
+// write however deep it is. A final run at depth 1 spins on the polled queue instead, for
+// comparison with the interrupt driven depth 1 latency.
+// Under QEMU, attach a disk with '-drive if=none,id=nvm,file=... -device nvme,serial=deadbeef,drive=nvm'.
+
+#define NVME_BENCH_IOS (50000)
+#define NVME_BENCH_POLLED_IOS (10000)
+#define NVME_BENCH_BLOCK KiB(4)
+#define NVME_BENCH_SPAN GiB(1)     //Bytes the reads are spread over
+#define NVME_BENCH_MAX_DEPTH (256)
+#define NVME_BENCH_BUCKETS (32)     //Latency histogram, bucket n holds reads under 2^n us
+
+static const int bench_depths[] = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+
+struct nvme_bench;
+
+typedef struct
+{
+    struct nvme_bench *bench;
+    nvme_queue_t *q;
+    block_seg_t seg;
+    block_bio_t data;
+    nvme_sqe_t cmd;
+    uint64_t seed;
+    uint64_t start;
+} nvme_bench_io_t;
+
+typedef struct nvme_bench
+{
+    nvme_ctrl_t *ctrl;
+    uint64_t span;  //In 4KiB blocks
+    uint8_t *bufs;
+    uint64_t bufs_phys;
+
+    _Atomic uint32_t issued;
+    _Atomic uint32_t completed;
+    _Atomic uint32_t errors;
+    _Atomic uint64_t latency;
+    _Atomic uint64_t max_latency;
+    _Atomic uint32_t buckets[NVME_BENCH_BUCKETS];
+    _Atomic uint32_t done;
+
+    nvme_bench_io_t ios[NVME_BENCH_MAX_DEPTH];
+} nvme_bench_t;
+
+static void nvme_bench_print(const char *what, uint64_t val)
+{
+    char tmp[20];
+    DEBUG_PRINT(what);
+    DEBUG_PRINT(ltoa(val, tmp, 10));
+}
+
+static void nvme_bench_record(nvme_bench_t *b, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = (us == 0) ? 0 : MIN(64 - __builtin_clzll(us), NVME_BENCH_BUCKETS - 1);
+    __atomic_add_fetch(&b->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->latency, ns, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&b->max_latency, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&b->max_latency, &max, ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+//Upper bound in us of the bucket holding the given fraction of reads
+static uint64_t nvme_bench_percentile(nvme_bench_t *b, uint64_t total, int percent)
+{
+    uint64_t want = (total * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < NVME_BENCH_BUCKETS; i++)
+    {
+        seen += b->buckets[i];
+        if (seen >= want)
+            return 1ull << i;
+    }
+    return 1ull << (NVME_BENCH_BUCKETS - 1);
+}
+
+static void nvme_bench_reset(nvme_bench_t *b)
+{
+    b->issued = 0;
+    b->completed = 0;
+    b->errors = 0;
+    b->latency = 0;
+    b->max_latency = 0;
+    b->done = 0;
+    for (int i = 0; i < NVME_BENCH_BUCKETS; i++)
+        b->buckets[i] = 0;
+}
+
+static uint64_t nvme_bench_nextlba(nvme_bench_t *b, nvme_bench_io_t *io)
+{
+    //xorshift, 4KiB aligned offsets
+    io->seed ^= io->seed << 13;
+    io->seed ^= io->seed >> 7;
+    io->seed ^= io->seed << 17;
+    return (io->seed % b->span) * (NVME_BENCH_BLOCK / b->ctrl->lba_size);
+}
+
+static void nvme_bench_callback(void *arg, int status);
+
+//Count a finished read, true once it was the last one of the run
+static bool nvme_bench_complete(nvme_bench_t *b, int status, uint64_t start)
+{
+    if (status != 0)
+        __atomic_add_fetch(&b->errors, 1, __ATOMIC_RELAXED);
+    nvme_bench_record(b, timer_timestamp_ns() - start);
+
+    if (__atomic_add_fetch(&b->completed, 1, __ATOMIC_SEQ_CST) != NVME_BENCH_IOS)
+        return false;
+    __atomic_store_n(&b->done, 1, __ATOMIC_SEQ_CST);
+    task_wake((uint32_t *)&b->done, 1);
+    return true;
+}
+
+//Submit the next read of the run on this io until one is accepted or the run has issued all of them
+static void nvme_bench_next(nvme_bench_io_t *io, bool ring)
+{
+    nvme_bench_t *b = io->bench;
+    while (__atomic_add_fetch(&b->issued, 1, __ATOMIC_RELAXED) <= NVME_BENCH_IOS)
+    {
+        uint64_t lba = nvme_bench_nextlba(b, io);
+        memset(&io->cmd, 0, sizeof(nvme_sqe_t));
+        io->cmd.opcode = NVME_CMD_READ;
+        io->cmd.nsid = b->ctrl->nsid;
+        io->cmd.cdw10 = (uint32_t)lba;
+        io->cmd.cdw11 = (uint32_t)(lba >> 32);
+        io->cmd.cdw12 = NVME_BENCH_BLOCK / b->ctrl->lba_size - 1;
+
+        io->start = timer_timestamp_ns();
+        if (nvme_submit(b->ctrl, io->q, &io->cmd, &io->data, ring, nvme_bench_callback, io) == 0)
+            return;
+        if (nvme_bench_complete(b, -1, io->start))
+            return;
+    }
+}
+
+static void nvme_bench_callback(void *arg, int status)
+{
+    nvme_bench_io_t *io = (nvme_bench_io_t *)arg;
+    if (!nvme_bench_complete(io->bench, status, io->start))
+        nvme_bench_next(io, true);
+}
+
+static void nvme_bench_report(nvme_bench_t *b, const char *mode, int depth, uint64_t ios, uint64_t ns)
+{
+    nvme_bench_print("[NVMe] 4KiB random read ", b->ctrl->index);
+    DEBUG_PRINT(mode);
+    nvme_bench_print(" depth=", depth);
+    nvme_bench_print(" IOPS=", ns == 0 ? 0 : (ios * 1000000000ull) / ns);
+    nvme_bench_print(" MiB/s=", ns == 0 ? 0 : (ios * NVME_BENCH_BLOCK * 1000000000ull) / ns / MiB(1));
+    nvme_bench_print(" avg us=", b->latency / ios / 1000);
+    nvme_bench_print(" p50 us<=", nvme_bench_percentile(b, ios, 50));
+    nvme_bench_print(" p99 us<=", nvme_bench_percentile(b, ios, 99));
+    nvme_bench_print(" max us=", b->max_latency / 1000);
+    nvme_bench_print(" errors=", b->errors);
+    DEBUG_PRINT("\r\n");
+}
+
+//Keep depth reads outstanding over the interrupt driven queues, no queue takes more than it holds
+static void nvme_bench_run(nvme_bench_t *b, int depth)
+{
+    nvme_ctrl_t *ctrl = b->ctrl;
+    nvme_bench_reset(b);
+
+    int per_queue = ctrl->queues[0]->entries - 1;
+    depth = MIN(depth, per_queue * ctrl->queue_cnt);
+
+    uint64_t start = timer_timestamp_ns();
+    for (int i = 0; i < depth; i++)
+    {
+        b->ios[i].q = ctrl->queues[i % ctrl->queue_cnt];
+        nvme_bench_next(&b->ios[i], false);
+    }
+    for (int i = 0; i < MIN(depth, ctrl->queue_cnt); i++)
+        nvme_ring(ctrl->queues[i]);
+
+    while (__atomic_load_n(&b->done, __ATOMIC_SEQ_CST) == 0)
+        task_wait((uint32_t *)&b->done, 0);
+    uint64_t ns = timer_timestamp_ns() - start;
+
+    nvme_bench_report(b, " irq", depth, NVME_BENCH_IOS, ns);
+}
+
+//Depth 1 spinning on the completion queue, no interrupt or wakeup in the path
+static void nvme_bench_polled(nvme_bench_t *b)
+{
+    nvme_ctrl_t *ctrl = b->ctrl;
+    nvme_bench_io_t *io = &b->ios[0];
+    nvme_bench_reset(b);
+
+    uint64_t start = timer_timestamp_ns();
+    for (int i = 0; i < NVME_BENCH_POLLED_IOS; i++)
+    {
+        uint64_t lba = nvme_bench_nextlba(b, io);
+        uint64_t io_start = timer_timestamp_ns();
+        if (nvme_rw_polled(ctrl, false, lba, io->seg.addr, NVME_BENCH_BLOCK) != 0)
+            b->errors++;
+        nvme_bench_record(b, timer_timestamp_ns() - io_start);
+    }
+    uint64_t ns = timer_timestamp_ns() - start;
+
+    nvme_bench_report(b, ctrl->poll_queue != NULL ? " polled" : " polled (shared queue)", 1, NVME_BENCH_POLLED_IOS, ns);
+}
+
+int nvme_bench()
+{
+    nvme_bench_t *b = malloc(sizeof(nvme_bench_t));
+    if (b == NULL)
+        return -1;
+
+    for (nvme_ctrl_t *ctrl = nvme_getcontrollers(); ctrl != NULL; ctrl = ctrl->next)
+    {
+        if (ctrl->queue_cnt == 0 || ctrl->lba_size > NVME_BENCH_BLOCK)
+            continue;
+
+        memset(b, 0, sizeof(nvme_bench_t));
+        b->ctrl = ctrl;
+        b->span = MIN(ctrl->lba_cnt * ctrl->lba_size, NVME_BENCH_SPAN) / NVME_BENCH_BLOCK;
+        if (b->span == 0)
+            continue;
+
+        b->bufs_phys = (uint64_t)pagealloc_alloc(-1, -1, physmem_alloc_flags_data, NVME_BENCH_MAX_DEPTH * NVME_BENCH_BLOCK);
+        if (b->bufs_phys == (uint64_t)-1)
+            break;
+        b->bufs = (uint8_t *)vmem_phystovirt(b->bufs_phys, NVME_BENCH_MAX_DEPTH * NVME_BENCH_BLOCK, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+
+        for (int i = 0; i < NVME_BENCH_MAX_DEPTH; i++)
+        {
+            nvme_bench_io_t *io = &b->ios[i];
+            io->bench = b;
+            io->seg.addr = b->bufs + i * NVME_BENCH_BLOCK;
+            io->seg.len = NVME_BENCH_BLOCK;
+            io->data.segs = &io->seg;
+            io->data.seg_cnt = 1;
+            io->seed = 0x9E3779B97F4A7C15ull * (i + 1) + ctrl->index;
+        }
+
+        for (size_t d = 0; d < sizeof(bench_depths) / sizeof(bench_depths[0]); d++)
+            nvme_bench_run(b, bench_depths[d]);
+        nvme_bench_polled(b);
+
+        //Block layer requests may have been turned away while the benchmark held the command ids
+        if (ctrl->block != NULL)
+            for (int i = 0; i < ctrl->queue_cnt; i++)
+                block_kick(ctrl->block, i);
+
+        pagealloc_free(b->bufs_phys, NVME_BENCH_MAX_DEPTH * NVME_BENCH_BLOCK);
+    }
+
+    free(b);
+    return 0;
+}
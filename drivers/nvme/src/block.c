@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CoreStorage/block.h"
+
+#include "nvme.h"
+
+// CoreStorage glue.
+// Hardware queue n is I/O queue n, so a core's requests go out on its own submission queue and
+// complete on its own vector. Requests are placed without touching the doorbell, the commit hook
+// writes it once for everything the block layer dispatched in one go.
+
+#define NVME_BLOCK_MAX_WRITE_ZEROES (65536) //16-bit 0's based block count
+
+static void nvme_block_callback(void *arg, int status)
+{
+    block_request_t *req = (block_request_t *)arg;
+    nvme_ctrl_t *ctrl = (nvme_ctrl_t *)req->driver_data;
+    block_complete(ctrl->block, req, (status == 0) ? 0 : -1);
+}
+
+static int nvme_block_submit(void *state, int hwq, block_request_t *req)
+{
+    nvme_ctrl_t *ctrl = (nvme_ctrl_t *)state;
+    req->driver_data = (uintptr_t)ctrl;
+    return nvme_submitreq(ctrl, ctrl->queues[hwq % ctrl->queue_cnt], req, nvme_block_callback, req);
+}
+
+static void nvme_block_commit(void *state, int hwq)
+{
+    nvme_ctrl_t *ctrl = (nvme_ctrl_t *)state;
+    nvme_ring(ctrl->queues[hwq % ctrl->queue_cnt]);
+}
+
+PRIVATE int nvme_registerblock(nvme_ctrl_t *ctrl)
+{
+    block_device_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    strncpy(desc.name, "nvme", sizeof(desc.name));
+    char tmp[10];
+    strncpy(desc.name + 4, itoa(ctrl->index, tmp, 10), sizeof(desc.name) - 7);
+    strncat(desc.name, "n1", sizeof(desc.name) - strlen(desc.name) - 1);
+    desc.state = ctrl;
+    desc.sector_size = ctrl->lba_size;
+    desc.sector_cnt = ctrl->lba_cnt;
+    desc.hwq_cnt = ctrl->queue_cnt;
+    desc.queue_depth = ctrl->queues[0]->entries - 1;
+    desc.max_sectors = ctrl->max_xfer / ctrl->lba_size;
+    desc.max_segs = NVME_MAX_SEGS;
+
+    //PRPs only describe page aligned joins, SGLs take anything
+    desc.seg_boundary = ctrl->sgl ? 0 : NVME_PAGE_SIZE;
+
+    if (ctrl->write_cache)
+        desc.features |= block_device_features_flush;
+    if (ctrl->oncs & NVME_ONCS_DSM)
+    {
+        desc.features |= block_device_features_discard;
+        desc.max_discard_sectors = 0xFFFFFFFF;
+    }
+    if (ctrl->oncs & NVME_ONCS_WRITE_ZEROES)
+    {
+        desc.features |= block_device_features_write_zeroes;
+        desc.max_write_zeroes_sectors = NVME_BLOCK_MAX_WRITE_ZEROES;
+    }
+    desc.ops.submit = nvme_block_submit;
+    desc.ops.commit = nvme_block_commit;
+
+    void *handle = NULL;
+    if (block_register(&desc, &handle) != 0)
+        return -1;
+    __atomic_store_n(&ctrl->block, handle, __ATOMIC_RELEASE);
+    return 0;
+}
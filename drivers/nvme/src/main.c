@@ -0,0 +1,322 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+#include <types.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <cardinal/local_spinlock.h>
+
+#include "SysVirtualMemory/vmem.h"
+#include "SysPhysicalMemory/phys_mem.h"
+#include "SysInterrupts/interrupts.h"
+#include "SysTaskMgr/task.h"
+#include "SysTimer/timer.h"
+#include "pci/pci.h"
+
+#include "nvme.h"
+
+// Controller bring-up.
+// The admin queue is set up and the controller enabled, admin commands are then issued by polling
+// the admin completion queue. Every core gets an I/O queue pair whose completion queue interrupts
+// on its own MSI-X entry routed to that core, entry 0 belongs to the admin queue. One more pair is
+// created without interrupts for callers that would rather spin on the completion queue than pay
+// for an interrupt and a wakeup. Only namespace 1 is exposed.
+
+static int device_init_lock = 0;
+static nvme_ctrl_t *controllers = NULL;
+static int controller_cnt = 0;
+
+PRIVATE nvme_ctrl_t *nvme_getcontrollers(void)
+{
+    return controllers;
+}
+
+static void nvme_handler(int int_num)
+{
+    for (nvme_ctrl_t *ctrl = controllers; ctrl != NULL; ctrl = ctrl->next)
+    {
+        int entry = int_num - ctrl->vector_base;
+        if (entry < 0 || entry >= ctrl->vector_cnt)
+            continue;
+
+        //A single shared vector carries every completion queue
+        if (ctrl->vector_cnt == 1)
+        {
+            for (int i = 0; i < ctrl->queue_cnt; i++)
+                nvme_reap(ctrl->queues[i]);
+        }
+        else if (entry > 0 && entry <= ctrl->queue_cnt)
+            nvme_reap(ctrl->queues[entry - 1]);
+
+        if (entry == 0 && ctrl->admin != NULL)
+            nvme_reap(ctrl->admin);
+    }
+}
+
+//Wait for CSTS.RDY to reach the given state within the controller's advertised timeout
+static bool nvme_waitready(nvme_ctrl_t *ctrl, bool ready)
+{
+    uint64_t deadline = timer_timestamp_ns() + MAX(NVME_CAP_TO(ctrl->cap), 1) * 500 * 1000 * 1000ull;
+    while (((nvme_read32(ctrl, NVME_REG_CSTS) & NVME_CSTS_RDY) != 0) != ready)
+    {
+        if (ready && (nvme_read32(ctrl, NVME_REG_CSTS) & NVME_CSTS_CFS))
+            return false;
+        if (timer_timestamp_ns() > deadline)
+            return false;
+    }
+    return true;
+}
+
+//Create the controller side of an I/O queue pair, the completion queue first since the
+//submission queue names it
+static int nvme_createqueue(nvme_ctrl_t *ctrl, nvme_queue_t *q)
+{
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_CQ;
+    cmd.cdw10 = ((uint32_t)(q->entries - 1) << 16) | q->qid;
+    cmd.cdw11 = 1; //Physically contiguous
+    if (q->vector >= 0)
+        cmd.cdw11 |= (1 << 1) | ((uint32_t)q->vector << 16);
+    if (nvme_admin(ctrl, &cmd, q->cq_phys, NULL) != 0)
+        return -1;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_CREATE_SQ;
+    cmd.cdw10 = ((uint32_t)(q->entries - 1) << 16) | q->qid;
+    cmd.cdw11 = ((uint32_t)q->qid << 16) | 1;
+    if (nvme_admin(ctrl, &cmd, q->sq_phys, NULL) != 0)
+        return -1;
+    return 0;
+}
+
+static int nvme_identify(nvme_ctrl_t *ctrl)
+{
+    uintptr_t id_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_zero, KiB(4));
+    if (id_phys == (uintptr_t)-1)
+        return -1;
+    uint8_t *id = (uint8_t *)vmem_phystovirt((intptr_t)id_phys, KiB(4), vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.cdw10 = NVME_IDENTIFY_CTRL;
+    if (nvme_admin(ctrl, &cmd, id_phys, NULL) != 0)
+    {
+        pagealloc_free(id_phys, KiB(4));
+        return -1;
+    }
+
+    //MDTS is a power of two in units of the minimum page size, 0 means no limit
+    uint8_t mdts = id[NVME_ID_MDTS];
+    ctrl->max_xfer = NVME_MAX_XFER;
+    if (mdts != 0 && mdts < 16)
+        ctrl->max_xfer = MIN(ctrl->max_xfer, (1u << mdts) * NVME_PAGE_SIZE);
+    ctrl->oncs = *(uint16_t *)(id + NVME_ID_ONCS);
+    ctrl->write_cache = (id[NVME_ID_VWC] & 1) != 0;
+    ctrl->sgl = (*(uint32_t *)(id + NVME_ID_SGLS) & 3) != 0;
+    uint32_t nn = *(uint32_t *)(id + NVME_ID_NN);
+
+    memset(id, 0, KiB(4));
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = 1;
+    cmd.cdw10 = NVME_IDENTIFY_NS;
+    if (nn == 0 || nvme_admin(ctrl, &cmd, id_phys, NULL) != 0)
+    {
+        pagealloc_free(id_phys, KiB(4));
+        return -1;
+    }
+
+    //The formatted LBA size is an index into the LBA format table
+    int fmt = id[26] & 0xF;
+    uint32_t lbaf = *(uint32_t *)(id + 128 + fmt * 4);
+    ctrl->nsid = 1;
+    ctrl->lba_cnt = *(uint64_t *)id;
+    ctrl->lba_size = 1u << ((lbaf >> 16) & 0xFF);
+
+    pagealloc_free(id_phys, KiB(4));
+    if (ctrl->lba_cnt == 0 || ctrl->lba_size < 512 || ctrl->lba_size > ctrl->max_xfer)
+        return -1;
+    return 0;
+}
+
+//Route MSI-X entry 0 to the first core and entry i to core i - 1, with plain MSI everything shares
+//one vector. Returns the usable entry count.
+static int nvme_setupvectors(nvme_ctrl_t *ctrl, pci_config_t *device, int want)
+{
+    int table_sz = 0;
+    int msi_val = pci_getmsiinfo(device, &table_sz);
+    if (msi_val < 0)
+        return -1;
+
+    int cnt = 1;
+    if (msi_val == 1)
+        cnt = MIN(want, table_sz);
+    else
+        table_sz = 1;
+
+    int base = 0;
+    if (interrupt_allocate(cnt, interrupt_flags_exclusive, &base) != 0)
+        return -1;
+    ctrl->vector_base = base;
+    ctrl->vector_cnt = cnt;
+
+    uintptr_t *msi_addr = malloc(sizeof(uintptr_t) * table_sz);
+    uint32_t *msi_msg = malloc(sizeof(uint32_t) * table_sz);
+    for (int i = 0; i < table_sz; i++)
+    {
+        int entry = (i < cnt) ? i : 0;
+        msi_addr[i] = (uintptr_t)msi_register_addr(task_coreapicid(entry == 0 ? 0 : entry - 1));
+        msi_msg[i] = msi_register_data(base + entry);
+    }
+
+    for (int i = 0; i < cnt; i++)
+        interrupt_registerhandler(base + i, nvme_handler);
+
+    pci_setmsiinfo(device, msi_val, msi_addr, msi_msg, table_sz);
+    free(msi_addr);
+    free(msi_msg);
+    return cnt;
+}
+
+int module_init(void *ecam_addr)
+{
+    pci_config_t *device = (pci_config_t *)vmem_phystovirt((intptr_t)ecam_addr, KiB(4), vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
+
+    //enable pci bus master
+    device->command.busmaster = 1;
+
+    //BAR0 holds the registers and doorbells
+    uint64_t bar = 0;
+    if ((device->bar[0] & 0x7) == 0x4)
+        bar = (device->bar[0] & 0xFFFFFFF0) + ((uint64_t)device->bar[1] << 32);
+    else if ((device->bar[0] & 0x7) == 0x0)
+        bar = (device->bar[0] & 0xFFFFFFF0);
+    if (bar == 0)
+        return -1;
+
+    nvme_ctrl_t *ctrl = (nvme_ctrl_t *)malloc(sizeof(nvme_ctrl_t));
+    memset(ctrl, 0, sizeof(nvme_ctrl_t));
+    ctrl->regs = (uintptr_t)vmem_phystovirt(bar, KiB(16), vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
+    ctrl->cap = nvme_read64(ctrl, NVME_REG_CAP);
+    ctrl->db_stride = 4u << NVME_CAP_DSTRD(ctrl->cap);
+    ctrl->vector_base = -1;
+
+    //NVM command set, and 4KiB pages have to be within the supported range
+    if (!(ctrl->cap & (1ull << 37)) || ((ctrl->cap >> 48) & 0xF) != 0)
+    {
+        DEBUG_PRINT("[NVMe] Unsupported controller\r\n");
+        free(ctrl);
+        return -1;
+    }
+
+    {
+        int cli_state = cli();
+        local_spinlock_lock(&device_init_lock);
+        ctrl->index = controller_cnt++;
+        ctrl->next = controllers;
+        controllers = ctrl;
+        local_spinlock_unlock(&device_init_lock);
+        sti(cli_state);
+    }
+
+    //Vectors for the admin queue and a queue per core, before anything can complete
+    int io_cnt = MIN(task_corecount(), NVME_MAX_QUEUES);
+    if (nvme_setupvectors(ctrl, device, io_cnt + 1) < 0)
+    {
+        DEBUG_PRINT("[NVMe] NO MSI\r\n");
+        return -1;
+    }
+
+    //Reset
+    uint32_t cc = nvme_read32(ctrl, NVME_REG_CC);
+    if (cc & NVME_CC_EN)
+        nvme_write32(ctrl, NVME_REG_CC, cc & ~NVME_CC_EN);
+    if (!nvme_waitready(ctrl, false))
+    {
+        DEBUG_PRINT("[NVMe] Reset timed out\r\n");
+        return -1;
+    }
+
+    //Admin queue, then enable with 4KiB pages and the standard entry sizes
+    ctrl->admin = nvme_allocqueue(ctrl, 0, NVME_ADMIN_QUEUE_LEN, 0);
+    nvme_write32(ctrl, NVME_REG_AQA, ((NVME_ADMIN_QUEUE_LEN - 1) << 16) | (NVME_ADMIN_QUEUE_LEN - 1));
+    nvme_write64(ctrl, NVME_REG_ASQ, ctrl->admin->sq_phys);
+    nvme_write64(ctrl, NVME_REG_ACQ, ctrl->admin->cq_phys);
+    nvme_write32(ctrl, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    if (!nvme_waitready(ctrl, true))
+    {
+        DEBUG_PRINT("[NVMe] Enable failed\r\n");
+        return -1;
+    }
+
+    if (nvme_identify(ctrl) != 0)
+    {
+        DEBUG_PRINT("[NVMe] Identify failed\r\n");
+        return -1;
+    }
+
+    //Ask for one more queue pair than there are cores for the polled queue, counts are 0's based
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((uint32_t)io_cnt << 16) | io_cnt;
+    uint32_t result = 0;
+    if (nvme_admin(ctrl, &cmd, 0, &result) != 0)
+    {
+        DEBUG_PRINT("[NVMe] Failed to set the queue count\r\n");
+        return -1;
+    }
+    int avail = MIN((int)(result & 0xFFFF), (int)(result >> 16)) + 1;
+    bool polled = avail > io_cnt;
+    io_cnt = MIN(io_cnt, avail);
+    if (ctrl->vector_cnt > 1)
+        io_cnt = MIN(io_cnt, ctrl->vector_cnt - 1);
+
+    int entries = MIN(NVME_IO_QUEUE_LEN, (int)NVME_CAP_MQES(ctrl->cap) + 1);
+    for (int i = 0; i < io_cnt; i++)
+    {
+        nvme_queue_t *q = nvme_allocqueue(ctrl, i + 1, entries, ctrl->vector_cnt > 1 ? i + 1 : 0);
+        if (nvme_createqueue(ctrl, q) != 0)
+        {
+            DEBUG_PRINT("[NVMe] Failed to create an I/O queue\r\n");
+            break;
+        }
+        ctrl->queues[i] = q;
+        __atomic_store_n(&ctrl->queue_cnt, i + 1, __ATOMIC_RELEASE);
+    }
+    if (ctrl->queue_cnt == 0)
+        return -1;
+
+    if (polled)
+    {
+        nvme_queue_t *q = nvme_allocqueue(ctrl, ctrl->queue_cnt + 1, entries, -1);
+        if (nvme_createqueue(ctrl, q) == 0)
+            ctrl->poll_queue = q;
+    }
+
+    {
+        char tmp[20];
+        DEBUG_PRINT("[NVMe] Queues: ");
+        DEBUG_PRINT(itoa(ctrl->queue_cnt, tmp, 10));
+        DEBUG_PRINT(" Depth: ");
+        DEBUG_PRINT(itoa(entries - 1, tmp, 10));
+        DEBUG_PRINT(" LBA size: ");
+        DEBUG_PRINT(itoa(ctrl->lba_size, tmp, 10));
+        DEBUG_PRINT(" LBAs: ");
+        DEBUG_PRINT(ltoa(ctrl->lba_cnt, tmp, 10));
+        DEBUG_PRINT(ctrl->sgl ? " SGL" : "");
+        DEBUG_PRINT(ctrl->poll_queue != NULL ? " polled\r\n" : "\r\n");
+    }
+
+    if (nvme_registerblock(ctrl) != 0)
+        DEBUG_PRINT("[NVMe] Failed to register with CoreStorage\r\n");
+    return 0;
+}
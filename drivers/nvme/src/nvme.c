@@ -0,0 +1,480 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cardinal/local_spinlock.h>
+
+#include "SysVirtualMemory/vmem.h"
+#include "SysPhysicalMemory/phys_mem.h"
+#include "SysInterrupts/interrupts.h"
+#include "SysTimer/timer.h"
+
+#include "nvme.h"
+
+// Queue pairs.
+// Commands are identified by their command id, which indexes the callback and the command's slice
+// of the queue's list memory. Data goes out as PRPs whenever the pages line up the way PRPs
+// require, anything else falls back to an SGL when the controller takes them. Submissions only
+// write the doorbell when asked to, so a run of commands costs a single MMIO write.
+
+PRIVATE uint32_t nvme_read32(nvme_ctrl_t *ctrl, uint32_t off)
+{
+    return *(volatile uint32_t *)(ctrl->regs + off);
+}
+
+PRIVATE uint64_t nvme_read64(nvme_ctrl_t *ctrl, uint32_t off)
+{
+    //Low dword first, not every controller takes 64-bit accesses
+    uint64_t lo = nvme_read32(ctrl, off);
+    uint64_t hi = nvme_read32(ctrl, off + 4);
+    return lo | (hi << 32);
+}
+
+PRIVATE void nvme_write32(nvme_ctrl_t *ctrl, uint32_t off, uint32_t val)
+{
+    *(volatile uint32_t *)(ctrl->regs + off) = val;
+}
+
+PRIVATE void nvme_write64(nvme_ctrl_t *ctrl, uint32_t off, uint64_t val)
+{
+    nvme_write32(ctrl, off, (uint32_t)val);
+    nvme_write32(ctrl, off + 4, (uint32_t)(val >> 32));
+}
+
+PRIVATE nvme_queue_t *nvme_allocqueue(nvme_ctrl_t *ctrl, int qid, int entries, int vector)
+{
+    nvme_queue_t *q = (nvme_queue_t *)malloc(sizeof(nvme_queue_t));
+    if (q == NULL)
+        return NULL;
+    memset(q, 0, sizeof(nvme_queue_t));
+    q->qid = qid;
+    q->entries = entries;
+    q->vector = vector;
+    q->phase = 1;
+
+    size_t sq_sz = (entries * sizeof(nvme_sqe_t) + KiB(4) - 1) & ~(KiB(4) - 1);
+    size_t cq_sz = (entries * sizeof(nvme_cqe_t) + KiB(4) - 1) & ~(KiB(4) - 1);
+    size_t lists_sz = (entries * NVME_LIST_SIZE + KiB(4) - 1) & ~(KiB(4) - 1);
+
+    q->sq_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_zero, sq_sz);
+    q->cq_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_zero, cq_sz);
+    q->lists_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_zero, lists_sz);
+    if (q->sq_phys == (uintptr_t)-1 || q->cq_phys == (uintptr_t)-1 || q->lists_phys == (uintptr_t)-1)
+        PANIC("[NVMe] Failed to allocate queue memory.");
+
+    q->sq = (volatile nvme_sqe_t *)vmem_phystovirt((intptr_t)q->sq_phys, sq_sz, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+    q->cq = (volatile nvme_cqe_t *)vmem_phystovirt((intptr_t)q->cq_phys, cq_sz, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+    q->lists = (uint8_t *)vmem_phystovirt((intptr_t)q->lists_phys, lists_sz, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+
+    q->sq_db = (volatile uint32_t *)(ctrl->regs + NVME_REG_DB + (2 * qid) * ctrl->db_stride);
+    q->cq_db = (volatile uint32_t *)(ctrl->regs + NVME_REG_DB + (2 * qid + 1) * ctrl->db_stride);
+
+    for (int i = 0; i < entries - 1; i++)
+        q->free[q->free_cnt++] = (uint16_t)(entries - 2 - i);
+    return q;
+}
+
+//PRP1 takes the first chunk at any dword aligned offset, every chunk after it has to start on a
+//page and follow one that ended on a page. Two pages fit in PRP1/PRP2, more go in the command's list.
+static int nvme_mapprp(nvme_queue_t *q, int cid, nvme_sqe_t *cmd, block_bio_t *data)
+{
+    uint64_t *list = (uint64_t *)(q->lists + cid * NVME_LIST_SIZE);
+    int max = NVME_LIST_SIZE / sizeof(uint64_t);
+    int cnt = 0;
+    bool first = true;
+    uint64_t prev_end = 0;
+
+    for (block_bio_t *bio = data; bio != NULL; bio = bio->next)
+        for (uint32_t i = 0; i < bio->seg_cnt; i++)
+        {
+            uintptr_t virt = (uintptr_t)bio->segs[i].addr;
+            uint32_t len = bio->segs[i].len;
+            while (len > 0)
+            {
+                intptr_t phys = 0;
+                if (vmem_virttophys(NULL, (intptr_t)virt, &phys) != 0)
+                    return -1;
+                uint32_t chunk = MIN(len, NVME_PAGE_SIZE - (virt & (NVME_PAGE_SIZE - 1)));
+
+                if (first)
+                {
+                    if (phys & 3)
+                        return -1;
+                    cmd->dptr[0] = phys;
+                    first = false;
+                }
+                else if ((uint64_t)phys != prev_end || (phys & (NVME_PAGE_SIZE - 1)) == 0)
+                {
+                    //Continuing inside the same page is implied, anything else starts a new entry
+                    if ((prev_end & (NVME_PAGE_SIZE - 1)) != 0 || (phys & (NVME_PAGE_SIZE - 1)) != 0 || cnt >= max)
+                        return -1;
+                    list[cnt++] = phys;
+                }
+
+                prev_end = phys + chunk;
+                virt += chunk;
+                len -= chunk;
+            }
+        }
+
+    if (first)
+        return -1;
+    if (cnt == 0)
+        cmd->dptr[1] = 0;
+    else if (cnt == 1)
+        cmd->dptr[1] = list[0];
+    else
+        cmd->dptr[1] = q->lists_phys + cid * NVME_LIST_SIZE;
+    return 0;
+}
+
+//One data block descriptor per physically contiguous run, a single one goes in the command itself
+static int nvme_mapsgl(nvme_queue_t *q, int cid, nvme_sqe_t *cmd, block_bio_t *data)
+{
+    nvme_sgl_desc_t *descs = (nvme_sgl_desc_t *)(q->lists + cid * NVME_LIST_SIZE);
+    int max = NVME_LIST_SIZE / sizeof(nvme_sgl_desc_t);
+    int cnt = 0;
+
+    for (block_bio_t *bio = data; bio != NULL; bio = bio->next)
+        for (uint32_t i = 0; i < bio->seg_cnt; i++)
+        {
+            uintptr_t virt = (uintptr_t)bio->segs[i].addr;
+            uint32_t len = bio->segs[i].len;
+            while (len > 0)
+            {
+                intptr_t phys = 0;
+                if (vmem_virttophys(NULL, (intptr_t)virt, &phys) != 0)
+                    return -1;
+                uint32_t chunk = MIN(len, NVME_PAGE_SIZE - (virt & (NVME_PAGE_SIZE - 1)));
+
+                if (cnt > 0 && descs[cnt - 1].addr + descs[cnt - 1].len == (uint64_t)phys)
+                    descs[cnt - 1].len += chunk;
+                else
+                {
+                    if (cnt >= max)
+                        return -1;
+                    memset(&descs[cnt], 0, sizeof(nvme_sgl_desc_t));
+                    descs[cnt].addr = phys;
+                    descs[cnt].len = chunk;
+                    descs[cnt].type = NVME_SGL_DATA_BLOCK;
+                    cnt++;
+                }
+
+                virt += chunk;
+                len -= chunk;
+            }
+        }
+
+    if (cnt == 0)
+        return -1;
+
+    cmd->flags |= NVME_CMD_FLAGS_SGL;
+    if (cnt == 1)
+    {
+        cmd->dptr[0] = descs[0].addr;
+        cmd->dptr[1] = descs[0].len | ((uint64_t)NVME_SGL_DATA_BLOCK << 56);
+    }
+    else
+    {
+        cmd->dptr[0] = q->lists_phys + cid * NVME_LIST_SIZE;
+        cmd->dptr[1] = (cnt * sizeof(nvme_sgl_desc_t)) | ((uint64_t)NVME_SGL_LAST_SEGMENT << 56);
+    }
+    return 0;
+}
+
+//Called with the queue locked
+static void nvme_doorbell(nvme_queue_t *q)
+{
+    if (q->sq_tail == q->sq_rung)
+        return;
+
+    //The entries must be visible before the controller is told to fetch them
+    __sync_synchronize();
+    *q->sq_db = q->sq_tail;
+    q->sq_rung = q->sq_tail;
+    q->doorbells++;
+}
+
+//Take a command id, fill in the data pointer and place the command, with the queue locked.
+//range is the discard payload, copied into the command's list memory.
+static int nvme_queuecmd(nvme_ctrl_t *ctrl, nvme_queue_t *q, nvme_sqe_t *cmd, block_bio_t *data, const nvme_dsm_range_t *range, bool ring, nvme_callback_t callback, void *arg)
+{
+    if (q->free_cnt == 0)
+        return -2;
+
+    int cid = q->free[--q->free_cnt];
+    cmd->cid = (uint16_t)cid;
+
+    if (range != NULL)
+    {
+        memcpy(q->lists + cid * NVME_LIST_SIZE, range, sizeof(nvme_dsm_range_t));
+        cmd->dptr[0] = q->lists_phys + cid * NVME_LIST_SIZE;
+        cmd->dptr[1] = 0;
+    }
+    else if (data != NULL)
+    {
+        int err = nvme_mapprp(q, cid, cmd, data);
+        if (err != 0 && ctrl->sgl)
+            err = nvme_mapsgl(q, cid, cmd, data);
+        if (err != 0)
+        {
+            q->free[q->free_cnt++] = (uint16_t)cid;
+            return -1;
+        }
+    }
+
+    q->callbacks[cid] = callback;
+    q->args[cid] = arg;
+    memcpy((void *)&q->sq[q->sq_tail], cmd, sizeof(nvme_sqe_t));
+    q->sq_tail = (uint16_t)((q->sq_tail + 1) % q->entries);
+    q->submitted++;
+
+    if (ring)
+        nvme_doorbell(q);
+    return 0;
+}
+
+PRIVATE int nvme_submit(nvme_ctrl_t *ctrl, nvme_queue_t *q, nvme_sqe_t *cmd, block_bio_t *data, bool ring, nvme_callback_t callback, void *arg)
+{
+    int cli_state = cli();
+    local_spinlock_lock(&q->lock);
+    int err = nvme_queuecmd(ctrl, q, cmd, data, NULL, ring, callback, arg);
+    local_spinlock_unlock(&q->lock);
+    sti(cli_state);
+    return err;
+}
+
+PRIVATE int nvme_submitreq(nvme_ctrl_t *ctrl, nvme_queue_t *q, block_request_t *req, nvme_callback_t callback, void *arg)
+{
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.nsid = ctrl->nsid;
+    cmd.cdw10 = (uint32_t)req->lba;
+    cmd.cdw11 = (uint32_t)(req->lba >> 32);
+    cmd.cdw12 = req->sectors - 1;
+
+    nvme_dsm_range_t range;
+    nvme_dsm_range_t *payload = NULL;
+    block_bio_t *data = NULL;
+
+    switch (req->op)
+    {
+    case block_op_read:
+        cmd.opcode = NVME_CMD_READ;
+        data = req->bios;
+        break;
+    case block_op_write:
+        cmd.opcode = NVME_CMD_WRITE;
+        data = req->bios;
+        break;
+    case block_op_flush:
+        cmd.opcode = NVME_CMD_FLUSH;
+        cmd.cdw10 = 0;
+        cmd.cdw11 = 0;
+        cmd.cdw12 = 0;
+        break;
+    case block_op_write_zeroes:
+        cmd.opcode = NVME_CMD_WRITE_ZEROES;
+        break;
+    case block_op_discard:
+        //A single range, number of ranges is 0's based
+        cmd.opcode = NVME_CMD_DSM;
+        cmd.cdw10 = 0;
+        cmd.cdw11 = NVME_DSM_AD;
+        cmd.cdw12 = 0;
+        memset(&range, 0, sizeof(range));
+        range.nlb = req->sectors;
+        range.slba = req->lba;
+        payload = &range;
+        break;
+    default:
+        return -1;
+    }
+
+    int cli_state = cli();
+    local_spinlock_lock(&q->lock);
+    int err = nvme_queuecmd(ctrl, q, &cmd, data, payload, false, callback, arg);
+    local_spinlock_unlock(&q->lock);
+    sti(cli_state);
+    return err;
+}
+
+PRIVATE void nvme_ring(nvme_queue_t *q)
+{
+    int cli_state = cli();
+    local_spinlock_lock(&q->lock);
+    nvme_doorbell(q);
+    local_spinlock_unlock(&q->lock);
+    sti(cli_state);
+}
+
+//Reaped a batch at a time, callbacks run with the queue unlocked so they can submit again
+PRIVATE int nvme_reap(nvme_queue_t *q)
+{
+    nvme_callback_t callbacks[NVME_DONE_BATCH];
+    void *args[NVME_DONE_BATCH];
+    int status[NVME_DONE_BATCH];
+    int total = 0;
+    int cnt = 0;
+
+    do
+    {
+        int cli_state = cli();
+        local_spinlock_lock(&q->lock);
+        cnt = 0;
+        while (cnt < NVME_DONE_BATCH)
+        {
+            volatile nvme_cqe_t *e = &q->cq[q->cq_head];
+            if ((e->status & 1) != q->phase)
+                break;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            uint16_t cid = e->cid;
+            int sc = (e->status >> 1) & 0x7FF;
+            if (cid >= q->entries - 1)
+                PANIC("[NVMe] Completion for an unknown command id.");
+
+            callbacks[cnt] = q->callbacks[cid];
+            args[cnt] = q->args[cid];
+            status[cnt] = sc;
+            cnt++;
+
+            q->callbacks[cid] = NULL;
+            q->free[q->free_cnt++] = cid;
+            q->completed++;
+            if (sc != 0)
+                q->errors++;
+
+            if (++q->cq_head == q->entries)
+            {
+                q->cq_head = 0;
+                q->phase ^= 1;
+            }
+        }
+        if (cnt > 0)
+            *q->cq_db = q->cq_head;
+        local_spinlock_unlock(&q->lock);
+        sti(cli_state);
+
+        for (int i = 0; i < cnt; i++)
+            if (callbacks[i] != NULL)
+                callbacks[i](args[i], status[i]);
+        total += cnt;
+    } while (cnt == NVME_DONE_BATCH);
+
+    return total;
+}
+
+typedef struct
+{
+    _Atomic int done;
+    int status;
+    uint32_t result;
+} nvme_wait_t;
+
+static void nvme_wait_callback(void *arg, int status)
+{
+    nvme_wait_t *w = (nvme_wait_t *)arg;
+    w->status = status;
+    __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+}
+
+PRIVATE int nvme_admin(nvme_ctrl_t *ctrl, nvme_sqe_t *cmd, uintptr_t prp1, uint32_t *result)
+{
+    nvme_wait_t w;
+    memset(&w, 0, sizeof(w));
+    cmd->dptr[0] = prp1;
+    cmd->dptr[1] = 0;
+    if (nvme_submit(ctrl, ctrl->admin, cmd, NULL, true, nvme_wait_callback, &w) != 0)
+        return -1;
+
+    uint64_t deadline = timer_timestamp_ns() + NVME_ADMIN_TIMEOUT_NS;
+    while (__atomic_load_n(&w.done, __ATOMIC_ACQUIRE) == 0)
+    {
+        nvme_reap(ctrl->admin);
+        if (timer_timestamp_ns() > deadline)
+            return -1;
+    }
+
+    //Admin commands are only issued one at a time from init, so the newest entry is this command's
+    if (result != NULL)
+        *result = ctrl->admin->cq[(ctrl->admin->cq_head + ctrl->admin->entries - 1) % ctrl->admin->entries].result;
+    return w.status;
+}
+
+PRIVATE int nvme_rw_polled(nvme_ctrl_t *ctrl, bool write, uint64_t lba, void *addr, uint32_t len)
+{
+    if (len == 0 || (len % ctrl->lba_size) != 0 || len > ctrl->max_xfer)
+        return -1;
+
+    nvme_queue_t *q = (ctrl->poll_queue != NULL) ? ctrl->poll_queue : ctrl->queues[0];
+
+    block_seg_t seg;
+    seg.addr = addr;
+    seg.len = len;
+    block_bio_t data;
+    memset(&data, 0, sizeof(data));
+    data.segs = &seg;
+    data.seg_cnt = 1;
+
+    nvme_sqe_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+    cmd.nsid = ctrl->nsid;
+    cmd.cdw10 = (uint32_t)lba;
+    cmd.cdw11 = (uint32_t)(lba >> 32);
+    cmd.cdw12 = len / ctrl->lba_size - 1;
+
+    nvme_wait_t w;
+    memset(&w, 0, sizeof(w));
+    int err = 0;
+    while ((err = nvme_submit(ctrl, q, &cmd, &data, true, nvme_wait_callback, &w)) == -2)
+        nvme_reap(q);
+    if (err != 0)
+        return -1;
+
+    while (__atomic_load_n(&w.done, __ATOMIC_ACQUIRE) == 0)
+        nvme_reap(q);
+
+    //The block layer may have been turned away while the command id was ours
+    if (q != ctrl->poll_queue && ctrl->block != NULL)
+        block_kick(ctrl->block, 0);
+    return (w.status == 0) ? 0 : -1;
+}
+
+//Dump queue counters
+int nvme_stats()
+{
+    char tmp[20];
+    for (nvme_ctrl_t *ctrl = nvme_getcontrollers(); ctrl != NULL; ctrl = ctrl->next)
+        for (int i = 0; i <= ctrl->queue_cnt; i++)
+        {
+            nvme_queue_t *q = (i < ctrl->queue_cnt) ? ctrl->queues[i] : ctrl->poll_queue;
+            if (q == NULL)
+                continue;
+
+            DEBUG_PRINT("[NVMe] ");
+            DEBUG_PRINT(itoa(ctrl->index, tmp, 10));
+            DEBUG_PRINT(" Queue ");
+            DEBUG_PRINT(itoa(q->qid, tmp, 10));
+            DEBUG_PRINT(q->vector < 0 ? " (polled)" : "");
+            DEBUG_PRINT(" submitted: ");
+            DEBUG_PRINT(ltoa(q->submitted, tmp, 10));
+            DEBUG_PRINT(" completed: ");
+            DEBUG_PRINT(ltoa(q->completed, tmp, 10));
+            DEBUG_PRINT(" errors: ");
+            DEBUG_PRINT(ltoa(q->errors, tmp, 10));
+            DEBUG_PRINT(" doorbells: ");
+            DEBUG_PRINT(ltoa(q->doorbells, tmp, 10));
+            DEBUG_PRINT("\r\n");
+        }
+    return 0;
+}
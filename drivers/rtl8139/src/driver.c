@@ -46,11 +46,15 @@ int rtl8139_linkstatus(void *state)
     return ~(device->memar[MEDIA_STATUS_REG] >> 2) & 1;
 }
 
-int rtl8139_tx(void *state, void *packet, int len, network_device_tx_flags_t gso)
+int rtl8139_tx(void *state, netbuf_t *nb, network_device_tx_flags_t gso)
 {
     gso = 0;
+    int len = nb->tot_len;
     if ((len > TX_DESC_SIZE) || (len <= 0))
+    {
+        netbuf_free(nb);
         return -1;
+    }
 
     rtl8139_state_t *device = (rtl8139_state_t *)state;
     if ((device->memar[TX_STS_REG(device->free_tx_buf_idx)] & 0xfff) != 0)
@@ -59,11 +63,13 @@ int rtl8139_tx(void *state, void *packet, int len, network_device_tx_flags_t gso
 
     local_spinlock_lock(&device->lock);
 
-    memcpy(device->tx_buffer[device->free_tx_buf_idx], packet, len);
+    //The 8139 only transmits out of its four fixed buffers, so this is the one place the frame is copied
+    netbuf_copyout(nb, device->tx_buffer[device->free_tx_buf_idx], len);
     *(uint32_t *)&device->memar[TX_STS_REG(device->free_tx_buf_idx)] = (len & 0xfff); //starts the transmission
     device->free_tx_buf_idx = (device->free_tx_buf_idx + 1) % 4;
 
     local_spinlock_unlock(&device->lock);
+    netbuf_free(nb);
     return 0;
 }
 
@@ -91,7 +97,7 @@ int rtl8139_init(rtl8139_state_t *state)
         ;
 
     //Allocate physical memory for the network buffers
-    uintptr_t buffer_phys = pagealloc_alloc(0, 0, physmem_alloc_flags_data | physmem_alloc_flags_zero | physmem_alloc_flags_32bit, RX_BUFFER_SIZE + TX_BUFFER_SIZE);
+    uintptr_t buffer_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_zero | physmem_alloc_flags_32bit, RX_BUFFER_SIZE + TX_BUFFER_SIZE);
     intptr_t buffer_virt = vmem_phystovirt((intptr_t)buffer_phys, RX_BUFFER_SIZE + TX_BUFFER_SIZE, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
 
     state->rx_buffer_phys = buffer_phys;
@@ -12,6 +12,7 @@
 #define TX_ADDR_REG (0x20)
 #define TX_CFG_REG (0x40)
 #define CMD_REG (0x37)
+#define TPPOLL_REG (0x38)
 #define IMR_REG (0x3C)
 #define ISR_REG (0x3E)
 #define RCR_REG (0x44)
@@ -31,6 +32,8 @@
 #define CMD_RX_EN (1 << 3)
 #define CMD_TX_EN (1 << 2)
 
+#define TPPOLL_NPQ (1 << 6)
+
 #define INTR_ROK (1 << 0)
 #define INTR_TOK (1 << 2)
 #define INTR_TIMEOUT (1 << 14)
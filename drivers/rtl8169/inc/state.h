@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include "CoreNetwork/driver.h"
+#include "CoreNetwork/netbuf.h"
 
 typedef struct {
     uint32_t frame_length : 16;
@@ -87,13 +88,11 @@ typedef struct {
 #define TX_DESC_SIZE sizeof(rtl8169_tx_desc_t)
 #define TX_DESC_COUNT 1024
 #define TX_PACKET_SIZE 2048
-#define TX_BUFFER_SIZE ((TX_DESC_SIZE + TX_PACKET_SIZE) * TX_DESC_COUNT)
 #define TX_DESC_REGION_SIZE (TX_DESC_SIZE * TX_DESC_COUNT)
 
 #define RX_DESC_SIZE sizeof(rtl8169_rx_desc_t)
 #define RX_DESC_COUNT 1024
-#define RX_PACKET_SIZE 2048
-#define RX_BUFFER_SIZE ((RX_DESC_SIZE + RX_PACKET_SIZE) * RX_DESC_COUNT)
+#define RX_PACKET_SIZE NETBUF_DATA_SIZE
 #define RX_DESC_REGION_SIZE (RX_DESC_SIZE * RX_DESC_COUNT)
 
 
@@ -101,11 +100,9 @@ typedef struct
 {
     volatile uint8_t *memar;
 
-    uintptr_t rx_buffer_phys;
-    uintptr_t tx_buffer_phys;
-
-    uint8_t *rx_buffer;
-    uint8_t *tx_buffer;
+    //Netbufs owned by the NIC, a transmitted chain is tracked at its last descriptor
+    netbuf_t *rx_bufs[RX_DESC_COUNT];
+    netbuf_t *tx_bufs[TX_DESC_COUNT];
 
     uintptr_t rx_descs_phys;
     uintptr_t tx_descs_phys;
@@ -114,11 +111,14 @@ typedef struct
     volatile rtl8169_rx_desc_t *rx_descs;
 
     volatile uint16_t free_tx_buf_idx;
+    uint16_t clean_tx_idx;
+    uint16_t rx_idx;
+    uint64_t rx_dropped;
     void *net_handle;
+    void *poll;
     int lock;
 } rtl8169_state_t;
 
-void rtl8169_intr_handler(rtl8169_state_t *state);
 void rtl8169_intr_routine(int isr);
 int rtl8169_init(rtl8169_state_t *state);
 
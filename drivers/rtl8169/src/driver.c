@@ -19,87 +19,199 @@
 #include "state.h"
 #include "registers.h"
 
-static _Atomic volatile int isr_pending = 0;
+static rtl8169_state_t *intr_state = NULL;
 void rtl8169_intr_routine(int isr)
 {
     isr = 0;
-    isr_pending = 1;
+    if (intr_state == NULL || intr_state->poll == NULL)
+        return;
+
+    //Mask everything until the poll task has drained the ring
+    *(uint16_t *)&intr_state->memar[IMR_REG] = 0;
+    network_poll_schedule(intr_state->poll);
 }
 
-void rtl8169_intr_handler(rtl8169_state_t *state)
+static void rtl8169_postrx(rtl8169_state_t *state, int idx, netbuf_t *nb)
 {
-    while (true)
-    {
-        task_monitor(task_current(), (uint32_t*)&isr_pending, 0);
-        //while (!isr_pending)
-        //    task_yield();  //halt(); //stop after each iteration to allow other tasks to work, swap for yield later
+    uintptr_t phys = netbuf_phys(nb);
+    state->rx_bufs[idx] = nb;
+    state->rx_descs[idx].cmd.buf_lo = (uint32_t)phys;
+    state->rx_descs[idx].cmd.buf_hi = (uint32_t)(phys >> 32);
+    state->rx_descs[idx].cmd.frame_length = (RX_PACKET_SIZE & 0x3FFF);
+    state->rx_descs[idx].cmd.rsvd0 = 0;
+    state->rx_descs[idx].cmd.rsvd1 = 0;
+    state->rx_descs[idx].cmd.own = 1;
+}
 
-        local_spinlock_lock(&state->lock);
-        if (*(uint16_t *)&state->memar[ISR_REG] & INTR_ROK)
+//Release the chains the NIC has finished sending, caller holds state->lock
+static void rtl8169_tx_reap(rtl8169_state_t *state)
+{
+    while (state->clean_tx_idx != state->free_tx_buf_idx && state->tx_descs[state->clean_tx_idx].status.own == 0)
+    {
+        if (state->tx_bufs[state->clean_tx_idx] != NULL)
         {
-            //Submit the packet to the network stack
-            for (int i = 0; i < RX_DESC_COUNT; i++){
-                //Only handle single descriptor packets
-                bool avl = (state->rx_descs[i].status.own == 0);
-                if (!avl)
-                    continue;
-
-                //if (state->rx_descs[i].status.fs && state->rx_descs[i].status.ls)
-                network_rx_packet(state->net_handle, state->rx_buffer + RX_PACKET_SIZE * i, state->rx_descs[i].status.frame_length);
-                
-                //Return this descriptor to the NIC
-                state->rx_descs[i].cmd.frame_length = (RX_PACKET_SIZE & 0x3FFF);
-                state->rx_descs[i].cmd.rsvd0 = 0;
-                state->rx_descs[i].cmd.rsvd1 = 0;
-                state->rx_descs[i].cmd.own = 1;
-            }
-            //DEBUG_PRINT("[RTL8169] Receive Interrupt\r\n");
-
-            *(uint16_t *)&state->memar[ISR_REG] = INTR_ROK;
+            netbuf_free(state->tx_bufs[state->clean_tx_idx]);
+            state->tx_bufs[state->clean_tx_idx] = NULL;
         }
+        state->clean_tx_idx = (state->clean_tx_idx + 1) % TX_DESC_COUNT;
+    }
+}
+
+static int rtl8169_poll(void *state, int budget)
+{
+    rtl8169_state_t *device = (rtl8169_state_t *)state;
+    netbuf_t *rx = NULL;
+    netbuf_t *rx_tail = NULL;
+    int cnt = 0;
+
+    int cli_state = cli();
+    local_spinlock_lock(&device->lock);
+
+    //Acknowledge first, packets landing after this point raise the status again
+    *(uint16_t *)&device->memar[ISR_REG] = (INTR_ROK | INTR_TOK);
 
-        if (*(uint16_t *)&state->memar[ISR_REG] & INTR_TOK)
+    //Walk the ring in order until a descriptor still owned by the NIC is found
+    while (cnt < budget && device->rx_descs[device->rx_idx].status.own == 0)
+    {
+        int idx = device->rx_idx;
+        netbuf_t *nb = device->rx_bufs[idx];
+        device->rx_idx = (device->rx_idx + 1) % RX_DESC_COUNT;
+        cnt++;
+
+        //Only handle single descriptor packets, recycle the buffer if the pool is dry
+        netbuf_t *n_nb = NULL;
+        if (device->rx_descs[idx].status.fs && device->rx_descs[idx].status.ls)
+            n_nb = netbuf_alloc();
+
+        if (n_nb == NULL)
         {
-            *(uint16_t *)&state->memar[ISR_REG] = INTR_TOK;
-            DEBUG_PRINT("[RTL8169] Transmit Interrupt\r\n");
+            device->rx_dropped++;
+            rtl8169_postrx(device, idx, nb);
+            continue;
         }
-        local_spinlock_unlock(&state->lock);
+
+        nb->len = device->rx_descs[idx].status.frame_length;
+        nb->tot_len = nb->len;
+        if (rx_tail != NULL)
+            rx_tail->q_next = nb;
+        else
+            rx = nb;
+        rx_tail = nb;
+
+        //Return this descriptor to the NIC
+        rtl8169_postrx(device, idx, n_nb);
+    }
+
+    rtl8169_tx_reap(device);
+    local_spinlock_unlock(&device->lock);
+    sti(cli_state);
+
+    //Submit the packets to the network stack without the lock, it may transmit in response
+    while (rx != NULL)
+    {
+        netbuf_t *next = rx->q_next;
+        rx->q_next = NULL;
+        network_rx_packet(device->net_handle, rx);
+        rx = next;
     }
+    return cnt;
 }
 
+static bool rtl8169_rearm(void *state)
+{
+    rtl8169_state_t *device = (rtl8169_state_t *)state;
+
+    int cli_state = cli();
+    local_spinlock_lock(&device->lock);
+    *(uint16_t *)&device->memar[IMR_REG] = INTR_ROK;
+    bool pending = device->rx_descs[device->rx_idx].status.own == 0;
+    local_spinlock_unlock(&device->lock);
+    sti(cli_state);
+    return pending;
+}
+
+static network_poll_handlers_t poll_handlers = {
+    .poll = rtl8169_poll,
+    .rearm = rtl8169_rearm,
+};
+
 int rtl8169_linkstatus(void *state)
 {
     rtl8169_state_t *device = (rtl8169_state_t *)state;
     return (device->memar[PHY_STATUS_REG] >> 1) & 1;
 }
 
-int rtl8169_tx(void *state, void *packet, int len, network_device_tx_flags_t gso)
+//Caller holds state->lock, returns the number of descriptors used, 0 if the ring is full or -1 if the packet was dropped
+static int rtl8169_posttx(rtl8169_state_t *device, netbuf_t *nb)
 {
-    gso = 0;
-    if ((len > TX_PACKET_SIZE) || (len <= 0))
+    int seg_cnt = netbuf_segcount(nb);
+    if ((nb->tot_len > TX_PACKET_SIZE) || (nb->tot_len <= 0) || (seg_cnt >= TX_DESC_COUNT))
         return -1;
 
+    if ((device->free_tx_buf_idx - device->clean_tx_idx + TX_DESC_COUNT) % TX_DESC_COUNT + seg_cnt >= TX_DESC_COUNT)
+        return 0;
+
+    //Point a descriptor at each segment, the NIC reads the frame straight out of the netbufs
+    int first = device->free_tx_buf_idx;
+    int idx = first;
+    for (netbuf_t *seg = nb; seg != NULL; seg = seg->next)
+    {
+        uintptr_t phys = netbuf_phys(seg);
+        device->tx_descs[idx].cmd.buf_lo = (uint32_t)phys;
+        device->tx_descs[idx].cmd.buf_hi = (uint32_t)(phys >> 32);
+        device->tx_descs[idx].cmd.frame_length = seg->len;
+        device->tx_descs[idx].cmd.fs = (seg == nb);
+        device->tx_descs[idx].cmd.ls = (seg->next == NULL);
+        device->tx_bufs[idx] = (seg->next == NULL) ? nb : NULL;
+
+        //The first descriptor is handed over last, so the NIC never sees a partial chain
+        if (idx != first)
+            device->tx_descs[idx].cmd.own = 1;
+        idx = (idx + 1) % TX_DESC_COUNT;
+    }
+    device->tx_descs[first].cmd.own = 1;
+    device->free_tx_buf_idx = idx;
+    return seg_cnt;
+}
+
+int rtl8169_txburst(void *state, int queue, netbuf_t **nbs, int cnt, network_device_tx_flags_t gso)
+{
+    queue = 0;
+    gso = 0;
     rtl8169_state_t *device = (rtl8169_state_t *)state;
+    int cli_state = cli();
     local_spinlock_lock(&device->lock);
 
-    //Wait until the descriptor is available
-    while (device->tx_descs[device->free_tx_buf_idx].status.own != 0){
-        local_spinlock_unlock(&device->lock);
-        halt();
-        local_spinlock_lock(&device->lock);
+    //TX completions don't interrupt, whatever the NIC has finished with is collected here
+    rtl8169_tx_reap(device);
+
+    int sent = 0;
+    bool posted = false;
+    for (; sent < cnt; sent++)
+    {
+        int ret = rtl8169_posttx(device, nbs[sent]);
+        if (ret == 0)
+            break;
+        if (ret < 0)
+            netbuf_free(nbs[sent]);
+        else
+            posted = true;
     }
 
-    //Copy the packet over
-    memcpy((void*)(device->tx_buffer + device->free_tx_buf_idx * TX_PACKET_SIZE), packet, len);
+    //One poll demand for the whole burst
+    if (posted)
+        device->memar[TPPOLL_REG] = TPPOLL_NPQ;
 
-    //Pass ownership of the descriptor over to the NIC
-    device->tx_descs[device->free_tx_buf_idx].cmd.fs = 1;
-    device->tx_descs[device->free_tx_buf_idx].cmd.ls = 1;
-    device->tx_descs[device->free_tx_buf_idx].cmd.frame_length = len;
-    device->tx_descs[device->free_tx_buf_idx].cmd.own = 1;
-    device->free_tx_buf_idx = (device->free_tx_buf_idx + 1) % TX_DESC_COUNT;
-    
     local_spinlock_unlock(&device->lock);
+    sti(cli_state);
+    return sent;
+}
+
+int rtl8169_tx(void *state, netbuf_t *nb, network_device_tx_flags_t gso)
+{
+    //Wait until enough descriptors are available
+    while (rtl8169_txburst(state, 0, &nb, 1, gso) == 0)
+        halt();
     return 0;
 }
 
@@ -109,6 +221,7 @@ static network_device_desc_t device_desc = {
     .type = network_device_type_ethernet,
     .handlers.ether = {
         .tx = rtl8169_tx,
+        .tx_burst = rtl8169_txburst,
         .link_status = rtl8169_linkstatus,
     },
     .spec_features.ether = 0,
@@ -123,39 +236,39 @@ int rtl8169_init(rtl8169_state_t *state)
     while (state->memar[CMD_REG] & CMD_RST_VAL)
         ;
 
-    //Allocate physical memory for the network buffers
-    uintptr_t buffer_phys = pagealloc_alloc(0, 0, physmem_alloc_flags_data, RX_BUFFER_SIZE + TX_BUFFER_SIZE);
-    intptr_t buffer_virt = vmem_phystovirt((intptr_t)buffer_phys, RX_BUFFER_SIZE + TX_BUFFER_SIZE, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
-    memset((void*)buffer_virt, 0, RX_BUFFER_SIZE + TX_BUFFER_SIZE);
+    //Allocate physical memory for the descriptor rings, packets live in netbufs
+    uintptr_t buffer_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data, RX_DESC_REGION_SIZE + TX_DESC_REGION_SIZE);
+    intptr_t buffer_virt = vmem_phystovirt((intptr_t)buffer_phys, RX_DESC_REGION_SIZE + TX_DESC_REGION_SIZE, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
+    memset((void*)buffer_virt, 0, RX_DESC_REGION_SIZE + TX_DESC_REGION_SIZE);
 
     state->free_tx_buf_idx = 0;
+    state->clean_tx_idx = 0;
+    state->rx_idx = 0;
     state->lock = 0;
 
     state->rx_descs_phys = buffer_phys;
-    state->rx_buffer_phys = buffer_phys + RX_DESC_REGION_SIZE;
     state->rx_descs = (rtl8169_rx_desc_t *)buffer_virt;
-    state->rx_buffer = (uint8_t *)(buffer_virt + RX_DESC_REGION_SIZE);
 
-    state->tx_descs_phys = buffer_phys + RX_BUFFER_SIZE;
-    state->tx_buffer_phys = buffer_phys + RX_BUFFER_SIZE + TX_DESC_REGION_SIZE;
-    state->tx_descs = (rtl8169_tx_desc_t *)(buffer_virt + RX_BUFFER_SIZE);
-    state->tx_buffer = (uint8_t *)(buffer_virt + RX_BUFFER_SIZE + TX_DESC_REGION_SIZE);
+    state->tx_descs_phys = buffer_phys + RX_DESC_REGION_SIZE;
+    state->tx_descs = (rtl8169_tx_desc_t *)(buffer_virt + RX_DESC_REGION_SIZE);
 
     //Setup rx descriptors
     for (int i = 0; i < RX_DESC_COUNT; i++)
     {
-        state->rx_descs[i].cmd.frame_length = (RX_PACKET_SIZE & 0x3FFF);
-        state->rx_descs[i].cmd.buf_lo = (uint32_t)(state->rx_buffer_phys + RX_PACKET_SIZE * i);
-        state->rx_descs[i].cmd.buf_hi = (uint32_t)((state->rx_buffer_phys + RX_PACKET_SIZE * i) >> 32);
-        state->rx_descs[i].cmd.own = 1;
+        netbuf_t *nb = netbuf_alloc();
+        if (nb == NULL)
+        {
+            DEBUG_PRINT("[RTL8169] Failed to allocate receive buffers.\r\n");
+            return -1;
+        }
+        rtl8169_postrx(state, i, nb);
     }
     state->rx_descs[RX_DESC_COUNT - 1].cmd.eor = 1;     //Mark the last descriptor as the end of the ring
 
     //Setup tx descriptors
     for (int i = 0; i < TX_DESC_COUNT; i++)
     {
-        state->tx_descs[i].cmd.buf_lo = (uint32_t)(state->tx_buffer_phys + TX_PACKET_SIZE * i);
-        state->tx_descs[i].cmd.buf_hi = (uint32_t)((state->tx_buffer_phys + TX_PACKET_SIZE * i) >> 32);
+        state->tx_bufs[i] = NULL;
         state->tx_descs[i].cmd.own = 0;
     }
     state->tx_descs[TX_DESC_COUNT - 1].cmd.eor = 1;
@@ -198,6 +311,9 @@ int rtl8169_init(rtl8169_state_t *state)
         //Register to network service
         device_desc.state = (void *)state;
         network_register(&device_desc, &state->net_handle);
+        if (network_poll_create(state->net_handle, 0, &poll_handlers, state, &state->poll) != 0)
+            return -1;
+        intr_state = state;
         
         *(uint16_t *)(&state->memar[0x00e2]) |= 0x5100;
 
@@ -205,7 +321,7 @@ int rtl8169_init(rtl8169_state_t *state)
         state->memar[CMD_REG] = CMD_TX_EN | CMD_RX_EN;
 
         //Configure interrupts
-        *(uint16_t *)&state->memar[IMR_REG] = (INTR_ROK | INTR_TOK);
+        *(uint16_t *)&state->memar[IMR_REG] = INTR_ROK;
         *(uint16_t *)&state->memar[ISR_REG] = (INTR_ROK | INTR_TOK);
    
         *(uint32_t *)&state->memar[MISSEDPKT_REG] = 0;
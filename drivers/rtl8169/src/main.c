@@ -56,10 +56,6 @@ int module_init(void *ecam_addr)
 
     rtl8169_init(n_state);
 
-    cs_id rtl_task = 0;
-    create_task_kernel("rtl8169_int_poll", task_permissions_kernel, &rtl_task);
-    start_task_kernel(rtl_task, (void (*)(void *))rtl8169_intr_handler, n_state);
-    
     interrupt_registerhandler(int_val, rtl8169_intr_routine);
 
     return 0;
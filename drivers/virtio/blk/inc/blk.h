@@ -0,0 +1,130 @@
+// Copyright (c) 2019 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINAL_SEMI_VIRTIO_BLK_H
+#define CARDINAL_SEMI_VIRTIO_BLK_H
+
+#include "virtio.h"
+#include "CoreStorage/block.h"
+
+#define VIRTIO_BLK_QUEUE_LEN 128
+#define VIRTIO_BLK_MAX_QUEUES 16
+#define VIRTIO_BLK_INDIRECT_DESCS 128   //Per request table, header and status included
+#define VIRTIO_BLK_DIRECT_DESCS 16      //Ring descriptors each request owns without indirect descriptors
+#define VIRTIO_BLK_DONE_BATCH 32        //Completions reaped per pass of the interrupt handler
+#define VIRTIO_BLK_SECTOR_SIZE 512      //Unit of the request header's sector, whatever the block size
+
+#define VIRTIO_BLK_F_SIZE_MAX (1 << 1)
+#define VIRTIO_BLK_F_SEG_MAX (1 << 2)
+#define VIRTIO_BLK_F_RO (1 << 5)
+#define VIRTIO_BLK_F_BLK_SIZE (1 << 6)
+#define VIRTIO_BLK_F_FLUSH (1 << 9)
+#define VIRTIO_BLK_F_MQ (1 << 12)
+#define VIRTIO_BLK_F_DISCARD (1 << 13)
+#define VIRTIO_BLK_F_WRITE_ZEROES (1 << 14)
+
+//Feature bits in the second feature word
+#define VIRTIO_F_VERSION_1 (1 << 0)
+
+typedef struct PACKED {
+    uint64_t capacity;  //In 512 byte sectors
+    uint32_t size_max;
+    uint32_t seg_max;
+    uint16_t cylinders;
+    uint8_t heads;
+    uint8_t sectors;
+    uint32_t blk_size;
+    uint8_t physical_block_exp;
+    uint8_t alignment_offset;
+    uint16_t min_io_size;
+    uint32_t opt_io_size;
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
+} virtio_blk_cfg_t;
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_DISCARD 11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+typedef struct PACKED {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} virtio_blk_req_hdr_t;
+
+//Payload of discard and write zeroes requests
+typedef struct PACKED {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} virtio_blk_range_t;
+
+//Everything a request needs besides its data, one per outstanding request
+typedef struct {
+    virtq_desc_t table[VIRTIO_BLK_INDIRECT_DESCS];
+    virtio_blk_req_hdr_t hdr;
+    virtio_blk_range_t range;
+    uint8_t status;
+    uint8_t padding[31];
+} virtio_blk_slot_t;
+
+typedef struct {
+    int idx;
+    int lock;
+
+    virtio_blk_slot_t *slots;
+    uintptr_t slots_phys;
+    int slot_cnt;
+
+    //Free slots, slot n posts through ring descriptor n * descs per slot
+    uint16_t free[VIRTIO_BLK_QUEUE_LEN];
+    int free_cnt;
+    block_request_t *reqs[VIRTIO_BLK_QUEUE_LEN];
+
+    //Finished requests collected under lock, completed after it is dropped
+    block_request_t *done[VIRTIO_BLK_DONE_BATCH];
+    int done_status[VIRTIO_BLK_DONE_BATCH];
+    int done_cnt;
+
+    uint64_t requests;
+    uint64_t errors;
+} virtio_blk_queue_t;
+
+typedef struct {
+    virtio_state_t *common_state;
+    virtio_blk_cfg_t *cfg;
+
+    void *handle;
+
+    virtio_virtq_cmd_state_t **qstate;
+    int *avail_idx;
+    int *used_idx;
+
+    bool indirect;
+    bool read_only;
+    uint32_t sector_size;
+    uint32_t size_max;      //Longest data descriptor, 0 if the device has no limit
+    int data_descs;         //Data descriptors a request may use
+
+    int queue_cnt;
+    int vector_base;        //Vector of queue 0 when every queue has its own, -1 otherwise
+    virtio_blk_queue_t *queues[VIRTIO_BLK_MAX_QUEUES];
+} virtio_blk_driver_state_t;
+
+#endif
@@ -0,0 +1,391 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cardinal/local_spinlock.h>
+
+#include "virtio.h"
+#include "blk.h"
+
+#include "SysVirtualMemory/vmem.h"
+#include "SysPhysicalMemory/phys_mem.h"
+#include "SysTaskMgr/task.h"
+
+#include "CoreStorage/block.h"
+
+// Request queue n is CoreStorage hardware queue n and is serviced on scheduler core n, with MSI-X
+// each queue gets its own vector routed to that core. Every outstanding request owns a slot holding
+// its header, status byte and descriptor table. With indirect descriptors a request takes a single
+// ring descriptor however many pages it covers, so the queue stays as deep as the ring. Without
+// them each slot owns VIRTIO_BLK_DIRECT_DESCS ring descriptors. Either way requests complete in
+// whatever order the device finishes them.
+
+static virtio_blk_driver_state_t device;
+
+//Ring descriptors behind each slot
+static inline int virtio_blk_stride(void)
+{
+    return device.indirect ? 1 : VIRTIO_BLK_DIRECT_DESCS;
+}
+
+//Called with the queue's lock held
+static void virtio_blk_resphandler(virtio_virtq_cmd_state_t *cmd)
+{
+    virtio_blk_queue_t *q = device.queues[cmd->q];
+    int slot = cmd->idx / virtio_blk_stride();
+    int status = (q->slots[slot].status == VIRTIO_BLK_S_OK) ? 0 : -1;
+    if (status != 0)
+        q->errors++;
+
+    q->done[q->done_cnt] = q->reqs[slot];
+    q->done_status[q->done_cnt] = status;
+    q->done_cnt++;
+
+    q->reqs[slot] = NULL;
+    q->free[q->free_cnt++] = (uint16_t)slot;
+}
+
+//Complete everything the device has returned on the queue, a batch at a time so the block layer
+//can refill the freed slots while the rest are still being reaped
+static void virtio_blk_reap(virtio_blk_queue_t *q)
+{
+    block_request_t *reqs[VIRTIO_BLK_DONE_BATCH];
+    int status[VIRTIO_BLK_DONE_BATCH];
+    int cnt = 0;
+
+    do
+    {
+        local_spinlock_lock(&q->lock);
+        cnt = virtio_accept_used_budget(device.common_state, q->idx, VIRTIO_BLK_DONE_BATCH);
+        int done = q->done_cnt;
+        for (int i = 0; i < done; i++)
+        {
+            reqs[i] = q->done[i];
+            status[i] = q->done_status[i];
+        }
+        q->done_cnt = 0;
+        local_spinlock_unlock(&q->lock);
+
+        for (int i = 0; i < done; i++)
+            block_complete(device.handle, reqs[i], status[i]);
+    } while (cnt == VIRTIO_BLK_DONE_BATCH);
+}
+
+static void intrpt_handler(int irq)
+{
+    if (device.vector_base >= 0)
+    {
+        //The configuration vector doesn't carry any completions
+        int idx = irq - device.vector_base;
+        if (idx >= 0 && idx < device.queue_cnt && device.queues[idx] != NULL)
+            virtio_blk_reap(device.queues[idx]);
+        return;
+    }
+
+    for (int i = 0; i < device.queue_cnt; i++)
+        if (device.queues[i] != NULL)
+            virtio_blk_reap(device.queues[i]);
+}
+
+//Fill in the slot's header and descriptor table for the request, returns the descriptor count or
+//-1 if it doesn't fit
+static int virtio_blk_build(virtio_blk_slot_t *s, uintptr_t s_phys, block_request_t *req)
+{
+    virtq_desc_t *t = s->table;
+    uint32_t ratio = device.sector_size / VIRTIO_BLK_SECTOR_SIZE;
+    uint16_t data_flags = 0;
+    int cnt = 0;
+
+    s->hdr.reserved = 0;
+    s->hdr.sector = req->lba * ratio;
+    s->status = 0xFF;
+
+    t[cnt].addr = s_phys + offsetof(virtio_blk_slot_t, hdr);
+    t[cnt].len = sizeof(virtio_blk_req_hdr_t);
+    t[cnt].flags = 0;
+    cnt++;
+
+    switch (req->op)
+    {
+    case block_op_read:
+        s->hdr.type = VIRTIO_BLK_T_IN;
+        data_flags = VIRTQ_DESC_F_WRITE;
+        break;
+    case block_op_write:
+        s->hdr.type = VIRTIO_BLK_T_OUT;
+        break;
+    case block_op_flush:
+        s->hdr.type = VIRTIO_BLK_T_FLUSH;
+        s->hdr.sector = 0;
+        break;
+    case block_op_discard:
+    case block_op_write_zeroes:
+        s->hdr.type = (req->op == block_op_discard) ? VIRTIO_BLK_T_DISCARD : VIRTIO_BLK_T_WRITE_ZEROES;
+        s->hdr.sector = 0;
+        s->range.sector = req->lba * ratio;
+        s->range.num_sectors = req->sectors * ratio;
+        s->range.flags = 0;
+
+        t[cnt].addr = s_phys + offsetof(virtio_blk_slot_t, range);
+        t[cnt].len = sizeof(virtio_blk_range_t);
+        t[cnt].flags = 0;
+        cnt++;
+        break;
+    default:
+        return -1;
+    }
+
+    //The data is walked a page at a time, physically contiguous pages share a descriptor
+    for (block_bio_t *bio = req->bios; bio != NULL && (req->op == block_op_read || req->op == block_op_write); bio = bio->next)
+        for (uint32_t i = 0; i < bio->seg_cnt; i++)
+        {
+            uintptr_t virt = (uintptr_t)bio->segs[i].addr;
+            uint32_t len = bio->segs[i].len;
+            while (len > 0)
+            {
+                intptr_t phys = 0;
+                if (vmem_virttophys(NULL, (intptr_t)virt, &phys) != 0)
+                    return -1;
+                uint32_t chunk = MIN(len, KiB(4) - (virt & (KiB(4) - 1)));
+                if (device.size_max != 0)
+                    chunk = MIN(chunk, device.size_max);
+
+                virtq_desc_t *last = &t[cnt - 1];
+                if (cnt > 1 && last->addr + last->len == (uint64_t)phys && (device.size_max == 0 || last->len + chunk <= device.size_max))
+                    last->len += chunk;
+                else
+                {
+                    if (cnt - 1 >= device.data_descs)
+                        return -1;
+                    t[cnt].addr = phys;
+                    t[cnt].len = chunk;
+                    t[cnt].flags = data_flags;
+                    cnt++;
+                }
+
+                virt += chunk;
+                len -= chunk;
+            }
+        }
+
+    t[cnt].addr = s_phys + offsetof(virtio_blk_slot_t, status);
+    t[cnt].len = 1;
+    t[cnt].flags = VIRTQ_DESC_F_WRITE;
+    cnt++;
+    return cnt;
+}
+
+static int virtio_blk_submit(void *state, int hwq, block_request_t *req)
+{
+    virtio_blk_driver_state_t *device = (virtio_blk_driver_state_t *)state;
+    virtio_blk_queue_t *q = device->queues[hwq % device->queue_cnt];
+    if (device->read_only && req->op != block_op_read && req->op != block_op_flush)
+        return -1;
+
+    int cli_state = cli();
+    local_spinlock_lock(&q->lock);
+    if (q->free_cnt == 0)
+    {
+        local_spinlock_unlock(&q->lock);
+        sti(cli_state);
+        return -2;
+    }
+
+    int slot = q->free[--q->free_cnt];
+    virtio_blk_slot_t *s = &q->slots[slot];
+    uintptr_t s_phys = q->slots_phys + slot * sizeof(virtio_blk_slot_t);
+    int cnt = virtio_blk_build(s, s_phys, req);
+    if (cnt < 0)
+    {
+        q->free[q->free_cnt++] = (uint16_t)slot;
+        local_spinlock_unlock(&q->lock);
+        sti(cli_state);
+        return -1;
+    }
+
+    q->reqs[slot] = req;
+    q->requests++;
+    virtio_postcmd_table(device->common_state, q->idx, slot * virtio_blk_stride(), s->table, s_phys + offsetof(virtio_blk_slot_t, table), cnt, device->indirect, virtio_blk_resphandler);
+    local_spinlock_unlock(&q->lock);
+    sti(cli_state);
+    return 0;
+}
+
+//One notification for everything the block layer dispatched in a go
+static void virtio_blk_commit(void *state, int hwq)
+{
+    virtio_blk_driver_state_t *device = (virtio_blk_driver_state_t *)state;
+    virtio_blk_queue_t *q = device->queues[hwq % device->queue_cnt];
+
+    int cli_state = cli();
+    local_spinlock_lock(&q->lock);
+    virtio_kick(device->common_state, q->idx);
+    local_spinlock_unlock(&q->lock);
+    sti(cli_state);
+}
+
+//Dump queue counters
+int virtio_blk_stats()
+{
+    char tmp[20];
+    for (int i = 0; i < device.queue_cnt; i++)
+    {
+        virtio_blk_queue_t *q = device.queues[i];
+        virtio_virtq_t *vq = &device.common_state->queues[i];
+
+        DEBUG_PRINT("[VirtioBlk] Queue ");
+        DEBUG_PRINT(itoa(i, tmp, 10));
+        DEBUG_PRINT(" requests: ");
+        DEBUG_PRINT(ltoa(q->requests, tmp, 10));
+        DEBUG_PRINT(" errors: ");
+        DEBUG_PRINT(ltoa(q->errors, tmp, 10));
+        DEBUG_PRINT(" notifications: ");
+        DEBUG_PRINT(ltoa(vq->kicks, tmp, 10));
+        DEBUG_PRINT(" suppressed: ");
+        DEBUG_PRINT(ltoa(vq->kicks_suppressed, tmp, 10));
+        DEBUG_PRINT("\r\n");
+    }
+    return 0;
+}
+
+int module_init(void *ecam)
+{
+
+    memset(&device, 0, sizeof(device));
+    device.vector_base = -1;
+
+    device.common_state = virtio_initialize(ecam, intrpt_handler, NULL, NULL, NULL);
+    device.cfg = (virtio_blk_cfg_t *)device.common_state->dev_cfg;
+
+    //Per queue bookkeeping, sized to what the device exposes
+    int queue_cnt = device.common_state->queue_cnt;
+    device.qstate = malloc(sizeof(virtio_virtq_cmd_state_t *) * queue_cnt);
+    device.avail_idx = malloc(sizeof(int) * queue_cnt);
+    device.used_idx = malloc(sizeof(int) * queue_cnt);
+    for (int i = 0; i < queue_cnt; i++)
+    {
+        device.qstate[i] = NULL;
+        device.avail_idx[i] = 0;
+        device.used_idx[i] = 0;
+    }
+    device.common_state->cmds = device.qstate;
+    device.common_state->avail_idx = device.avail_idx;
+    device.common_state->used_idx = device.used_idx;
+
+    uint32_t features = virtio_getfeatures(device.common_state, 0);
+    uint32_t features_hi = virtio_getfeatures(device.common_state, 1);
+
+    uint32_t drv_features = features & (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE |
+                                        VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_MQ | VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES |
+                                        VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX);
+    virtio_setfeatures(device.common_state, 0, drv_features);
+    virtio_setfeatures(device.common_state, 1, features_hi & VIRTIO_F_VERSION_1);
+
+    if (!virtio_features_ok(device.common_state))
+        return -1;
+
+    device.indirect = (drv_features & VIRTIO_F_INDIRECT_DESC) != 0;
+    device.read_only = (drv_features & VIRTIO_BLK_F_RO) != 0;
+    device.sector_size = VIRTIO_BLK_SECTOR_SIZE;
+    if ((drv_features & VIRTIO_BLK_F_BLK_SIZE) && device.cfg->blk_size >= VIRTIO_BLK_SECTOR_SIZE && (device.cfg->blk_size % VIRTIO_BLK_SECTOR_SIZE) == 0)
+        device.sector_size = device.cfg->blk_size;
+    device.size_max = (drv_features & VIRTIO_BLK_F_SIZE_MAX) ? device.cfg->size_max : 0;
+
+    //Header and status take two of the descriptors
+    device.data_descs = (device.indirect ? VIRTIO_BLK_INDIRECT_DESCS : VIRTIO_BLK_DIRECT_DESCS) - 2;
+    if ((drv_features & VIRTIO_BLK_F_SEG_MAX) && device.cfg->seg_max > 0)
+        device.data_descs = MIN(device.data_descs, (int)device.cfg->seg_max);
+
+    //One queue per core, each with its own vector delivered to that core
+    device.queue_cnt = 1;
+    if (drv_features & VIRTIO_BLK_F_MQ)
+    {
+        int mq_cnt = MIN(MIN((int)device.cfg->num_queues, task_corecount()), VIRTIO_BLK_MAX_QUEUES);
+        int apic_ids[VIRTIO_BLK_MAX_QUEUES];
+        for (int i = 0; i < mq_cnt; i++)
+            apic_ids[i] = task_coreapicid(i);
+
+        if (mq_cnt > 1)
+            device.vector_base = virtio_setupvectors(device.common_state, mq_cnt, apic_ids, intrpt_handler);
+        if (device.vector_base >= 0)
+            device.queue_cnt = mq_cnt;
+    }
+
+    //setup virtqueues
+    int slot_cnt = VIRTIO_BLK_QUEUE_LEN / virtio_blk_stride();
+    for (int i = 0; i < device.queue_cnt; i++)
+    {
+        virtio_blk_queue_t *q = malloc(sizeof(virtio_blk_queue_t));
+        memset(q, 0, sizeof(virtio_blk_queue_t));
+        q->idx = i;
+        device.queues[i] = q;
+
+        device.qstate[i] = malloc(sizeof(virtio_virtq_cmd_state_t) * VIRTIO_BLK_QUEUE_LEN);
+        memset(device.qstate[i], 0, sizeof(virtio_virtq_cmd_state_t) * VIRTIO_BLK_QUEUE_LEN);
+        device.common_state->queues[i].msix_vector = (device.vector_base >= 0) ? i + 1 : 0;
+        virtio_setupqueue(device.common_state, i, VIRTIO_BLK_QUEUE_LEN);
+
+        size_t slots_sz = (slot_cnt * sizeof(virtio_blk_slot_t) + KiB(4) - 1) & ~(KiB(4) - 1);
+        q->slots_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_zero, slots_sz);
+        if (q->slots_phys == (uintptr_t)-1)
+            PANIC("[VirtioBlk] Failed to allocate request slots.");
+        q->slots = (virtio_blk_slot_t *)vmem_phystovirt((intptr_t)q->slots_phys, slots_sz, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+        q->slot_cnt = slot_cnt;
+        for (int j = 0; j < slot_cnt; j++)
+            q->free[q->free_cnt++] = (uint16_t)(slot_cnt - 1 - j);
+    }
+
+    virtio_driver_ok(device.common_state);
+
+    //register as a block device
+    uint32_t ratio = device.sector_size / VIRTIO_BLK_SECTOR_SIZE;
+    block_device_desc_t desc;
+    memset(&desc, 0, sizeof(desc));
+    strncpy(desc.name, "vblk0", sizeof(desc.name));
+    desc.state = &device;
+    desc.sector_size = device.sector_size;
+    desc.sector_cnt = device.cfg->capacity / ratio;
+    desc.hwq_cnt = device.queue_cnt;
+    desc.queue_depth = slot_cnt;
+
+    //Every segment may start and end part way into a page, which costs up to two extra descriptors
+    desc.max_segs = MAX(device.data_descs / 4, 1);
+    desc.max_sectors = MAX((uint32_t)((device.data_descs - 2 * (int)desc.max_segs) * KiB(4)) / device.sector_size, 1);
+    if (device.size_max != 0 && device.size_max < KiB(4))
+        desc.max_sectors = MAX((uint32_t)((device.data_descs - 2 * (int)desc.max_segs) * device.size_max) / device.sector_size, 1);
+
+    if (drv_features & VIRTIO_BLK_F_FLUSH)
+        desc.features |= block_device_features_flush;
+    if ((drv_features & VIRTIO_BLK_F_DISCARD) && !device.read_only && device.cfg->max_discard_sectors >= ratio)
+    {
+        desc.features |= block_device_features_discard;
+        desc.max_discard_sectors = device.cfg->max_discard_sectors / ratio;
+    }
+    if ((drv_features & VIRTIO_BLK_F_WRITE_ZEROES) && !device.read_only && device.cfg->max_write_zeroes_sectors >= ratio)
+    {
+        desc.features |= block_device_features_write_zeroes;
+        desc.max_write_zeroes_sectors = device.cfg->max_write_zeroes_sectors / ratio;
+    }
+    desc.ops.submit = virtio_blk_submit;
+    desc.ops.commit = virtio_blk_commit;
+
+    if (block_register(&desc, &device.handle) != 0)
+        PANIC("[VirtioBlk] Failed to register with CoreStorage.");
+
+    {
+        char tmp[10];
+        DEBUG_PRINT("[VirtioBlk] Queues: ");
+        DEBUG_PRINT(itoa(device.queue_cnt, tmp, 10));
+        DEBUG_PRINT(" Depth: ");
+        DEBUG_PRINT(itoa(slot_cnt, tmp, 10));
+        DEBUG_PRINT(device.indirect ? " indirect\r\n" : "\r\n");
+    }
+
+    return 0;
+}
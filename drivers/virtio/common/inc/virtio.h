@@ -78,6 +78,11 @@ typedef struct PACKED
 /* This means the buffer contains a list of buffer descriptors. */
 #define VIRTQ_DESC_F_INDIRECT 4
 
+/* The driver doesn't want an interrupt when the device consumes a buffer. */
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+/* The device doesn't want a notification when the driver adds a buffer. */
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
 typedef struct
 {
     uint64_t addr;  /* Address (guest-physical). */
@@ -121,9 +126,27 @@ typedef struct virtio_virtq_cmd_state
     bool finished;
     int q;
     int idx;
+    int chain_len;      //Descriptors following idx that belong to this command
+    uint32_t used_len;  //Bytes the device wrote, valid in the handler
     void (*handler)(struct virtio_virtq_cmd_state *);
 } virtio_virtq_cmd_state_t;
 
+//Ring pointers cached at setup so posting never has to go through the common config
+typedef struct
+{
+    virtq_desc_t *descs;
+    virtq_avail_t *avail;
+    virtq_used_t *used;
+    volatile uint16_t *notify;
+    int len;
+    uint16_t msix_vector;   //MSI-X table entry the queue signals, set before virtio_setupqueue
+    uint16_t kicked_idx;    //Avail index the device was last notified of
+    bool intr_suppressed;
+
+    uint64_t kicks;
+    uint64_t kicks_suppressed;
+} virtio_virtq_t;
+
 typedef struct
 {
     virtio_pci_common_cfg_t *common_cfg;
@@ -135,8 +158,13 @@ typedef struct
     int *used_idx;
     virtio_virtq_cmd_state_t **cmds;
 
+    virtio_virtq_t *queues;
+    int queue_cnt;
+    bool event_idx;
+
     intptr_t notif_bar;
     pci_config_t *device;
+    int vector;             //Vector behind MSI-X table entry 0 or the plain MSI
 } virtio_state_t;
 
 PRIVATE virtio_state_t *virtio_initialize(void *ecam_addr, void (*int_handler)(int), virtio_virtq_cmd_state_t **cmds, int *avail_idx, int *used_idx);
@@ -151,14 +179,41 @@ PRIVATE void virtio_driver_ok(virtio_state_t *state);
 
 PRIVATE void *virtio_setupqueue(virtio_state_t *state, int idx, int entcnt);
 
+//Give MSI-X table entries 1 to cnt their own vectors, entry n + 1 is delivered to apic_ids[n].
+//Entry 0 keeps the vector set up by virtio_initialize. Returns the vector of entry 1, or -1 if
+//the device doesn't have enough MSI-X entries.
+PRIVATE int virtio_setupvectors(virtio_state_t *state, int cnt, int *apic_ids, void (*int_handler)(int));
+
 PRIVATE void virtio_notify(virtio_state_t *state, int idx);
 
+//Notify the device of everything posted since the last kick, unless it asked not to be
+PRIVATE bool virtio_kick(virtio_state_t *state, int idx);
+
+//Ask the device to hold off on used buffer interrupts for this queue, the driver reclaims them itself
+PRIVATE void virtio_suppress_intr(virtio_state_t *state, int idx, bool suppress);
+
 PRIVATE void virtio_addresponse(virtio_state_t *state, int idx, void *buf, int len, void (*resp_handler)(virtio_virtq_cmd_state_t *));
 
 PRIVATE void virtio_postcmd_noresp(virtio_state_t *state, int idx, void *cmd, int len, void (*resp_handler)(virtio_virtq_cmd_state_t *));
 
+PRIVATE void virtio_postcmd_sg(virtio_state_t *state, int idx, virtio_phys_virt_addrpair_t *segs, int seg_cnt, void (*resp_handler)(virtio_virtq_cmd_state_t *));
+
+//Post a request through descriptor head, for drivers that keep track of free descriptors themselves
+//so requests can complete out of order. table holds cnt descriptors with their addr, len and
+//VIRTQ_DESC_F_WRITE filled in, the chaining is done here. With indirect the device reads the table
+//from table_phys and only head is used, otherwise it's copied into descriptors head to head + cnt - 1.
+PRIVATE void virtio_postcmd_table(virtio_state_t *state, int idx, int head, virtq_desc_t *table, intptr_t table_phys, int cnt, bool indirect, void (*resp_handler)(virtio_virtq_cmd_state_t *));
+
 PRIVATE void virtio_postcmd(virtio_state_t *state, int idx, void *cmd, int len, void *resp, int response_len, void (*resp_handler)(virtio_virtq_cmd_state_t *));
 
 PRIVATE void virtio_accept_used(virtio_state_t *state, int idx);
 
+#define VIRTIO_NO_BUDGET (0x7fffffff)
+
+//Process at most budget used buffers, returns how many were processed
+PRIVATE int virtio_accept_used_budget(virtio_state_t *state, int idx, int budget);
+
+//True if the device has returned buffers that haven't been accepted yet
+PRIVATE bool virtio_has_used(virtio_state_t *state, int idx);
+
 #endif
\ No newline at end of file
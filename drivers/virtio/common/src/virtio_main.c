@@ -89,12 +89,18 @@ PRIVATE virtio_state_t *virtio_initialize(void *ecam_addr, void (*int_handler)(i
     //Reset the device
     n_state->common_cfg->device_status = 0;
 
+    n_state->event_idx = false;
+    n_state->queue_cnt = n_state->common_cfg->num_queues;
+    n_state->queues = malloc(sizeof(virtio_virtq_t) * n_state->queue_cnt);
+    memset(n_state->queues, 0, sizeof(virtio_virtq_t) * n_state->queue_cnt);
+
     //interrupt setup
     //install msi interrupt servicing
     int int_cnt = 0;
     int msi_val = pci_getmsiinfo(device, &int_cnt);
 
     interrupt_allocate(1, interrupt_flags_exclusive, &msi_vector);
+    n_state->vector = msi_vector;
 
     char vector_str[10];
     DEBUG_PRINT("[VirtioCommon] Allocated Interrupt Vector: ");
@@ -139,6 +145,9 @@ PRIVATE void virtio_setfeatures(virtio_state_t *state, int idx, uint32_t val)
 {
     state->common_cfg->driver_feature_select = idx;
     state->common_cfg->driver_feature = val;
+
+    if (idx == 0)
+        state->event_idx = (val & VIRTIO_F_EVENT_IDX) != 0;
 }
 
 PRIVATE bool virtio_features_ok(virtio_state_t *state)
@@ -163,7 +172,7 @@ PRIVATE void *virtio_setupqueue(virtio_state_t *state, int idx, int entcnt)
 
     size_t ts = 16 * entcnt + 6 + 2 * entcnt + 6 + 8 * entcnt;
 
-    uintptr_t virtqueue_phys = pagealloc_alloc(0, 0, physmem_alloc_flags_data, ts);
+    uintptr_t virtqueue_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data, ts);
     intptr_t virtqueue_virt = vmem_phystovirt((intptr_t)virtqueue_phys, ts, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
 
     memset((void *)virtqueue_virt, 0, ts);
@@ -171,31 +180,124 @@ PRIVATE void *virtio_setupqueue(virtio_state_t *state, int idx, int entcnt)
     state->common_cfg->queue_desc = virtqueue_phys;
     state->common_cfg->queue_avail = virtqueue_phys + 16 * entcnt;
     state->common_cfg->queue_used = virtqueue_phys + 16 * entcnt + 6 + 2 * entcnt;
-    state->common_cfg->queue_msix_vector = 0;
+    virtio_virtq_t *q = &state->queues[idx];
+    state->common_cfg->queue_msix_vector = q->msix_vector;
     state->common_cfg->queue_enable = 1;
 
+    q->descs = (virtq_desc_t *)virtqueue_virt;
+    q->avail = (virtq_avail_t *)(virtqueue_virt + 16 * entcnt);
+    q->used = (virtq_used_t *)(virtqueue_virt + 16 * entcnt + 6 + 2 * entcnt);
+    q->notify = (volatile uint16_t *)(state->notif_bar + state->notif_cfg->cap.offset + state->common_cfg->queue_notify_off * state->notif_cfg->notify_multiplier);
+    q->len = entcnt;
+    q->kicked_idx = 0;
+    q->intr_suppressed = false;
+
     return (void *)virtqueue_virt;
 }
 
+PRIVATE int virtio_setupvectors(virtio_state_t *state, int cnt, int *apic_ids, void (*int_handler)(int))
+{
+    int table_sz = 0;
+    if (pci_getmsiinfo(state->device, &table_sz) != 1 || table_sz < cnt + 1)
+        return -1;
+
+    int base = 0;
+    if (interrupt_allocate(cnt, interrupt_flags_exclusive, &base) != 0)
+        return -1;
+
+    uintptr_t *msi_addr = malloc(sizeof(uintptr_t) * table_sz);
+    uint32_t *msi_msg = malloc(sizeof(uint32_t) * table_sz);
+    for (int i = 0; i < table_sz; i++)
+    {
+        bool own = (i >= 1 && i <= cnt);
+        msi_addr[i] = (uintptr_t)msi_register_addr(own ? apic_ids[i - 1] : 0);
+        msi_msg[i] = msi_register_data(own ? base + i - 1 : state->vector);
+    }
+
+    for (int i = 0; i < cnt; i++)
+        interrupt_registerhandler(base + i, int_handler);
+
+    pci_setmsiinfo(state->device, 1, msi_addr, msi_msg, table_sz);
+    free(msi_addr);
+    free(msi_msg);
+    return base;
+}
+
 PRIVATE void virtio_notify(virtio_state_t *state, int idx)
 {
-    state->common_cfg->queue_select = (uint16_t)idx;
+    virtio_virtq_t *q = &state->queues[idx];
+    q->kicked_idx = q->avail->idx;
+    q->kicks++;
+    *q->notify = (uint16_t)idx;
+}
 
-    *(uint16_t *)(state->notif_bar + state->notif_cfg->cap.offset + state->common_cfg->queue_notify_off * state->notif_cfg->notify_multiplier) = (uint16_t)idx;
+PRIVATE bool virtio_kick(virtio_state_t *state, int idx)
+{
+    virtio_virtq_t *q = &state->queues[idx];
+    uint16_t new_idx = q->avail->idx;
+    uint16_t old_idx = q->kicked_idx;
+    if (new_idx == old_idx)
+        return false;
+
+    //The avail index must be visible before the device's suppression state is sampled
+    __sync_synchronize();
+
+    bool needed;
+    if (state->event_idx)
+    {
+        //avail_event lives just past the used ring
+        uint16_t event = *(volatile uint16_t *)&q->used->ring[q->len];
+        needed = (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+    }
+    else
+        needed = (*(volatile uint16_t *)&q->used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0;
+
+    if (!needed)
+    {
+        q->kicked_idx = new_idx;
+        q->kicks_suppressed++;
+        return false;
+    }
+
+    virtio_notify(state, idx);
+    return true;
 }
 
-PRIVATE void virtio_addresponse(virtio_state_t *state, int idx, void *buf, int len, void (*resp_handler)(virtio_virtq_cmd_state_t *))
+//Caller holds whatever lock protects the queue
+static void virtio_update_used_event(virtio_state_t *state, int idx)
 {
-    state->common_cfg->queue_select = (uint16_t)idx;
-    int q_len = state->common_cfg->queue_size;
+    virtio_virtq_t *q = &state->queues[idx];
+    if (!state->event_idx)
+        return;
+
+    //used_event lives just past the avail ring, a suppressed queue still interrupts once it is mostly full
+    uint16_t event = (uint16_t)state->used_idx[idx];
+    if (q->intr_suppressed)
+        event += (uint16_t)(q->len * 3 / 4);
+    *(volatile uint16_t *)&q->avail->ring[q->len] = event;
+}
 
-    virtq_desc_t *descs = (virtq_desc_t *)vmem_phystovirt((intptr_t)state->common_cfg->queue_desc, q_len * 16, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
-    virtq_avail_t *avails = (virtq_avail_t *)vmem_phystovirt((intptr_t)state->common_cfg->queue_avail, q_len * 2 + 6, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
-    //avails->flags = 1;
+PRIVATE void virtio_suppress_intr(virtio_state_t *state, int idx, bool suppress)
+{
+    virtio_virtq_t *q = &state->queues[idx];
+    q->intr_suppressed = suppress;
+    if (suppress)
+        q->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    else
+        q->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    virtio_update_used_event(state, idx);
+}
 
-    int cur_desc_idx = state->avail_idx[idx];
-    state->avail_idx[idx] = (state->avail_idx[idx] + 1) % q_len;
+//Hand the chain starting at head to the device
+static void virtio_publish(virtio_virtq_t *q, int head)
+{
+    q->avail->ring[q->avail->idx % q->len] = head;
+    __asm__ volatile("" ::: "memory");
+    q->avail->idx++;
+}
 
+static void virtio_claimdesc(virtio_state_t *state, int idx, int cur_desc_idx, void (*resp_handler)(virtio_virtq_cmd_state_t *))
+{
     while (state->cmds[idx][cur_desc_idx].waiting && !state->cmds[idx][cur_desc_idx].finished)
     {
         virtio_notify(state, idx);
@@ -206,8 +308,19 @@ PRIVATE void virtio_addresponse(virtio_state_t *state, int idx, void *buf, int l
     state->cmds[idx][cur_desc_idx].q = idx;
     state->cmds[idx][cur_desc_idx].idx = cur_desc_idx;
     state->cmds[idx][cur_desc_idx].handler = resp_handler;
+    state->cmds[idx][cur_desc_idx].chain_len = 0;
+}
+
+PRIVATE void virtio_addresponse(virtio_state_t *state, int idx, void *buf, int len, void (*resp_handler)(virtio_virtq_cmd_state_t *))
+{
+    virtio_virtq_t *q = &state->queues[idx];
+    virtq_desc_t *descs = q->descs;
+
+    int cur_desc_idx = state->avail_idx[idx];
+    state->avail_idx[idx] = (state->avail_idx[idx] + 1) % q->len;
+
+    virtio_claimdesc(state, idx, cur_desc_idx, resp_handler);
 
-    //Fill a descriptor with the cmd and update the available ring
     //Fill a descriptor with the response and update the available ring
     intptr_t resp_phys = 0;
     vmem_virttophys(NULL, (intptr_t)buf, &resp_phys);
@@ -223,37 +336,20 @@ PRIVATE void virtio_addresponse(virtio_state_t *state, int idx, void *buf, int l
     descs[cur_desc_idx].flags = VIRTQ_DESC_F_WRITE;
     descs[cur_desc_idx].next = 0;
 
-    avails->ring[avails->idx % q_len] = cur_desc_idx;
-    avails->idx++;
+    virtio_publish(q, cur_desc_idx);
 }
 
 PRIVATE void virtio_postcmd_noresp(virtio_state_t *state, int idx, void *cmd, int len, void (*resp_handler)(virtio_virtq_cmd_state_t *))
 {
-
-    state->common_cfg->queue_select = (uint16_t)idx;
-    int q_len = state->common_cfg->queue_size;
-
-    virtq_desc_t *descs = (virtq_desc_t *)vmem_phystovirt((intptr_t)state->common_cfg->queue_desc, q_len * 16, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
-    virtq_avail_t *avails = (virtq_avail_t *)vmem_phystovirt((intptr_t)state->common_cfg->queue_avail, q_len * 2 + 6, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
-    virtq_used_t *used = (virtq_used_t *)vmem_phystovirt((intptr_t)state->common_cfg->queue_used, q_len * 8 + 6, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
-    //avails->flags = 1;
+    virtio_virtq_t *q = &state->queues[idx];
+    virtq_desc_t *descs = q->descs;
 
     int cur_desc_idx = state->avail_idx[idx];
-    state->avail_idx[idx] = (state->avail_idx[idx] + 1) % q_len;
+    state->avail_idx[idx] = (state->avail_idx[idx] + 1) % q->len;
 
-    while (state->cmds[idx][cur_desc_idx].waiting && !state->cmds[idx][cur_desc_idx].finished)
-    {
-        virtio_notify(state, idx);
-    }
-
-    state->cmds[idx][cur_desc_idx].waiting = true;
-    state->cmds[idx][cur_desc_idx].finished = false;
-    state->cmds[idx][cur_desc_idx].q = idx;
-    state->cmds[idx][cur_desc_idx].idx = cur_desc_idx;
-    state->cmds[idx][cur_desc_idx].handler = resp_handler;
+    virtio_claimdesc(state, idx, cur_desc_idx, resp_handler);
 
     //Fill a descriptor with the cmd and update the available ring
-    //Fill a descriptor with the response and update the available ring
     intptr_t cmd_phys = 0;
     vmem_virttophys(NULL, (intptr_t)cmd, &cmd_phys);
 
@@ -268,33 +364,82 @@ PRIVATE void virtio_postcmd_noresp(virtio_state_t *state, int idx, void *cmd, in
     descs[cur_desc_idx].flags = 0;
     descs[cur_desc_idx].addr = cmd_phys;
 
-    avails->ring[avails->idx % q_len] = cur_desc_idx;
-    avails->idx++;
+    virtio_publish(q, cur_desc_idx);
 }
 
-PRIVATE void virtio_postcmd(virtio_state_t *state, int idx, void *cmd, int len, void *resp, int response_len, void (*resp_handler)(virtio_virtq_cmd_state_t *))
+//Post a device readable buffer made of several physically discontiguous segments
+PRIVATE void virtio_postcmd_sg(virtio_state_t *state, int idx, virtio_phys_virt_addrpair_t *segs, int seg_cnt, void (*resp_handler)(virtio_virtq_cmd_state_t *))
 {
+    virtio_virtq_t *q = &state->queues[idx];
+    virtq_desc_t *descs = q->descs;
 
-    state->common_cfg->queue_select = (uint16_t)idx;
-    int q_len = state->common_cfg->queue_size;
+    int head_idx = state->avail_idx[idx];
+    state->avail_idx[idx] = (state->avail_idx[idx] + seg_cnt) % q->len;
 
-    virtq_desc_t *descs = (virtq_desc_t *)vmem_phystovirt((intptr_t)state->common_cfg->queue_desc, q_len * 16, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
-    virtq_avail_t *avails = (virtq_avail_t *)vmem_phystovirt((intptr_t)state->common_cfg->queue_avail, q_len * 2 + 6, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
-    //avails->flags = 1;
+    for (int i = 0; i < seg_cnt; i++)
+    {
+        int cur_desc_idx = (head_idx + i) % q->len;
+        virtio_claimdesc(state, idx, cur_desc_idx, (i == 0) ? resp_handler : NULL);
+        state->cmds[idx][cur_desc_idx].chain_len = (i == 0) ? seg_cnt - 1 : 0;
+        state->cmds[idx][cur_desc_idx].cmd = segs[i];
+
+        descs[cur_desc_idx].addr = segs[i].phys;
+        descs[cur_desc_idx].len = (uint32_t)segs[i].len;
+        descs[cur_desc_idx].flags = (i + 1 < seg_cnt) ? VIRTQ_DESC_F_NEXT : 0;
+        descs[cur_desc_idx].next = (uint16_t)((cur_desc_idx + 1) % q->len);
+    }
 
-    int cur_desc_idx = state->avail_idx[idx];
-    state->avail_idx[idx] = (state->avail_idx[idx] + 2) % q_len;
+    virtio_publish(q, head_idx);
+}
 
-    while (state->cmds[idx][cur_desc_idx].waiting && !state->cmds[idx][cur_desc_idx].finished)
+PRIVATE void virtio_postcmd_table(virtio_state_t *state, int idx, int head, virtq_desc_t *table, intptr_t table_phys, int cnt, bool indirect, void (*resp_handler)(virtio_virtq_cmd_state_t *))
+{
+    virtio_virtq_t *q = &state->queues[idx];
+    virtq_desc_t *descs = q->descs;
+
+    if (indirect)
     {
-        virtio_notify(state, idx);
+        for (int i = 0; i < cnt; i++)
+        {
+            table[i].flags = (table[i].flags & VIRTQ_DESC_F_WRITE) | ((i + 1 < cnt) ? VIRTQ_DESC_F_NEXT : 0);
+            table[i].next = (uint16_t)(i + 1);
+        }
+
+        virtio_claimdesc(state, idx, head, resp_handler);
+        state->cmds[idx][head].cmd.virt = table;
+        state->cmds[idx][head].cmd.phys = table_phys;
+        state->cmds[idx][head].cmd.len = cnt * sizeof(virtq_desc_t);
+
+        descs[head].addr = table_phys;
+        descs[head].len = (uint32_t)(cnt * sizeof(virtq_desc_t));
+        descs[head].flags = VIRTQ_DESC_F_INDIRECT;
+        descs[head].next = 0;
+    }
+    else
+    {
+        for (int i = 0; i < cnt; i++)
+        {
+            virtio_claimdesc(state, idx, head + i, (i == 0) ? resp_handler : NULL);
+            descs[head + i].addr = table[i].addr;
+            descs[head + i].len = table[i].len;
+            descs[head + i].flags = (table[i].flags & VIRTQ_DESC_F_WRITE) | ((i + 1 < cnt) ? VIRTQ_DESC_F_NEXT : 0);
+            descs[head + i].next = (uint16_t)(head + i + 1);
+        }
+        state->cmds[idx][head].chain_len = cnt - 1;
     }
 
-    state->cmds[idx][cur_desc_idx].waiting = true;
-    state->cmds[idx][cur_desc_idx].finished = false;
-    state->cmds[idx][cur_desc_idx].q = idx;
-    state->cmds[idx][cur_desc_idx].idx = cur_desc_idx;
-    state->cmds[idx][cur_desc_idx].handler = resp_handler;
+    virtio_publish(q, head);
+}
+
+PRIVATE void virtio_postcmd(virtio_state_t *state, int idx, void *cmd, int len, void *resp, int response_len, void (*resp_handler)(virtio_virtq_cmd_state_t *))
+{
+    virtio_virtq_t *q = &state->queues[idx];
+    virtq_desc_t *descs = q->descs;
+
+    int cur_desc_idx = state->avail_idx[idx];
+    state->avail_idx[idx] = (state->avail_idx[idx] + 2) % q->len;
+
+    virtio_claimdesc(state, idx, cur_desc_idx, resp_handler);
 
     //Fill a descriptor with the cmd and update the available ring
     //Fill a descriptor with the response and update the available ring
@@ -336,50 +481,63 @@ PRIVATE void virtio_postcmd(virtio_state_t *state, int idx, void *cmd, int len,
     }
     descs[cur_desc_idx].addr = cmd_phys;
 
-    avails->ring[avails->idx % q_len] = cur_desc_idx;
-    avails->idx++;
+    virtio_publish(q, cur_desc_idx);
 }
 
-PRIVATE void virtio_accept_used(virtio_state_t *state, int idx)
+PRIVATE int virtio_accept_used_budget(virtio_state_t *state, int idx, int budget)
 {
-    state->common_cfg->queue_select = (uint16_t)idx;
-    int q_len = state->common_cfg->queue_size;
+    virtio_virtq_t *q = &state->queues[idx];
+    int q_len = q->len;
+    int processed = 0;
 
-    virtq_used_t *descs = (virtq_used_t *)vmem_phystovirt((intptr_t)state->common_cfg->queue_used, q_len * 8 + 6, vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
+    virtq_used_t *descs = q->used;
 
-    int d_idx = descs->idx;
+    //Indices are free running 16-bit counters
+    uint16_t d_idx = descs->idx;
     do
     {
-        for (int i = state->used_idx[idx]; i != d_idx; i++)
+        uint16_t i = (uint16_t)state->used_idx[idx];
+        for (; i != d_idx && processed < budget; i++, processed++)
         {
             int r_id = descs->ring[i % q_len].id;
 
-            /*{
-                char tmp[10];
-                DEBUG_PRINT("IDX: ");
-                DEBUG_PRINT(itoa(idx, tmp, 10));
-                DEBUG_PRINT(" USED INDEX: ");
-                DEBUG_PRINT(itoa(r_id, tmp, 16));
-                DEBUG_PRINT(" DIDEX: ");
-                DEBUG_PRINT(itoa(d_idx, tmp, 16));
-                DEBUG_PRINT("\r\n");
-            }*/
-
             state->cmds[idx][r_id].waiting = false;
+            state->cmds[idx][r_id].used_len = descs->ring[i % q_len].len;
+            for (int j = 1; j <= state->cmds[idx][r_id].chain_len; j++)
+            {
+                state->cmds[idx][(r_id + j) % q_len].waiting = false;
+                state->cmds[idx][(r_id + j) % q_len].finished = true;
+            }
             if (state->cmds[idx][r_id].handler != NULL)
                 state->cmds[idx][r_id].handler(&state->cmds[idx][r_id]);
             state->cmds[idx][r_id].finished = true;
             state->cmds[idx][r_id].handler = NULL;
         }
+        state->used_idx[idx] = i;
+
+        //Re-arm before the final check so a completion racing with us still raises an interrupt
+        virtio_update_used_event(state, idx);
+        __sync_synchronize();
+
+        if (processed >= budget)
+            return processed;
+
         if (d_idx == descs->idx)
         {
             *state->isr_cfg;
-            return;
-        }
-        else
-        {
-            state->used_idx[idx] = d_idx;
-            d_idx = descs->idx;
+            return processed;
         }
+        d_idx = descs->idx;
     } while (true);
-}
\ No newline at end of file
+}
+
+PRIVATE void virtio_accept_used(virtio_state_t *state, int idx)
+{
+    virtio_accept_used_budget(state, idx, VIRTIO_NO_BUDGET);
+}
+
+PRIVATE bool virtio_has_used(virtio_state_t *state, int idx)
+{
+    __sync_synchronize();
+    return state->queues[idx].used->idx != (uint16_t)state->used_idx[idx];
+}
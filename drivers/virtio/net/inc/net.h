@@ -7,26 +7,51 @@
 #define CARDINAL_SEMI_VIRTIO_NET_H
 
 #include "virtio.h"
+#include "CoreNetwork/netbuf.h"
 
-#define VIRTIO_NET_QUEUE_CNT 2
 #define VIRTIO_NET_QUEUE_LEN 256
+#define VIRTIO_NET_CTRL_QUEUE_LEN 16
+#define VIRTIO_NET_TX_MAX_SEGS 48    //Enough for a 64KiB super-packet in netbufs
+#define VIRTIO_NET_GSO_MAX_SIZE KiB(64)
+#define VIRTIO_NET_MAX_PAIRS 8
 
 #define VIRTIO_NET_F_CSUM (1 << 0)
+#define VIRTIO_NET_F_GUEST_CSUM (1 << 1)
 #define VIRTIO_NET_F_MAC (1 << 5)
+#define VIRTIO_NET_F_GUEST_TSO4 (1 << 7)
+#define VIRTIO_NET_F_GUEST_TSO6 (1 << 8)
+#define VIRTIO_NET_F_HOST_TSO4 (1 << 11)
+#define VIRTIO_NET_F_HOST_TSO6 (1 << 12)
+#define VIRTIO_NET_F_MRG_RXBUF (1 << 15)
 #define VIRTIO_NET_F_STATUS (1 << 16)
+#define VIRTIO_NET_F_CTRL_VQ (1 << 17)
+#define VIRTIO_NET_F_MQ (1 << 22)
 
-#define VIRTIO_NET_Q_RX 0
-#define VIRTIO_NET_Q_TX 1
+//Feature bits in the second feature word
+#define VIRTIO_F_VERSION_1 (1 << 0)
+#define VIRTIO_NET_F_HASH_REPORT (1 << 25)
+#define VIRTIO_NET_F_RSS (1 << 28)
+
+//Queue pair n uses RX queue 2n and TX queue 2n + 1
+#define VIRTIO_NET_Q_RX(n) (2 * (n))
+#define VIRTIO_NET_Q_TX(n) (2 * (n) + 1)
 
 #define VIRTIO_NET_S_LINK_UP 1
-typedef struct {
+typedef struct PACKED {
     uint8_t mac[6];
     uint16_t status;
-    uint16_t virtq_pairs;
+    uint16_t max_virtqueue_pairs;
+    uint16_t mtu;
+    uint32_t speed;
+    uint8_t duplex;
+    uint8_t rss_max_key_size;
+    uint16_t rss_max_indirection_table_length;
+    uint32_t supported_hash_types;
 } virtio_net_cfg_t;
 
 typedef struct {
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
     uint8_t flags;
 #define VIRTIO_NET_GSO_NONE 0
 #define VIRTIO_NET_GSO_TCPV4 1
@@ -38,23 +63,90 @@ typedef struct {
     uint16_t gso_sz;
     uint16_t csum_start;
     uint16_t csum_offset;
+    uint16_t num_buffers; //Part of the header whenever VIRTIO_F_VERSION_1 is negotiated
+    uint32_t hash_value;  //Hash fields are only present with VIRTIO_NET_F_HASH_REPORT
+    uint16_t hash_report;
+    uint16_t padding;
 } PACKED virtio_net_cmd_hdr_t;
 
+#define VIRTIO_NET_HDR_SZ (12)
+#define VIRTIO_NET_HDR_HASH_SZ (20)
+
+//Control queue
+typedef struct PACKED {
+    uint8_t class;
+    uint8_t cmd;
+} virtio_net_ctrl_hdr_t;
+
+#define VIRTIO_NET_OK 0
+
+#define VIRTIO_NET_CTRL_MQ 4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG 1
+#define VIRTIO_NET_CTRL_MQ_HASH_CONFIG 2
+
+#define VIRTIO_NET_HASH_TYPE_IPV4 (1 << 0)
+#define VIRTIO_NET_HASH_TYPE_TCPV4 (1 << 1)
+#define VIRTIO_NET_HASH_TYPE_UDPV4 (1 << 2)
+#define VIRTIO_NET_HASH_TYPE_IPV6 (1 << 3)
+#define VIRTIO_NET_HASH_TYPE_TCPV6 (1 << 4)
+#define VIRTIO_NET_HASH_TYPE_UDPV6 (1 << 5)
+
+#define VIRTIO_NET_RSS_TABLE_LEN 128
+#define VIRTIO_NET_RSS_KEY_LEN 40
+
+typedef struct {
+    int idx;
+    int lock;
+
+    //Netbufs currently posted to the rings, indexed by head descriptor
+    netbuf_t *rx_bufs[VIRTIO_NET_QUEUE_LEN];
+    netbuf_t *tx_bufs[VIRTIO_NET_QUEUE_LEN];
+
+    //Received packets collected under lock, handed to the stack after it is dropped
+    netbuf_t *rx_pending;
+    netbuf_t *rx_pending_tail;
+
+    //Packet being reassembled from mergeable buffers
+    netbuf_t *rx_partial;
+    netbuf_t *rx_partial_tail;
+    int rx_remaining;   //Buffers still to come for it
+    bool rx_discard;    //Part of it was dropped, swallow the rest
+
+    int tx_inflight;    //TX descriptors not yet reclaimed
+
+    void *poll;
+    volatile bool rx_masked;
+
+    uint64_t rx_dropped;
+    uint64_t tx_dropped;
+    uint64_t tx_linearized; //Chains with more than VIRTIO_NET_TX_MAX_SEGS segments copied into fewer
+} virtio_net_queue_t;
+
 typedef struct {
     virtio_state_t *common_state;
     virtio_net_cfg_t *cfg;
 
     void *handle;
 
-    virtio_virtq_cmd_state_t *qstate[VIRTIO_NET_QUEUE_CNT];
-    int avail_idx[VIRTIO_NET_QUEUE_CNT];
-    int used_idx[VIRTIO_NET_QUEUE_CNT];
+    virtio_virtq_cmd_state_t **qstate;
+    int *avail_idx;
+    int *used_idx;
     bool checksum_offload;
+    bool tso4;
+    bool tso6;
+    bool rx_checksum;
+    bool mrg_rxbuf;
+    bool hash_report;
+    int hdr_sz;
 
-    uintptr_t rx_buf_phys;
+    int pair_cnt;
+    int vector_base;    //Vector of pair 0 when every pair has its own, -1 otherwise
+    virtio_net_queue_t *pairs[VIRTIO_NET_MAX_PAIRS];
 
-    uintptr_t tx_buf_phys;
-    uint8_t *tx_buf_virt;
+    int ctrl_q;
+    uint8_t *ctrl_buf;
+    int ctrl_lock;
 } virtio_net_driver_state_t;
 
-#endif
\ No newline at end of file
+#endif
@@ -18,83 +18,446 @@
 
 #include "CoreNetwork/driver.h"
 
+// Queue pair n is serviced on scheduler core n. With MSI-X each pair gets its own vector routed
+// to that core, and with RSS the device spreads flows over the pairs through its indirection
+// table, so a flow's receive processing, the replies it triggers and their completions all stay
+// on one core. Without MQ support everything runs through pair 0 and the shared vector.
+
 static virtio_net_driver_state_t device;
-static _Atomic int virtio_signalled = 0;
-static _Atomic int virtio_inited = 0;
-static int virtio_queue_avl = 0;
 
-static void intrpt_handler(int idx)
+//Microsoft's default Toeplitz key, what most RSS implementations are validated against
+static const uint8_t rss_key[VIRTIO_NET_RSS_KEY_LEN] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static void virtio_net_resphandler(virtio_virtq_cmd_state_t *cmd);
+
+static void intrpt_handler(int irq)
 {
-    idx = 0;
-    virtio_signalled = true;
-    //local_spinlock_unlock(&virtio_signalled);
+    int pair = 0;
+    if (device.vector_base >= 0)
+    {
+        //The configuration/control vector doesn't carry any packets
+        pair = irq - device.vector_base;
+        if (pair < 0 || pair >= device.pair_cnt)
+            return;
+    }
+
+    virtio_net_queue_t *q = device.pairs[pair];
+    if (q == NULL || q->poll == NULL)
+        return;
+
+    //Receive interrupts stay off until the poll task has drained the ring
+    if (!q->rx_masked)
+    {
+        q->rx_masked = true;
+        virtio_suppress_intr(device.common_state, VIRTIO_NET_Q_RX(q->idx), true);
+    }
+    network_poll_schedule(q->poll);
 }
 
-static void virtio_task_handler(void *arg)
+static int virtio_net_poll(void *state, int budget)
 {
-    arg = NULL;
+    virtio_net_queue_t *q = (virtio_net_queue_t *)state;
 
-    while (!virtio_inited)
-        ;
+    int cli_state = cli();
+    local_spinlock_lock(&q->lock);
 
-    while (true)
-    {
-        while (virtio_signalled)
-        {
-            local_spinlock_lock(&virtio_queue_avl);
-            virtio_signalled = false;
+    //acknowledge transmitted packets, TX interrupts are suppressed so this only catches stragglers
+    virtio_accept_used(device.common_state, VIRTIO_NET_Q_TX(q->idx));
 
-            DEBUG_PRINT("VirtioNet Interrupt!\r\n");
+    //collect received packets
+    int cnt = virtio_accept_used_budget(device.common_state, VIRTIO_NET_Q_RX(q->idx), budget);
+    virtio_kick(device.common_state, VIRTIO_NET_Q_RX(q->idx));
 
-            //acknowledge transmitted packets
-            virtio_accept_used(device.common_state, VIRTIO_NET_Q_TX);
+    netbuf_t *rx = q->rx_pending;
+    q->rx_pending = NULL;
+    q->rx_pending_tail = NULL;
 
-            //forward received packets
-            virtio_accept_used(device.common_state, VIRTIO_NET_Q_RX);
+    local_spinlock_unlock(&q->lock);
+    sti(cli_state);
 
-            local_spinlock_unlock(&virtio_queue_avl);
-        }
+    //forward them without holding the queue lock, the stack may transmit in response
+    while (rx != NULL)
+    {
+        netbuf_t *next = rx->q_next;
+        rx->q_next = NULL;
+        network_rx_packet(device.handle, rx);
+        rx = next;
     }
+    return cnt;
 }
 
+static bool virtio_net_rearm(void *state)
+{
+    virtio_net_queue_t *q = (virtio_net_queue_t *)state;
+
+    int cli_state = cli();
+    local_spinlock_lock(&q->lock);
+    q->rx_masked = false;
+    virtio_suppress_intr(device.common_state, VIRTIO_NET_Q_RX(q->idx), false);
+    bool pending = virtio_has_used(device.common_state, VIRTIO_NET_Q_RX(q->idx));
+    local_spinlock_unlock(&q->lock);
+    sti(cli_state);
+    return pending;
+}
+
+static network_poll_handlers_t poll_handlers = {
+    .poll = virtio_net_poll,
+    .rearm = virtio_net_rearm,
+};
+
+//The header goes into the headroom in front of the data, so the frame lands at nb->data
+static void virtio_net_postrx(virtio_net_queue_t *q, netbuf_t *nb)
+{
+    int rx_q = VIRTIO_NET_Q_RX(q->idx);
+    q->rx_bufs[device.avail_idx[rx_q]] = nb;
+    virtio_addresponse(device.common_state, rx_q, nb->data - device.hdr_sz, NETBUF_DATA_SIZE + device.hdr_sz, virtio_net_resphandler);
+}
+
+//Called with the pair's lock held
 static void virtio_net_resphandler(virtio_virtq_cmd_state_t *cmd)
 {
-    //submit this response
-    int state = cli();
-    DEBUG_PRINT("Package Received!\r\n");
+    virtio_net_queue_t *q = device.pairs[cmd->q / 2];
+    netbuf_t *nb = q->rx_bufs[cmd->idx];
+    q->rx_bufs[cmd->idx] = NULL;
+
+    //Only the first buffer of a packet has the header, with mergeable buffers it says how many follow
+    virtio_net_cmd_hdr_t *hdr = (virtio_net_cmd_hdr_t *)(nb->data - device.hdr_sz);
+    bool first = q->rx_remaining == 0;
+    if (first)
+    {
+        q->rx_remaining = device.mrg_rxbuf ? MAX(hdr->num_buffers, 1) : 1;
+        q->rx_discard = cmd->used_len <= (uint32_t)device.hdr_sz;
+    }
+    q->rx_remaining--;
 
-    virtio_net_cmd_hdr_t *resp = (virtio_net_cmd_hdr_t *)cmd->resp.virt;
-    uint8_t *resp_u8 = (uint8_t *)cmd->resp.virt;
-    network_rx_packet(device.handle, resp_u8 + sizeof(virtio_net_cmd_hdr_t), 1514);
+    //Hand the filled buffer up and post a fresh one in its place, recycle it if the pool is dry
+    netbuf_t *n_nb = netbuf_alloc();
+    if (n_nb == NULL)
+    {
+        if (!q->rx_discard)
+            q->rx_dropped++;
+        q->rx_discard = true;
+        virtio_net_postrx(q, nb);
+        nb = NULL;
+    }
+    else
+        virtio_net_postrx(q, n_nb);
 
-    memset(resp_u8, 0, KiB(2));
-    virtio_addresponse(device.common_state, VIRTIO_NET_Q_RX, resp_u8, KiB(2), virtio_net_resphandler);
-    virtio_notify(device.common_state, VIRTIO_NET_Q_RX);
+    if (q->rx_discard)
+    {
+        if (nb != NULL)
+            netbuf_free(nb);
+        if (q->rx_partial != NULL)
+            netbuf_free(q->rx_partial);
+        q->rx_partial = NULL;
+        return;
+    }
 
-    sti(state);
+    if (first)
+    {
+        if (device.rx_checksum && (hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)))
+            nb->flags |= NETBUF_F_CSUM_VALID;
+        if (device.hash_report && hdr->hash_report != 0)
+            nb->hash = hdr->hash_value;
+
+        nb->len = (uint16_t)(cmd->used_len - device.hdr_sz);
+        nb->tot_len = nb->len;
+        q->rx_partial = nb;
+        q->rx_partial_tail = nb;
+    }
+    else
+    {
+        //The rest of a merged packet is written from the very start of each buffer
+        nb->data -= device.hdr_sz;
+        nb->len = (uint16_t)cmd->used_len;
+        q->rx_partial_tail->next = nb;
+        q->rx_partial_tail = nb;
+        q->rx_partial->tot_len += nb->len;
+    }
+
+    if (q->rx_remaining > 0)
+        return;
+
+    nb = q->rx_partial;
+    q->rx_partial = NULL;
+    if (q->rx_pending_tail != NULL)
+        q->rx_pending_tail->q_next = nb;
+    else
+        q->rx_pending = nb;
+    q->rx_pending_tail = nb;
+}
+
+//Called with the pair's lock held
+static void virtio_net_txhandler(virtio_virtq_cmd_state_t *cmd)
+{
+    virtio_net_queue_t *q = device.pairs[cmd->q / 2];
+    netbuf_t *nb = q->tx_bufs[cmd->idx];
+    q->tx_bufs[cmd->idx] = NULL;
+    q->tx_inflight -= cmd->chain_len + 1;
+    if (nb != NULL)
+        netbuf_free(nb);
+}
+
+//Copy a chain into as few full segments as hold it, the original is freed on success. Offload
+//metadata moves to the new head, which keeps its headroom for the virtio header.
+static netbuf_t *virtio_net_linearize(netbuf_t *nb)
+{
+    netbuf_t *head = NULL;
+    netbuf_t *dst = NULL;
+    for (netbuf_t *src = nb; src != NULL; src = src->next)
+    {
+        int off = 0;
+        while (off < src->len)
+        {
+            if (dst == NULL || netbuf_tailroom(dst) == 0)
+            {
+                netbuf_t *seg = netbuf_alloc();
+                if (seg == NULL)
+                {
+                    if (head != NULL)
+                        netbuf_free(head);
+                    return NULL;
+                }
+                if (head == NULL)
+                    head = seg;
+                else
+                    dst->next = seg;
+                dst = seg;
+            }
+
+            int cp_sz = MIN(src->len - off, netbuf_tailroom(dst));
+            memcpy(netbuf_put(dst, cp_sz), src->data + off, cp_sz);
+            off += cp_sz;
+        }
+    }
+    if (head == NULL)
+        return NULL;
+
+    //netbuf_put only counted each segment on itself
+    head->tot_len = 0;
+    for (netbuf_t *seg = head; seg != NULL; seg = seg->next)
+        head->tot_len += seg->len;
+    head->flags = nb->flags;
+    head->tx_flags = nb->tx_flags;
+    head->csum_start = nb->csum_start;
+    head->hdr_len = nb->hdr_len;
+    head->gso_size = nb->gso_size;
+    head->hash = nb->hash;
+    head->interface = nb->interface;
+
+    netbuf_free(nb);
+    return head;
 }
 
-int virtio_net_sendpacket(void *state, void *packet, int len, network_device_tx_flags_t gso)
+//Called with the pair's lock held, returns the number of descriptors used, 0 if the ring is full or
+//-1 if the packet was dropped. *nbp is replaced if the chain had to be linearized.
+static int virtio_net_posttx(virtio_net_queue_t *q, netbuf_t **nbp, network_device_tx_flags_t flags)
 {
-    gso = 0;
+    int tx_q = VIRTIO_NET_Q_TX(q->idx);
+    int seg_cnt = netbuf_segcount(*nbp);
+    if (seg_cnt > VIRTIO_NET_TX_MAX_SEGS)
+    {
+        //Small segments, e.g. clones of many short writes, can't be posted one descriptor each
+        netbuf_t *linear = virtio_net_linearize(*nbp);
+        if (linear == NULL)
+            return -1;
+        *nbp = linear;
+        q->tx_linearized++;
+
+        seg_cnt = netbuf_segcount(linear);
+        if (seg_cnt > VIRTIO_NET_TX_MAX_SEGS)
+            return -1;
+    }
+    netbuf_t *nb = *nbp;
+
+    //Completed descriptors are only reclaimed once the ring runs short
+    if (VIRTIO_NET_QUEUE_LEN - q->tx_inflight < seg_cnt)
+        virtio_accept_used(device.common_state, tx_q);
+    if (VIRTIO_NET_QUEUE_LEN - q->tx_inflight < seg_cnt)
+        return 0;
+
+    //Offsets are taken before the header is pushed, the device counts them from the frame
+    flags |= nb->tx_flags;
+    int csum_offset = network_tx_csum_offset(flags);
+    uint16_t csum_start = nb->csum_start;
+    uint16_t hdr_len = nb->hdr_len;
+
+    virtio_net_cmd_hdr_t *hdr = (virtio_net_cmd_hdr_t *)netbuf_push(nb, device.hdr_sz);
+    if (hdr == NULL)
+        return -1;
+    memset(hdr, 0, device.hdr_sz);
+    hdr->gso_type = VIRTIO_NET_GSO_NONE;
+
+    if (csum_offset >= 0 && device.checksum_offload)
+    {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = csum_start;
+        hdr->csum_offset = (uint16_t)csum_offset;
+    }
+    if ((flags & network_device_tx_flag_tcpv4_tso) && device.tso4)
+        hdr->gso_type = VIRTIO_NET_GSO_TCPV4;
+    else if ((flags & network_device_tx_flag_tcpv6_tso) && device.tso6)
+        hdr->gso_type = VIRTIO_NET_GSO_TCPV6;
+    if (hdr->gso_type != VIRTIO_NET_GSO_NONE)
+    {
+        hdr->hdr_len = hdr_len;
+        hdr->gso_sz = nb->gso_size;
+    }
+
+    //Each segment is posted in place, the device reads the frame straight out of the netbufs
+    virtio_phys_virt_addrpair_t segs[VIRTIO_NET_TX_MAX_SEGS];
+    int i = 0;
+    for (netbuf_t *seg = nb; seg != NULL; seg = seg->next, i++)
+    {
+        segs[i].virt = seg->data;
+        segs[i].phys = (intptr_t)netbuf_phys(seg);
+        segs[i].len = seg->len;
+    }
+
+    q->tx_bufs[device.avail_idx[tx_q]] = nb;
+    q->tx_inflight += seg_cnt;
+    virtio_postcmd_sg(device.common_state, tx_q, segs, seg_cnt, virtio_net_txhandler);
+    return seg_cnt;
+}
 
+int virtio_net_txburst(void *state, int queue, netbuf_t **nbs, int cnt, network_device_tx_flags_t flags)
+{
     virtio_net_driver_state_t *device = (virtio_net_driver_state_t *)state;
+    virtio_net_queue_t *q = device->pairs[queue % device->pair_cnt];
 
-    int ent_idx = device->avail_idx[VIRTIO_NET_Q_TX];
-    uint8_t *data_buf = device->tx_buf_virt + ent_idx * KiB(2);
+    int cli_state = cli();
+    local_spinlock_lock(&q->lock);
+    int sent = 0;
+    for (; sent < cnt; sent++)
+    {
+        int ret = virtio_net_posttx(q, &nbs[sent], flags);
+        if (ret == 0)
+            break;
+        if (ret < 0)
+        {
+            q->tx_dropped++;
+            netbuf_free(nbs[sent]);
+        }
+    }
 
-    memcpy(data_buf + sizeof(virtio_net_cmd_hdr_t), packet, len);
-    virtio_net_cmd_hdr_t *hdr = (virtio_net_cmd_hdr_t *)data_buf;
+    //One notification for the whole burst
+    virtio_kick(device->common_state, VIRTIO_NET_Q_TX(q->idx));
+    local_spinlock_unlock(&q->lock);
+    sti(cli_state);
+    return sent;
+}
 
-    hdr->flags = 0;
-    hdr->gso_type = VIRTIO_NET_GSO_NONE;
-    hdr->hdr_len = 0;
-    hdr->gso_sz = 0;
-    hdr->csum_start = 0;
-    hdr->csum_offset = 0;
+int virtio_net_sendpacket(void *state, netbuf_t *nb, network_device_tx_flags_t flags)
+{
+    while (virtio_net_txburst(state, 0, &nb, 1, flags) == 0)
+        task_yield();
+    return 0;
+}
 
-    virtio_postcmd_noresp(device->common_state, VIRTIO_NET_Q_TX, data_buf, len + sizeof(virtio_net_cmd_hdr_t), NULL);
-    virtio_notify(device->common_state, VIRTIO_NET_Q_TX);
+//Issue a control queue command and wait for the device to acknowledge it, data is copied in after the header
+static int virtio_net_ctrlcmd(uint8_t class, uint8_t cmd, void *data, int len)
+{
+    if (device.ctrl_q < 0 || len + (int)sizeof(virtio_net_ctrl_hdr_t) + 1 > (int)KiB(4))
+        return -1;
+
+    local_spinlock_lock(&device.ctrl_lock);
+    virtio_net_ctrl_hdr_t *hdr = (virtio_net_ctrl_hdr_t *)device.ctrl_buf;
+    uint8_t *ack = device.ctrl_buf + KiB(4) - 1;
+    hdr->class = class;
+    hdr->cmd = cmd;
+    memcpy(device.ctrl_buf + sizeof(virtio_net_ctrl_hdr_t), data, len);
+    *ack = 0xff;
+
+    int idx = device.avail_idx[device.ctrl_q];
+    virtio_postcmd(device.common_state, device.ctrl_q, hdr, sizeof(virtio_net_ctrl_hdr_t) + len, ack, 1, NULL);
+    virtio_notify(device.common_state, device.ctrl_q);
+
+    //Control commands are rare, poll for the completion instead of routing an interrupt for them
+    while (!device.qstate[device.ctrl_q][idx].finished)
+        virtio_accept_used(device.common_state, device.ctrl_q);
+
+    int ret = (*(volatile uint8_t *)ack == VIRTIO_NET_OK) ? 0 : -1;
+    local_spinlock_unlock(&device.ctrl_lock);
+    return ret;
+}
+
+//Spread the hash space over the queue pairs and enable hash reporting
+static int virtio_net_setrss(bool rss)
+{
+    int table_len = VIRTIO_NET_RSS_TABLE_LEN;
+    while (table_len > device.cfg->rss_max_indirection_table_length && table_len > 1)
+        table_len >>= 1;
+    int key_len = MIN(VIRTIO_NET_RSS_KEY_LEN, device.cfg->rss_max_key_size);
+    uint32_t hash_types = (VIRTIO_NET_HASH_TYPE_IPV4 | VIRTIO_NET_HASH_TYPE_TCPV4 | VIRTIO_NET_HASH_TYPE_UDPV4 |
+                           VIRTIO_NET_HASH_TYPE_IPV6 | VIRTIO_NET_HASH_TYPE_TCPV6 | VIRTIO_NET_HASH_TYPE_UDPV6) &
+                          device.cfg->supported_hash_types;
+
+    uint8_t buf[4 + 2 + 2 + 2 * VIRTIO_NET_RSS_TABLE_LEN + 2 + 1 + VIRTIO_NET_RSS_KEY_LEN];
+    int len = 0;
+
+    *(uint32_t *)&buf[len] = hash_types;
+    len += 4;
+    if (rss)
+    {
+        //indirection_table_mask, unclassified_queue, indirection_table, max_tx_vq.
+        //Queues are receive queue indices, 0 is receiveq1, not virtqueue numbers.
+        *(uint16_t *)&buf[len] = (uint16_t)(table_len - 1);
+        *(uint16_t *)&buf[len + 2] = 0;
+        len += 4;
+        for (int i = 0; i < table_len; i++, len += 2)
+            *(uint16_t *)&buf[len] = (uint16_t)(i % device.pair_cnt);
+        *(uint16_t *)&buf[len] = (uint16_t)device.pair_cnt;
+        len += 2;
+    }
+    else
+    {
+        //The hash-only layout has 8 reserved bytes in place of the table
+        memset(&buf[len], 0, 8);
+        len += 8;
+    }
+    buf[len++] = (uint8_t)key_len;
+    memcpy(&buf[len], rss_key, key_len);
+    len += key_len;
+
+    return virtio_net_ctrlcmd(VIRTIO_NET_CTRL_MQ, rss ? VIRTIO_NET_CTRL_MQ_RSS_CONFIG : VIRTIO_NET_CTRL_MQ_HASH_CONFIG, buf, len);
+}
+
+//Dump queue counters
+int virtio_net_stats()
+{
+    char tmp[20];
+    for (int i = 0; i < device.pair_cnt; i++)
+    {
+        virtio_net_queue_t *q = device.pairs[i];
+        virtio_virtq_t *tx = &device.common_state->queues[VIRTIO_NET_Q_TX(i)];
+        virtio_virtq_t *rx = &device.common_state->queues[VIRTIO_NET_Q_RX(i)];
+
+        DEBUG_PRINT("[VirtioNet] Pair ");
+        DEBUG_PRINT(itoa(i, tmp, 10));
+        DEBUG_PRINT(" TX notifications: ");
+        DEBUG_PRINT(ltoa(tx->kicks, tmp, 10));
+        DEBUG_PRINT(" suppressed: ");
+        DEBUG_PRINT(ltoa(tx->kicks_suppressed, tmp, 10));
+        DEBUG_PRINT(" dropped: ");
+        DEBUG_PRINT(ltoa(q->tx_dropped, tmp, 10));
+        DEBUG_PRINT(" linearized: ");
+        DEBUG_PRINT(ltoa(q->tx_linearized, tmp, 10));
+        DEBUG_PRINT("\r\n[VirtioNet] Pair ");
+        DEBUG_PRINT(itoa(i, tmp, 10));
+        DEBUG_PRINT(" RX notifications: ");
+        DEBUG_PRINT(ltoa(rx->kicks, tmp, 10));
+        DEBUG_PRINT(" suppressed: ");
+        DEBUG_PRINT(ltoa(rx->kicks_suppressed, tmp, 10));
+        DEBUG_PRINT(" dropped: ");
+        DEBUG_PRINT(ltoa(q->rx_dropped, tmp, 10));
+        DEBUG_PRINT("\r\n");
+    }
     return 0;
 }
 
@@ -111,6 +474,7 @@ static network_device_desc_t device_desc = {
     .type = network_device_type_ethernet,
     .handlers.ether = {
         .tx = virtio_net_sendpacket,
+        .tx_burst = virtio_net_txburst,
         .link_status = virtio_net_linkstatus,
     },
     .spec_features.ether = 0,
@@ -121,68 +485,169 @@ int module_init(void *ecam)
 {
 
     memset(&device, 0, sizeof(device));
+    device.vector_base = -1;
+    device.ctrl_q = -1;
 
-    cs_id ss_id = 0;
-    cs_error ss_err = create_task_kernel("virtio_net_0", task_permissions_kernel, &ss_id);
-    if (ss_err != CS_OK)
-        PANIC("VIRTIO_NET_ERR0");
-    ss_err = start_task_kernel(ss_id, virtio_task_handler, NULL);
-    if (ss_err != CS_OK)
-        PANIC("VIRTIO_NET_ERR1");
+    device.common_state = virtio_initialize(ecam, intrpt_handler, NULL, NULL, NULL);
+    device.cfg = (virtio_net_cfg_t *)device.common_state->dev_cfg;
 
-    for (int i = 0; i < VIRTIO_NET_QUEUE_CNT; i++)
+    //Per queue bookkeeping, sized to what the device exposes
+    int queue_cnt = device.common_state->queue_cnt;
+    device.qstate = malloc(sizeof(virtio_virtq_cmd_state_t *) * queue_cnt);
+    device.avail_idx = malloc(sizeof(int) * queue_cnt);
+    device.used_idx = malloc(sizeof(int) * queue_cnt);
+    for (int i = 0; i < queue_cnt; i++)
     {
-        device.qstate[i] = malloc(sizeof(virtio_virtq_cmd_state_t) * VIRTIO_NET_QUEUE_LEN);
+        device.qstate[i] = NULL;
         device.avail_idx[i] = 0;
         device.used_idx[i] = 0;
     }
-    device.common_state = virtio_initialize(ecam, intrpt_handler, device.qstate, device.avail_idx, device.used_idx);
-    device.cfg = (virtio_net_cfg_t *)device.common_state->dev_cfg;
+    device.common_state->cmds = device.qstate;
+    device.common_state->avail_idx = device.avail_idx;
+    device.common_state->used_idx = device.used_idx;
 
     uint32_t features = virtio_getfeatures(device.common_state, 0);
-
-    if (features & VIRTIO_NET_F_CSUM)
-    {
-        device.checksum_offload = true;
+    uint32_t features_hi = virtio_getfeatures(device.common_state, 1);
+
+    //Offloads, segmentation needs checksumming on the same side and receiving super-packets
+    //needs mergeable buffers, otherwise every receive buffer would have to hold 64KiB
+    device.checksum_offload = (features & VIRTIO_NET_F_CSUM) != 0;
+    device.tso4 = device.checksum_offload && (features & VIRTIO_NET_F_HOST_TSO4);
+    device.tso6 = device.checksum_offload && (features & VIRTIO_NET_F_HOST_TSO6);
+    device.rx_checksum = (features & VIRTIO_NET_F_GUEST_CSUM) != 0;
+    device.mrg_rxbuf = (features & VIRTIO_NET_F_MRG_RXBUF) != 0;
+    uint32_t guest_tso = (device.rx_checksum && device.mrg_rxbuf) ? (features & (VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6)) : 0;
+
+    if (device.checksum_offload)
         device_desc.features |= network_device_features_checksum_offload;
-    }
-
-    virtio_setfeatures(device.common_state, 0, VIRTIO_NET_F_STATUS | VIRTIO_NET_F_MAC | (device.checksum_offload ? VIRTIO_NET_F_CSUM : 0));
+    if (device.tso4)
+        device_desc.features |= network_device_features_tso4;
+    if (device.tso6)
+        device_desc.features |= network_device_features_tso6;
+    if (device.rx_checksum)
+        device_desc.features |= network_device_features_rx_checksum;
+    if (guest_tso != 0)
+        device_desc.features |= network_device_features_rx_coalesce;
+    device_desc.gso_max_size = VIRTIO_NET_GSO_MAX_SIZE;
+
+    //Multiple queues and steering are all configured through the control queue
+    bool mq = (features & VIRTIO_NET_F_MQ) && (features & VIRTIO_NET_F_CTRL_VQ);
+    bool rss = mq && (features_hi & VIRTIO_NET_F_RSS);
+    device.hash_report = (features & VIRTIO_NET_F_CTRL_VQ) && (features_hi & VIRTIO_NET_F_HASH_REPORT);
+    device.hdr_sz = device.hash_report ? VIRTIO_NET_HDR_HASH_SZ : VIRTIO_NET_HDR_SZ;
+
+    uint32_t drv_features = VIRTIO_NET_F_STATUS | VIRTIO_NET_F_MAC | (features & VIRTIO_F_EVENT_IDX) | guest_tso;
+    drv_features |= features & (VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MRG_RXBUF);
+    drv_features |= (device.tso4 ? VIRTIO_NET_F_HOST_TSO4 : 0) | (device.tso6 ? VIRTIO_NET_F_HOST_TSO6 : 0);
+    if (mq || device.hash_report)
+        drv_features |= VIRTIO_NET_F_CTRL_VQ;
+    if (mq)
+        drv_features |= VIRTIO_NET_F_MQ;
+    virtio_setfeatures(device.common_state, 0, drv_features);
+    virtio_setfeatures(device.common_state, 1, (features_hi & VIRTIO_F_VERSION_1) | (rss ? VIRTIO_NET_F_RSS : 0) | (device.hash_report ? VIRTIO_NET_F_HASH_REPORT : 0));
 
     if (!virtio_features_ok(device.common_state))
         return -1;
 
+    //One pair per core, each with its own vector delivered to that core
+    device.pair_cnt = 1;
+    if (mq)
+    {
+        int pair_cnt = MIN(MIN((int)device.cfg->max_virtqueue_pairs, task_corecount()), VIRTIO_NET_MAX_PAIRS);
+        int apic_ids[VIRTIO_NET_MAX_PAIRS];
+        for (int i = 0; i < pair_cnt; i++)
+            apic_ids[i] = task_coreapicid(i);
+
+        if (pair_cnt > 1)
+            device.vector_base = virtio_setupvectors(device.common_state, pair_cnt, apic_ids, intrpt_handler);
+        if (device.vector_base >= 0)
+            device.pair_cnt = pair_cnt;
+    }
+    if (mq || device.hash_report)
+        device.ctrl_q = mq ? 2 * device.cfg->max_virtqueue_pairs : 2;
+
     //setup virtqueues
-    for (int i = 0; i < VIRTIO_NET_QUEUE_CNT; i++)
-        virtio_setupqueue(device.common_state, i, VIRTIO_NET_QUEUE_LEN);
+    for (int i = 0; i < device.pair_cnt; i++)
+    {
+        virtio_net_queue_t *q = malloc(sizeof(virtio_net_queue_t));
+        memset(q, 0, sizeof(virtio_net_queue_t));
+        q->idx = i;
+        device.pairs[i] = q;
 
-    virtio_driver_ok(device.common_state);
+        for (int j = VIRTIO_NET_Q_RX(i); j <= VIRTIO_NET_Q_TX(i); j++)
+        {
+            device.qstate[j] = malloc(sizeof(virtio_virtq_cmd_state_t) * VIRTIO_NET_QUEUE_LEN);
+            memset(device.qstate[j], 0, sizeof(virtio_virtq_cmd_state_t) * VIRTIO_NET_QUEUE_LEN);
+            device.common_state->queues[j].msix_vector = (device.vector_base >= 0) ? i + 1 : 0;
+            virtio_setupqueue(device.common_state, j, VIRTIO_NET_QUEUE_LEN);
+        }
 
-    //Fill the receive virtq with buffers
-    uintptr_t rcv_buf = pagealloc_alloc(0, 0, physmem_alloc_flags_data, VIRTIO_NET_QUEUE_LEN * KiB(2));
-    uint8_t *rcv_buf_virt = (uint8_t *)vmem_phystovirt((intptr_t)rcv_buf, VIRTIO_NET_QUEUE_LEN * KiB(2), vmem_flags_uncached | vmem_flags_rw | vmem_flags_kernel);
-    device.rx_buf_phys = rcv_buf;
+        //Transmit completions are reclaimed lazily from the send path
+        virtio_suppress_intr(device.common_state, VIRTIO_NET_Q_TX(i), true);
+    }
 
-    for (int i = 0; i < VIRTIO_NET_QUEUE_LEN; i++)
+    if (device.ctrl_q >= 0)
     {
-        virtio_net_cmd_hdr_t *cmd_tmp = (virtio_net_cmd_hdr_t *)(rcv_buf_virt + i * KiB(2));
-        virtio_addresponse(device.common_state, VIRTIO_NET_Q_RX, cmd_tmp, KiB(2), virtio_net_resphandler);
+        device.qstate[device.ctrl_q] = malloc(sizeof(virtio_virtq_cmd_state_t) * VIRTIO_NET_CTRL_QUEUE_LEN);
+        memset(device.qstate[device.ctrl_q], 0, sizeof(virtio_virtq_cmd_state_t) * VIRTIO_NET_CTRL_QUEUE_LEN);
+        virtio_setupqueue(device.common_state, device.ctrl_q, VIRTIO_NET_CTRL_QUEUE_LEN);
+
+        uintptr_t ctrl_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data, KiB(4));
+        device.ctrl_buf = (uint8_t *)vmem_phystovirt((intptr_t)ctrl_phys, KiB(4), vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
     }
 
-    //Allocate tx buffer
-    device.tx_buf_phys = pagealloc_alloc(0, 0, physmem_alloc_flags_data, VIRTIO_NET_QUEUE_LEN * KiB(2));
-    device.tx_buf_virt = (uint8_t *)vmem_phystovirt((intptr_t)device.tx_buf_phys, VIRTIO_NET_QUEUE_LEN * KiB(2), vmem_flags_uncached | vmem_flags_rw | vmem_flags_kernel);
+    virtio_driver_ok(device.common_state);
+
+    //Fill the receive virtqs with buffers
+    for (int i = 0; i < device.pair_cnt; i++)
+        for (int j = 0; j < VIRTIO_NET_QUEUE_LEN; j++)
+        {
+            netbuf_t *nb = netbuf_alloc();
+            if (nb == NULL)
+                PANIC("[VirtioNet] Failed to allocate receive buffers.");
+            virtio_net_postrx(device.pairs[i], nb);
+        }
+
+    //Turn on the extra pairs, RSS_CONFIG replaces VQ_PAIRS_SET when the device steers flows itself
+    if (rss || device.hash_report)
+    {
+        if (virtio_net_setrss(rss) != 0)
+            DEBUG_PRINT("[VirtioNet] Failed to configure receive hashing.\r\n");
+    }
+    if (mq && !rss && device.pair_cnt > 1)
+    {
+        uint16_t pairs = (uint16_t)device.pair_cnt;
+        if (virtio_net_ctrlcmd(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs)) != 0)
+            DEBUG_PRINT("[VirtioNet] Failed to enable queue pairs.\r\n");
+    }
 
     //register as a network device
     for (int i = 0; i < 6; i++)
         device_desc.mac[i] = device.cfg->mac[i];
+    device_desc.queue_cnt = device.pair_cnt;
 
     network_register(&device_desc, &device.handle);
 
-    virtio_notify(device.common_state, VIRTIO_NET_Q_RX);
-    virtio_notify(device.common_state, VIRTIO_NET_Q_TX);
+    for (int i = 0; i < device.pair_cnt; i++)
+    {
+        void *poll = NULL;
+        if (network_poll_create(device.handle, i, &poll_handlers, device.pairs[i], &poll) != 0)
+            PANIC("[VirtioNet] Failed to create receive poll task.");
+        device.pairs[i]->poll = poll;
+
+        virtio_notify(device.common_state, VIRTIO_NET_Q_RX(i));
+        virtio_notify(device.common_state, VIRTIO_NET_Q_TX(i));
 
-    virtio_inited = true;
+        //Pick up anything that arrived before the poll task existed
+        network_poll_schedule(poll);
+    }
+
+    {
+        char tmp[10];
+        DEBUG_PRINT("[VirtioNet] Queue pairs: ");
+        DEBUG_PRINT(itoa(device.pair_cnt, tmp, 10));
+        DEBUG_PRINT(rss ? " RSS\r\n" : "\r\n");
+    }
 
     /*arp_t packet_a;
     arp_t *packet = (arp_t*)&packet_a;
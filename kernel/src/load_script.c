@@ -53,6 +53,13 @@ void module_user_load(char *name)
     task_startnew_user(hdr->data, hdr->uncompressed_len);
 }
 
+// Script lines:
+// LOAD:<module>    load a module and run its entry point
+// CALL:<function>  call a function in place, it must return 0
+// USER:<module>    start a user program
+// TASK:<function>  run a function in a kernel task of its own. Benchmarks and counter dumps are
+//                  started this way, e.g. 'TASK:tcp_bench' in servicescript.txt, since they may
+//                  sleep or wait on interrupts. The debug shell's 'call' only works after a panic.
 int script_execute(char *load_script, size_t load_len)
 {
     char name[1024];
@@ -70,6 +77,8 @@ int script_execute(char *load_script, size_t load_len)
             mode = 1;
         else if (strncmp(load_script, "USER:", 5) == 0)
             mode = 2;
+        else if (strncmp(load_script, "TASK:", 5) == 0)
+            mode = 3;
         else if (strncmp(load_script, "#", 1) == 0)
             mode = -2;
 
@@ -126,6 +135,19 @@ int script_execute(char *load_script, size_t load_len)
         {
             module_user_load(name);
         }
+        else if (mode == 3)
+        {
+            print_str("[Kernel] Start task:");
+            print_str(name);
+            print_str("\r\n");
+
+            void *entry_pt = elf_resolvefunction(name);
+            if (entry_pt == NULL)
+                PANIC("[Kernel] Failed to resolve function!");
+
+            void (*task_startnew_kernel)(char *, void *) = (void (*)(char *, void *))elf_resolvefunction("task_startnew_kernel");
+            task_startnew_kernel(name, entry_pt);
+        }
         else if (mode == -1)
         {
             print_str("[Kernel] Name:");
@@ -35,6 +35,8 @@
 #define APIC_CCoR (0x390)
 #define APIC_DCR (0x3E0)
 
+#define IA32_TSC_DEADLINE (0x6E0)
+
 #define MSI_ADDR (0xFEEFF00C)
 #define MSI_VEC (lvl, active_low, vector) (((lvl & 1) << 15) | ((~active_low & 1) << 14) | 0x100 /*lowest priority*/ | (vector & 0xff))
 
@@ -190,6 +192,27 @@ int local_apic_timer_init(bool tsc_mode, void (*handler)(int), bool ap) {
     return intrpt_num;
 }
 
+//switch the timer to one-shot mode and start counting down from count, 0 stops the timer
+void local_apic_timer_oneshot(uint32_t count) {
+    uint64_t v = apic_read(APIC_TIMER);
+    if(v & 0x00070000) {
+        v = v & ~0x00070000;    //Unmask, One-shot mode
+        apic_write(APIC_TIMER, v);
+    }
+    apic_write(APIC_ICoR, count);
+}
+
+//switch the timer to TSC-Deadline mode and fire once the tsc reaches the given value
+void local_apic_timer_deadline(uint64_t tsc) {
+    uint64_t v = apic_read(APIC_TIMER);
+    if((v & 0x00070000) != (2 << 17)) {
+        v = (v & ~0x00070000) | (2 << 17);
+        apic_write(APIC_TIMER, v);
+        __asm__ volatile("mfence" ::: "memory");    //The LVT write must land before the deadline is armed
+    }
+    wrmsr(IA32_TSC_DEADLINE, tsc);
+}
+
 
 
 //task switches don't require callibration
@@ -197,16 +197,16 @@ void idt_mainhandler(regs_t *regs)
 
     int state = cli();
 
-    local_spinlock_lock(&interrupt_alloc_lock);
+    //Handlers are read without taking interrupt_alloc_lock, so cores don't serialize on each other's interrupts
     for (int i = 0; i < IDT_HANDLER_CNT; i++)
     {
-        if (interrupt_funcs[regs->int_no][i] != NULL)
+        InterruptHandler handler = __atomic_load_n(&interrupt_funcs[regs->int_no][i], __ATOMIC_ACQUIRE);
+        if (handler != NULL)
         {
-            interrupt_funcs[regs->int_no][i](regs->int_no);
+            handler(regs->int_no);
             handled = true;
         }
     }
-    local_spinlock_unlock(&interrupt_alloc_lock);
     sti(state);
 
     if (!handled)
@@ -267,6 +267,13 @@ void interrupt_setregisterstate(interrupt_register_state_t *state)
     }
 }
 
+uint64_t interrupt_geterrorcode(void)
+{
+    if (idt->reg_ref == NULL)
+        return 0;
+    return idt->reg_ref->err_code;
+}
+
 void interrupt_getregisterstate(interrupt_register_state_t *state)
 {
     if (state != NULL)
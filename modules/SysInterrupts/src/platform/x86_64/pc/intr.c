@@ -9,6 +9,7 @@
 #include <stdlib.h>
 
 #include "SysInterrupts/interrupts.h"
+#include "SysVirtualMemory/vmem.h"
 
 int idt_init();
 int gdt_init();
@@ -25,12 +26,29 @@ static void pagefault_handler(int int_num)
 {
     int_num = 0;
 
+    uint64_t cr2 = 0;
+    __asm__ volatile("mov %%cr2, %0"
+                     : "=r"(cr2));
+
+    //The error code says what kind of access faulted, see vmem_fault_flags
+    uint64_t err = interrupt_geterrorcode();
+    int rVal = vmem_handlefault((intptr_t)cr2, err);
+    if (rVal == vmem_err_none)
+        return;
+
     interrupt_register_state_t reg_state;
     interrupt_getregisterstate(&reg_state);
 
     char tmp[20];
-    DEBUG_PRINT("Page fault at: ");
+    if (rVal == vmem_err_guard)
+        DEBUG_PRINT("Stack guard page hit at: ");
+    else
+        DEBUG_PRINT("Page fault at: ");
+    DEBUG_PRINT(ltoa(cr2, tmp, 16));
+    DEBUG_PRINT(" rip: ");
     DEBUG_PRINT(ltoa(reg_state.rip, tmp, 16));
+    DEBUG_PRINT(" err: ");
+    DEBUG_PRINT(ltoa(err, tmp, 16));
     DEBUG_PRINT("\r\n");
 
     PANIC("");
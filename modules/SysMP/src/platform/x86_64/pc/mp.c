@@ -24,6 +24,7 @@ static _Atomic volatile int pos = 0;
 static TLS uint64_t* g_tls;
 static _Atomic int coreCount = 1;
 static volatile int core_ready = 0;
+static void (*volatile ap_entry)(void) = NULL;
 
 void alloc_ap_stack(void);
 
@@ -74,12 +75,21 @@ int mp_signalready() {
     coreCount++;
     core_ready = 1;
 
+    //Park until a scheduler takes over the APs
+    while(ap_entry == NULL)
+        __asm__ volatile("pause");
+    ap_entry();
+
     while(true)
-        ;
+        halt();
 
     return 0;
 }
 
+void mp_setapentry(void (*entry)(void)) {
+    ap_entry = entry;
+}
+
 int mp_tls_setup() {
     uint64_t tls = (uint64_t)malloc(TLS_SIZE);
     if(tls == 0)
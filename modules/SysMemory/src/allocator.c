@@ -10,117 +10,426 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdlist.h>
+
+#include <cardinal/local_spinlock.h>
 
 #include "SysVirtualMemory/vmem.h"
 #include "SysPhysicalMemory/phys_mem.h"
+#include "SysMemory/memory.h"
+#include "elf.h"
+#include "kvs.h"
+
+// Slab allocator.
+// Small allocations come from object caches. A cache carves SLAB_SIZE aligned slabs
+// into equal sized objects, the slab header sits at the start of the slab so free()
+// finds it by masking the pointer. Each core keeps a magazine of objects per cache,
+// the cache lock is only taken to refill or drain a magazine in batches. A slab that
+// empties out is returned to the page allocator once the cache already holds a spare.
+// Allocations too big for the size classes get their own pages, with a header right
+// below the returned pointer.
+
+#define SLAB_SIZE (KiB(32))
+#define SLAB_HDR_SIZE (64)
+#define SLAB_MAGIC (0x534c41424d454d31ull)
+#define LARGE_MAGIC (0x4c5247454d454d31ull)
+#define FREE_POISON (0xf4eef4eef4eef4eeull)
+
+#define MEM_MAX_CACHES (16)
+#define MEM_MIN_CLASS_LOG2 (4)
+#define MEM_MAX_CLASS_LOG2 (12)
+#define MEM_CLASS_CNT (MEM_MAX_CLASS_LOG2 - MEM_MIN_CLASS_LOG2 + 1)
+#define MEM_MIN_OBJS (4)            //Objects a slab must hold, bounds the size of a named cache
+#define MEM_KEEP_EMPTY (1)          //Empty slabs a cache holds on to before returning them
+#define MEM_EXACT_CNT (4)
+
+#define MAG_LEN (16)
+#define MAG_BATCH (8)
+
+typedef struct mem_slab
+{
+    uint64_t magic;
+    struct mem_slab *self;
+    struct mem_cache *cache;
+    struct mem_slab *next;
+    struct mem_slab *prev;
+    void *free_list;
+    uint32_t inuse;
+    uint32_t rsv;
+    uintptr_t phys;
+} mem_slab_t;
+
+typedef struct
+{
+    uint64_t magic;
+    void *self;
+    uintptr_t phys;
+    size_t len;
+} mem_large_t;
 
-typedef struct mem_node
+struct mem_cache
+{
+    char name[MEM_CACHE_NAME_LEN];
+    size_t obj_sz;
+    uint32_t obj_per_slab;
+    int idx;
+    int lock;
+
+    mem_slab_t *partial;
+    mem_slab_t *full;
+    mem_slab_t *empty;
+    uint32_t empty_cnt;
+
+    //Protected by lock
+    uint64_t slab_cnt;
+    uint64_t slab_peak;
+    uint64_t inuse;
+    uint64_t refill_cnt;
+    uint64_t drain_cnt;
+    uint64_t reclaim_cnt;
+};
+
+typedef struct
 {
-    struct mem_node *next;
-    uint32_t len;
-    bool isFree;
-    uint8_t data[0];
-} mem_node_t;
+    int cnt;
+    void *objs[MAG_LEN];
+} mem_mag_t;
 
-static mem_node_t *root = NULL;
-static _Atomic uint32_t node_cnt = 0;
+static struct mem_cache caches[MEM_MAX_CACHES];
+static int cache_cnt = 0;
+static int cache_lock = 0;
 
-void *WEAK malloc(size_t sz)
+static mem_cache_t *size_classes[MEM_CLASS_CNT];
+
+//Allocations of exactly these sizes go to their own cache instead of the size class
+static size_t exact_sz[MEM_EXACT_CNT];
+static mem_cache_t *exact_caches[MEM_EXACT_CNT];
+static int exact_cnt = 0;
+
+static TLS mem_mag_t *mags = NULL;
+static bool mag_enabled = false;
+
+static _Atomic uint64_t large_cnt = 0;
+static _Atomic uint64_t large_bytes = 0;
+
+_Static_assert(sizeof(mem_slab_t) <= SLAB_HDR_SIZE, "Slab header too large.");
+_Static_assert(sizeof(mem_large_t) <= SLAB_HDR_SIZE, "Large allocation header too large.");
+
+static void slab_push(mem_slab_t **list, mem_slab_t *s)
 {
-    if (sz == 0)
+    s->prev = NULL;
+    s->next = *list;
+    if (*list != NULL)
+        (*list)->prev = s;
+    *list = s;
+}
+
+static void slab_unlink(mem_slab_t **list, mem_slab_t *s)
+{
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+}
+
+//Must be called with the cache lock held
+static mem_slab_t *slab_new(struct mem_cache *c)
+{
+    //Blocks from the page allocator are aligned to their size
+    uintptr_t phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data, SLAB_SIZE);
+    if (phys == (uintptr_t)-1)
         return NULL;
 
-    int cli_state = cli();
-    //Align size with 16 bytes, so all allocations are 16-byte aligned
-    if (sz % 8)
-        sz += 8 - (sz % 8);
+    mem_slab_t *s = (mem_slab_t *)vmem_phystovirt(phys, SLAB_SIZE, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+    s->magic = SLAB_MAGIC;
+    s->self = s;
+    s->cache = c;
+    s->inuse = 0;
+    s->phys = phys;
+    s->free_list = NULL;
 
-    //Search list for best fitting free region
-    mem_node_t *cur_best_fit = NULL;
-    mem_node_t *iter = root;
-    while (iter != NULL)
+    uint8_t *base = (uint8_t *)s + SLAB_HDR_SIZE;
+    for (int i = (int)c->obj_per_slab - 1; i >= 0; i--)
     {
-        if (iter->isFree && iter->len >= sz)
+        void **obj = (void **)(base + i * c->obj_sz);
+        obj[0] = s->free_list;
+        obj[1] = (void *)FREE_POISON;
+        s->free_list = obj;
+    }
+
+    c->slab_cnt++;
+    if (c->slab_cnt > c->slab_peak)
+        c->slab_peak = c->slab_cnt;
+    return s;
+}
+
+//Must be called with the cache lock held
+static void *slab_take(struct mem_cache *c)
+{
+    mem_slab_t *s = c->partial;
+    if (s == NULL)
+    {
+        s = c->empty;
+        if (s != NULL)
         {
-            if (cur_best_fit != NULL)
-            {
-                if (iter->len < cur_best_fit->len)
-                    cur_best_fit = iter;
-            }
-            else
-                cur_best_fit = iter;
+            slab_unlink(&c->empty, s);
+            c->empty_cnt--;
         }
-        iter = iter->next;
+        else if ((s = slab_new(c)) == NULL)
+            return NULL;
+        slab_push(&c->partial, s);
     }
 
-    //If none found, allocate a new set of pages
-    if (cur_best_fit == NULL)
-    {
+    void **obj = s->free_list;
+    s->free_list = obj[0];
+    s->inuse++;
+    c->inuse++;
 
-        //allocate new page set
-        size_t alloc_sz = sz + sizeof(mem_node_t);
-        if (alloc_sz % KiB(4))
-            alloc_sz += KiB(4) - (alloc_sz % KiB(4));
+    if (s->inuse == c->obj_per_slab)
+    {
+        slab_unlink(&c->partial, s);
+        slab_push(&c->full, s);
+    }
+    return obj;
+}
 
-        uintptr_t phys = pagealloc_alloc(0, 0, physmem_alloc_flags_data, alloc_sz);
+//Must be called with the cache lock held, slabs to give back to the page allocator are added to reclaim
+static void slab_put(struct mem_cache *c, void **obj, mem_slab_t **reclaim)
+{
+    mem_slab_t *s = (mem_slab_t *)((uintptr_t)obj & ~(SLAB_SIZE - 1));
 
-        //setup a mem_node_t at the top
-        mem_node_t *n_node = (mem_node_t *)vmem_phystovirt(phys, alloc_sz, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
-        n_node->next = NULL;
-        n_node->len = alloc_sz - sizeof(mem_node_t);
-        n_node->isFree = false;
+    if (s->inuse == c->obj_per_slab)
+    {
+        slab_unlink(&c->full, s);
+        slab_push(&c->partial, s);
+    }
 
-        cur_best_fit = n_node;
-        node_cnt++;
+    obj[0] = s->free_list;
+    s->free_list = obj;
+    s->inuse--;
+    c->inuse--;
 
-        //insert the node into the list
-        if (root == NULL)
+    if (s->inuse == 0)
+    {
+        slab_unlink(&c->partial, s);
+        if (c->empty_cnt < MEM_KEEP_EMPTY)
         {
-            root = n_node;
+            slab_push(&c->empty, s);
+            c->empty_cnt++;
         }
         else
         {
-            n_node->next = root->next;
-            root->next = n_node;
+            s->magic = 0;
+            s->next = *reclaim;
+            *reclaim = s;
+            c->slab_cnt--;
+            c->reclaim_cnt++;
         }
     }
+}
 
-    if (cur_best_fit->len > sz + sizeof(mem_node_t))
+static void slab_reclaim(mem_slab_t *s)
+{
+    while (s != NULL)
     {
+        mem_slab_t *next = s->next;
+        pagealloc_free(s->phys, SLAB_SIZE);
+        s = next;
+    }
+}
 
-        //Create a new free node with the remaining memory
-        mem_node_t *n_node = (mem_node_t *)(cur_best_fit->data + sz);
-        n_node->next = NULL;
-        n_node->len = cur_best_fit->len - sz - sizeof(mem_node_t);
-        n_node->isFree = true;
-
-        node_cnt++;
+void *mem_cache_alloc(mem_cache_t *c)
+{
+    void **obj = NULL;
 
-        if (n_node->len <= sz / 2)
+    int cli_state = cli();
+    if (mag_enabled)
+    {
+        TLS mem_mag_t *m = &mags[c->idx];
+        if (m->cnt == 0)
         {
-            //TODO: report freenode creations that are at or below half the allocation size, this can be used to tune the best 'fit' scoring
+            local_spinlock_lock(&c->lock);
+            while (m->cnt < MAG_BATCH)
+            {
+                void *o = slab_take(c);
+                if (o == NULL)
+                    break;
+                m->objs[m->cnt++] = o;
+            }
+            c->refill_cnt++;
+            local_spinlock_unlock(&c->lock);
         }
 
-        //insert the node into the list
-        n_node->next = cur_best_fit->next;
-        cur_best_fit->next = n_node;
+        if (m->cnt > 0)
+            obj = m->objs[--m->cnt];
+    }
+    else
+    {
+        local_spinlock_lock(&c->lock);
+        obj = slab_take(c);
+        local_spinlock_unlock(&c->lock);
+    }
+    sti(cli_state);
+
+    if (obj != NULL)
+        obj[1] = NULL;
+    return obj;
+}
+
+static void mem_cache_release(mem_cache_t *c, void **obj)
+{
+    mem_slab_t *reclaim = NULL;
+    obj[1] = (void *)FREE_POISON;
 
-        //shrink the best fit node to fully fit
-        cur_best_fit->len = sz;
+    int cli_state = cli();
+    if (mag_enabled)
+    {
+        TLS mem_mag_t *m = &mags[c->idx];
+        if (m->cnt == MAG_LEN)
+        {
+            //Return the oldest objects, the recently freed ones are still warm in the cache
+            local_spinlock_lock(&c->lock);
+            for (int i = 0; i < MAG_BATCH; i++)
+                slab_put(c, m->objs[i], &reclaim);
+            c->drain_cnt++;
+            local_spinlock_unlock(&c->lock);
+
+            for (int i = MAG_BATCH; i < MAG_LEN; i++)
+                m->objs[i - MAG_BATCH] = m->objs[i];
+            m->cnt -= MAG_BATCH;
+        }
+        m->objs[m->cnt++] = obj;
     }
+    else
+    {
+        local_spinlock_lock(&c->lock);
+        slab_put(c, obj, &reclaim);
+        local_spinlock_unlock(&c->lock);
+    }
+    sti(cli_state);
 
-    cur_best_fit->isFree = false;
-    void *retAddr = cur_best_fit->data;
+    slab_reclaim(reclaim);
+}
+
+mem_cache_t *mem_cache_create(const char *name, size_t obj_sz)
+{
+    //Objects hold the free list link and the double free marker while free
+    if (obj_sz < 16)
+        obj_sz = 16;
+    obj_sz = (obj_sz + 15) & ~15ull;
+    if (obj_sz * MEM_MIN_OBJS > SLAB_SIZE - SLAB_HDR_SIZE)
+        return NULL;
 
+    int cli_state = cli();
+    local_spinlock_lock(&cache_lock);
+    if (cache_cnt == MEM_MAX_CACHES)
+    {
+        local_spinlock_unlock(&cache_lock);
+        sti(cli_state);
+        return NULL;
+    }
+
+    struct mem_cache *c = &caches[cache_cnt];
+    memset(c, 0, sizeof(struct mem_cache));
+    strncpy(c->name, name, MEM_CACHE_NAME_LEN - 1);
+    c->obj_sz = obj_sz;
+    c->obj_per_slab = (SLAB_SIZE - SLAB_HDR_SIZE) / obj_sz;
+    c->idx = cache_cnt++;
+    local_spinlock_unlock(&cache_lock);
     sti(cli_state);
 
-    return retAddr;
+    return c;
+}
+
+static void mem_addexact(const char *name, size_t sz)
+{
+    mem_cache_t *c = mem_cache_create(name, sz);
+    if (c == NULL || exact_cnt == MEM_EXACT_CNT)
+        PANIC("[SysMemory] Failed to create object cache.");
+
+    exact_sz[exact_cnt] = sz;
+    exact_caches[exact_cnt] = c;
+    exact_cnt++;
+}
+
+PRIVATE void mem_slab_init(void)
+{
+    for (int i = 0; i < MEM_CLASS_CNT; i++)
+    {
+        char name[MEM_CACHE_NAME_LEN] = "size-";
+        char tmp[20];
+        strncat(name, itoa(1 << (i + MEM_MIN_CLASS_LOG2), tmp, 10), MEM_CACHE_NAME_LEN - 6);
+
+        size_classes[i] = mem_cache_create(name, 1ull << (i + MEM_MIN_CLASS_LOG2));
+        if (size_classes[i] == NULL)
+            PANIC("[SysMemory] Failed to create size class.");
+    }
+
+    //Kept apart from the size classes so the long lived registry and list nodes don't pin down slabs used for transient buffers
+    mem_addexact("kvs_t", sizeof(kvs_t));
+    mem_addexact("list_node_t", sizeof(list_node_t));
 }
 
-static void mem_compact()
+//Set up the magazines of the calling core, they aren't used before mem_slab_enable
+PRIVATE void mem_slab_mp_init(void)
 {
-    //TODO: compact list if it gets too big, to clear out small fragmented areas
-    //TODO: detect adjacent free areas and merge them
+    if (mags == NULL)
+    {
+        TLS void *(*mp_tls_get)(int) = (TLS void *(*)(int))elf_resolvefunction("mp_tls_get");
+        int (*mp_tls_alloc)(int) = (int (*)(int))elf_resolvefunction("mp_tls_alloc");
+        mags = (TLS mem_mag_t *)mp_tls_get(mp_tls_alloc(sizeof(mem_mag_t) * MEM_MAX_CACHES));
+    }
+
+    for (int i = 0; i < MEM_MAX_CACHES; i++)
+        mags[i].cnt = 0;
+}
+
+//Called once every core has set up its magazines, an AP allocates before its TLS exists
+PRIVATE void mem_slab_enable(void)
+{
+    mag_enabled = true;
+}
+
+static void *mem_large_alloc(size_t sz)
+{
+    size_t len = sz + SLAB_HDR_SIZE;
+    if (len % KiB(4))
+        len += KiB(4) - (len % KiB(4));
+
+    uintptr_t phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data, len);
+    if (phys == (uintptr_t)-1)
+        return NULL;
+
+    mem_large_t *hdr = (mem_large_t *)vmem_phystovirt(phys, len, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+    hdr->magic = LARGE_MAGIC;
+    hdr->self = hdr;
+    hdr->phys = phys;
+    hdr->len = len;
+
+    large_cnt++;
+    large_bytes += len;
+    return (uint8_t *)hdr + SLAB_HDR_SIZE;
+}
+
+void *WEAK malloc(size_t sz)
+{
+    if (sz == 0)
+        return NULL;
+
+    if (sz > (1ull << MEM_MAX_CLASS_LOG2))
+        return mem_large_alloc(sz);
+
+    for (int i = 0; i < exact_cnt; i++)
+        if (exact_sz[i] == sz)
+            return mem_cache_alloc(exact_caches[i]);
+
+    //All allocations are 16-byte aligned
+    int order = 64 - __builtin_clzll(sz - 1);
+    if (order < MEM_MIN_CLASS_LOG2)
+        order = MEM_MIN_CLASS_LOG2;
+    return mem_cache_alloc(size_classes[order - MEM_MIN_CLASS_LOG2]);
 }
 
 static void *doublefree_addr = NULL;
@@ -138,25 +447,81 @@ void WEAK free(void *sz)
     if (sz == NULL)
         return;
 
-    int cli_state = cli();
-
-    //access the node info
-    mem_node_t *desc = (mem_node_t *)((intptr_t)sz - sizeof(mem_node_t));
+    //A slab header at the aligned base can only belong to the slab holding this pointer, see mem_large_alloc for the other case
+    mem_slab_t *s = (mem_slab_t *)((uintptr_t)sz & ~(SLAB_SIZE - 1));
+    if (s->magic == SLAB_MAGIC && s->self == s)
+    {
+        void **obj = (void **)sz;
+        if (obj[1] == (void *)FREE_POISON)
+        {
+            doublefree_addr = __builtin_return_address(0);
+            PANIC("Double free detected.");
+        }
 
-    //Remove any freed pages from the allocator
+        mem_cache_release(s->cache, obj);
+        return;
+    }
 
-    //Mark the remaining space as available
-    if (desc->isFree)
+    if ((uintptr_t)sz % KiB(4) == SLAB_HDR_SIZE)
     {
-        doublefree_addr = __builtin_return_address(0);
-        PANIC("Double free detected.");
+        mem_large_t *hdr = (mem_large_t *)((uintptr_t)sz - SLAB_HDR_SIZE);
+        if (hdr->magic == LARGE_MAGIC && hdr->self == hdr)
+        {
+            hdr->magic = 0;
+            large_cnt--;
+            large_bytes -= hdr->len;
+            pagealloc_free(hdr->phys, hdr->len);
+            return;
+        }
     }
 
-    desc->isFree = true;
+    //Allocated from the kernel's bootstrap area before SysMemory took over, that memory isn't reclaimed
+}
 
-    //TODO: implement returning remaining memory to system
-    if (node_cnt >= 512)
-        mem_compact();
+//Dump per cache slab usage
+int mem_cachestats()
+{
+    char tmp[20];
+    for (int i = 0; i < cache_cnt; i++)
+    {
+        struct mem_cache *c = &caches[i];
+
+        int cli_state = cli();
+        local_spinlock_lock(&c->lock);
+        uint64_t slab_cnt = c->slab_cnt;
+        uint64_t slab_peak = c->slab_peak;
+        uint64_t inuse = c->inuse;
+        uint64_t refill_cnt = c->refill_cnt;
+        uint64_t drain_cnt = c->drain_cnt;
+        uint64_t reclaim_cnt = c->reclaim_cnt;
+        local_spinlock_unlock(&c->lock);
+        sti(cli_state);
+
+        DEBUG_PRINT("[SysMemory] ");
+        DEBUG_PRINT(c->name);
+        DEBUG_PRINT(": obj=");
+        DEBUG_PRINT(ltoa(c->obj_sz, tmp, 10));
+        DEBUG_PRINT(" slabs=");
+        DEBUG_PRINT(ltoa(slab_cnt, tmp, 10));
+        DEBUG_PRINT(" peak=");
+        DEBUG_PRINT(ltoa(slab_peak, tmp, 10));
+        DEBUG_PRINT(" objs=");
+        DEBUG_PRINT(ltoa(inuse, tmp, 10));
+        DEBUG_PRINT("/");
+        DEBUG_PRINT(ltoa(slab_cnt * c->obj_per_slab, tmp, 10));
+        DEBUG_PRINT(" refills=");
+        DEBUG_PRINT(ltoa(refill_cnt, tmp, 10));
+        DEBUG_PRINT(" drains=");
+        DEBUG_PRINT(ltoa(drain_cnt, tmp, 10));
+        DEBUG_PRINT(" reclaimed=");
+        DEBUG_PRINT(ltoa(reclaim_cnt, tmp, 10));
+        DEBUG_PRINT("\r\n");
+    }
 
-    sti(cli_state);
-}
\ No newline at end of file
+    DEBUG_PRINT("[SysMemory] Large allocations: ");
+    DEBUG_PRINT(ltoa(large_cnt, tmp, 10));
+    DEBUG_PRINT(" KiB=");
+    DEBUG_PRINT(ltoa(large_bytes / KiB(1), tmp, 10));
+    DEBUG_PRINT("\r\n");
+    return 0;
+}
@@ -16,15 +16,23 @@ void *stack_alloc(size_t sz, bool kernel) {
 
 int kernel_updatememhandlers();
 
+PRIVATE void mem_slab_init(void);
+PRIVATE void mem_slab_mp_init(void);
+PRIVATE void mem_slab_enable(void);
+
 int module_init() {
+    mem_slab_init();
     return 0;
 }
 
 int mem_init() {
+    mem_slab_mp_init();
+    mem_slab_enable();
     kernel_updatememhandlers();
     return 0;
 }
 
 int mem_mp_init() {
+    mem_slab_mp_init();
     return 0;
 }
\ No newline at end of file
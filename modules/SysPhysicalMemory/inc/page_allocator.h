@@ -5,6 +5,22 @@
 #ifndef CARDINAL_PHYSMEM_H
 #define CARDINAL_PHYSMEM_H
 
+#include <stdint.h>
+#include <types.h>
+
+#define BUDDY_MAX_ORDER (18) //4KiB << 18 = 1GiB
+#define BUDDY_ORDER_CNT (BUDDY_MAX_ORDER + 1)
+
 int pagealloc_init();
 
+int pagealloc_mp_init();
+
+int pagealloc_cache_init();
+
+int pagealloc_numa_init();
+
+int pagealloc_publishstats();
+
+PRIVATE void pagealloc_getfree(uint64_t *free_bytes, uint64_t *free_blocks);
+
 #endif
\ No newline at end of file
@@ -19,7 +19,7 @@ int pmem_initial_test() {
 
     for(int i = 0; i < 16; i++) {
         char tmp_buf[10];
-        DEBUG_PRINT(itoa((int)pagealloc_alloc(0, 0, 0, KiB(4)), tmp_buf, 16));
+        DEBUG_PRINT(itoa((int)pagealloc_alloc(-1, -1, 0, KiB(4)), tmp_buf, 16));
         DEBUG_PRINT("\r\n");
     }
 
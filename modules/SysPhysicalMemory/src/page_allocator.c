@@ -1,37 +1,96 @@
 #include "SysPhysicalMemory/phys_mem.h"
 #include "SysReg/registry.h"
+#include "SysVirtualMemory/vmem.h"
+#include "page_allocator.h"
+#include "elf.h"
 
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <stdqueue.h>
 #include <string.h>
 #include <types.h>
+#include <cardinal/local_spinlock.h>
 
-// Compute the space needed for three levels of bitmaps, 1GiB, 2MiB, 4KiB and
-// allocate them
-// For the higher levels, 1GiB and 2MiB, allocate an additional bitmap, use to
-// determine if the subtree is in use
+// Binary buddy allocator over all of physical memory, orders 4KiB to 1GiB.
+// Physical memory above 2GiB isn't mapped until SysVirtualMemory is up, so free
+// blocks can't carry their own list links. Instead every order has a bitmap with
+// one bit per block that is set while the block is free, plus a summary bitmap
+// with one bit per nonzero bitmap word, so finding a free block is a couple of
+// find-first-set operations starting from a low water mark.
 
-// If SUBMP_PRESENT, don't touch, treat as used for allocations, recurse for
-// free
+// Zones are page ranges over the same bitmaps, split by NUMA domain (from the
+// SRAT) and at 4GiB for 32-bit DMA. Blocks never straddle a zone boundary, so a
+// zone can be searched by restricting the bitmap scan to its range, and
+// pagealloc_numa_init can re-zone memory after boot by only splitting the few
+// blocks that cross a new boundary.
 
-// If SUBMP_ABSENT, may touch, further state depends on FREE/USED
+// Single pages and 2MiB pages are additionally cached per core, those are
+// handed out and returned with only interrupts disabled, the buddy lock is taken
+// once per batch to refill or drain the cache.
 
-#define BTM_LEVEL (KiB(4))
-#define ADDR_SHAMT (8)
-#define MAX_ENTRIES (1 << (12 + ADDR_SHAMT))
-
-#define BUILD_ADDR(addr) ((addr & ~(BTM_LEVEL - 1)) << ADDR_SHAMT)
-#define BUILD_PAGES(pages) ((pages - 1) & (MAX_ENTRIES - 1))
-#define BUILD_ENTRY(addr, pages) (BUILD_ADDR(addr) | BUILD_PAGES(pages))
+// Single page allocations can ask for a cache color, the number of colors is
+// the number of pages one way of the last level cache spans.
 
-#define GET_ADDR(e) ((e >> ADDR_SHAMT) & ~(BTM_LEVEL - 1))
-#define GET_PG_CNT(e) ((e & (MAX_ENTRIES - 1)) + 1)
+// The idle task keeps a pool of pre-zeroed pages topped up through
+// pagealloc_zero_refill, physmem_alloc_flags_zero single pages come from there.
 
-static queue_t btm_level;
+#define BTM_LEVEL (KiB(4))
+#define DMA32_PFN (GiB(4) / BTM_LEVEL)
+
+#define PCP_ORDER0_LEN (64)
+#define PCP_ORDER0_BATCH (16)
+#define PCP_ORDER9_LEN (8)
+#define PCP_ORDER9_BATCH (2)
+
+#define PAGEALLOC_MAX_ZONES (16)
+#define PAGEALLOC_MAX_COLORS (64)
+#define PAGEALLOC_COLOR_SCAN (64)   //Bitmap words inspected for a page of the right color before splitting a block for one
+#define ZERO_POOL_LEN (256)
+
+typedef struct {
+    uint64_t *map;      //One bit per block, set if free
+    uint64_t *summary;  //One bit per map word, set if the word is nonzero
+    uint64_t blocks;
+    uint64_t words;
+    uint64_t hint;      //No summary word below this has bits set
+    uint64_t free_cnt;
+} buddy_order_t;
+
+typedef struct {
+    uint64_t start_pfn;
+    uint64_t end_pfn;
+    int domain;
+    bool dma32;
+    uint64_t free_pages;
+    uint64_t alloc_cnt;
+    uint64_t fail_cnt;
+} pagealloc_zone_t;
+
+typedef struct {
+    int cnt0;
+    int cnt9;
+    uintptr_t pages0[PCP_ORDER0_LEN];
+    uintptr_t pages9[PCP_ORDER9_LEN];
+} pagealloc_pcp_t;
+
+static buddy_order_t orders[BUDDY_ORDER_CNT];
+static uint64_t total_pages;
 static uint64_t mem_size;
 static uint64_t free_mem;
+static int pagealloc_lock = 0;
+
+static pagealloc_zone_t zones[PAGEALLOC_MAX_ZONES];
+static int zone_cnt = 0;
+static int published_zone_cnt = 0;
+static bool normal_first = false;   //Only the low 2GiB are mapped until vmem_init, allocate lowest first until then
+static uint64_t color_cnt = 1;
+
+static uintptr_t zero_pool[ZERO_POOL_LEN];
+static int zero_pool_cnt = 0;
+static intptr_t (*phystovirt)(intptr_t, size_t, int) = NULL;
+
+static TLS pagealloc_pcp_t *pcp = NULL;
+static bool pcp_enabled = false;
 
 static uint64_t data_multiple;
 static uint64_t instr_multiple;
@@ -40,84 +99,317 @@ static uint64_t pagetable_multiple;
 static uint64_t roundUp_po2(uint64_t val, uint64_t mult) {
     return (val + (mult - 1)) & ~(mult - 1);
 }
-static int32_t partition_pgs(uint64_t *data, int32_t lo, int32_t hi,
-                             int32_t sz) {
-    int32_t piv_loc = (lo + hi) / 2;
-    uint64_t pivot = GET_ADDR(data[piv_loc % sz]);
-    int32_t i = lo - 1;
-    int32_t j = hi + 1;
-    while (true) {
-        do
-            j--;
-        while (GET_ADDR(data[j % sz]) > pivot);
-        do
-            i++;
-        while (GET_ADDR(data[i % sz]) < pivot);
-
-        if (i >= j)
-            return j;
-
-        data[i % sz] ^= data[j % sz];
-        data[j % sz] ^= data[i % sz];
-        data[i % sz] ^= data[j % sz];
-    }
+
+static int ceil_log2(uint64_t val) {
+    if (val <= 1)
+        return 0;
+    return 64 - __builtin_clzll(val - 1);
+}
+
+static int floor_log2(uint64_t val) {
+    return 63 - __builtin_clzll(val);
+}
+
+static void buddy_setfree(int order, uint64_t idx) {
+    buddy_order_t *o = &orders[order];
+    uint64_t w = idx / 64;
+    o->map[w] |= (1ull << (idx % 64));
+    o->summary[w / 64] |= (1ull << (w % 64));
+    if (w / 64 < o->hint)
+        o->hint = w / 64;
+    o->free_cnt++;
+}
+
+static void buddy_setused(int order, uint64_t idx) {
+    buddy_order_t *o = &orders[order];
+    uint64_t w = idx / 64;
+    o->map[w] &= ~(1ull << (idx % 64));
+    if (o->map[w] == 0)
+        o->summary[w / 64] &= ~(1ull << (w % 64));
+    o->free_cnt--;
+}
+
+static bool buddy_isfree(int order, uint64_t idx) {
+    buddy_order_t *o = &orders[order];
+    if (idx >= o->blocks)
+        return false;
+    return (o->map[idx / 64] & (1ull << (idx % 64))) != 0;
+}
+
+static pagealloc_zone_t *zone_of(uint64_t pfn) {
+    for (int i = 0; i < zone_cnt; i++)
+        if (pfn < zones[i].end_pfn)
+            return &zones[i];
+    return &zones[zone_cnt - 1];
+}
+
+static bool zone_crosses(uint64_t pfn, uint64_t pg_cnt) {
+    return zone_of(pfn) != zone_of(pfn + pg_cnt - 1);
 }
-static void quicksort_pgs(uint64_t *data, int32_t lo, int32_t hi, int32_t sz) {
-    while (hi > lo) {
-        int32_t p = partition_pgs(data, lo, hi, sz);
-
-        // Ensure log(n) stack usage by always recursing the smaller partition
-        if (p - lo > hi - p) {
-            quicksort_pgs(data, lo, p, sz);
-            lo = p + 1;
-        } else {
-            quicksort_pgs(data, p + 1, hi, sz);
-            hi = p;
+
+//Lowest free block in [min_idx, max_idx), -1 if none
+static int64_t buddy_findfree(int order, uint64_t min_idx, uint64_t max_idx) {
+    buddy_order_t *o = &orders[order];
+    if (o->free_cnt == 0 || min_idx >= max_idx)
+        return -1;
+
+    uint64_t min_w = min_idx / 64;
+    uint64_t s_words = (o->words + 63) / 64;
+    uint64_t s = min_w / 64;
+    if (s < o->hint)
+        s = o->hint;
+
+    for (; s < s_words && s * 4096 < max_idx; s++) {
+        uint64_t sum = o->summary[s];
+        if (sum == 0) {
+            if (s == o->hint)
+                o->hint++;
+            continue;
+        }
+
+        if (s == min_w / 64)
+            sum &= ~0ull << (min_w % 64);
+
+        while (sum != 0) {
+            uint64_t w = s * 64 + __builtin_ctzll(sum);
+            uint64_t bits = o->map[w];
+            if (w == min_w)
+                bits &= ~0ull << (min_idx % 64);
+
+            if (bits != 0) {
+                uint64_t idx = w * 64 + __builtin_ctzll(bits);
+                if (idx >= max_idx)
+                    return -1;
+                return (int64_t)idx;
+            }
+            sum &= sum - 1;
         }
     }
+    return -1;
+}
+
+static void buddy_freeblock(uint64_t pfn, int order) {
+    free_mem += (BTM_LEVEL << order);
+    zone_of(pfn)->free_pages += (1ull << order);
+    while (order < BUDDY_MAX_ORDER) {
+        uint64_t buddy = (pfn >> order) ^ 1;
+        if (!buddy_isfree(order, buddy))
+            break;
+
+        uint64_t merged = pfn & ~(1ull << order);
+        if (zone_crosses(merged, 2ull << order))
+            break;
+
+        buddy_setused(order, buddy);
+        pfn = merged;
+        order++;
+    }
+    buddy_setfree(order, pfn >> order);
 }
 
-static void compact_queue() {
-    int32_t lo = btm_level.head;
-    int32_t hi = btm_level.tail - 1;
-    if (hi < lo)
-        hi += btm_level.size;
+//Split an arbitrary page range into the largest aligned blocks it contains
+static void buddy_freerange(uint64_t pfn, uint64_t pg_cnt) {
+    while (pg_cnt > 0) {
+        int order = floor_log2(pg_cnt);
+        if (pfn != 0 && __builtin_ctzll(pfn) < order)
+            order = __builtin_ctzll(pfn);
+        if (order > BUDDY_MAX_ORDER)
+            order = BUDDY_MAX_ORDER;
+        while (order > 0 && zone_crosses(pfn, 1ull << order))
+            order--;
+
+        buddy_freeblock(pfn, order);
+        pfn += (1ull << order);
+        pg_cnt -= (1ull << order);
+    }
+}
 
-    quicksort_pgs(btm_level.queue, lo, hi, btm_level.size);
+static void buddy_take(int k, uint64_t idx, int order) {
+    buddy_setused(k, idx);
+    uint64_t pfn = idx << k;
 
-    for (; lo < hi - 1; lo++) {
-        int32_t pg_cnt = GET_PG_CNT(btm_level.queue[lo % btm_level.size]);
-        uint64_t pg_addr = GET_ADDR(btm_level.queue[lo % btm_level.size]);
-        uint64_t n_pg_addr = GET_ADDR(btm_level.queue[(lo + 1) % btm_level.size]);
-        int32_t n_pg_cnt =
-            pg_cnt + GET_PG_CNT(btm_level.queue[(lo + 1) % btm_level.size]);
+    //Return the upper halves until the block is the requested size
+    while (k > order) {
+        k--;
+        buddy_setfree(k, (pfn >> k) + 1);
+    }
+    free_mem -= (BTM_LEVEL << order);
+    zone_of(pfn)->free_pages -= (1ull << order);
+}
 
-        if (pg_cnt * BTM_LEVEL + pg_addr == n_pg_addr && n_pg_cnt < MAX_ENTRIES) {
-            uint64_t n_ent = BUILD_ENTRY(pg_addr, n_pg_cnt);
-            btm_level.queue[(lo + 1) % btm_level.size] = n_ent;
-            btm_level.queue[lo % btm_level.size] = 0;
-            btm_level.head = (btm_level.head + 1) % btm_level.size;
-            btm_level.ent_cnt--;
+static int64_t buddy_allocblock(pagealloc_zone_t *z, int order) {
+    for (int k = order; k <= BUDDY_MAX_ORDER; k++) {
+        uint64_t min_idx = (z->start_pfn + (1ull << k) - 1) >> k;
+        int64_t idx = buddy_findfree(k, min_idx, z->end_pfn >> k);
+        if (idx < 0)
+            continue;
+
+        buddy_take(k, idx, order);
+        return idx << k;
+    }
+    return -1;
+}
+
+//Allocations past the largest order take a run of consecutive top order blocks
+static int64_t buddy_allocrun(pagealloc_zone_t *z, uint64_t blk_cnt) {
+    uint64_t min_idx = (z->start_pfn + (1ull << BUDDY_MAX_ORDER) - 1) >> BUDDY_MAX_ORDER;
+    uint64_t max_idx = z->end_pfn >> BUDDY_MAX_ORDER;
+
+    uint64_t run = 0;
+    for (uint64_t idx = min_idx; idx < max_idx; idx++) {
+        run = buddy_isfree(BUDDY_MAX_ORDER, idx) ? run + 1 : 0;
+        if (run == blk_cnt) {
+            uint64_t base = idx + 1 - blk_cnt;
+            for (uint64_t i = base; i <= idx; i++)
+                buddy_setused(BUDDY_MAX_ORDER, i);
+            free_mem -= blk_cnt * (BTM_LEVEL << BUDDY_MAX_ORDER);
+            z->free_pages -= blk_cnt << BUDDY_MAX_ORDER;
+            return base << BUDDY_MAX_ORDER;
         }
     }
+    return -1;
 }
 
-static void insert_queue(uint64_t val) {
-    if (!queue_tryenqueue(&btm_level, val)) {
-        compact_queue();
+//Single page of the requested color, an existing free page if one is close by, otherwise carved from a block holding every color
+static int64_t buddy_alloccolor(pagealloc_zone_t *z, uint64_t color) {
+    buddy_order_t *o = &orders[0];
+    uint64_t pattern = 0;
+    for (uint64_t i = color; i < 64; i += color_cnt)
+        pattern |= (1ull << i);
+
+    uint64_t min_w = (z->start_pfn + 63) / 64;
+    uint64_t max_w = z->end_pfn / 64;
+    uint64_t scanned = 0;
+    for (uint64_t w = min_w; w < max_w && scanned < PAGEALLOC_COLOR_SCAN; w++) {
+        if ((o->summary[w / 64] & (1ull << (w % 64))) == 0) {
+            //Skip the rest of an empty summary word
+            if (o->summary[w / 64] == 0)
+                w |= 63;
+            continue;
+        }
 
-        if (!queue_tryenqueue(&btm_level, val))
-            PANIC("Failed to enqueue entry.");
+        scanned++;
+        uint64_t bits = o->map[w] & pattern;
+        if (bits != 0) {
+            uint64_t idx = w * 64 + __builtin_ctzll(bits);
+            buddy_take(0, idx, 0);
+            return idx;
+        }
     }
+
+    int color_order = floor_log2(color_cnt);
+    int64_t pfn = buddy_allocblock(z, color_order);
+    if (pfn < 0)
+        return -1;
+
+    if (color != 0)
+        buddy_freerange(pfn, color);
+    if (color + 1 < color_cnt)
+        buddy_freerange(pfn + color + 1, color_cnt - color - 1);
+    return pfn + color;
+}
+
+static uintptr_t zone_alloc(pagealloc_zone_t *z, uint64_t pg_cnt, int color) {
+    int order = ceil_log2(pg_cnt);
+    if (z->free_pages < pg_cnt)
+        return (uintptr_t)-1;
+
+    int64_t pfn = -1;
+    if (pg_cnt == 1 && color >= 0 && color_cnt > 1)
+        pfn = buddy_alloccolor(z, (uint64_t)color % color_cnt);
+    else if (order > BUDDY_MAX_ORDER)
+        pfn = buddy_allocrun(z, (pg_cnt + (1ull << BUDDY_MAX_ORDER) - 1) >> BUDDY_MAX_ORDER);
+    else
+        pfn = buddy_allocblock(z, order);
+
+    if (pfn < 0)
+        return (uintptr_t)-1;
+
+    //Give back the tail so frees of the requested size line up
+    uint64_t alloc_cnt = roundUp_po2(pg_cnt, 1ull << (order > BUDDY_MAX_ORDER ? BUDDY_MAX_ORDER : order));
+    if (alloc_cnt > pg_cnt)
+        buddy_freerange(pfn + pg_cnt, alloc_cnt - pg_cnt);
+
+    z->alloc_cnt++;
+    return (uintptr_t)pfn * BTM_LEVEL;
 }
 
-static void insert_queue_front(uint64_t val) {
-    if (!queue_tryenqueue_front(&btm_level, val)) {
-        compact_queue();
+//Preferred domain first, then any domain. Once everything is mapped normal memory goes before DMA32 so it isn't used up by allocations that could go anywhere.
+static uintptr_t buddy_alloc(uint64_t pg_cnt, int domain, int color, bool dma32_only) {
+    //A failure is charged to the zone that would have been tried first
+    pagealloc_zone_t *preferred = NULL;
+    for (int pass = (domain < 0) ? 1 : 0; pass < 2; pass++)
+        for (int round = 0; round < (normal_first ? 2 : 1); round++)
+            for (int i = 0; i < zone_cnt; i++) {
+                pagealloc_zone_t *z = &zones[i];
+                if (dma32_only && !z->dma32)
+                    continue;
+                if (normal_first && z->dma32 == (round == 0))
+                    continue;
+                if (pass == 0 && z->domain != domain)
+                    continue;
+
+                if (preferred == NULL)
+                    preferred = z;
+                uintptr_t addr = zone_alloc(z, pg_cnt, color);
+                if (addr != (uintptr_t)-1)
+                    return addr;
+            }
 
-        if (!queue_tryenqueue_front(&btm_level, val))
-            PANIC("Failed to enqueue entry.");
+    if (preferred != NULL)
+        preferred->fail_cnt++;
+    return (uintptr_t)-1;
+}
+
+static void pagealloc_zero(uintptr_t addr, uint64_t size) {
+    if (phystovirt == NULL)
+        phystovirt = (intptr_t (*)(intptr_t, size_t, int))elf_resolvefunction("vmem_phystovirt");
+    memset((void *)phystovirt(addr, size, vmem_flags_cachewriteback), 0, size);
+}
+
+//Must be called with interrupts disabled
+static uintptr_t pcp_alloc(uint64_t size) {
+    TLS int *cnt = (size == BTM_LEVEL) ? &pcp->cnt0 : &pcp->cnt9;
+    TLS uintptr_t *pages = (size == BTM_LEVEL) ? pcp->pages0 : pcp->pages9;
+    int batch = (size == BTM_LEVEL) ? PCP_ORDER0_BATCH : PCP_ORDER9_BATCH;
+
+    if (*cnt == 0) {
+        local_spinlock_lock(&pagealloc_lock);
+        for (int i = 0; i < batch; i++) {
+            uintptr_t addr = buddy_alloc(size / BTM_LEVEL, -1, -1, false);
+            if (addr == (uintptr_t)-1)
+                break;
+            pages[(*cnt)++] = addr;
+        }
+        local_spinlock_unlock(&pagealloc_lock);
+
+        if (*cnt == 0)
+            return (uintptr_t)-1;
+    }
+
+    return pages[--(*cnt)];
+}
+
+//Must be called with interrupts disabled
+static void pcp_free(uintptr_t addr, uint64_t size) {
+    TLS int *cnt = (size == BTM_LEVEL) ? &pcp->cnt0 : &pcp->cnt9;
+    TLS uintptr_t *pages = (size == BTM_LEVEL) ? pcp->pages0 : pcp->pages9;
+    int len = (size == BTM_LEVEL) ? PCP_ORDER0_LEN : PCP_ORDER9_LEN;
+    int batch = (size == BTM_LEVEL) ? PCP_ORDER0_BATCH : PCP_ORDER9_BATCH;
+
+    if (*cnt == len) {
+        //Return the coldest pages so the hot ones stay cached
+        local_spinlock_lock(&pagealloc_lock);
+        for (int i = 0; i < batch; i++)
+            buddy_freerange(pages[i] / BTM_LEVEL, size / BTM_LEVEL);
+        local_spinlock_unlock(&pagealloc_lock);
+
+        for (int i = batch; i < len; i++)
+            pages[i - batch] = pages[i];
+        *cnt -= batch;
     }
+
+    pages[(*cnt)++] = addr;
 }
 
 void pagealloc_free(uintptr_t addr, uint64_t size) {
@@ -128,8 +420,8 @@ void pagealloc_free(uintptr_t addr, uint64_t size) {
     if (size % BTM_LEVEL != 0)
         PANIC("Misaligned size");
 
-    uint64_t page_cnt = size / BTM_LEVEL;
-    free_mem += size;
+    if ((addr + size) / BTM_LEVEL > total_pages)
+        PANIC("Address out of range");
 
 #ifdef PHYSMEM_DEBUG_VERBOSE_HIGH
     {
@@ -142,106 +434,403 @@ void pagealloc_free(uintptr_t addr, uint64_t size) {
     }
 #endif
 
-    for (uint64_t pg_0 = 0; pg_0 < page_cnt; pg_0 += MAX_ENTRIES) {
-        uint64_t cur_pg = 0;
-        if (page_cnt - pg_0 >= MAX_ENTRIES)
-            cur_pg = MAX_ENTRIES;
-        else
-            cur_pg = page_cnt - pg_0;
-
-        uint64_t val = BUILD_ENTRY(addr, cur_pg);
-        addr += cur_pg * BTM_LEVEL;
-        insert_queue(val);
+    //pcp_alloc hands 2MiB blocks out for large page mappings, only aligned ones may be cached
+    int cli_state = cli();
+    if (pcp_enabled && (size == BTM_LEVEL || (size == MiB(2) && addr % MiB(2) == 0))) {
+        pcp_free(addr, size);
+        sti(cli_state);
+        return;
     }
+
+    local_spinlock_lock(&pagealloc_lock);
+    buddy_freerange(addr / BTM_LEVEL, size / BTM_LEVEL);
+    local_spinlock_unlock(&pagealloc_lock);
+    sti(cli_state);
 }
 
+//domain and color are -1 when the caller doesn't care, a domain is only a preference and color only applies to single pages
 uintptr_t pagealloc_alloc(int domain, int color, physmem_alloc_flags_t flags,
                           uint64_t size) {
 
-    domain = 0;
-    color = 0;
-    flags = 0;
-
-    // determine how to compute cache coloring
-    // Get associated cache size
-    // Divide by page size to get the number of slots
-    // Divide by the number of associativity to get the number of colors
-    // Page index % number of colors to get the page color
-    // Thus, change the page increment appropriately
-    // Coloring only matters for single page allocations of cache age size
-
     // allocations are multiples of BTM_LEVEL pages
     size = roundUp_po2(size, BTM_LEVEL);
-    int32_t pg_cnt = size / BTM_LEVEL;
-
-    // dequeue and enqueue until a unit large enough for this allocation is found
-    for (int32_t j = 0; j < 2; j++) {
-        int32_t max_iter = queue_entcnt(&btm_level);
-        for (int32_t i = 0; i < max_iter; i++) {
-            uint64_t deq = 0;
-            if (queue_trydequeue(&btm_level, &deq) == false)
-                PANIC("Out of Memory!");
-
-            /*{
-                    char tmp_buf[20];
-                    DEBUG_PRINT("SysPhysicalMemory: Deq=");
-                    DEBUG_PRINT(ltoa(deq, tmp_buf, 16));
-                    DEBUG_PRINT("\r\n");
-            }*/
-
-            //Ensure allocations required to be 32bit are such
-            if(flags & physmem_alloc_flags_32bit)
-                if(GET_ADDR(deq) & ~0xffffffffull) {
-                    insert_queue(deq);
-                    continue;
-                }
+    if (size == 0)
+        return (uintptr_t)-1;
+
+    bool dma32_only = (flags & physmem_alloc_flags_32bit) != 0;
+    bool constrained = dma32_only || domain >= 0 || (color >= 0 && color_cnt > 1);
+
+    int cli_state = cli();
+    uintptr_t ret_addr = (uintptr_t)-1;
+    bool zeroed = false;
+    if ((flags & physmem_alloc_flags_zero) && size == BTM_LEVEL && !constrained) {
+        local_spinlock_lock(&pagealloc_lock);
+        if (zero_pool_cnt > 0) {
+            ret_addr = zero_pool[--zero_pool_cnt];
+            zeroed = true;
+        }
+        local_spinlock_unlock(&pagealloc_lock);
+    }
 
-            if ((int32_t)GET_PG_CNT(deq) >= pg_cnt) {
-                uint64_t ret_addr = GET_ADDR(deq);
-                uint64_t n_addr = ret_addr + pg_cnt * BTM_LEVEL;
-                int32_t n_pg_cnt = GET_PG_CNT(deq) - pg_cnt;
-                if (n_pg_cnt > 0)
-                    insert_queue_front(BUILD_ENTRY(n_addr, n_pg_cnt));
+    if (zeroed)
+        ;
+    else if (pcp_enabled && !constrained && (size == BTM_LEVEL || size == MiB(2)))
+        ret_addr = pcp_alloc(size);
+    else {
+        local_spinlock_lock(&pagealloc_lock);
+        ret_addr = buddy_alloc(size / BTM_LEVEL, domain, color, dma32_only);
+        local_spinlock_unlock(&pagealloc_lock);
+    }
+    sti(cli_state);
 
-                free_mem -= size;
+    if (!zeroed && ret_addr != (uintptr_t)-1 && (flags & physmem_alloc_flags_zero))
+        pagealloc_zero(ret_addr, size);
 
 #ifdef PHYSMEM_DEBUG_VERBOSE_HIGH
-                {
-                    char tmp_buf[20];
-                    DEBUG_PRINT("SysPhysicalMemory: Allocated addr=");
-                    DEBUG_PRINT(ltoa(ret_addr, tmp_buf, 16));
-                    DEBUG_PRINT("\r\n");
-                }
+    {
+        char tmp_buf[20];
+        DEBUG_PRINT("SysPhysicalMemory: Allocated addr=");
+        DEBUG_PRINT(ltoa(ret_addr, tmp_buf, 16));
+        DEBUG_PRINT("\r\n");
+    }
 #endif
 
-                return ret_addr;
-            } else
-                insert_queue(deq);
+    return ret_addr;
+}
+
+//Zero one page into the pool, returns false once the pool is full so the idle task can halt
+bool pagealloc_zero_refill(void) {
+    int cli_state = cli();
+    local_spinlock_lock(&pagealloc_lock);
+    bool full = zero_pool_cnt >= ZERO_POOL_LEN;
+    local_spinlock_unlock(&pagealloc_lock);
+    sti(cli_state);
+    if (full)
+        return false;
+
+    uintptr_t addr = pagealloc_alloc(-1, -1, physmem_alloc_flags_data, BTM_LEVEL);
+    if (addr == (uintptr_t)-1)
+        return false;
+    pagealloc_zero(addr, BTM_LEVEL);
+
+    cli_state = cli();
+    local_spinlock_lock(&pagealloc_lock);
+    if (zero_pool_cnt < ZERO_POOL_LEN) {
+        zero_pool[zero_pool_cnt++] = addr;
+        addr = (uintptr_t)-1;
+    }
+    local_spinlock_unlock(&pagealloc_lock);
+    sti(cli_state);
+
+    //Another core filled the pool first
+    if (addr != (uintptr_t)-1)
+        pagealloc_free(addr, BTM_LEVEL);
+    return true;
+}
+
+PRIVATE void pagealloc_getfree(uint64_t *free_bytes, uint64_t *free_blocks) {
+    int cli_state = cli();
+    local_spinlock_lock(&pagealloc_lock);
+    *free_bytes = free_mem;
+    for (int i = 0; i < BUDDY_ORDER_CNT; i++)
+        free_blocks[i] = orders[i].free_cnt;
+    local_spinlock_unlock(&pagealloc_lock);
+    sti(cli_state);
+}
+
+static void pagealloc_pcp_setup(void) {
+    if (pcp == NULL) {
+        TLS void *(*mp_tls_get)(int) = (TLS void *(*)(int))elf_resolvefunction("mp_tls_get");
+        int (*mp_tls_alloc)(int) = (int (*)(int))elf_resolvefunction("mp_tls_alloc");
+        pcp = (TLS pagealloc_pcp_t *)mp_tls_get(mp_tls_alloc(sizeof(pagealloc_pcp_t)));
+    }
+    pcp->cnt0 = 0;
+    pcp->cnt9 = 0;
+}
+
+//Called on each AP once its TLS is set up
+int pagealloc_mp_init() {
+    pagealloc_pcp_setup();
+    return 0;
+}
+
+//Called on the BSP after the APs have come up, until then an AP may allocate before its TLS exists
+int pagealloc_cache_init() {
+    pagealloc_pcp_setup();
+    pcp_enabled = true;
+    return 0;
+}
+
+//Colors are the pages one way of the largest L2/L3 spans, 1 if the cache info is missing
+static uint64_t pagealloc_readcolors(void) {
+    uint64_t colors = 1;
+    for (uint64_t i = 0;; i++) {
+        char idx_str[10];
+        char key_str[256] = "HW/CACHE/";
+        strncat(key_str, itoa(i, idx_str, 16), 255);
+
+        uint64_t level = 0, line_sz = 0, set_cnt = 0, partitions = 0;
+        if (registry_readkey_uint(key_str, "LEVEL", &level) != registry_err_ok)
+            break;
+        if (level < 2)
+            continue;
+        if (registry_readkey_uint(key_str, "LINE_SZ", &line_sz) != registry_err_ok)
+            break;
+        if (registry_readkey_uint(key_str, "SET_CNT", &set_cnt) != registry_err_ok)
+            break;
+        if (registry_readkey_uint(key_str, "PARITITIONS", &partitions) != registry_err_ok)
+            break;
+
+        uint64_t way_pages = (line_sz * partitions * set_cnt) / BTM_LEVEL;
+        if (way_pages > colors)
+            colors = way_pages;
+    }
+
+    if (colors > PAGEALLOC_MAX_COLORS)
+        colors = PAGEALLOC_MAX_COLORS;
+    return 1ull << floor_log2(colors);
+}
+
+static void pagealloc_publishzone(int idx, pagealloc_zone_t *z) {
+    char idx_str[10];
+    char key_str[256] = "HW/PHYS_MEM/ZONES/";
+    strncat(key_str, itoa(idx, idx_str, 16), 255);
+
+    //Keys can't be overwritten, drop the previous values first
+    if (idx >= published_zone_cnt)
+        registry_createdirectory("HW/PHYS_MEM/ZONES", idx_str);
+    else {
+        registry_removekey(key_str, "DOMAIN");
+        registry_removekey(key_str, "DMA32");
+        registry_removekey(key_str, "ADDR");
+        registry_removekey(key_str, "LEN");
+        registry_removekey(key_str, "FREE_PAGES");
+        registry_removekey(key_str, "ALLOC_CNT");
+        registry_removekey(key_str, "FAIL_CNT");
+    }
+
+    registry_addkey_uint(key_str, "DOMAIN", z->domain);
+    registry_addkey_bool(key_str, "DMA32", z->dma32);
+    registry_addkey_uint(key_str, "ADDR", z->start_pfn * BTM_LEVEL);
+    registry_addkey_uint(key_str, "LEN", (z->end_pfn - z->start_pfn) * BTM_LEVEL);
+    registry_addkey_uint(key_str, "FREE_PAGES", z->free_pages);
+    registry_addkey_uint(key_str, "ALLOC_CNT", z->alloc_cnt);
+    registry_addkey_uint(key_str, "FAIL_CNT", z->fail_cnt);
+}
+
+//Write the per zone counters to HW/PHYS_MEM/ZONES
+int pagealloc_publishstats() {
+    pagealloc_zone_t snap[PAGEALLOC_MAX_ZONES];
+    int cli_state = cli();
+    local_spinlock_lock(&pagealloc_lock);
+    int cnt = zone_cnt;
+    int pool_cnt = zero_pool_cnt;
+    memcpy(snap, zones, sizeof(snap));
+    local_spinlock_unlock(&pagealloc_lock);
+    sti(cli_state);
+
+    if (published_zone_cnt == 0)
+        registry_createdirectory("HW/PHYS_MEM", "ZONES");
+    else {
+        registry_removekey("HW/PHYS_MEM", "ZONE_COUNT");
+        registry_removekey("HW/PHYS_MEM", "COLORS");
+        registry_removekey("HW/PHYS_MEM", "ZERO_POOL");
+    }
+
+    for (int i = 0; i < cnt; i++)
+        pagealloc_publishzone(i, &snap[i]);
+
+    for (int i = cnt; i < published_zone_cnt; i++) {
+        char idx_str[10];
+        char key_str[256] = "HW/PHYS_MEM/ZONES/";
+        strncat(key_str, itoa(i, idx_str, 16), 255);
+        registry_removekey(key_str, "DOMAIN");
+        registry_removekey(key_str, "DMA32");
+        registry_removekey(key_str, "ADDR");
+        registry_removekey(key_str, "LEN");
+        registry_removekey(key_str, "FREE_PAGES");
+        registry_removekey(key_str, "ALLOC_CNT");
+        registry_removekey(key_str, "FAIL_CNT");
+        registry_removedirectory("HW/PHYS_MEM/ZONES", idx_str);
+    }
+    published_zone_cnt = cnt;
+
+    registry_addkey_uint("HW/PHYS_MEM", "ZONE_COUNT", cnt);
+    registry_addkey_uint("HW/PHYS_MEM", "COLORS", color_cnt);
+    registry_addkey_uint("HW/PHYS_MEM", "ZERO_POOL", pool_cnt);
+    return 0;
+}
+
+static int zone_push(pagealloc_zone_t *z, int cnt, uint64_t start, uint64_t end, int domain) {
+    if (start >= end)
+        return cnt;
+
+    bool dma32 = start < DMA32_PFN;
+    if (cnt > 0 && z[cnt - 1].end_pfn == start && z[cnt - 1].domain == domain && z[cnt - 1].dma32 == dma32) {
+        z[cnt - 1].end_pfn = end;
+        return cnt;
+    }
+    if (cnt == PAGEALLOC_MAX_ZONES) {
+        z[cnt - 1].end_pfn = end;
+        return cnt;
+    }
+
+    z[cnt].start_pfn = start;
+    z[cnt].end_pfn = end;
+    z[cnt].domain = domain;
+    z[cnt].dma32 = dma32;
+    z[cnt].free_pages = 0;
+    z[cnt].alloc_cnt = 0;
+    z[cnt].fail_cnt = 0;
+    return cnt + 1;
+}
+
+//Domain of a page according to the SRAT ranges, pages not covered by any belong to domain 0
+static int numa_domain(uint64_t pfn, uint64_t *range_start, uint64_t *range_end, int *range_domain, int range_cnt) {
+    for (int i = 0; i < range_cnt; i++)
+        if (pfn >= range_start[i] && pfn < range_end[i])
+            return range_domain[i];
+    return 0;
+}
+
+//Re-zone memory by NUMA domain once acpi_init has parsed the SRAT
+int pagealloc_numa_init() {
+    //vmem_init has set up the full physical map by now
+    normal_first = true;
+
+    uint64_t mem_cnt = 0;
+    if (registry_readkey_uint("HW/NUMA", "MEM_COUNT", &mem_cnt) != registry_err_ok || mem_cnt == 0)
+        return 0;
+    if (mem_cnt > PAGEALLOC_MAX_ZONES * 2)
+        mem_cnt = PAGEALLOC_MAX_ZONES * 2;
+
+    uint64_t range_start[PAGEALLOC_MAX_ZONES * 2];
+    uint64_t range_end[PAGEALLOC_MAX_ZONES * 2];
+    int range_domain[PAGEALLOC_MAX_ZONES * 2];
+
+    //Boundaries are every range edge plus 4GiB, sorted
+    uint64_t cuts[PAGEALLOC_MAX_ZONES * 4 + 2];
+    int cut_cnt = 0;
+    cuts[cut_cnt++] = 0;
+    cuts[cut_cnt++] = DMA32_PFN < total_pages ? DMA32_PFN : total_pages;
+
+    int range_cnt = 0;
+    for (uint64_t i = 0; i < mem_cnt; i++) {
+        char idx_str[10];
+        char key_str[256] = "HW/NUMA/";
+        strncat(key_str, itoa(i, idx_str, 16), 255);
+
+        uint64_t addr = 0, len = 0, domain = 0;
+        if (registry_readkey_uint(key_str, "ADDR", &addr) != registry_err_ok)
+            PANIC("Failed to read registry.");
+        if (registry_readkey_uint(key_str, "LEN", &len) != registry_err_ok)
+            PANIC("Failed to read registry.");
+        if (registry_readkey_uint(key_str, "DOMAIN", &domain) != registry_err_ok)
+            PANIC("Failed to read registry.");
+
+        uint64_t start = addr / BTM_LEVEL;
+        uint64_t end = (addr + len) / BTM_LEVEL;
+        if (start >= total_pages)
+            continue;
+        if (end > total_pages)
+            end = total_pages;
+
+        range_start[range_cnt] = start;
+        range_end[range_cnt] = end;
+        range_domain[range_cnt] = (int)domain;
+        range_cnt++;
+        cuts[cut_cnt++] = start;
+        cuts[cut_cnt++] = end;
+    }
+
+    for (int i = 1; i < cut_cnt; i++)
+        for (int j = i; j > 0 && cuts[j - 1] > cuts[j]; j--) {
+            uint64_t t = cuts[j];
+            cuts[j] = cuts[j - 1];
+            cuts[j - 1] = t;
+        }
+
+    pagealloc_zone_t new_zones[PAGEALLOC_MAX_ZONES];
+    int new_cnt = 0;
+    uint64_t prev = 0;
+    for (int i = 0; i <= cut_cnt; i++) {
+        uint64_t next = (i == cut_cnt) ? total_pages : cuts[i];
+        if (next > prev) {
+            int domain = numa_domain(prev, range_start, range_end, range_domain, range_cnt);
+            new_cnt = zone_push(new_zones, new_cnt, prev, next, domain);
+            prev = next;
         }
-        compact_queue();
     }
 
-    return -1;
+    int cli_state = cli();
+    local_spinlock_lock(&pagealloc_lock);
+
+    //Free blocks that straddle a new boundary get split, the blocks at each zone edge are all that can be affected
+    memcpy(zones, new_zones, sizeof(new_zones));
+    zone_cnt = new_cnt;
+    for (int k = BUDDY_MAX_ORDER; k > 0; k--)
+        for (int i = 1; i < zone_cnt; i++) {
+            uint64_t idx = zones[i].start_pfn >> k;
+            if ((idx << k) == zones[i].start_pfn || !buddy_isfree(k, idx))
+                continue;
+
+            buddy_setused(k, idx);
+            free_mem -= (BTM_LEVEL << k);
+            buddy_freerange(idx << k, 1ull << k);
+        }
+
+    //freerange above counted against the new zones before they were all consistent, recount from the bitmaps
+    for (int i = 0; i < zone_cnt; i++)
+        zones[i].free_pages = 0;
+    for (int k = 0; k <= BUDDY_MAX_ORDER; k++) {
+        buddy_order_t *o = &orders[k];
+        for (uint64_t w = 0; w < o->words; w++) {
+            uint64_t bits = o->map[w];
+            while (bits != 0) {
+                uint64_t pfn = (w * 64 + __builtin_ctzll(bits)) << k;
+                zone_of(pfn)->free_pages += (1ull << k);
+                bits &= bits - 1;
+            }
+        }
+    }
+
+    local_spinlock_unlock(&pagealloc_lock);
+    sti(cli_state);
+
+    return pagealloc_publishstats();
 }
 
 int pagealloc_init() {
-    //TODO: use registry to allocate memory for the queue, ensuring enough is available
-    // initialize allocator as normal
     mem_size = 0;
     if (registry_readkey_uint("HW/BOOTINFO", "MEMSIZE", &mem_size) !=
             registry_err_ok)
         PANIC("Failed to read registry.");
 
-    // Compute the number of bits
-    int32_t btm_sz = roundUp_po2(mem_size, BTM_LEVEL) / BTM_LEVEL;
-    //TODO: queue size becomes large with memory size increase, figure out how to keep it manageable
     //TODO: also fix memsize calculation so it reflects usable memory size, rather than address space size
+    total_pages = roundUp_po2(mem_size, BTM_LEVEL) / BTM_LEVEL;
+
+    // Allocate the bitmaps, all blocks start out used
+    for (int i = 0; i < BUDDY_ORDER_CNT; i++) {
+        buddy_order_t *o = &orders[i];
+        o->blocks = total_pages >> i;
+        o->words = (o->blocks + 63) / 64;
+        if (o->words == 0)
+            o->words = 1;
+        o->map = malloc(o->words * sizeof(uint64_t));
+        o->summary = malloc(((o->words + 63) / 64) * sizeof(uint64_t));
+        if (o->map == NULL || o->summary == NULL)
+            PANIC("Bitmap allocation failure!");
+
+        memset(o->map, 0, o->words * sizeof(uint64_t));
+        memset(o->summary, 0, ((o->words + 63) / 64) * sizeof(uint64_t));
+        o->hint = 0;
+        o->free_cnt = 0;
+    }
+    free_mem = 0;
 
-    // Allocate the blocks
-    if (queue_init(&btm_level,
-                   btm_sz / 2 + 1) !=
-            0) // Worst case requires half the number of entries as are pages
-        PANIC("Queue init failure!");
+    //Until the SRAT is parsed everything is one domain, split at 4GiB
+    zone_cnt = zone_push(zones, 0, 0, DMA32_PFN < total_pages ? DMA32_PFN : total_pages, 0);
+    zone_cnt = zone_push(zones, zone_cnt, DMA32_PFN, total_pages, 0);
 
     // parse each memory map entry and free the regions
     {
@@ -271,6 +860,12 @@ int pagealloc_init() {
 
             addr = roundUp_po2(addr, BTM_LEVEL);
 
+            //Only memory below MEMSIZE is tracked
+            if (addr >= total_pages * BTM_LEVEL)
+                continue;
+            if (addr + len > total_pages * BTM_LEVEL)
+                len = total_pages * BTM_LEVEL - addr;
+
 #ifdef PHYSMEM_DEBUG_VERBOSE_MID
             {
                 char tmp_buf[20];
@@ -296,5 +891,6 @@ int pagealloc_init() {
     pagetable_multiple = 1;
     // TODO: Load these with actual data
 
-    return 0;
+    color_cnt = pagealloc_readcolors();
+    return pagealloc_publishstats();
 }
@@ -0,0 +1,148 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "SysPhysicalMemory/phys_mem.h"
+#include "page_allocator.h"
+#include "elf.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <types.h>
+
+// Allocator stress run, pagealloc_stress.
+// Replays a pseudo random trace of allocations and frees with a size mix resembling
+// the kernel's (mostly single pages, some small runs, 2MiB pages and the odd large
+// buffer) against a fixed number of live slots. Reports allocation latency
+// percentiles and how much of the free memory is still available as 2MiB or larger
+// blocks, both while the trace is at its peak and once everything is returned.
+
+#define STRESS_SLOTS (512)
+#define STRESS_OPS (20000)
+#define STRESS_SEED (0x2545F491)
+#define STRESS_FRAG_ORDER (9)
+
+typedef struct {
+    uintptr_t addr;
+    uint64_t size;
+} stress_slot_t;
+
+static uint32_t stress_rand(uint32_t *state) {
+    *state = *state * 1664525 + 1013904223;
+    return *state >> 8;
+}
+
+static uint64_t stress_size(uint32_t *state) {
+    uint32_t kind = stress_rand(state) % 10;
+    if (kind < 6)
+        return KiB(4);
+    if (kind < 8)
+        return KiB(4) * (2 + stress_rand(state) % 15);
+    if (kind < 9)
+        return MiB(2);
+    return KiB(4) * (1 + stress_rand(state) % 256);
+}
+
+static void stress_sort(uint32_t *vals, int cnt) {
+    for (int gap = cnt / 2; gap > 0; gap /= 2)
+        for (int i = gap; i < cnt; i++) {
+            uint32_t v = vals[i];
+            int j = i;
+            for (; j >= gap && vals[j - gap] > v; j -= gap)
+                vals[j] = vals[j - gap];
+            vals[j] = v;
+        }
+}
+
+static void stress_report_frag(const char *when) {
+    char tmp[20];
+    uint64_t free_bytes = 0;
+    uint64_t blocks[BUDDY_ORDER_CNT];
+    pagealloc_getfree(&free_bytes, blocks);
+
+    uint64_t large_pages = 0;
+    int largest = -1;
+    for (int i = 0; i < BUDDY_ORDER_CNT; i++) {
+        if (blocks[i] != 0)
+            largest = i;
+        if (i >= STRESS_FRAG_ORDER)
+            large_pages += blocks[i] << i;
+    }
+
+    uint64_t free_pages = free_bytes / KiB(4);
+    DEBUG_PRINT("[SysPhysicalMemory] ");
+    DEBUG_PRINT(when);
+    DEBUG_PRINT(": free KiB=");
+    DEBUG_PRINT(ltoa(free_bytes / KiB(1), tmp, 10));
+    DEBUG_PRINT(" largest order=");
+    DEBUG_PRINT(itoa(largest, tmp, 10));
+    DEBUG_PRINT(" free in >=2MiB blocks=");
+    DEBUG_PRINT(ltoa(free_pages == 0 ? 0 : (large_pages * 100) / free_pages, tmp, 10));
+    DEBUG_PRINT("%\r\n");
+}
+
+int pagealloc_stress() {
+    uint64_t (*timer_timestamp_ns)(void) = (uint64_t (*)(void))elf_resolvefunction("timer_timestamp_ns");
+    char tmp[20];
+
+    stress_slot_t *slots = malloc(STRESS_SLOTS * sizeof(stress_slot_t));
+    uint32_t *lat = malloc(STRESS_OPS * sizeof(uint32_t));
+    if (slots == NULL || lat == NULL)
+        PANIC("[SysPhysicalMemory] Stress buffer allocation failed.");
+
+    for (int i = 0; i < STRESS_SLOTS; i++)
+        slots[i].addr = (uintptr_t)-1;
+
+    uint32_t state = STRESS_SEED;
+    int lat_cnt = 0;
+    int failures = 0;
+    for (int op = 0; op < STRESS_OPS; op++) {
+        stress_slot_t *slot = &slots[stress_rand(&state) % STRESS_SLOTS];
+        if (slot->addr != (uintptr_t)-1) {
+            pagealloc_free(slot->addr, slot->size);
+            slot->addr = (uintptr_t)-1;
+            continue;
+        }
+
+        slot->size = stress_size(&state);
+        uint64_t t0 = timer_timestamp_ns();
+        slot->addr = pagealloc_alloc(-1, -1, physmem_alloc_flags_data, slot->size);
+        uint64_t t1 = timer_timestamp_ns();
+
+        if (slot->addr == (uintptr_t)-1)
+            failures++;
+        else
+            lat[lat_cnt++] = (uint32_t)(t1 - t0);
+    }
+
+    stress_report_frag("Peak");
+
+    for (int i = 0; i < STRESS_SLOTS; i++)
+        if (slots[i].addr != (uintptr_t)-1)
+            pagealloc_free(slots[i].addr, slots[i].size);
+
+    stress_report_frag("Drained");
+
+    stress_sort(lat, lat_cnt);
+    DEBUG_PRINT("[SysPhysicalMemory] Allocations=");
+    DEBUG_PRINT(itoa(lat_cnt, tmp, 10));
+    DEBUG_PRINT(" failed=");
+    DEBUG_PRINT(itoa(failures, tmp, 10));
+    if (lat_cnt > 0) {
+        DEBUG_PRINT(" p50=");
+        DEBUG_PRINT(ltoa(lat[lat_cnt / 2], tmp, 10));
+        DEBUG_PRINT("ns p99=");
+        DEBUG_PRINT(ltoa(lat[(lat_cnt * 99) / 100], tmp, 10));
+        DEBUG_PRINT("ns max=");
+        DEBUG_PRINT(ltoa(lat[lat_cnt - 1], tmp, 10));
+        DEBUG_PRINT("ns");
+    }
+    DEBUG_PRINT("\r\n");
+
+    free(lat);
+    free(slots);
+    return 0;
+}
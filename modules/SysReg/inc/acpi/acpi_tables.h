@@ -17,6 +17,7 @@
 #define FADT_SIG "FACP" //!< FADT
 #define HPET_SIG "HPET" //!< HPET Table
 #define MCFG_SIG "MCFG" //!< MCFG Table
+#define SRAT_SIG "SRAT" //!< SRAT Table
 
 //! RSDT pointer Table
 typedef struct {
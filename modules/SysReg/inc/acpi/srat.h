@@ -0,0 +1,73 @@
+// Copyright (c) 2018 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+#ifndef SRAT_ACPI_TABLE_H
+#define SRAT_ACPI_TABLE_H
+
+#include "acpi_tables.h"
+#include <stdint.h>
+#include <types.h>
+
+/**
+ * \addtogroup acpi_tables ACPI Tables
+ * @{
+*/
+
+//! The SRAT
+typedef struct PACKED {
+    ACPISDTHeader h;
+    uint32_t reserved0;
+    uint64_t reserved1;
+    uint8_t entries[1];
+} SRAT;
+
+//! Header for an entry in the SRAT
+typedef struct {
+    uint8_t type;
+    uint8_t entry_size;
+} SRAT_EntryHeader;
+
+//! A Local APIC affinity entry in the SRAT
+typedef struct PACKED {
+    SRAT_EntryHeader h;
+    uint8_t domain_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_hi[3];
+    uint32_t clock_domain;
+} SRAT_EntryLAPIC;
+#define SRAT_LAPIC_ENTRY_TYPE 0 //!< The type ID describing a Local APIC affinity entry
+
+//! A memory affinity entry in the SRAT
+typedef struct PACKED {
+    SRAT_EntryHeader h;
+    uint32_t domain;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+} SRAT_EntryMemory;
+#define SRAT_MEMORY_ENTRY_TYPE 1 //!< The type ID describing a memory affinity entry
+
+//! An x2APIC affinity entry in the SRAT
+typedef struct PACKED {
+    SRAT_EntryHeader h;
+    uint16_t reserved0;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved1;
+} SRAT_EntryX2APIC;
+#define SRAT_X2APIC_ENTRY_TYPE 2 //!< The type ID describing an x2APIC affinity entry
+
+#define SRAT_FLAGS_ENABLED (1 << 0) //!< The entry is in use
+#define SRAT_FLAGS_HOTPLUG (1 << 1) //!< The memory range may be hot plugged
+
+/**@}*/
+
+#endif /* end of include guard: SRAT_ACPI_TABLE_H */
@@ -10,6 +10,7 @@
 #include "acpi/fadt.h"
 #include "acpi/hpet.h"
 #include "acpi/mcfg.h"
+#include "acpi/srat.h"
 
 #include "registry.h"
 #include "SysVirtualMemory/vmem.h"
@@ -179,6 +180,54 @@ static int save_isaovr(uint32_t ioapic_cnt, MADT_EntryISAOVR *isaovr)
     return 0;
 }
 
+static int save_numa_mem(uint32_t idx, SRAT_EntryMemory *mem)
+{
+    char idx_str[10] = "";
+    char key_str[256] = "HW/NUMA/";
+    char *key_idx = strncat(key_str, itoa(idx, idx_str, 16), 255);
+
+    if (registry_createdirectory("HW/NUMA", idx_str) != registry_err_ok)
+        return -29;
+
+    if (registry_addkey_uint(key_idx, "DOMAIN", mem->domain) != registry_err_ok)
+        return -30;
+
+    if (registry_addkey_uint(key_idx, "ADDR", mem->base) != registry_err_ok)
+        return -31;
+
+    if (registry_addkey_uint(key_idx, "LEN", mem->length) != registry_err_ok)
+        return -32;
+
+    if (registry_addkey_bool(key_idx, "HOTPLUG", (mem->flags & SRAT_FLAGS_HOTPLUG) != 0) != registry_err_ok)
+        return -33;
+
+    return 0;
+}
+
+static int save_lapic_domain(uint32_t lapic_cnt, uint32_t apic_id, uint32_t domain)
+{
+    //Attach the domain to the matching MADT entry
+    for (uint32_t i = 0; i < lapic_cnt; i++)
+    {
+        char idx_str[10] = "";
+        char key_str[256] = "HW/LAPIC/";
+        char *key_idx = strncat(key_str, itoa(i, idx_str, 16), 255);
+
+        uint64_t cur_apic_id = 0;
+        if (registry_readkey_uint(key_idx, "APIC ID", &cur_apic_id) != registry_err_ok)
+            return -34;
+
+        if (cur_apic_id == apic_id)
+        {
+            if (registry_addkey_uint(key_idx, "DOMAIN", domain) != registry_err_ok)
+                return -35;
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
 int WEAK print_uint64(uint64_t v, uint8_t base);
 int preinit_acpi()
 {
@@ -291,6 +340,87 @@ int acpi_init()
         }
     }
 
+    {
+        SRAT *srat = ACPITables_FindTable(SRAT_SIG);
+
+        if (srat != NULL)
+        {
+            if (registry_createdirectory("HW", "NUMA") != registry_err_ok)
+                return -17;
+
+            uint64_t lapic_cnt = 0;
+            if (registry_readkey_uint("HW/LAPIC", "COUNT", &lapic_cnt) != registry_err_ok)
+                return -18;
+
+            uint32_t len = srat->h.Length - 12 - sizeof(ACPISDTHeader);
+            uint32_t mem_cnt = 0;
+            uint32_t domain_cnt = 0;
+
+            for (uint32_t i = 0; i < len;)
+            {
+                SRAT_EntryHeader *hdr = (SRAT_EntryHeader *)&srat->entries[i];
+                uint32_t domain = 0;
+                bool enabled = false;
+
+                switch (hdr->type)
+                {
+                case SRAT_LAPIC_ENTRY_TYPE:
+                {
+                    SRAT_EntryLAPIC *lapic = (SRAT_EntryLAPIC *)hdr;
+                    domain = lapic->domain_lo | (lapic->domain_hi[0] << 8) | (lapic->domain_hi[1] << 16) | (lapic->domain_hi[2] << 24);
+                    enabled = lapic->flags & SRAT_FLAGS_ENABLED;
+                    if (enabled)
+                    {
+                        int err = save_lapic_domain(lapic_cnt, lapic->apic_id, domain);
+                        if (err != 0)
+                            return err;
+                    }
+                }
+                break;
+                case SRAT_X2APIC_ENTRY_TYPE:
+                {
+                    SRAT_EntryX2APIC *x2apic = (SRAT_EntryX2APIC *)hdr;
+                    domain = x2apic->domain;
+                    enabled = x2apic->flags & SRAT_FLAGS_ENABLED;
+                    if (enabled)
+                    {
+                        int err = save_lapic_domain(lapic_cnt, x2apic->x2apic_id, domain);
+                        if (err != 0)
+                            return err;
+                    }
+                }
+                break;
+                case SRAT_MEMORY_ENTRY_TYPE:
+                {
+                    SRAT_EntryMemory *mem = (SRAT_EntryMemory *)hdr;
+                    domain = mem->domain;
+                    enabled = mem->flags & SRAT_FLAGS_ENABLED;
+                    if (enabled)
+                    {
+                        int err = save_numa_mem(mem_cnt++, mem);
+                        if (err != 0)
+                            return err;
+                    }
+                }
+                break;
+                }
+
+                if (enabled && domain + 1 > domain_cnt)
+                    domain_cnt = domain + 1;
+
+                i += hdr->entry_size;
+                if (hdr->entry_size == 0)
+                    break;
+            }
+
+            if (registry_addkey_uint("HW/NUMA", "MEM_COUNT", mem_cnt) != registry_err_ok)
+                return -19;
+
+            if (registry_addkey_uint("HW/NUMA", "DOMAIN_COUNT", domain_cnt) != registry_err_ok)
+                return -20;
+        }
+    }
+
     {
         HPET *hpet = ACPITables_FindTable(HPET_SIG);
 
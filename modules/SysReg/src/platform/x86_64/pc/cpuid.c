@@ -327,6 +327,12 @@ int add_cpuid()
             if (registry_addkey_uint(dir_str, "SET_CNT", set_cnt) != registry_err_ok)
                 return -1;
 
+            if (registry_addkey_uint(dir_str, "LEVEL", cache_level) != registry_err_ok)
+                return -1;
+
+            if (registry_addkey_uint(dir_str, "TYPE", cache_type) != registry_err_ok)
+                return -1;
+
             cache_idx++;
         } while (true);
     }
@@ -351,6 +357,30 @@ int add_cpuid()
         if (registry_addkey_bool("HW/PROC", "SMAP", smap) !=
             registry_err_ok)
             return -1;
+
+        //INVPCID
+        bool invpcid = (ebx >> 10) & 1;
+        if (registry_addkey_bool("HW/PROC", "INVPCID", invpcid) !=
+            registry_err_ok)
+            return -1;
+    }
+
+    {
+        CPUID_RequestInfo(0x1, 0, &eax, &ebx, &ecx, &edx);
+        bool sse2 = (edx >> 26) & 1;
+        bool avx = ((ecx >> 28) & 1) && ((ecx >> 26) & 1);
+
+        CPUID_RequestInfo(7, 0, &eax, &ebx, &ecx, &edx);
+        bool avx2 = avx && ((ebx >> 5) & 1);
+
+        //SIMD paths, AVX state is only usable because SysFP enables it through XSAVE
+        if (registry_addkey_bool("HW/PROC", "SSE2", sse2) !=
+            registry_err_ok)
+            return -1;
+
+        if (registry_addkey_bool("HW/PROC", "AVX2", avx2) !=
+            registry_err_ok)
+            return -1;
     }
 
     {
@@ -380,6 +410,12 @@ int add_cpuid()
             registry_err_ok)
             return -1;
 
+        //PCID
+        bool pcid = (ecx >> 17) & 1;
+        if (registry_addkey_bool("HW/PROC", "PCID", pcid) !=
+            registry_err_ok)
+            return -1;
+
         //xsave
         bool xsave = (ecx >> 26) & 1;
         if (registry_addkey_bool("HW/PROC", "XSAVE", xsave) !=
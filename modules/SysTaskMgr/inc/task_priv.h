@@ -18,7 +18,19 @@
 #define TASK_NAME_LEN 256
 #define MAX_DESCRIPTOR_COUNT 256
 #define KERNEL_STACK_LEN KiB(32)
-#define USER_STACK_LEN KiB(32)
+#define USER_STACK_BASE (0x100000000)
+#define USER_STACK_LEN MiB(1)                   //Reserved, pages are only backed once touched
+#define USER_STACK_GUARD_LEN KiB(4)
+
+#define SCHED_PRIORITY_COUNT 32
+#define SCHED_PRIORITY_DEFAULT 16
+#define SCHED_MAX_CORES 64
+#define SCHED_STEAL_SCAN 8                  //Max tasks inspected per priority level when stealing
+#define SCHED_AFFINITY_ALL (~0ull)
+#define SCHED_CORE_BIT(idx) (1ull << (idx))
+#define SCHED_SLICE_NS (50 * 1000)              //Preemption time slice
+#define SCHED_SLEEP_HEAP_INIT 64
+#define SCHED_WAKE_HIST_BUCKETS 16              //Bucket n counts wakeup latencies below 2^(n + 10) ns, the last bucket is unbounded
 
 typedef enum
 {
@@ -89,13 +101,7 @@ typedef struct process_desc
     task_state_t state;
     task_permissions_t permissions;
     
-    union{
-        uint32_t monitor_value;
-    };
-    union{
-        volatile uint32_t *monitor_tgt;
-        uint64_t sleep_end;
-    };
+    uint64_t sleep_end;
 
     descriptor_entry_t descriptors[MAX_DESCRIPTOR_COUNT];
 
@@ -104,18 +110,100 @@ typedef struct process_desc
     uint8_t *reg_state;
     uint8_t *kernel_stack;
     uint8_t *user_stack;
-    intptr_t user_stack_phys;
     uint8_t *syscall_data;
 
     struct cardinal_program_setup_params *usersetup_params;
 
+    int priority;
+    uint64_t affinity;                      //Bit n set if the task may run on the core with run queue index n
+    bool rq_queued;
+    bool rq_migrating;
+    int sleep_idx;                          //Index in the owning run queue's sleep heap
+
+    task_waitqueue_t *wait_queue;           //Wait queue the task is blocked on, protected by wait_lock
+    int *wait_lock;
+    uintptr_t wait_key;
+    struct process_desc *wait_next;
+    struct process_desc *wait_prev;
+    struct run_queue *rq;
+    struct process_desc *rq_next;
+    struct process_desc *rq_prev;
+
     struct process_desc *next;
 } process_desc_t;
 
+typedef struct
+{
+    process_desc_t *head;
+    process_desc_t *tail;
+} task_fifo_t;
+
+typedef struct run_queue
+{
+    int lock;
+    int core_idx;
+    int apic_id;
+
+    uint32_t ready_bitmap;                      //Bit n set if ready[n] is non-empty, lower n is higher priority
+    uint32_t ready_count;
+    task_fifo_t ready[SCHED_PRIORITY_COUNT];
+    process_desc_t **sleep_heap;                //Min-heap on sleep_end
+    int sleep_cnt;
+    int sleep_cap;
+
+    process_desc_t *idle_task;
+    process_desc_t *prev_task;                  //Last task switched out, its stack is in use until the switch completes
+    process_desc_t *migrating;                  //Tasks to requeue on another core at the next switch
+    bool running;
+
+    int steal_order[SCHED_MAX_CORES];           //Other cores ordered by topological distance, closest first
+    int steal_order_len;
+
+    uint64_t switch_count;
+    uint64_t stolen_count;
+    uint64_t wake_hist[SCHED_WAKE_HIST_BUCKETS];
+} run_queue_t;
+
 typedef struct
 {
     uint8_t *interrupt_stack;
     process_desc_t *cur_task;
+    run_queue_t *rq;
 } core_desc_t;
 
+//Per-core run queue management, sched_insert/sched_remove/sched_next expect rq->lock to be held
+void sched_rq_init(run_queue_t *rq, int apic_id, process_desc_t *idle_task);
+
+void sched_enqueue(run_queue_t *rq, process_desc_t *task);
+
+run_queue_t *sched_place(process_desc_t *task, run_queue_t *local);
+
+void sched_migrate(run_queue_t *rq);
+
+void sched_setaffinity(process_desc_t *task, uint64_t affinity);
+
+void sched_setstate(process_desc_t *task, task_state_t state);
+
+void sched_setpriority(process_desc_t *task, int priority);
+
+void sched_insert(run_queue_t *rq, process_desc_t *task);
+
+void sched_remove(run_queue_t *rq, process_desc_t *task);
+
+process_desc_t *sched_next(run_queue_t *rq, process_desc_t *cur_task);
+
+uint64_t sched_nextevent(run_queue_t *rq);
+
+//True while a core may still be switching away from the task, i.e. it is some core's previous task
+bool sched_inuse(process_desc_t *task);
+
+process_desc_t *task_current_desc(void);
+
+//Wait queue management, expects the lock protecting wq to be held
+void waitqueue_block(task_waitqueue_t *wq, int *lock, process_desc_t *task, uintptr_t key);
+
+int waitqueue_wake(task_waitqueue_t *wq, uintptr_t key, int n);
+
+void waitqueue_cancel(process_desc_t *task);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,556 @@
+/**
+ * Copyright (c) 2021 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <cardinal/local_spinlock.h>
+
+#include "SysTimer/timer.h"
+
+#include "task_priv.h"
+
+static run_queue_t *run_queues[SCHED_MAX_CORES];
+static _Atomic int run_queue_cnt = 0;
+static int run_queue_lock = 0;
+
+static void fifo_push(task_fifo_t *fifo, process_desc_t *task)
+{
+    task->rq_next = NULL;
+    task->rq_prev = fifo->tail;
+    if (fifo->tail != NULL)
+        fifo->tail->rq_next = task;
+    else
+        fifo->head = task;
+    fifo->tail = task;
+}
+
+static void fifo_unlink(task_fifo_t *fifo, process_desc_t *task)
+{
+    if (task->rq_prev != NULL)
+        task->rq_prev->rq_next = task->rq_next;
+    else
+        fifo->head = task->rq_next;
+
+    if (task->rq_next != NULL)
+        task->rq_next->rq_prev = task->rq_prev;
+    else
+        fifo->tail = task->rq_prev;
+
+    task->rq_next = NULL;
+    task->rq_prev = NULL;
+}
+
+static void heap_swap(run_queue_t *rq, int a, int b)
+{
+    process_desc_t *tmp = rq->sleep_heap[a];
+    rq->sleep_heap[a] = rq->sleep_heap[b];
+    rq->sleep_heap[b] = tmp;
+    rq->sleep_heap[a]->sleep_idx = a;
+    rq->sleep_heap[b]->sleep_idx = b;
+}
+
+static void heap_up(run_queue_t *rq, int idx)
+{
+    while (idx > 0)
+    {
+        int parent = (idx - 1) / 2;
+        if (rq->sleep_heap[parent]->sleep_end <= rq->sleep_heap[idx]->sleep_end)
+            break;
+        heap_swap(rq, parent, idx);
+        idx = parent;
+    }
+}
+
+static void heap_down(run_queue_t *rq, int idx)
+{
+    while (true)
+    {
+        int min = idx;
+        int l = idx * 2 + 1;
+        int r = l + 1;
+        if (l < rq->sleep_cnt && rq->sleep_heap[l]->sleep_end < rq->sleep_heap[min]->sleep_end)
+            min = l;
+        if (r < rq->sleep_cnt && rq->sleep_heap[r]->sleep_end < rq->sleep_heap[min]->sleep_end)
+            min = r;
+        if (min == idx)
+            break;
+        heap_swap(rq, min, idx);
+        idx = min;
+    }
+}
+
+static void heap_push(run_queue_t *rq, process_desc_t *task)
+{
+    if (rq->sleep_cnt == rq->sleep_cap)
+    {
+        int n_cap = (rq->sleep_cap == 0) ? SCHED_SLEEP_HEAP_INIT : rq->sleep_cap * 2;
+        process_desc_t **n_heap = malloc(n_cap * sizeof(process_desc_t *));
+        if (n_heap == NULL)
+            PANIC("[SysTaskMgr] Unexpected memory allocation failure.");
+
+        if (rq->sleep_heap != NULL)
+        {
+            memcpy(n_heap, rq->sleep_heap, rq->sleep_cnt * sizeof(process_desc_t *));
+            free(rq->sleep_heap);
+        }
+        rq->sleep_heap = n_heap;
+        rq->sleep_cap = n_cap;
+    }
+
+    int idx = rq->sleep_cnt++;
+    rq->sleep_heap[idx] = task;
+    task->sleep_idx = idx;
+    heap_up(rq, idx);
+}
+
+static void heap_remove(run_queue_t *rq, process_desc_t *task)
+{
+    int idx = task->sleep_idx;
+    int last = --rq->sleep_cnt;
+    if (idx != last)
+    {
+        heap_swap(rq, idx, last);
+        heap_up(rq, idx);
+        heap_down(rq, idx);
+    }
+    task->sleep_idx = -1;
+}
+
+//Topological distance between two cores. SMT siblings only differ in the low APIC ID bits and cores
+//sharing a package (and its LLC) share the upper bits, so a smaller xor means more shared cache.
+static uint32_t sched_distance(run_queue_t *a, run_queue_t *b)
+{
+    return (uint32_t)(a->apic_id ^ b->apic_id);
+}
+
+static void sched_order_insert(run_queue_t *rq, int idx)
+{
+    uint32_t dist = sched_distance(rq, run_queues[idx]);
+    int pos = rq->steal_order_len;
+    while (pos > 0 && sched_distance(rq, run_queues[rq->steal_order[pos - 1]]) > dist)
+    {
+        rq->steal_order[pos] = rq->steal_order[pos - 1];
+        pos--;
+    }
+    rq->steal_order[pos] = idx;
+    __atomic_store_n(&rq->steal_order_len, rq->steal_order_len + 1, __ATOMIC_RELEASE);
+}
+
+void sched_rq_init(run_queue_t *rq, int apic_id, process_desc_t *idle_task)
+{
+    memset(rq, 0, sizeof(run_queue_t));
+    rq->lock = 0;
+    rq->apic_id = apic_id;
+    rq->idle_task = idle_task;
+
+    //Register the queue and slot it into every core's steal order
+    int cli_state = cli();
+    local_spinlock_lock(&run_queue_lock);
+    int idx = run_queue_cnt;
+    if (idx >= SCHED_MAX_CORES)
+        PANIC("[SysTaskMgr] Too many cores.");
+
+    rq->core_idx = idx;
+    run_queues[idx] = rq;
+    for (int i = 0; i < idx; i++)
+    {
+        sched_order_insert(run_queues[i], idx);
+        sched_order_insert(rq, i);
+    }
+    run_queue_cnt = idx + 1;
+    local_spinlock_unlock(&run_queue_lock);
+    sti(cli_state);
+
+    if (idle_task != NULL)
+    {
+        idle_task->rq = rq;
+        idle_task->affinity = SCHED_CORE_BIT(idx);
+    }
+}
+
+void sched_insert(run_queue_t *rq, process_desc_t *task)
+{
+    task->rq = rq;
+    switch (task->state)
+    {
+    case task_state_pending:
+        fifo_push(&rq->ready[task->priority], task);
+        rq->ready_bitmap |= (1u << task->priority);
+        rq->ready_count++;
+        break;
+    case task_state_sleep:
+        heap_push(rq, task);
+        break;
+    case task_state_blocked:
+        //Tracked by the wait queue it is blocked on, the run queue only keeps ownership
+        break;
+    case task_state_exited:
+        //Detach from the core, task_cleanup is now free to release it
+        task->rq = NULL;
+        return;
+    default:
+        return;
+    }
+    task->rq_queued = true;
+}
+
+void sched_remove(run_queue_t *rq, process_desc_t *task)
+{
+    if (!task->rq_queued)
+        return;
+
+    switch (task->state)
+    {
+    case task_state_pending:
+    {
+        task_fifo_t *fifo = &rq->ready[task->priority];
+        fifo_unlink(fifo, task);
+        if (fifo->head == NULL)
+            rq->ready_bitmap &= ~(1u << task->priority);
+        rq->ready_count--;
+    }
+    break;
+    case task_state_sleep:
+        heap_remove(rq, task);
+        break;
+    case task_state_blocked:
+        break;
+    default:
+        PANIC("[SysTaskMgr] Queued task in unexpected state.");
+        break;
+    }
+    task->rq_queued = false;
+}
+
+void sched_enqueue(run_queue_t *rq, process_desc_t *task)
+{
+    int cli_state = cli();
+    local_spinlock_lock(&rq->lock);
+    sched_insert(rq, task);
+    local_spinlock_unlock(&rq->lock);
+    sti(cli_state);
+}
+
+//Lock the run queue owning a task, retrying if the task is migrated to another core in the meantime
+static run_queue_t *sched_locktask(process_desc_t *task)
+{
+    while (true)
+    {
+        run_queue_t *rq = task->rq;
+        if (rq == NULL)
+            return NULL;
+
+        local_spinlock_lock(&rq->lock);
+        if (task->rq == rq)
+            return rq;
+        local_spinlock_unlock(&rq->lock);
+    }
+}
+
+void sched_setstate(process_desc_t *task, task_state_t state)
+{
+    int cli_state = cli();
+    run_queue_t *rq = sched_locktask(task);
+    if (rq == NULL)
+    {
+        //Not owned by any core yet
+        task->state = state;
+        sti(cli_state);
+        return;
+    }
+
+    if (task->rq_queued)
+    {
+        sched_remove(rq, task);
+        task->state = state;
+        sched_insert(rq, task);
+    }
+    else
+    {
+        //Currently running, the state is applied when it is switched out
+        task->state = state;
+    }
+    local_spinlock_unlock(&rq->lock);
+    sti(cli_state);
+}
+
+void sched_setpriority(process_desc_t *task, int priority)
+{
+    int cli_state = cli();
+    run_queue_t *rq = sched_locktask(task);
+    if (rq == NULL)
+    {
+        task->priority = priority;
+        sti(cli_state);
+        return;
+    }
+
+    if (task->rq_queued)
+    {
+        sched_remove(rq, task);
+        task->priority = priority;
+        sched_insert(rq, task);
+    }
+    else
+        task->priority = priority;
+    local_spinlock_unlock(&rq->lock);
+    sti(cli_state);
+}
+
+static uint32_t sched_load(run_queue_t *rq)
+{
+    return rq->ready_count + (rq->running ? 1 : 0);
+}
+
+run_queue_t *sched_place(process_desc_t *task, run_queue_t *local)
+{
+    //Stay on the local core unless an allowed core is less loaded
+    run_queue_t *best = NULL;
+    if (local != NULL && (task->affinity & SCHED_CORE_BIT(local->core_idx)))
+        best = local;
+
+    int cnt = run_queue_cnt;
+    for (int i = 0; i < cnt; i++)
+    {
+        run_queue_t *rq = run_queues[i];
+        if (!(task->affinity & SCHED_CORE_BIT(i)))
+            continue;
+
+        if (best == NULL || sched_load(rq) < sched_load(best))
+            best = rq;
+    }
+
+    if (best == NULL)
+        PANIC("[SysTaskMgr] Task affinity excludes all cores.");
+    return best;
+}
+
+//Detach a task from its core so that it is requeued on an allowed one at the next switch
+static void sched_defer_migrate(run_queue_t *rq, process_desc_t *task)
+{
+    task->rq = NULL;
+    task->rq_migrating = true;
+    task->rq_prev = NULL;
+    task->rq_next = rq->migrating;
+    rq->migrating = task;
+}
+
+void sched_setaffinity(process_desc_t *task, uint64_t affinity)
+{
+    int cli_state = cli();
+    run_queue_t *rq = sched_locktask(task);
+    task->affinity = affinity;
+
+    if (rq != NULL)
+    {
+        //Queued tasks are moved right away, the running task is moved when it is switched out
+        bool move = task->rq_queued && task != rq->prev_task && !(affinity & SCHED_CORE_BIT(rq->core_idx));
+        if (move)
+        {
+            sched_remove(rq, task);
+            task->rq = NULL;
+        }
+        local_spinlock_unlock(&rq->lock);
+
+        if (move)
+            sched_enqueue(sched_place(task, NULL), task);
+    }
+    sti(cli_state);
+}
+
+void sched_migrate(run_queue_t *rq)
+{
+    if (rq->migrating == NULL)
+        return;
+
+    local_spinlock_lock(&rq->lock);
+    process_desc_t *iter = rq->migrating;
+    rq->migrating = NULL;
+    local_spinlock_unlock(&rq->lock);
+
+    while (iter != NULL)
+    {
+        process_desc_t *next = iter->rq_next;
+        sched_enqueue(sched_place(iter, NULL), iter);
+        iter->rq_migrating = false;
+        iter = next;
+    }
+}
+
+//Take a ready task from the closest core that has work queued, only trylock is used so cores
+//stealing from each other can't deadlock and a busy victim is simply skipped
+static process_desc_t *sched_steal(run_queue_t *rq)
+{
+    uint64_t self_bit = SCHED_CORE_BIT(rq->core_idx);
+    int order_len = __atomic_load_n(&rq->steal_order_len, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < order_len; i++)
+    {
+        run_queue_t *victim = run_queues[rq->steal_order[i]];
+        if (victim->ready_count == 0)
+            continue;
+
+        if (!local_spinlock_trylock(&victim->lock))
+            continue;
+
+        //Take from the tail of the highest priority queue, the head is what the victim runs next
+        uint32_t bitmap = victim->ready_bitmap;
+        while (bitmap != 0)
+        {
+            process_desc_t *iter = victim->ready[__builtin_ctz(bitmap)].tail;
+            for (int scan = 0; iter != NULL && scan < SCHED_STEAL_SCAN; scan++, iter = iter->rq_prev)
+            {
+                //The victim's previous task may still be on its stack until the switch completes
+                if (!(iter->affinity & self_bit) || iter == victim->prev_task)
+                    continue;
+
+                sched_remove(victim, iter);
+                iter->rq = rq;
+                victim->stolen_count++;
+                local_spinlock_unlock(&victim->lock);
+                return iter;
+            }
+            bitmap &= bitmap - 1;
+        }
+        local_spinlock_unlock(&victim->lock);
+    }
+    return NULL;
+}
+
+process_desc_t *sched_next(run_queue_t *rq, process_desc_t *cur_task)
+{
+    uint64_t self_bit = SCHED_CORE_BIT(rq->core_idx);
+
+    //Requeue the outgoing task according to its state
+    if (cur_task != NULL && cur_task != rq->idle_task)
+    {
+        if (cur_task->state == task_state_running)
+            cur_task->state = task_state_pending;
+
+        if (cur_task->state != task_state_exited && !(cur_task->affinity & self_bit))
+            sched_defer_migrate(rq, cur_task);
+        else
+            sched_insert(rq, cur_task);
+    }
+    rq->prev_task = cur_task;
+
+    //Wake expired sleepers, only the heap root needs to be checked
+    if (rq->sleep_cnt != 0)
+    {
+        uint64_t now = timer_timestamp_ns();
+        while (rq->sleep_cnt != 0 && rq->sleep_heap[0]->sleep_end <= now)
+        {
+            process_desc_t *task = rq->sleep_heap[0];
+
+            //Record how late the wakeup is
+            uint64_t late = (now - task->sleep_end) >> 10;
+            int bucket = (late == 0) ? 0 : 64 - __builtin_clzll(late);
+            if (bucket >= SCHED_WAKE_HIST_BUCKETS)
+                bucket = SCHED_WAKE_HIST_BUCKETS - 1;
+            rq->wake_hist[bucket]++;
+
+            sched_remove(rq, task);
+            task->state = task_state_pending;
+            sched_insert(rq, task);
+        }
+    }
+
+    //Pick the head of the highest priority non-empty queue
+    process_desc_t *ntask = NULL;
+    while (ntask == NULL && rq->ready_bitmap != 0)
+    {
+        ntask = rq->ready[__builtin_ctz(rq->ready_bitmap)].head;
+        sched_remove(rq, ntask);
+
+        //Affinity was changed while the task was queued here
+        if (!(ntask->affinity & self_bit))
+        {
+            sched_defer_migrate(rq, ntask);
+            ntask = NULL;
+        }
+    }
+
+    //Nothing local to run, try to pull work from another core before idling
+    if (ntask == NULL)
+        ntask = sched_steal(rq);
+
+    if (ntask == NULL)
+        ntask = rq->idle_task;
+
+    if (ntask == NULL)
+        PANIC("[SysTaskMgr] Out of Processes!\r\n");
+
+    ntask->state = task_state_running;
+    rq->running = (ntask != rq->idle_task);
+    rq->switch_count++;
+    return ntask;
+}
+
+uint64_t sched_nextevent(run_queue_t *rq)
+{
+    //Fire at the end of the time slice, or earlier if a sleeper expires first
+    uint64_t deadline = timer_timestamp_ns() + SCHED_SLICE_NS;
+    if (rq->sleep_cnt != 0 && rq->sleep_heap[0]->sleep_end < deadline)
+        deadline = rq->sleep_heap[0]->sleep_end;
+    return deadline;
+}
+
+bool sched_inuse(process_desc_t *task)
+{
+    //prev_task is only replaced once that core has fully switched to another task. A busy run queue
+    //counts as in use, so this only trylocks and can be called with task and process locks held.
+    int cnt = run_queue_cnt;
+    for (int i = 0; i < cnt; i++)
+    {
+        run_queue_t *rq = run_queues[i];
+        if (!local_spinlock_trylock(&rq->lock))
+            return true;
+        bool inuse = (rq->prev_task == task);
+        local_spinlock_unlock(&rq->lock);
+        if (inuse)
+            return true;
+    }
+    return false;
+}
+
+int task_corecount(void)
+{
+    return run_queue_cnt;
+}
+
+int task_coreapicid(int core_idx)
+{
+    if (core_idx < 0 || core_idx >= run_queue_cnt)
+        return -1;
+    return run_queues[core_idx]->apic_id;
+}
+
+//Dump each core's wakeup latency histogram
+int sched_wakestats()
+{
+    char tmp[20];
+    int cnt = run_queue_cnt;
+    for (int i = 0; i < cnt; i++)
+    {
+        run_queue_t *rq = run_queues[i];
+
+        DEBUG_PRINT("[SysTaskMgr] Core ");
+        DEBUG_PRINT(itoa(rq->core_idx, tmp, 10));
+        DEBUG_PRINT(" wakeup latency:\r\n");
+        for (int b = 0; b < SCHED_WAKE_HIST_BUCKETS; b++)
+        {
+            DEBUG_PRINT((b == SCHED_WAKE_HIST_BUCKETS - 1) ? "  >= " : "  < ");
+            DEBUG_PRINT(ltoa((b == SCHED_WAKE_HIST_BUCKETS - 1) ? (1ull << (b + 9)) : (1ull << (b + 10)), tmp, 10));
+            DEBUG_PRINT("ns: ");
+            DEBUG_PRINT(ltoa(rq->wake_hist[b], tmp, 10));
+            DEBUG_PRINT("\r\n");
+        }
+    }
+    return 0;
+}
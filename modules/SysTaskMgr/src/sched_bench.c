@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) 2021 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "SysTimer/timer.h"
+
+#include "task_priv.h"
+
+// Scheduler microbenchmark, sched_bench.
+// For each population, all but one of the tasks are parked in the sleep queue and a single partner
+// task ping-pongs with the caller through task_yield, so the reported switch latency shows how the
+// cost of picking the next task scales with the total task count.
+
+#define SCHED_BENCH_YIELDS (10000)
+#define SCHED_BENCH_SLEEP_NS (100 * 1000 * 1000)
+
+static volatile bool sched_bench_stop = false;
+static _Atomic int sched_bench_live = 0;
+
+static void sched_bench_sleeper(void *arg)
+{
+    arg = NULL;
+    while (!sched_bench_stop)
+    {
+        task_sleep(task_current(), SCHED_BENCH_SLEEP_NS);
+        task_yield();
+    }
+    sched_bench_live--;
+}
+
+static void sched_bench_yielder(void *arg)
+{
+    arg = NULL;
+    while (!sched_bench_stop)
+        task_yield();
+    sched_bench_live--;
+}
+
+static int sched_bench_run(int task_cnt)
+{
+    char tmp[20];
+
+    sched_bench_stop = false;
+    sched_bench_live = 0;
+
+    for (int i = 0; i < task_cnt; i++)
+    {
+        cs_id id = 0;
+        if (create_task_kernel("sched_bench", task_permissions_kernel, &id) != CS_OK)
+            return -1;
+
+        sched_bench_live++;
+        if (start_task_kernel(id, i == 0 ? sched_bench_yielder : sched_bench_sleeper, NULL) != CS_OK)
+            return -1;
+    }
+
+    //Let the sleepers settle into the sleep queue
+    task_sleep(task_current(), SCHED_BENCH_SLEEP_NS / 10);
+    task_yield();
+
+    uint64_t start = timer_timestamp_ns();
+    for (int i = 0; i < SCHED_BENCH_YIELDS; i++)
+        task_yield();
+    uint64_t elapsed = timer_timestamp_ns() - start;
+
+    //Each yield switches to the partner task and back
+    uint64_t switch_ns = elapsed / (SCHED_BENCH_YIELDS * 2);
+
+    DEBUG_PRINT("[SysTaskMgr] sched_bench: tasks=");
+    DEBUG_PRINT(itoa(task_cnt, tmp, 10));
+    DEBUG_PRINT(" switch_ns=");
+    DEBUG_PRINT(ltoa(switch_ns, tmp, 10));
+    DEBUG_PRINT("\r\n");
+
+    sched_bench_stop = true;
+    while (sched_bench_live > 0)
+        task_yield();
+
+    return 0;
+}
+
+int sched_bench()
+{
+    static const int task_cnts[] = {10, 1000, 10000};
+
+    for (uint32_t i = 0; i < sizeof(task_cnts) / sizeof(task_cnts[0]); i++)
+        if (sched_bench_run(task_cnts[i]) != 0)
+        {
+            DEBUG_PRINT("[SysTaskMgr] sched_bench: task creation failed.\r\n");
+            return -1;
+        }
+
+    return 0;
+}
@@ -33,25 +33,44 @@ static _Atomic cs_id cur_id = 1;
 static process_desc_t *processes = NULL;
 static _Atomic int process_count = 0;
 static int process_lock = 0;
+static mem_cache_t *process_cache = NULL;
 
 // current core description
 static TLS core_desc_t *core_descs = NULL;
 
-cs_error create_task_kernel(char *name, task_permissions_t perms, cs_id *id)
+//Release everything a task descriptor owns, members that were never allocated are NULL
+static void free_task_desc(process_desc_t *pinfo)
+{
+    if (pinfo->mem != NULL)
+        vmem_destroy(pinfo->mem);
+    if (pinfo->syscall_data != NULL)
+        free(pinfo->syscall_data);
+    if (pinfo->fpu_state_unaligned != NULL)
+        free(pinfo->fpu_state_unaligned);
+    if (pinfo->reg_state != NULL)
+        free(pinfo->reg_state);
+    if (pinfo->kernel_stack != NULL)
+        free(pinfo->kernel_stack - KERNEL_STACK_LEN);
+
+    pinfo->mem = NULL;
+    pinfo->syscall_data = NULL;
+    pinfo->fpu_state_unaligned = NULL;
+    pinfo->reg_state = NULL;
+    pinfo->kernel_stack = NULL;
+}
+
+static cs_error create_task_desc(char *name, task_permissions_t perms, process_desc_t **desc)
 {
     cs_id alloc_id = cur_id++;
 
     //Create the process address space and add it to the list
-    process_desc_t *proc_info = malloc(sizeof(process_desc_t));
+    process_desc_t *proc_info = mem_cache_alloc(process_cache);
 
     DEBUG_PRINT("[SysTaskMgr] Process Created: ");
     DEBUG_PRINT(name);
     DEBUG_PRINT("\r\n");
     if (proc_info == NULL)
-    {
-        free(proc_info);
         return CS_OUTOFMEM;
-    }
 
     memset(proc_info, 0, sizeof(process_desc_t));
     strncpy(proc_info->name, name, 256);
@@ -64,30 +83,39 @@ cs_error create_task_kernel(char *name, task_permissions_t perms, cs_id *id)
         return CS_OUTOFMEM;
     }
 
-    *id = alloc_id;
-
     proc_info->state = task_state_uninitialized;
     proc_info->permissions = perms;
+    proc_info->priority = SCHED_PRIORITY_DEFAULT;
+    proc_info->affinity = SCHED_AFFINITY_ALL;
+    proc_info->rq = NULL;
+    proc_info->rq_queued = false;
+    proc_info->rq_migrating = false;
 
     //Allocate the kernel level stack
     proc_info->kernel_stack = malloc(KERNEL_STACK_LEN);
-    if (proc_info->kernel_stack == NULL)
-        PANIC("[SysTaskMgr] Unexpected memory allocation failure.");
-    proc_info->kernel_stack += KERNEL_STACK_LEN;
+    if (proc_info->kernel_stack != NULL)
+        proc_info->kernel_stack += KERNEL_STACK_LEN;
 
     proc_info->user_stack = NULL;
     proc_info->syscall_data = NULL;
-
     if (perms == task_permissions_none)
-    {
         proc_info->syscall_data = malloc(syscall_getfullstate_size());
-        syscall_getdefaultstate(proc_info->syscall_data, proc_info->kernel_stack, proc_info->user_stack, NULL);
-    }
 
     proc_info->fpu_state = malloc(fp_platform_getstatesize() + fp_platform_getalign());
     proc_info->fpu_state_unaligned = proc_info->fpu_state;
-    if (proc_info->fpu_state == NULL)
-        PANIC("[SysTaskMgr] Unexpected memory allocation failure.");
+    proc_info->reg_state = malloc(mp_platform_getstatesize());
+
+    //Undo everything on failure, the address space included
+    if (proc_info->kernel_stack == NULL || proc_info->fpu_state == NULL || proc_info->reg_state == NULL ||
+        (perms == task_permissions_none && proc_info->syscall_data == NULL))
+    {
+        free_task_desc(proc_info);
+        free(proc_info);
+        return CS_OUTOFMEM;
+    }
+
+    if (proc_info->syscall_data != NULL)
+        syscall_getdefaultstate(proc_info->syscall_data, proc_info->kernel_stack, proc_info->user_stack, NULL);
 
     //Align the FPU state properly
     if ((uintptr_t)proc_info->fpu_state % fp_platform_getalign() != 0)
@@ -95,9 +123,6 @@ cs_error create_task_kernel(char *name, task_permissions_t perms, cs_id *id)
 
     fp_platform_getdefaultstate(proc_info->fpu_state);
 
-    proc_info->reg_state = malloc(mp_platform_getstatesize());
-    if (proc_info->reg_state == NULL)
-        PANIC("[SysTaskMgr] Unexpected memory allocation failure.");
     mp_platform_getdefaultstate(proc_info->reg_state, proc_info->kernel_stack, NULL, NULL, NULL);
 
     //add this to the process queue
@@ -118,6 +143,18 @@ cs_error create_task_kernel(char *name, task_permissions_t perms, cs_id *id)
 
     process_count++;
 
+    *desc = proc_info;
+    return CS_OK;
+}
+
+cs_error create_task_kernel(char *name, task_permissions_t perms, cs_id *id)
+{
+    process_desc_t *desc = NULL;
+    cs_error err = create_task_desc(name, perms, &desc);
+    if (err != CS_OK)
+        return err;
+
+    *id = desc->id;
     return CS_OK;
 }
 
@@ -157,14 +194,20 @@ cs_error start_task_kernel(cs_id id, void *handler, void *arg)
 
                 if (iter->permissions == task_permissions_none)
                 {
-                    iter->user_stack = (uint8_t *)0x100000000;
+                    iter->user_stack = (uint8_t *)USER_STACK_BASE;
                     iter->user_stack += USER_STACK_LEN - sizeof(struct cardinal_program_setup_params);
 
-                    uintptr_t pmem = pagealloc_alloc(0, 0, physmem_alloc_flags_data | physmem_alloc_flags_zero, USER_STACK_LEN);
-                    iter->user_stack_phys = pmem;
-                    vmem_map(iter->mem, (intptr_t)0x100000000, (intptr_t)pmem, USER_STACK_LEN, vmem_flags_cachewriteback | vmem_flags_rw | vmem_flags_user, 0);
+                    //The stack is backed as it grows, overflowing it runs into the unbacked guard page below
+                    vmem_map(iter->mem, USER_STACK_BASE - USER_STACK_GUARD_LEN, 0, USER_STACK_GUARD_LEN, vmem_flags_user, vmem_map_guard);
+                    vmem_map(iter->mem, USER_STACK_BASE, 0, USER_STACK_LEN, vmem_flags_cachewriteback | vmem_flags_rw | vmem_flags_user, vmem_map_demand);
 
-                    iter->usersetup_params = (struct cardinal_program_setup_params *)vmem_phystovirt(iter->user_stack_phys + USER_STACK_LEN - sizeof(struct cardinal_program_setup_params), sizeof(struct cardinal_program_setup_params), vmem_flags_cachewriteback | vmem_flags_rw);
+                    //Only the page holding the setup parameters is needed up front
+                    intptr_t params_phys = 0;
+                    if (vmem_populate(iter->mem, (intptr_t)iter->user_stack, sizeof(struct cardinal_program_setup_params)) != 0 ||
+                        vmem_virttophys(iter->mem, (intptr_t)iter->user_stack, &params_phys) != 0)
+                        PANIC("[SysTaskMgr] User stack allocation failure.");
+
+                    iter->usersetup_params = (struct cardinal_program_setup_params *)vmem_phystovirt(params_phys, sizeof(struct cardinal_program_setup_params), vmem_flags_cachewriteback | vmem_flags_rw);
                     iter->usersetup_params->ver = 1;
                     iter->usersetup_params->page_size = KiB(4);
                     iter->usersetup_params->argc = 0;
@@ -183,6 +226,7 @@ cs_error start_task_kernel(cs_id id, void *handler, void *arg)
                     mp_platform_getdefaultstate(iter->reg_state, iter->kernel_stack, (void*)kernel_entry_handler, handler, arg); //Rebuild stack state
                 }
                 iter->state = task_state_pending; //Set task to initialized
+                sched_enqueue(sched_place(iter, core_descs->rq), iter);
 
                 local_spinlock_unlock(&iter->lock);
             }
@@ -220,7 +264,8 @@ cs_error end_task_kernel(cs_id id)
             DEBUG_PRINT(iter->name);
             DEBUG_PRINT("\r\n");
 
-            iter->state = task_state_exited; //Set task to exited
+            waitqueue_cancel(iter);
+            sched_setstate(iter, task_state_exited); //Set task to exited
 
             local_spinlock_unlock(&iter->lock);
         }
@@ -364,196 +409,60 @@ free_descriptors(process_desc_t *pinfo, descriptor_entry_t *desc_table, cs_id ba
     }
 }
 
-static void task_switch_handler(int irq)
+static void task_save(process_desc_t *task, interrupt_register_state_t *mp_state)
 {
-    irq = 0;
-
-    int cli_state = cli();
-    local_spinlock_lock(&process_lock);
-
-    process_desc_t *ntask = NULL; //find the first pending task
-    if (core_descs->cur_task != NULL)
-    {
-        local_spinlock_lock(&core_descs->cur_task->lock);
-
-        if (core_descs->cur_task->state == task_state_running)
-            core_descs->cur_task->state = task_state_pending;  //Set the cur_task to pending again
-        fp_platform_getstate(core_descs->cur_task->fpu_state); //Save the current tasks's fpu state
-        mp_platform_getstate(core_descs->cur_task->reg_state); //Save the current task's register state
-        if (core_descs->cur_task->syscall_data != NULL)
-            syscall_getfullstate(core_descs->cur_task->syscall_data);
-
-        //find the next pending task
-        ntask = core_descs->cur_task->next;
-        local_spinlock_unlock(&core_descs->cur_task->lock);
+    fp_platform_getstate(task->fpu_state); //Save the current tasks's fpu state
+    if (mp_state != NULL)
+        memcpy(task->reg_state, mp_state, sizeof(interrupt_register_state_t));
+    else
+        mp_platform_getstate(task->reg_state); //Save the current task's register state
+    if (task->syscall_data != NULL)
+        syscall_getfullstate(task->syscall_data);
+}
 
-        while (ntask != NULL)
-        {
-            process_desc_t *cur_ntask = ntask;
-            local_spinlock_lock(&cur_ntask->lock);
-            if (ntask->state == task_state_pending)
-            {
-                local_spinlock_unlock(&cur_ntask->lock);
-                break;
-            }else if (ntask->state == task_state_suspended_monitor_mem_32){
-                if(*ntask->monitor_tgt != ntask->monitor_value){
-                    local_spinlock_unlock(&cur_ntask->lock);
-                    break;
-                }
-            }else if(ntask->state == task_state_sleep) {
-                if(timer_timestamp_ns() >= ntask->sleep_end){
-                    local_spinlock_unlock(&cur_ntask->lock);
-                    break;
-                }
-            }
-            ntask = ntask->next;
-            local_spinlock_unlock(&cur_ntask->lock);
-        }
-    }
+static void task_restore(process_desc_t *task, interrupt_register_state_t *mp_state)
+{
+    vmem_setactive(task->mem);             //Set virtual memory
+    fp_platform_setstate(task->fpu_state); //Set fpu state
+    if (mp_state != NULL)
+        memcpy(mp_state, task->reg_state, sizeof(interrupt_register_state_t));
+    else
+        mp_platform_setstate(task->reg_state); //Set registers
+    if (task->syscall_data != NULL)
+        syscall_setfullstate(task->syscall_data);
+}
 
-    //if an appropriate task could not be found, iterate over the entire list to find a task
-    if (ntask == NULL)
-    {
-        ntask = processes;
-        while (ntask != NULL)
-        {
-            process_desc_t *cur_ntask = ntask;
-            local_spinlock_lock(&cur_ntask->lock);
-            if (ntask->state == task_state_pending)
-            {
-                local_spinlock_unlock(&cur_ntask->lock);
-                break;
-            }else if (ntask->state == task_state_suspended_monitor_mem_32){
-                if(*ntask->monitor_tgt != ntask->monitor_value){
-                    local_spinlock_unlock(&cur_ntask->lock);
-                    break;
-                }
-            }else if(ntask->state == task_state_sleep) {
-                if(timer_timestamp_ns() >= ntask->sleep_end){
-                    local_spinlock_unlock(&cur_ntask->lock);
-                    break;
-                }
-            }
-            ntask = ntask->next;
-            local_spinlock_unlock(&cur_ntask->lock);
-        }
-    }
+static void task_switch(interrupt_register_state_t *mp_state)
+{
+    //Only this core's run queue is touched, other cores are not contended
+    run_queue_t *rq = core_descs->rq;
+    sched_migrate(rq);
+    local_spinlock_lock(&rq->lock);
 
-    //if an appropriate task could still not be found, panic
-    if (ntask == NULL)
-    {
-        PANIC("[SysTaskMgr] Out of Processes!\r\n");
-    }
+    if (core_descs->cur_task != NULL)
+        task_save(core_descs->cur_task, mp_state);
 
-    //switch to this task
+    process_desc_t *ntask = sched_next(rq, core_descs->cur_task);
     core_descs->cur_task = ntask;
+    task_restore(ntask, mp_state);
 
-    local_spinlock_lock(&ntask->lock);
-    ntask->state = task_state_running;
-    vmem_setactive(ntask->mem);             //Set virtual memory
-    fp_platform_setstate(ntask->fpu_state); //Set fpu state
-    mp_platform_setstate(ntask->reg_state); //Set registers
-    if (ntask->syscall_data != NULL)
-        syscall_setfullstate(ntask->syscall_data);
+    //Sleepers cost nothing until the earliest one is due, the timer is armed for it or the end of the slice
+    timer_local_deadline(sched_nextevent(rq));
 
-    local_spinlock_unlock(&ntask->lock);
+    local_spinlock_unlock(&rq->lock);
+}
 
-    local_spinlock_unlock(&process_lock);
+static void task_switch_handler(int irq)
+{
+    irq = 0;
+
+    int cli_state = cli();
+    task_switch(NULL);
     sti(cli_state);
 }
 
 static void task_yield_stage2(interrupt_register_state_t *mp_state){
-    local_spinlock_lock(&process_lock);
-
-    process_desc_t *ntask = NULL; //find the first pending task
-    if (core_descs->cur_task != NULL)
-    {
-        local_spinlock_lock(&core_descs->cur_task->lock);
-
-        if (core_descs->cur_task->state == task_state_running)
-            core_descs->cur_task->state = task_state_pending;  //Set the cur_task to pending again
-        fp_platform_getstate(core_descs->cur_task->fpu_state); //Save the current tasks's fpu state
-        memcpy(core_descs->cur_task->reg_state, mp_state, sizeof(interrupt_register_state_t)); //Save the current task's register state
-        if (core_descs->cur_task->syscall_data != NULL)
-            syscall_getfullstate(core_descs->cur_task->syscall_data);
-
-        //find the next pending task
-        ntask = core_descs->cur_task->next;
-        local_spinlock_unlock(&core_descs->cur_task->lock);
-
-        while (ntask != NULL)
-        {
-            process_desc_t *cur_ntask = ntask;
-            local_spinlock_lock(&cur_ntask->lock);
-            if (ntask->state == task_state_pending)
-            {
-                local_spinlock_unlock(&cur_ntask->lock);
-                break;
-            }else if (ntask->state == task_state_suspended_monitor_mem_32){
-                if(*ntask->monitor_tgt != ntask->monitor_value){
-                    local_spinlock_unlock(&cur_ntask->lock);
-                    break;
-                }
-            }else if(ntask->state == task_state_sleep) {
-                if(timer_timestamp_ns() >= ntask->sleep_end){
-                    local_spinlock_unlock(&cur_ntask->lock);
-                    break;
-                }
-            }
-            ntask = ntask->next;
-            local_spinlock_unlock(&cur_ntask->lock);
-        }
-    }
-
-    //if an appropriate task could not be found, iterate over the entire list to find a task
-    if (ntask == NULL)
-    {
-        ntask = processes;
-        while (ntask != NULL)
-        {
-            process_desc_t *cur_ntask = ntask;
-            local_spinlock_lock(&cur_ntask->lock);
-            if (ntask->state == task_state_pending)
-            {
-                local_spinlock_unlock(&cur_ntask->lock);
-                break;
-            }else if (ntask->state == task_state_suspended_monitor_mem_32){
-                if(*ntask->monitor_tgt != ntask->monitor_value){
-                    local_spinlock_unlock(&cur_ntask->lock);
-                    break;
-                }
-            }else if(ntask->state == task_state_sleep) {
-                if(timer_timestamp_ns() >= ntask->sleep_end){
-                    local_spinlock_unlock(&cur_ntask->lock);
-                    break;
-                }
-            }
-            ntask = ntask->next;
-            local_spinlock_unlock(&cur_ntask->lock);
-        }
-    }
-
-    //if an appropriate task could still not be found, panic
-    if (ntask == NULL)
-    {
-        PANIC("[SysTaskMgr] Out of Processes!\r\n");
-    }
-
-    //switch to this task
-    core_descs->cur_task = ntask;
-
-    local_spinlock_lock(&ntask->lock);
-    ntask->state = task_state_running;
-    vmem_setactive(ntask->mem);             //Set virtual memory
-    fp_platform_setstate(ntask->fpu_state); //Set fpu state
-    //mp_platform_setstate(ntask->reg_state); //Set registers
-    memcpy(mp_state, ntask->reg_state, sizeof(interrupt_register_state_t));
-    if (ntask->syscall_data != NULL)
-        syscall_setfullstate(ntask->syscall_data);
-
-    local_spinlock_unlock(&ntask->lock);
-
-    local_spinlock_unlock(&process_lock);
+    task_switch(mp_state);
 }
 
 void task_yield(){
@@ -679,56 +588,87 @@ cs_id task_current()
     return core_descs->cur_task->id;
 }
 
-cs_error task_monitor_noyield(cs_id id, uint32_t *tgt, uint32_t cur_val)
+process_desc_t *task_current_desc(void)
+{
+    return core_descs->cur_task;
+}
+
+cs_error task_monitor(cs_id id, uint32_t *tgt, uint32_t cur_val)
 {
-    if (tgt == NULL)
+    //Monitors are futex waits on the target, the writer is expected to task_wake it
+    if (tgt == NULL || id != task_current())
         return CS_UNKN;
 
-    int cli_state = cli();
-    local_spinlock_lock(&process_lock);
-    if (processes != NULL)
-    {
-        cs_error res_cs = CS_UNKN;
-        process_desc_t *iter = processes;
-        while (iter != NULL)
-        {
-            process_desc_t *cur_iter = iter;
-            local_spinlock_lock(&cur_iter->lock);
-            if (iter->id == id)
-                break;
-            iter = iter->next;
-            local_spinlock_unlock(&cur_iter->lock);
-        }
-        if (iter != NULL)
-        {
-            intptr_t phys_ptr = 0;
-            vmem_virttophys(iter->mem, (intptr_t)tgt, &phys_ptr);
-            iter->monitor_tgt = (uint32_t*)vmem_phystovirt(phys_ptr, 4, vmem_flags_uncached | vmem_flags_kernel);
-            iter->monitor_value = cur_val;
-            iter->state = task_state_suspended_monitor_mem_32;
+    return task_wait(tgt, cur_val);
+}
 
-            //Lock is already held from the break in the previous loop
-            local_spinlock_unlock(&iter->lock);
-        }
-        local_spinlock_unlock(&process_lock);
-        sti(cli_state);
-        return res_cs;
-    }
-    local_spinlock_unlock(&process_lock);
-    sti(cli_state);
-    return CS_UNKN;
+static int task_vmemperms(process_desc_t *task, task_map_perms_t perms)
+{
+    int map_perms = 0;
+    if (perms & task_map_perm_writeonly)
+        map_perms |= vmem_flags_rw;
+    if (perms & task_map_perm_execute)
+        map_perms |= vmem_flags_exec;
+    if (perms & task_map_perm_cachewritethrough)
+        map_perms |= vmem_flags_cachewritethrough;
+    else if (perms & task_map_perm_cachewriteback)
+        map_perms |= vmem_flags_cachewriteback;
+    else if (perms & task_map_perm_cachewritecomplete)
+        map_perms |= vmem_flags_cachewritecomplete;
+    else if (perms & task_map_perm_uncached)
+        map_perms |= vmem_flags_uncached;
+
+    if (task->permissions & task_permissions_kernel)
+        map_perms |= vmem_flags_kernel;
+    else
+        map_perms |= vmem_flags_user;
+    return map_perms;
 }
 
-cs_error task_monitor(cs_id id, uint32_t *tgt, uint32_t cur_val)
+cs_error task_mapvmem(cs_id id, intptr_t vaddr, intptr_t paddr, size_t sz, task_map_perms_t perms, int map_flags, cs_id *shmem_id)
 {
-    if (tgt == NULL)
+    if (shmem_id == NULL)
         return CS_UNKN;
 
+    cs_error res_cs = CS_UNKN;
     int cli_state = cli();
-    task_monitor_noyield(id, tgt, cur_val);
-    task_yield();
+    local_spinlock_lock(&process_lock);
+    process_desc_t *iter = processes;
+    while (iter != NULL)
+    {
+        process_desc_t *cur_iter = iter;
+        local_spinlock_lock(&cur_iter->lock);
+        if (iter->id == id)
+            break;
+        iter = iter->next;
+        local_spinlock_unlock(&cur_iter->lock);
+    }
+    if (iter != NULL)
+    {
+        //Lock is already held from the break in the previous loop
+        if (vmem_map(iter->mem, vaddr, paddr, sz, task_vmemperms(iter, perms), map_flags) == 0)
+        {
+            cs_id k_id = alloc_descriptor(iter, descriptor_type_map_entry);
+            descriptor_entry_t *d = read_descriptor(iter, k_id);
+            d->type = descriptor_type_map_entry;
+            d->map_entry = malloc(sizeof(map_entry_t));
+            d->map_entry->vaddr = vaddr;
+            d->map_entry->paddr = paddr;
+            d->map_entry->sz = sz;
+            d->map_entry->owner_perms = perms;
+            d->map_entry->child_perms = 0;
+            d->map_entry->flags = task_map_none;
+            d->map_entry->is_owner = true;
+            d->map_entry->child_count = 0;
+
+            *shmem_id = k_id;
+            res_cs = CS_OK;
+        }
+        local_spinlock_unlock(&iter->lock);
+    }
+    local_spinlock_unlock(&process_lock);
     sti(cli_state);
-    return CS_UNKN;
+    return res_cs;
 }
 
 cs_error task_map(cs_id id, const char *name, intptr_t vaddr, size_t sz, task_map_flags_t flags, task_map_perms_t owner_perms, task_map_perms_t child_perms, int child_count, cs_id *shmem_id)
@@ -795,30 +735,9 @@ cs_error task_map(cs_id id, const char *name, intptr_t vaddr, size_t sz, task_ma
             }
             else
             {
-                int map_perms = 0;
-                if (owner_perms & task_map_perm_writeonly)
-                    map_perms |= vmem_flags_rw;
-                if (owner_perms & task_map_perm_execute)
-                    map_perms |= vmem_flags_exec;
-                if (owner_perms & task_map_perm_cachewritethrough)
-                    map_perms |= vmem_flags_cachewritethrough;
-                else if (owner_perms & task_map_perm_cachewriteback)
-                    map_perms |= vmem_flags_cachewriteback;
-                else if (owner_perms & task_map_perm_cachewritecomplete)
-                    map_perms |= vmem_flags_cachewritecomplete;
-                else if (owner_perms & task_map_perm_uncached)
-                    map_perms |= vmem_flags_uncached;
-
-                if (iter->permissions & task_permissions_kernel)
-                    map_perms |= vmem_flags_kernel;
-                else
-                    map_perms |= vmem_flags_user;
-
-                //Allocate physical memory and map it into the process
-                uintptr_t pmem = pagealloc_alloc(0, 0, physmem_alloc_flags_data | physmem_alloc_flags_instr | physmem_alloc_flags_zero, sz);
-                d->map_entry->paddr = pmem;
+                //Pages are allocated zeroed on first access and released by the address space on unmap
                 d->map_entry->is_owner = true;
-                vmem_map(iter->mem, d->map_entry->vaddr, (intptr_t)pmem, sz, map_perms, 0);
+                vmem_map(iter->mem, d->map_entry->vaddr, 0, sz, task_vmemperms(iter, owner_perms), vmem_map_demand);
             }
 
             *shmem_id = shmem_k_id;
@@ -861,27 +780,8 @@ cs_error task_updatemap(cs_id id, cs_id shmem_id, task_map_perms_t perms)
                 else
                     perms &= d->map_entry->child_perms;
 
-                int map_perms = 0;
-                if (perms & task_map_perm_writeonly)
-                    map_perms |= vmem_flags_rw;
-                if (perms & task_map_perm_execute)
-                    map_perms |= vmem_flags_exec;
-                if (perms & task_map_perm_cachewritethrough)
-                    map_perms |= vmem_flags_cachewritethrough;
-                else if (perms & task_map_perm_cachewriteback)
-                    map_perms |= vmem_flags_cachewriteback;
-                else if (perms & task_map_perm_cachewritecomplete)
-                    map_perms |= vmem_flags_cachewritecomplete;
-                else if (perms & task_map_perm_uncached)
-                    map_perms |= vmem_flags_uncached;
-
-                if (iter->permissions & task_permissions_kernel)
-                    map_perms |= vmem_flags_kernel;
-                else
-                    map_perms |= vmem_flags_user;
-
-                vmem_unmap(iter->mem, d->map_entry->vaddr, d->map_entry->sz);
-                vmem_map(iter->mem, d->map_entry->vaddr, (intptr_t)d->map_entry->paddr, d->map_entry->sz, map_perms, 0);
+                //Rewrites the permissions in place, so pages that were already faulted in are kept
+                vmem_protect(iter->mem, d->map_entry->vaddr, d->map_entry->sz, task_vmemperms(iter, perms));
             }
             local_spinlock_unlock(&iter->lock);
         }
@@ -896,6 +796,8 @@ cs_error task_updatemap(cs_id id, cs_id shmem_id, task_map_perms_t perms)
 
 cs_error task_unmap(cs_id id, cs_id shmem_id)
 {
+    vmem_t *mem = NULL;
+
     int cli_state = cli();
     local_spinlock_lock(&process_lock);
     if (processes != NULL)
@@ -916,13 +818,9 @@ cs_error task_unmap(cs_id id, cs_id shmem_id)
             descriptor_entry_t *d = read_descriptor(iter, shmem_id);
             if (d->type == descriptor_type_map_entry)
             {
-                //Unmap memory region
+                //Unmap memory region, the address space releases the pages it backed once no core can still reach them
                 vmem_unmap(iter->mem, d->map_entry->vaddr, d->map_entry->sz);
-                if (d->map_entry->is_owner)
-                {
-                    //free physical memory
-                    pagealloc_free(d->map_entry->paddr, d->map_entry->sz);
-                }
+                mem = iter->mem;
 
                 free(d->map_entry);
                 d->map_entry = NULL;
@@ -932,6 +830,10 @@ cs_error task_unmap(cs_id id, cs_id shmem_id)
         }
         local_spinlock_unlock(&process_lock);
         sti(cli_state);
+
+        //Wait with no locks held, the other cores may be spinning on them with interrupts off
+        if (mem != NULL)
+            vmem_shootdown_wait(mem);
         return CS_OK;
     }
     local_spinlock_unlock(&process_lock);
@@ -1042,7 +944,8 @@ cs_error task_sleep(cs_id id, uint64_t ns)
         if (iter != NULL)
         {
             iter->sleep_end = timer_timestamp_ns() + ns;
-            iter->state = task_state_sleep;
+            sched_setstate(iter, task_state_sleep);
+            res_cs = CS_OK;
 
             //Lock is already held from the break in the previous loop
             local_spinlock_unlock(&iter->lock);
@@ -1057,8 +960,87 @@ cs_error task_sleep(cs_id id, uint64_t ns)
     return CS_UNKN;
 }
 
-cs_error nanosleep_syscall()
+cs_error task_setpriority(cs_id id, int priority)
+{
+    if (priority < 0 || priority >= SCHED_PRIORITY_COUNT)
+        return CS_UNKN;
+
+    int cli_state = cli();
+    local_spinlock_lock(&process_lock);
+    if (processes != NULL)
+    {
+        cs_error res_cs = CS_UNKN;
+        process_desc_t *iter = processes;
+        while (iter != NULL)
+        {
+            process_desc_t *cur_iter = iter;
+            local_spinlock_lock(&cur_iter->lock);
+            if (iter->id == id)
+                break;
+            iter = iter->next;
+            local_spinlock_unlock(&cur_iter->lock);
+        }
+        if (iter != NULL)
+        {
+            sched_setpriority(iter, priority);
+            res_cs = CS_OK;
+
+            //Lock is already held from the break in the previous loop
+            local_spinlock_unlock(&iter->lock);
+        }
+        local_spinlock_unlock(&process_lock);
+        sti(cli_state);
+        return res_cs;
+    }
+    local_spinlock_unlock(&process_lock);
+    sti(cli_state);
+    return CS_UNKN;
+}
+
+cs_error task_setaffinity(cs_id id, uint64_t affinity)
+{
+    if (affinity == 0)
+        return CS_UNKN;
+
+    int cli_state = cli();
+    local_spinlock_lock(&process_lock);
+    if (processes != NULL)
+    {
+        cs_error res_cs = CS_UNKN;
+        process_desc_t *iter = processes;
+        while (iter != NULL)
+        {
+            process_desc_t *cur_iter = iter;
+            local_spinlock_lock(&cur_iter->lock);
+            if (iter->id == id)
+                break;
+            iter = iter->next;
+            local_spinlock_unlock(&cur_iter->lock);
+        }
+        if (iter != NULL)
+        {
+            sched_setaffinity(iter, affinity);
+            res_cs = CS_OK;
+
+            //Lock is already held from the break in the previous loop
+            local_spinlock_unlock(&iter->lock);
+        }
+        local_spinlock_unlock(&process_lock);
+        sti(cli_state);
+        return res_cs;
+    }
+    local_spinlock_unlock(&process_lock);
+    sti(cli_state);
+    return CS_UNKN;
+}
+
+cs_error nanosleep_syscall(uint64_t ns)
 {
+    cs_error err = task_sleep(task_current(), ns);
+    if (err != CS_OK)
+        return err;
+
+    task_yield();
     return CS_OK;
 }
 
@@ -1079,25 +1061,18 @@ static void task_cleanup(void *arg)
             process_desc_t *cur_iter = iter;
             if (!local_spinlock_trylock(&cur_iter->lock))
                 break;
-            if (iter->state == task_state_exited)
+            //Being detached from its run queue isn't enough, the core that switched away from the task
+            //may still be on its kernel stack with its address space loaded until it switches again
+            if (iter->state == task_state_exited && iter->rq == NULL && !iter->rq_migrating && !sched_inuse(iter))
             {
-                //Delete task
                 if (iter->mem != NULL)
                 {
                     free_descriptors(iter, iter->descriptors, 0); //Unmap/free all descriptors regions
-                    if (iter->syscall_data != NULL)
-                        free(iter->syscall_data);
                     if (iter->user_stack != NULL)
                     {
-                        vmem_unmap(iter->mem, 0x100000000, USER_STACK_LEN);
-                        pagealloc_free(iter->user_stack_phys, USER_STACK_LEN);
+                        vmem_unmap(iter->mem, USER_STACK_BASE - USER_STACK_GUARD_LEN, USER_STACK_LEN + USER_STACK_GUARD_LEN);
                     }
-                    vmem_destroy(iter->mem);
-                    free(iter->fpu_state_unaligned);
-                    free(iter->reg_state);
-                    free(iter->kernel_stack - KERNEL_STACK_LEN);
-
-                    iter->mem = NULL;
+                    free_task_desc(iter);
                 }
 
                 if (prev_iter == NULL)
@@ -1131,31 +1106,36 @@ void semaphore_init(semaphore_t *sema)
 {
     sema->count = 0;
     sema->spinlock = 0;
+    sema->waiters.head = NULL;
+    sema->waiters.tail = NULL;
 }
 
 int semaphore_signal(semaphore_t *sema)
 {
     int rVal = 0;
+    int state = cli();
     local_spinlock_lock(&sema->spinlock);
     rVal = sema->count++;
+    waitqueue_wake(&sema->waiters, 0, 1); //Hand the count to exactly one waiter
     local_spinlock_unlock(&sema->spinlock);
+    sti(state);
     return rVal;
 }
 
 int semaphore_wait(semaphore_t *sema)
 {
     int rVal = 0;
+    int state = cli();
     local_spinlock_lock(&sema->spinlock);
     while (sema->count == 0){
-        int state = cli();
-        task_monitor_noyield(task_current(), (uint32_t*)&sema->count, 0);
+        waitqueue_block(&sema->waiters, &sema->spinlock, core_descs->cur_task, 0);
         local_spinlock_unlock(&sema->spinlock);
         task_yield();
-        sti(state);
         local_spinlock_lock(&sema->spinlock);
     }
     rVal = --sema->count;
     local_spinlock_unlock(&sema->spinlock);
+    sti(state);
     return rVal;
 }
 
@@ -1166,7 +1146,16 @@ void servicescript_handler(void *arg)
     servicescript_execute();
 }
 
-int module_mp_init()
+static void NORETURN idle_handler(void *arg)
+{
+    arg = NULL;
+    //Spend idle time zeroing pages for later allocations, halt once the pool is full
+    while (true)
+        if (!pagealloc_zero_refill())
+            halt();
+}
+
+static void task_core_init()
 {
     //Allocate and setup interrupt stack
     uint8_t *interrupt_stack = (uint8_t *)malloc(KERNEL_STACK_LEN) + KERNEL_STACK_LEN;
@@ -1176,6 +1165,42 @@ int module_mp_init()
 
     interrupt_setstack(interrupt_stack);
 
+    //Setup this core's idle task, it is only run when the run queue is empty
+    process_desc_t *idle_task = NULL;
+    if (create_task_desc("idle", task_permissions_kernel, &idle_task) != CS_OK)
+        PANIC("[SysTaskMgr] Failed to create idle task.");
+    mp_platform_getdefaultstate(idle_task->reg_state, idle_task->kernel_stack, (void *)kernel_entry_handler, (void *)idle_handler, NULL);
+    idle_task->state = task_state_pending;
+
+    //Setup the run queue
+    run_queue_t *rq = malloc(sizeof(run_queue_t));
+    if (rq == NULL)
+        PANIC("[SysTaskMgr] Unexpected memory allocation failure.");
+    sched_rq_init(rq, interrupt_get_cpuidx(), idle_task);
+    core_descs->rq = rq;
+}
+
+static void NORETURN task_ap_entry(void)
+{
+    //SysFP and SysUser are loaded after the APs are started, finish their per-core setup here
+    fp_mp_init();
+    user_mp_init();
+    task_core_init();
+
+    if (timer_request(timer_features_oneshot | timer_features_local, SCHED_SLICE_NS, task_switch_handler))
+        PANIC("[SysTaskMgr] Failed to allocate local timer!");
+    timer_local_deadline(timer_timestamp_ns() + SCHED_SLICE_NS);
+
+    //Idle until the first tick switches this core into its run queue
+    sti(1);
+    while (true)
+        halt();
+}
+
+int module_mp_init()
+{
+    task_core_init();
+
     //Launch servicescript task
     cs_id ss_id = 0;
     cs_error ss_err = create_task_kernel("servicescript", task_permissions_kernel, &ss_id);
@@ -1194,8 +1219,9 @@ int module_mp_init()
     if (tc_err != CS_OK)
         PANIC("[SysTaskMgr] Failed to start task_cleanup task.");
 
-    if (timer_request(timer_features_periodic | timer_features_local, 50000, task_switch_handler))
-        PANIC("[SysTaskMgr] Failed to allocate periodic timer!");
+    if (timer_request(timer_features_oneshot | timer_features_local, SCHED_SLICE_NS, task_switch_handler))
+        PANIC("[SysTaskMgr] Failed to allocate local timer!");
+    timer_local_deadline(timer_timestamp_ns() + SCHED_SLICE_NS);
     return 0;
 }
 
@@ -1211,6 +1237,16 @@ void task_startnew_user(void *elf, size_t elf_len)
     elf_err = start_task_kernel(elf_id, entry_pt, NULL);
 }
 
+//Run a kernel function in a task of its own, used by TASK: lines of the load scripts
+void task_startnew_kernel(char *name, void *handler)
+{
+    cs_id id = 0;
+    if (create_task_kernel(name, task_permissions_kernel, &id) != CS_OK)
+        PANIC("[SysTaskMgr] Failed to create kernel task.");
+    if (start_task_kernel(id, handler, NULL) != CS_OK)
+        PANIC("[SysTaskMgr] Failed to start kernel task.");
+}
+
 int module_init()
 {
     //Allocate core memory
@@ -1218,10 +1254,18 @@ int module_init()
         core_descs = (TLS core_desc_t *)mp_tls_get(mp_tls_alloc(sizeof(core_desc_t)));
     core_descs->interrupt_stack = NULL;
     core_descs->cur_task = NULL;
+    core_descs->rq = NULL;
+
+    process_cache = mem_cache_create("process_desc_t", sizeof(process_desc_t));
+    if (process_cache == NULL)
+        PANIC("[SysTaskMgr] Failed to create process cache.");
 
     registry_createdirectory("", "procs");
     module_mp_init();
 
+    //Release the APs parked in mp_signalready into the scheduler
+    mp_setapentry(task_ap_entry);
+
     syscall_sethandler(1, (void *)nanosleep_syscall);
 
     syscall_sethandler(2, (void *)task_map);
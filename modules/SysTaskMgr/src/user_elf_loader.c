@@ -12,54 +12,75 @@
 
 #include <cardinal/local_spinlock.h>
 
+#include "SysPhysicalMemory/phys_mem.h"
 #include "SysVirtualMemory/vmem.h"
 
 #include "task_priv.h"
 #include "error.h"
 #include "elf.h"
 
-int user_elf_load(cs_id task_id, void *elf, size_t elf_len, void (**entry_point)(void *))
-{
-    if (elf == NULL)
-        return -1;
+// Images are laid out once per ELF and shared by every task started from it. Pages with file
+// contents are mapped copy-on-write, so read-only text is never duplicated and data is only
+// copied once a task writes to it. Pages covered by nothing but bss are left to the fault
+// handler. The shared pages stay owned by the image, which lives as long as the initrd ELF it was
+// built from, so the cache holds at most one image per program and is never trimmed.
 
-    if (entry_point == NULL)
-        return -1;
+#define ELF_PAGE_WRITE (1 << 0)
+#define ELF_PAGE_EXEC (1 << 1)
+#define ELF_PAGE_DATA (1 << 2)
 
-    if (elf_len == 0)
-        return -1;
+typedef struct
+{
+    uint64_t vaddr;
+    uintptr_t phys;
+    int flags;
+} elf_image_page_t;
 
-    Elf64_Ehdr *hdr = elf;
+typedef struct elf_image
+{
+    void *elf;
+    elf_image_page_t *pages;
+    int page_cnt;
+    int page_cap;
+    struct elf_image *next;
+} elf_image_t;
 
-    // Verify the header
-    Elf_CommonEhdr *c_hdr = &hdr->e_hdr;
-    if (c_hdr->e_ident[EI_MAG0] != ELF_MAG0)
-        return -1;
-    if (c_hdr->e_ident[EI_MAG1] != ELF_MAG1)
-        return -1;
-    if (c_hdr->e_ident[EI_MAG2] != ELF_MAG2)
-        return -1;
-    if (c_hdr->e_ident[EI_MAG3] != ELF_MAG3)
-        return -1;
+static elf_image_t *images = NULL;
+static int images_lock = 0;
 
-    if (c_hdr->e_ident[EI_DATA] != ELFDATA2LSB)
-        return -2;
-    if (c_hdr->e_type != ET_EXEC)
-        return -2;
-    if (c_hdr->e_machine == ET_NONE)
-        return -2;
-    if (c_hdr->e_version != EV_CURRENT)
-        return -2;
-    if (c_hdr->e_ident[EI_OSABI] != ELFOSABI_GNU &&
-        c_hdr->e_ident[EI_OSABI] != ELFOSABI_NONE)
-        return -2;
+static elf_image_page_t *elf_image_page(elf_image_t *img, uint64_t vaddr)
+{
+    for (int i = img->page_cnt - 1; i >= 0; i--)
+        if (img->pages[i].vaddr == vaddr)
+            return &img->pages[i];
 
-    *entry_point = (void (*)(void *))hdr->e_entry;
+    if (img->page_cnt == img->page_cap)
+    {
+        int n_cap = (img->page_cap == 0) ? 16 : img->page_cap * 2;
+        elf_image_page_t *n_pages = malloc(n_cap * sizeof(elf_image_page_t));
+        if (n_pages == NULL)
+            PANIC("[SysTaskMgr] Elf image allocation failure.");
+        if (img->pages != NULL)
+        {
+            memcpy(n_pages, img->pages, img->page_cnt * sizeof(elf_image_page_t));
+            free(img->pages);
+        }
+        img->pages = n_pages;
+        img->page_cap = n_cap;
+    }
+
+    elf_image_page_t *pg = &img->pages[img->page_cnt++];
+    pg->vaddr = vaddr;
+    pg->phys = 0;
+    pg->flags = 0;
+    return pg;
+}
 
+static void elf_image_build(elf_image_t *img, Elf64_Ehdr *hdr)
+{
     Elf64_Shdr *
         shdr_root = (Elf64_Shdr *)((uint8_t *)hdr + hdr->e_shoff);
 
-    // setup sections into target process
     for (int i = 0; i < hdr->e_shnum; i++)
     {
         Elf64_Shdr *shdr = &shdr_root[i];
@@ -72,25 +93,10 @@ int user_elf_load(cs_id task_id, void *elf, size_t elf_len, void (**entry_point)
             {
                 // Round down target address to page boundary
                 uint64_t dst_addr = shdr->sh_addr & ~(KiB(4) - 1);
-                uint64_t dst_sz = shdr->sh_size;
-
-                // Round up page size
-                if (dst_sz % KiB(4) != 0)
-                    dst_sz += KiB(4) - (dst_sz % KiB(4));
-
-                // Determine if mapping for each page exists
-                // Create mapping for missing pages
-                intptr_t phys_dst_addr = 0;
-                cs_id dst_shmem_id = 0;
-                for (uint64_t j = 0; j < dst_sz; j += KiB(4))
-                    if (task_virttophys(task_id, (intptr_t)dst_addr + j, &phys_dst_addr) != CS_OK)
-                    {
-                        task_map(task_id, NULL, (intptr_t)(dst_addr + j), KiB(4), task_map_none, task_map_perm_cachewriteback | task_map_perm_writeonly, 0, 0, &dst_shmem_id);
-                        if (task_virttophys(task_id, (intptr_t)dst_addr + j, &phys_dst_addr) != CS_OK)
-                            PANIC("[SysTaskMgr] Elf memory allocation failure.");
-
-                        //task_map ensures a clear page
-                    }
+                uint64_t dst_end = shdr->sh_addr + shdr->sh_size;
+
+                for (uint64_t j = dst_addr; j < dst_end; j += KiB(4))
+                    elf_image_page(img, j)->flags |= ELF_PAGE_WRITE;
             }
         }
         else if (shdr->sh_type == SHT_SYMTAB)
@@ -107,51 +113,43 @@ int user_elf_load(cs_id task_id, void *elf, size_t elf_len, void (**entry_point)
                 Elf64_Shdr *sec_shdr = &shdr_root[sym[j].st_shndx];
 
                 if (ELF64_ST_TYPE(sym[j].st_info) == STT_FUNC)
-                {
-                    Elf64_Shdr *strtab = &shdr_root[shdr->sh_link];
                     sym[j].st_value += sec_shdr->sh_addr;
-                }
                 else if (ELF64_ST_TYPE(sym[j].st_info) == STT_SECTION)
-                {
                     sym[j].st_value += sec_shdr->sh_addr;
-                }
                 else if (ELF64_ST_TYPE(sym[j].st_info) == STT_OBJECT)
-                {
                     sym[j].st_value += sec_shdr->sh_addr;
-                }
             }
         }
         else if (shdr->sh_flags & SHF_ALLOC)
         {
             // Round down target address to page boundary
             uint64_t dst_addr = shdr->sh_addr & ~(KiB(4) - 1);
-            uint64_t dst_sz = shdr->sh_size;
 
             uint64_t targ_addr = shdr->sh_addr;
-            uint64_t src_off = shdr->sh_addr & (KiB(4) - 1);
             uint64_t src_addr = (uint64_t)hdr + shdr->sh_offset;
             uint64_t src_sz = shdr->sh_size;
 
-            // Round up page size
-            if (dst_sz % KiB(4) != 0)
-                dst_sz += KiB(4) - (dst_sz % KiB(4));
+            int flags = ELF_PAGE_DATA;
+            if (shdr->sh_flags & SHF_WRITE)
+                flags |= ELF_PAGE_WRITE;
+            if (shdr->sh_flags & SHF_EXECINSTR)
+                flags |= ELF_PAGE_EXEC;
 
-            // Determine if mapping for each page exists
-            // Create mapping for missing pages
-            intptr_t phys_dst_addr = 0;
-            cs_id dst_shmem_id = 0;
-            for (uint64_t j = 0; j < dst_sz; j += KiB(4))
+            for (uint64_t j = dst_addr; src_sz > 0; j += KiB(4))
             {
-                if (task_virttophys(task_id, (intptr_t)dst_addr + j, &phys_dst_addr) != CS_OK)
-                    task_map(task_id, NULL, (intptr_t)(dst_addr + j), KiB(4), task_map_none, task_map_perm_cachewriteback | (shdr->sh_flags & SHF_EXECINSTR ? task_map_perm_execute : task_map_perm_writeonly), 0, 0, &dst_shmem_id);
+                elf_image_page_t *pg = elf_image_page(img, j);
+                pg->flags |= flags;
 
-                if (task_virttophys(task_id, (intptr_t)dst_addr + j, &phys_dst_addr) != CS_OK)
-                    PANIC("[SysTaskMgr] Elf memory allocation failure.");
+                if (pg->phys == 0)
+                {
+                    pg->phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_instr | physmem_alloc_flags_zero, KiB(4));
+                    if (pg->phys == (uintptr_t)-1)
+                        PANIC("[SysTaskMgr] Elf memory allocation failure.");
+                }
 
-                //task_map ensures a clear page
-                intptr_t map_vaddr = vmem_phystovirt(phys_dst_addr, KiB(4), task_map_perm_cachewriteback);
+                intptr_t map_vaddr = vmem_phystovirt(pg->phys, KiB(4), vmem_flags_cachewriteback);
 
-                uint64_t dst_off = targ_addr - (dst_addr + j);
+                uint64_t dst_off = targ_addr - j;
                 uint64_t cp_sz = MIN(KiB(4) - dst_off, src_sz);
 
                 memcpy((uint64_t *)(map_vaddr + dst_off), (uint64_t *)src_addr, cp_sz);
@@ -162,6 +160,96 @@ int user_elf_load(cs_id task_id, void *elf, size_t elf_len, void (**entry_point)
             }
         }
     }
+}
+
+//Building stays under the lock, it relocates the ELF's symbol table in place and must only run once
+static elf_image_t *elf_image_get(Elf64_Ehdr *hdr)
+{
+    int cli_state = cli();
+    local_spinlock_lock(&images_lock);
+    elf_image_t *img = images;
+    while (img != NULL && img->elf != hdr)
+        img = img->next;
+
+    if (img == NULL)
+    {
+        img = malloc(sizeof(elf_image_t));
+        if (img == NULL)
+            PANIC("[SysTaskMgr] Elf image allocation failure.");
+        img->elf = hdr;
+        img->pages = NULL;
+        img->page_cnt = 0;
+        img->page_cap = 0;
+        elf_image_build(img, hdr);
+
+        img->next = images;
+        images = img;
+    }
+    local_spinlock_unlock(&images_lock);
+    sti(cli_state);
+    return img;
+}
+
+int user_elf_load(cs_id task_id, void *elf, size_t elf_len, void (**entry_point)(void *))
+{
+    if (elf == NULL)
+        return -1;
+
+    if (entry_point == NULL)
+        return -1;
+
+    if (elf_len == 0)
+        return -1;
+
+    Elf64_Ehdr *hdr = elf;
+
+    // Verify the header
+    Elf_CommonEhdr *c_hdr = &hdr->e_hdr;
+    if (c_hdr->e_ident[EI_MAG0] != ELF_MAG0)
+        return -1;
+    if (c_hdr->e_ident[EI_MAG1] != ELF_MAG1)
+        return -1;
+    if (c_hdr->e_ident[EI_MAG2] != ELF_MAG2)
+        return -1;
+    if (c_hdr->e_ident[EI_MAG3] != ELF_MAG3)
+        return -1;
+
+    if (c_hdr->e_ident[EI_DATA] != ELFDATA2LSB)
+        return -2;
+    if (c_hdr->e_type != ET_EXEC)
+        return -2;
+    if (c_hdr->e_machine == ET_NONE)
+        return -2;
+    if (c_hdr->e_version != EV_CURRENT)
+        return -2;
+    if (c_hdr->e_ident[EI_OSABI] != ELFOSABI_GNU &&
+        c_hdr->e_ident[EI_OSABI] != ELFOSABI_NONE)
+        return -2;
+
+    *entry_point = (void (*)(void *))hdr->e_entry;
+
+    // setup pages into target process
+    elf_image_t *img = elf_image_get(hdr);
+    for (int i = 0; i < img->page_cnt; i++)
+    {
+        elf_image_page_t *pg = &img->pages[i];
+
+        task_map_perms_t perms = task_map_perm_cachewriteback;
+        if (pg->flags & ELF_PAGE_WRITE)
+            perms |= task_map_perm_writeonly;
+        if (pg->flags & ELF_PAGE_EXEC)
+            perms |= task_map_perm_execute;
+
+        cs_id dst_shmem_id = 0;
+        cs_error err;
+        if (pg->flags & ELF_PAGE_DATA)
+            err = task_mapvmem(task_id, (intptr_t)pg->vaddr, (intptr_t)pg->phys, KiB(4), perms, vmem_map_cow, &dst_shmem_id);
+        else
+            err = task_mapvmem(task_id, (intptr_t)pg->vaddr, 0, KiB(4), perms, vmem_map_demand, &dst_shmem_id);
+
+        if (err != CS_OK)
+            PANIC("[SysTaskMgr] Elf memory allocation failure.");
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,172 @@
+/**
+ * Copyright (c) 2021 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <cardinal/local_spinlock.h>
+
+#include "SysVirtualMemory/vmem.h"
+
+#include "task_priv.h"
+
+#define WAIT_HASH_BITS 8
+#define WAIT_HASH_SIZE (1 << WAIT_HASH_BITS)
+
+typedef struct
+{
+    int lock;
+    task_waitqueue_t queue;
+} wait_bucket_t;
+
+//Futex style waiters, hashed on the physical address being waited on
+static wait_bucket_t wait_buckets[WAIT_HASH_SIZE];
+
+static wait_bucket_t *wait_bucket(uintptr_t key)
+{
+    return &wait_buckets[((key >> 2) * 0x9E3779B97F4A7C15ull) >> (64 - WAIT_HASH_BITS)];
+}
+
+static uintptr_t wait_getkey(uint32_t *addr)
+{
+    //Kernel addresses resolve without a task, so this is safe from interrupt handlers
+    vmem_t *mem = NULL;
+    if ((intptr_t)addr >= 0)
+    {
+        process_desc_t *task = task_current_desc();
+        if (task == NULL)
+            return 0;
+        mem = task->mem;
+    }
+
+    intptr_t phys = 0;
+    if (vmem_virttophys(mem, (intptr_t)addr, &phys) != 0)
+        return 0;
+    return (uintptr_t)phys;
+}
+
+static void waitqueue_unlink(task_waitqueue_t *wq, process_desc_t *task)
+{
+    if (task->wait_prev != NULL)
+        task->wait_prev->wait_next = task->wait_next;
+    else
+        wq->head = task->wait_next;
+
+    if (task->wait_next != NULL)
+        task->wait_next->wait_prev = task->wait_prev;
+    else
+        wq->tail = task->wait_prev;
+
+    task->wait_next = NULL;
+    task->wait_prev = NULL;
+    task->wait_queue = NULL;
+    task->wait_lock = NULL;
+}
+
+void waitqueue_block(task_waitqueue_t *wq, int *lock, process_desc_t *task, uintptr_t key)
+{
+    task->wait_queue = wq;
+    task->wait_lock = lock;
+    task->wait_key = key;
+
+    task->wait_next = NULL;
+    task->wait_prev = wq->tail;
+    if (wq->tail != NULL)
+        wq->tail->wait_next = task;
+    else
+        wq->head = task;
+    wq->tail = task;
+
+    //A running task only switches out as blocked once it yields, so a wake before then is not lost
+    sched_setstate(task, task_state_blocked);
+}
+
+int waitqueue_wake(task_waitqueue_t *wq, uintptr_t key, int n)
+{
+    int woken = 0;
+    process_desc_t *iter = wq->head;
+    while (iter != NULL && woken < n)
+    {
+        process_desc_t *next = iter->wait_next;
+        if (key == 0 || iter->wait_key == key)
+        {
+            waitqueue_unlink(wq, iter);
+            sched_setstate(iter, task_state_pending);
+            woken++;
+        }
+        iter = next;
+    }
+    return woken;
+}
+
+void waitqueue_cancel(process_desc_t *task)
+{
+    //The task may be woken and block elsewhere concurrently, retry until the lock matches
+    while (true)
+    {
+        int *lock = task->wait_lock;
+        if (lock == NULL)
+            return;
+
+        local_spinlock_lock(lock);
+        if (task->wait_lock == lock)
+        {
+            waitqueue_unlink(task->wait_queue, task);
+            local_spinlock_unlock(lock);
+            return;
+        }
+        local_spinlock_unlock(lock);
+    }
+}
+
+cs_error task_wait(uint32_t *addr, uint32_t val)
+{
+    if (addr == NULL)
+        return CS_UNKN;
+
+    uintptr_t key = wait_getkey(addr);
+    if (key == 0)
+        return CS_UNKN;
+
+    wait_bucket_t *bucket = wait_bucket(key);
+
+    int cli_state = cli();
+    local_spinlock_lock(&bucket->lock);
+    if (*(volatile uint32_t *)addr != val)
+    {
+        local_spinlock_unlock(&bucket->lock);
+        sti(cli_state);
+        return CS_OK;
+    }
+
+    waitqueue_block(&bucket->queue, &bucket->lock, task_current_desc(), key);
+    local_spinlock_unlock(&bucket->lock);
+
+    task_yield();
+    sti(cli_state);
+    return CS_OK;
+}
+
+int task_wake(uint32_t *addr, int n)
+{
+    if (addr == NULL)
+        return 0;
+
+    uintptr_t key = wait_getkey(addr);
+    if (key == 0)
+        return 0;
+
+    wait_bucket_t *bucket = wait_bucket(key);
+
+    int cli_state = cli();
+    local_spinlock_lock(&bucket->lock);
+    int woken = waitqueue_wake(&bucket->queue, key, n);
+    local_spinlock_unlock(&bucket->lock);
+    sti(cli_state);
+
+    return woken;
+}
@@ -135,8 +135,9 @@ int timer_request(timer_features_t features, uint64_t ns, void (*handler)(int))
 {
     //Allocate a timer for the desired mode with a rate that can match the desired time
     int idx = 0;
+    //Local timers keep their state per-core, so each core may request its own instance
     for (; idx < timer_idx; idx++)
-        if (!timer_defs[idx].in_use && ((timer_defs[idx].features & features) == features))
+        if ((!timer_defs[idx].in_use || (features & timer_features_local)) && ((timer_defs[idx].features & features) == features))
         {
 
             if (timer_defs[idx].handlers.set_mode != NULL &&
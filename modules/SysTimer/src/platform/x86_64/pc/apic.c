@@ -14,8 +14,6 @@
 #include "SysMP/mp.h"
 #include "SysReg/registry.h"
 
-#define IA32_TSC_DEADLINE 0x6e0
-
 typedef struct {
     bool tsc_mode;
     bool enabled;
@@ -24,17 +22,24 @@ typedef struct {
 } tls_apic_timer_state_t;
 
 int local_apic_timer_init(bool tsc_mode, void (*handler)(int), bool ap);
+void local_apic_timer_oneshot(uint32_t count);
+void local_apic_timer_deadline(uint64_t tsc);
 PRIVATE uint64_t tsc_read(timer_handlers_t *handlers);
 static TLS tls_apic_timer_state_t *apic_state = NULL;
 
+static uint64_t apic_freq = 0;
+static uint64_t apic_tsc_freq = 0;
+static bool apic_tsc_deadline = false;
+
 PRIVATE void apic_handler(int irq) {
     if(apic_state->enabled) {
-        if(apic_state->handler != NULL)
-            apic_state->handler(irq);
-
+        //Disable first, so the handler is free to rearm a one-shot timer
         if(apic_state->oneshot) {
             apic_state->enabled = false;
         }
+
+        if(apic_state->handler != NULL)
+            apic_state->handler(irq);
     }
 }
 
@@ -43,6 +48,7 @@ PRIVATE uint64_t apic_timer_setmode(timer_handlers_t *handler, timer_features_t
 
     if(features & timer_features_oneshot) {
         apic_state->oneshot = true;
+        local_apic_timer_oneshot(0);    //Stop the periodic tick, the timer is armed through timer_local_deadline
     } else if(features & timer_features_periodic) {
         apic_state->oneshot = false;
     }
@@ -91,10 +97,56 @@ PRIVATE int apic_timer_init() {
 
     local_apic_timer_init(false, apic_handler, apic_init_done);
 
+    if(!apic_init_done) {
+        registry_readkey_uint("HW/PROC", "APIC_FREQ", &apic_freq);
+        registry_readkey_uint("HW/PROC", "TSC_FREQ", &apic_tsc_freq);
+        registry_readkey_bool("HW/PROC", "TSC_DEADLINE", &apic_tsc_deadline);
+        if(apic_tsc_freq == 0)
+            apic_tsc_deadline = false;
+    }
+
     apic_init_done = true;
     return 0;
 }
 
+static uint64_t ns_to_ticks(uint64_t ns, uint64_t freq) {
+    //Split to avoid overflowing ns * freq
+    const uint64_t ns_per_s = 1000 * 1000 * 1000;
+    return (ns / ns_per_s) * freq + ((ns % ns_per_s) * freq) / ns_per_s;
+}
+
+int timer_local_deadline(uint64_t deadline_ns) {
+    if(apic_state == NULL)
+        return -1;
+
+    if(deadline_ns == 0) {
+        apic_state->enabled = false;
+        local_apic_timer_oneshot(0);
+        return 0;
+    }
+
+    uint64_t now = timer_timestamp_ns();
+    uint64_t delta = (deadline_ns > now) ? deadline_ns - now : 0;
+
+    apic_state->oneshot = true;
+    apic_state->enabled = true;
+
+    if(apic_tsc_deadline) {
+        local_apic_timer_deadline(tsc_read(NULL) + ns_to_ticks(delta, apic_tsc_freq));
+    } else {
+        if(apic_freq == 0)
+            return -1;
+
+        uint64_t ticks = ns_to_ticks(delta, apic_freq);
+        if(ticks == 0)
+            ticks = 1;
+        if(ticks > 0xffffffff)
+            ticks = 0xffffffff;
+        local_apic_timer_oneshot((uint32_t)ticks);
+    }
+    return 0;
+}
+
 PRIVATE int apic_timer_tsc_init() {
     local_apic_timer_init(true, apic_handler, apic_init_done);
 
@@ -0,0 +1,230 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "SysVirtualMemory/vmem.h"
+#include "SysPhysicalMemory/phys_mem.h"
+#include "vmem_priv.h"
+#include <cardinal/local_spinlock.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <types.h>
+
+// Page fault resolution for user address spaces.
+// Demand mappings are left non-present with SW_DEMAND set and the final permissions in place, the
+// first access swaps in a zeroed page from the physical allocator's pool. Copy-on-write mappings
+// point at a shared page with WRITE cleared, the first write copies it into a page owned by the
+// address space. Guard entries are never backed and are reported back to the caller.
+
+static _Atomic uint64_t stat_demand = 0;
+static _Atomic uint64_t stat_cow = 0;
+static _Atomic uint64_t stat_spurious = 0;
+static _Atomic uint64_t stat_failed = 0;
+static _Atomic uint64_t stat_cycles = 0;
+static _Atomic uint64_t stat_max_cycles = 0;
+
+//Caller holds vm->lock
+static int vmem_resolve(vmem_t *vm, uint64_t *ent, intptr_t virt, uint64_t err, bool *flush)
+{
+    uint64_t e = *ent;
+
+    if (e & SW_GUARD)
+        return vmem_err_guard;
+
+    if (e & SW_DEMAND)
+    {
+        uintptr_t pg = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_zero, KiB(4));
+        if (pg == (uintptr_t)-1)
+            return vmem_err_nomem;
+
+        *ent = (e & ~(SW_DEMAND | ADDR_MASK)) | pg | SW_OWNED | PRESENT;
+        stat_demand++;
+        return vmem_err_none;
+    }
+
+    if ((e & PRESENT) == 0)
+        return vmem_err_nomapping;
+
+    //User code touching a kernel page is never resolved, not even through a copy
+    if ((err & vmem_fault_user) && (e & USER) == 0)
+        return vmem_err_nomapping;
+
+    bool write = (err & vmem_fault_write) != 0;
+    if (write && (e & SW_COW))
+    {
+        uintptr_t pg = pagealloc_alloc(-1, -1, physmem_alloc_flags_data, KiB(4));
+        if (pg == (uintptr_t)-1)
+            return vmem_err_nomem;
+
+        memcpy((void *)vmem_phystovirt(pg, KiB(4), vmem_flags_cachewriteback),
+               (void *)vmem_phystovirt(e & ADDR_MASK, KiB(4), vmem_flags_cachewriteback),
+               KiB(4));
+
+        *ent = (e & ~(SW_COW | SW_SHARED | ADDR_MASK)) | pg | SW_OWNED | WRITE;
+        vmem_shootdown_queue(vm, virt, KiB(4));
+        *flush = true;
+        stat_cow++;
+        return vmem_err_none;
+    }
+
+    //Accesses the entry doesn't allow are real protection faults, returning would just fault again
+    if (write && (e & WRITE) == 0)
+        return vmem_err_nomapping;
+    if ((err & vmem_fault_fetch) && (e & NOEXEC))
+        return vmem_err_nomapping;
+
+    //The entry allows the access, another core resolved it first or the TLB held a stale entry
+    __asm__ volatile("invlpg (%0)" ::"r"(virt)
+                     : "memory");
+    stat_spurious++;
+    return vmem_err_none;
+}
+
+int vmem_handlefault(intptr_t virt, uint64_t err)
+{
+    //Kernel mappings are never populated lazily
+    if (virt < 0)
+        return vmem_err_nomapping;
+
+    uint64_t start = vmem_rdtsc();
+
+    vmem_t *vm = vmem_getlcl()->cur_vmem;
+    if (vm == NULL)
+        return vmem_err_nomapping;
+
+    virt &= ~(intptr_t)(KiB(4) - 1);
+
+    int cli_state = cli();
+    local_spinlock_lock(&vm->lock);
+
+    int rVal = vmem_err_nomapping;
+    bool flush = false;
+    uint64_t *ent = vmem_getleaf(vm, virt);
+    if (ent != NULL)
+        rVal = vmem_resolve(vm, ent, virt, err, &flush);
+
+    if (flush)
+        vmem_shootdown_commit(vm);
+
+    local_spinlock_unlock(&vm->lock);
+    sti(cli_state);
+
+    if (rVal != vmem_err_none)
+    {
+        stat_failed++;
+        return rVal;
+    }
+
+    uint64_t cycles = vmem_rdtsc() - start;
+    stat_cycles += cycles;
+    uint64_t prev_max = stat_max_cycles;
+    while (cycles > prev_max && !__atomic_compare_exchange_n(&stat_max_cycles, &prev_max, cycles, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    return vmem_err_none;
+}
+
+int vmem_populate(vmem_t *vm, intptr_t virt, size_t size)
+{
+    if (vm == NULL || virt < 0)
+        return vmem_err_nomapping;
+
+    intptr_t end = virt + size;
+    virt &= ~(intptr_t)(KiB(4) - 1);
+
+    int cli_state = cli();
+    local_spinlock_lock(&vm->lock);
+
+    int rVal = vmem_err_none;
+    for (; virt < end; virt += KiB(4))
+    {
+        uint64_t *ent = vmem_getleaf(vm, virt);
+        if (ent == NULL)
+        {
+            rVal = vmem_err_nomapping;
+            break;
+        }
+
+        if ((*ent & SW_DEMAND) == 0)
+            continue;
+
+        bool flush = false;
+        rVal = vmem_resolve(vm, ent, virt, 0, &flush);
+        if (rVal != vmem_err_none)
+            break;
+    }
+
+    local_spinlock_unlock(&vm->lock);
+    sti(cli_state);
+    return rVal;
+}
+
+int vmem_protect(vmem_t *vm, intptr_t virt, size_t size, int perms)
+{
+    if (vm == NULL || virt < 0)
+        return vmem_err_nomapping;
+
+    uint64_t perm_mask = WRITE | NOEXEC | USER | WRITETHROUGH | CACHEDISABLE;
+    uint64_t c_flags = vmem_permbits(perms);
+
+    int cli_state = cli();
+    local_spinlock_lock(&vm->lock);
+
+    int rVal = vmem_err_none;
+    for (intptr_t cur = virt; cur < virt + (intptr_t)size; cur += KiB(4))
+    {
+        uint64_t *ent = vmem_getleaf(vm, cur);
+        if (ent == NULL)
+        {
+            rVal = vmem_err_nomapping;
+            break;
+        }
+
+        uint64_t e = *ent;
+        if (e & SW_GUARD)
+            continue;
+
+        e = (e & ~perm_mask) | c_flags;
+
+        //Shared pages only become writable through a copy
+        if (e & SW_SHARED)
+        {
+            e &= ~(WRITE | SW_COW);
+            if (c_flags & WRITE)
+                e |= SW_COW;
+        }
+        *ent = e;
+    }
+
+    vmem_shootdown_queue(vm, virt, size);
+    vmem_shootdown_commit(vm);
+    local_spinlock_unlock(&vm->lock);
+    sti(cli_state);
+    return rVal;
+}
+
+//Dump page fault counters
+int vmem_faultstats()
+{
+    char tmp[20];
+    uint64_t resolved = stat_demand + stat_cow + stat_spurious;
+
+    DEBUG_PRINT("[SysVirtualMemory] Demand zero faults: ");
+    DEBUG_PRINT(ltoa(stat_demand, tmp, 10));
+    DEBUG_PRINT("\r\n[SysVirtualMemory] Copy-on-write faults: ");
+    DEBUG_PRINT(ltoa(stat_cow, tmp, 10));
+    DEBUG_PRINT("\r\n[SysVirtualMemory] Spurious faults: ");
+    DEBUG_PRINT(ltoa(stat_spurious, tmp, 10));
+    DEBUG_PRINT("\r\n[SysVirtualMemory] Unresolved faults: ");
+    DEBUG_PRINT(ltoa(stat_failed, tmp, 10));
+    DEBUG_PRINT("\r\n[SysVirtualMemory] Average cycles per minor fault: ");
+    DEBUG_PRINT(ltoa(resolved == 0 ? 0 : stat_cycles / resolved, tmp, 10));
+    DEBUG_PRINT("\r\n[SysVirtualMemory] Worst minor fault cycles: ");
+    DEBUG_PRINT(ltoa(stat_max_cycles, tmp, 10));
+    DEBUG_PRINT("\r\n");
+    return 0;
+}
@@ -0,0 +1,319 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "SysVirtualMemory/vmem.h"
+#include "SysInterrupts/interrupts.h"
+#include "vmem_priv.h"
+#include "elf.h"
+#include <cardinal/local_spinlock.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <types.h>
+
+// Cross core TLB invalidation.
+// Unmaps collect their ranges on the address space, vmem_shootdown_commit then posts them to the
+// mailbox of every core that has the address space loaded and sends an IPI only if the core
+// doesn't already have one in flight, so bursts of unmaps share a single interrupt. The initiator
+// does not wait, it records the mailbox sequence number it needs acknowledged and
+// vmem_shootdown_wait spins on those only when the caller is about to reuse the freed memory.
+
+typedef struct
+{
+    vmem_t *vm;
+    intptr_t virt;
+    size_t sz; //SHOOTDOWN_ALL drops everything belonging to vm
+} shootdown_req_t;
+
+typedef struct
+{
+    int lock;
+    int apic_id;
+    bool ipi_pending;
+    bool overflow;
+    int cnt;
+    shootdown_req_t reqs[SHOOTDOWN_MAILBOX_LEN];
+    _Atomic uint64_t req_seq;
+    _Atomic uint64_t done_seq;
+} shootdown_mailbox_t;
+
+static shootdown_mailbox_t mailboxes[VMEM_MAX_CORES];
+static _Atomic uint64_t shootdown_online = 0;
+static int shootdown_vector = 0;
+
+static int (*shootdown_getcpuidx)(void);
+static void (*shootdown_sendipi)(int, int, ipi_delivery_mode_t);
+
+static _Atomic uint64_t stat_ipis = 0;
+static _Atomic uint64_t stat_pages = 0;
+static _Atomic uint64_t stat_fullflushes = 0;
+static _Atomic uint64_t stat_wait_cycles = 0;
+
+static void shootdown_invalidate(TLS struct lcl_data *lcl, vmem_t *vm, intptr_t virt, size_t sz)
+{
+    //Other address spaces are covered by the PCID generation reset done by the initiator
+    if (vm != &kmem && vm != lcl->cur_vmem)
+        return;
+
+    vmem_flush_local(vm, virt, sz);
+    if (sz / KiB(4) > SHOOTDOWN_FULL_PAGES)
+        stat_fullflushes++;
+    else
+        stat_pages += sz / KiB(4);
+}
+
+//Must be called with interrupts disabled
+static void shootdown_drain()
+{
+    TLS struct lcl_data *lcl = vmem_getlcl();
+    shootdown_mailbox_t *mb = &mailboxes[lcl->core_idx];
+
+    local_spinlock_lock(&mb->lock);
+    if (mb->overflow)
+    {
+        vmem_flushall();
+        stat_fullflushes++;
+    }
+    else
+        for (int i = 0; i < mb->cnt; i++)
+            shootdown_invalidate(lcl, mb->reqs[i].vm, mb->reqs[i].virt, mb->reqs[i].sz);
+
+    mb->cnt = 0;
+    mb->overflow = false;
+    mb->ipi_pending = false;
+    uint64_t seq = mb->req_seq;
+    local_spinlock_unlock(&mb->lock);
+
+    mb->done_seq = seq;
+}
+
+static void shootdown_handler(int irq)
+{
+    irq = 0;
+    shootdown_drain();
+}
+
+PRIVATE void vmem_shootdown_queue(vmem_t *vm, intptr_t virt, size_t sz)
+{
+    if (sz == 0 || vm->sd_full)
+        return;
+
+    vm->sd_pages += sz / KiB(4);
+    if (vm->sd_pages > SHOOTDOWN_FULL_PAGES)
+    {
+        vm->sd_full = true;
+        return;
+    }
+
+    //Merge with the previous range when unmapping consecutive regions
+    if (vm->sd_cnt > 0)
+    {
+        vmem_range_t *last = &vm->sd_ranges[vm->sd_cnt - 1];
+        if (last->virt + (intptr_t)last->sz == virt)
+        {
+            last->sz += sz;
+            return;
+        }
+    }
+
+    if (vm->sd_cnt >= SHOOTDOWN_BATCH_LEN)
+    {
+        vm->sd_full = true;
+        return;
+    }
+
+    vm->sd_ranges[vm->sd_cnt].virt = virt;
+    vm->sd_ranges[vm->sd_cnt].sz = sz;
+    vm->sd_cnt++;
+}
+
+static void shootdown_post(shootdown_mailbox_t *mb, vmem_t *vm)
+{
+    if (mb->overflow)
+        return;
+
+    int req_cnt = vm->sd_full ? 1 : vm->sd_cnt;
+    if (mb->cnt + req_cnt > SHOOTDOWN_MAILBOX_LEN)
+    {
+        mb->overflow = true;
+        return;
+    }
+
+    if (vm->sd_full)
+    {
+        mb->reqs[mb->cnt].vm = vm;
+        mb->reqs[mb->cnt].virt = 0;
+        mb->reqs[mb->cnt].sz = SHOOTDOWN_ALL;
+        mb->cnt++;
+    }
+    else
+        for (int i = 0; i < vm->sd_cnt; i++)
+        {
+            mb->reqs[mb->cnt].vm = vm;
+            mb->reqs[mb->cnt].virt = vm->sd_ranges[i].virt;
+            mb->reqs[mb->cnt].sz = vm->sd_ranges[i].sz;
+            mb->cnt++;
+        }
+}
+
+//Caller holds vm->lock, the page tables must already be updated
+PRIVATE void vmem_shootdown_commit(vmem_t *vm)
+{
+    if (!vm->sd_full && vm->sd_cnt == 0)
+        return;
+
+    //Cores that have this address space tagged but not loaded pick up a fresh PCID on their next switch
+    if (vm != &kmem)
+        vmem_pcid_invalidate(vm);
+
+    //Pairs with the fence in vmem_setactive, a core switching in either sees the reset generation
+    //or is already in active and gets an IPI. Without it the load below may pass the stores above.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    int state = cli();
+    TLS struct lcl_data *lcl = vmem_getlcl();
+    int self = lcl->core_idx;
+    uint64_t targets = (vm == &kmem) ? (shootdown_online | (1ull << self)) : vm->active;
+
+    for (int core = 0; core < VMEM_MAX_CORES; core++)
+    {
+        if (~targets & (1ull << core))
+            continue;
+
+        if (core == self)
+        {
+            if (vm->sd_full)
+                shootdown_invalidate(lcl, vm, 0, SHOOTDOWN_ALL);
+            else
+                for (int i = 0; i < vm->sd_cnt; i++)
+                    shootdown_invalidate(lcl, vm, vm->sd_ranges[i].virt, vm->sd_ranges[i].sz);
+            continue;
+        }
+
+        //Cores that haven't brought up their IPI handler yet run with the kernel table only
+        if (~shootdown_online & (1ull << core))
+            continue;
+
+        shootdown_mailbox_t *mb = &mailboxes[core];
+        local_spinlock_lock(&mb->lock);
+        shootdown_post(mb, vm);
+        uint64_t seq = ++mb->req_seq;
+        bool send = !mb->ipi_pending;
+        mb->ipi_pending = true;
+        local_spinlock_unlock(&mb->lock);
+
+        vm->sd_ticket[core] = seq;
+        vm->sd_pending |= (1ull << core);
+
+        if (send)
+        {
+            shootdown_sendipi(mb->apic_id, shootdown_vector, ipi_delivery_mode_fixed);
+            stat_ipis++;
+        }
+    }
+    sti(state);
+
+    vm->sd_cnt = 0;
+    vm->sd_pages = 0;
+    vm->sd_full = false;
+}
+
+void vmem_shootdown_wait(vmem_t *vm)
+{
+    if (vm == NULL)
+        vm = &kmem;
+
+    //Everything on the release list was committed before it was added, so the tickets below cover it.
+    //The tickets are taken together with the list, a commit on another core after this point posts
+    //newer ones that its own caller waits on.
+    uint64_t tickets[VMEM_MAX_CORES];
+    int cli_state = cli();
+    local_spinlock_lock(&vm->lock);
+    uintptr_t *release = vm->release;
+    size_t release_cnt = vm->release_cnt;
+    vm->release = NULL;
+    vm->release_cnt = 0;
+    vm->release_cap = 0;
+    uint64_t pending = vm->sd_pending;
+    for (int core = 0; core < VMEM_MAX_CORES; core++)
+        if (pending & (1ull << core))
+            tickets[core] = vm->sd_ticket[core];
+    vm->sd_pending = 0;
+    local_spinlock_unlock(&vm->lock);
+    sti(cli_state);
+
+    if (pending == 0)
+    {
+        vmem_release_free(release, release_cnt);
+        return;
+    }
+
+    uint64_t start = vmem_rdtsc();
+    for (int core = 0; core < VMEM_MAX_CORES; core++)
+    {
+        if (~pending & (1ull << core))
+            continue;
+
+        while (mailboxes[core].done_seq < tickets[core])
+        {
+            //Keep acknowledging our own requests in case the other core is waiting on us with interrupts off
+            int state = cli();
+            if (mailboxes[vmem_getlcl()->core_idx].ipi_pending)
+                shootdown_drain();
+            sti(state);
+            __asm__ volatile("pause");
+        }
+    }
+    stat_wait_cycles += vmem_rdtsc() - start;
+
+    vmem_release_free(release, release_cnt);
+}
+
+int vmem_shootdown_mp_init()
+{
+    TLS struct lcl_data *lcl = vmem_getlcl();
+    shootdown_mailbox_t *mb = &mailboxes[lcl->core_idx];
+
+    mb->lock = 0;
+    mb->apic_id = shootdown_getcpuidx();
+    mb->cnt = 0;
+    mb->ipi_pending = false;
+    mb->overflow = false;
+
+    shootdown_online |= (1ull << lcl->core_idx);
+    return 0;
+}
+
+int vmem_shootdown_init()
+{
+    int (*interrupt_allocate)(int, interrupt_flags_t, int *) = (int (*)(int, interrupt_flags_t, int *))elf_resolvefunction("interrupt_allocate");
+    void (*interrupt_registerhandler)(int, InterruptHandler) = (void (*)(int, InterruptHandler))elf_resolvefunction("interrupt_registerhandler");
+
+    shootdown_getcpuidx = (int (*)(void))elf_resolvefunction("interrupt_get_cpuidx");
+    shootdown_sendipi = (void (*)(int, int, ipi_delivery_mode_t))elf_resolvefunction("interrupt_sendipi");
+
+    if (interrupt_allocate(1, interrupt_flags_exclusive, &shootdown_vector) != 0)
+        PANIC("[SysVirtualMemory] Failed to allocate shootdown vector.");
+    interrupt_registerhandler(shootdown_vector, shootdown_handler);
+
+    return vmem_shootdown_mp_init();
+}
+
+//Dump shootdown counters
+int vmem_shootdown_stats()
+{
+    char tmp[20];
+    DEBUG_PRINT("[SysVirtualMemory] Shootdown IPIs sent: ");
+    DEBUG_PRINT(ltoa(stat_ipis, tmp, 10));
+    DEBUG_PRINT("\r\n[SysVirtualMemory] Pages invalidated: ");
+    DEBUG_PRINT(ltoa(stat_pages, tmp, 10));
+    DEBUG_PRINT("\r\n[SysVirtualMemory] Full flushes: ");
+    DEBUG_PRINT(ltoa(stat_fullflushes, tmp, 10));
+    DEBUG_PRINT("\r\n[SysVirtualMemory] Cycles waiting for acknowledgement: ");
+    DEBUG_PRINT(ltoa(stat_wait_cycles, tmp, 10));
+    DEBUG_PRINT("\r\n");
+    return 0;
+}
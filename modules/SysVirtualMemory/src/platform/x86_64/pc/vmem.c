@@ -1,4 +1,5 @@
 #include "SysVirtualMemory/vmem.h"
+#include "vmem_priv.h"
 #include "SysPhysicalMemory/phys_mem.h"
 #include "SysReg/registry.h"
 #include "elf.h"
@@ -9,37 +10,10 @@
 #include <stdlib.h>
 #include <types.h>
 
-#define PRESENT (1ull << 0)
-#define WRITE (1ull << 1)
-#define USER (1ull << 2)
-
-#define WRITETHROUGH (1ull << 3)
-#define CACHEDISABLE (1ull << 4)
-#define WRITEBACK (0)
-#define WRITECOMPLETE (3ull << 3)
-
-#define LARGEPAGE (1ull << 7)
-#define GLOBALPAGE (1ull << 8)
-#define NOEXEC (1ull << 63)
-#define ADDR_MASK (0x000ffffffffff000)
-
 #define KERN_TOP_BASE (0xffffffff80000000)
 #define KERN_PHYSMAP_BASE (0xFFFF800000000000)
 #define KERN_PHYSMAP_BASE_UC (KERN_PHYSMAP_BASE + GiB(512))
 
-struct vmem
-{
-    uint64_t ptable[256];
-    int flags;
-    int lock;
-};
-
-struct lcl_data
-{
-    uintptr_t ktable;
-    vmem_t *cur_vmem;
-};
-
 static uint64_t levels[] = {
     GiB(512),
     GiB(1),
@@ -68,9 +42,13 @@ static bool largepage_avail[] = {
 };
 
 static TLS struct lcl_data *lcl;
-static vmem_t kmem;
+PRIVATE vmem_t kmem;
 static size_t phys_map_sz;
 
+static bool pcid_avail = false;
+static bool invpcid_avail = false;
+static _Atomic int vmem_core_cnt = 0;
+
 static uint64_t kernel_vmalloc = (KERN_PHYSMAP_BASE_UC + GiB(512));
 
 //TODO: none of these operations are atomic to preemption within the kernel
@@ -87,6 +65,67 @@ void vmem_vfree(intptr_t virt, size_t sz)
         kernel_vmalloc -= sz;
 }
 
+static void vmem_pcid_init()
+{
+    lcl->core_idx = vmem_core_cnt++;
+    if (lcl->core_idx >= VMEM_MAX_CORES)
+        PANIC("[SysVirtualMemory] Too many cores.");
+    lcl->pcid_next = 1; //PCID 0 is left for the kernel only table
+    lcl->pcid_gen = 1;
+
+    //Kernel mappings are global, so they survive address space switches
+    uint64_t cr4 = 0;
+    __asm__ volatile("mov %%cr4, %0"
+                     : "=r"(cr4)::);
+    cr4 |= CR4_PGE;
+    if (pcid_avail)
+        cr4 |= CR4_PCIDE; //CR3 must have PCID 0 loaded here
+    __asm__ volatile("mov %0, %%cr4" ::"r"(cr4));
+}
+
+//Drop every translation on this core, including global ones and those of other PCIDs
+PRIVATE void vmem_flushall(void)
+{
+    if (invpcid_avail)
+    {
+        uint64_t desc[2] = {0, 0};
+        __asm__ volatile("invpcid (%0), %1" ::"r"(desc), "r"((uint64_t)2)
+                         : "memory");
+    }
+    else
+    {
+        uint64_t cr4 = 0;
+        __asm__ volatile("mov %%cr4, %0"
+                         : "=r"(cr4)::);
+        __asm__ volatile("mov %0, %%cr4" ::"r"(cr4 & ~CR4_PGE));
+        __asm__ volatile("mov %0, %%cr4" ::"r"(cr4));
+    }
+}
+
+PRIVATE TLS struct lcl_data *vmem_getlcl(void)
+{
+    return lcl;
+}
+
+//Force every core to use a fresh PCID for this address space the next time it is activated
+PRIVATE void vmem_pcid_invalidate(vmem_t *vm)
+{
+    for (int i = 0; i < VMEM_MAX_CORES; i++)
+        vm->pcid_gen[i] = 0;
+}
+
+//Lets the benchmark compare against the old flush on every switch behaviour on an address space of
+//its own, must be called before the address space is first loaded
+PRIVATE void vmem_setuntagged(vmem_t *vm)
+{
+    vm->untagged = true;
+}
+
+PRIVATE bool vmem_pcid_enabled(void)
+{
+    return pcid_avail;
+}
+
 int vmem_init()
 {
     TLS void *(*mp_tls_get)(int) = (TLS void *(*)(int))elf_resolvefunction("mp_tls_get");
@@ -124,21 +163,30 @@ int vmem_init()
     pat |= ((uint64_t)0x1) << 24; //PAT3 WC
     wrmsr(PAT_MSR, pat);
 
-    uintptr_t ktable_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_pagetable, KiB(4));
-    uint64_t *ktable = (uint64_t *)vmem_phystovirt(ktable_phys, KiB(4), vmem_flags_cachewriteback);
-    memset(ktable, 0, KiB(4));
+    registry_readkey_bool("HW/PROC", "PCID", &pcid_avail);
+    registry_readkey_bool("HW/PROC", "INVPCID", &invpcid_avail);
 
     if (lcl == NULL)
     {
         //mp_tls_alloc(8);
         lcl = (TLS struct lcl_data *)mp_tls_get(mp_tls_alloc(sizeof(struct lcl_data)));
     }
-    lcl->ktable = ktable_phys;
     {
         kmem.flags = vmem_flags_kernel;
         kmem.lock = 0;
-        memset(kmem.ptable, 0, sizeof(uint64_t) * 256);
+        kmem.ptable_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_pagetable, KiB(4));
+        kmem.ptable = (uint64_t *)vmem_phystovirt(kmem.ptable_phys, KiB(4), vmem_flags_cachewriteback);
+        memset(kmem.ptable, 0, KiB(4));
+
+        //Preallocate the kernel half, its top level entries then never change and can be copied into each address space once
+        for (int i = 256; i < 512; i++)
+        {
+            uintptr_t n_lv = pagealloc_alloc(-1, -1, physmem_alloc_flags_pagetable, KiB(4));
+            memset((uint64_t *)vmem_phystovirt(n_lv, KiB(4), vmem_flags_cachewriteback), 0, KiB(4));
+            kmem.ptable[i] = (n_lv & ADDR_MASK) | PRESENT | WRITE | USER;
+        }
     }
+    lcl->ktable = kmem.ptable_phys;
 
     lcl->cur_vmem = NULL;
 
@@ -156,8 +204,9 @@ int vmem_init()
     vmem_map(NULL, KERN_PHYSMAP_BASE, 0x0, phys_map_sz, vmem_flags_kernel | vmem_flags_rw | vmem_flags_cachewriteback, 0);
     vmem_map(NULL, KERN_PHYSMAP_BASE_UC, 0x0, phys_map_sz, vmem_flags_kernel | vmem_flags_rw | vmem_flags_uncached, 0);
 
-    __asm__ volatile("mov %0, %%cr3" ::"r"(ktable_phys)
+    __asm__ volatile("mov %0, %%cr3" ::"r"(lcl->ktable)
                      :);
+    vmem_pcid_init();
 
     return 0;
 }
@@ -199,23 +248,42 @@ int vmem_mp_init()
     pat |= ((uint64_t)0x1) << 24; //PAT3 WC
     wrmsr(PAT_MSR, pat);
 
-    uintptr_t ktable_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_pagetable, KiB(4));
-    uint64_t *ktable = (uint64_t *)vmem_phystovirt(ktable_phys, KiB(4), vmem_flags_cachewriteback);
-    memset(ktable, 0, KiB(4));
-
-    lcl->ktable = ktable_phys;
+    //The kernel only table is shared, its top level entries are fixed
+    lcl->ktable = kmem.ptable_phys;
     lcl->cur_vmem = NULL;
 
-    local_spinlock_lock(&kmem.lock);
-    memcpy(ktable + 256, kmem.ptable, sizeof(uint64_t) * 256);
-    local_spinlock_unlock(&kmem.lock);
-
-    __asm__ volatile("mov %0, %%cr3" ::"r"(ktable_phys)
+    __asm__ volatile("mov %0, %%cr3" ::"r"(lcl->ktable)
                      :);
+    vmem_pcid_init();
 
     return 0;
 }
 
+PRIVATE uint64_t vmem_permbits(int perms)
+{
+    uint64_t c_flags = 0;
+
+    if (perms & vmem_flags_write)
+        c_flags |= WRITE;
+
+    if ((perms & vmem_flags_exec) == 0)
+        c_flags |= NOEXEC;
+
+    if (perms & vmem_flags_cachewritethrough)
+        c_flags |= WRITETHROUGH;
+    else if (perms & vmem_flags_uncached)
+        c_flags |= CACHEDISABLE;
+    else if (perms & vmem_flags_cachewritecomplete)
+        c_flags |= WRITECOMPLETE;
+    else if (perms & vmem_flags_cachewriteback)
+        c_flags |= WRITEBACK;
+
+    if (perms & vmem_flags_user)
+        c_flags |= USER;
+
+    return c_flags;
+}
+
 static int vmem_map_st(uint64_t *p_vm, uint64_t *vm, intptr_t virt, intptr_t phys, size_t size, int perms, int flags, int lv)
 {
     uint64_t mask = masks[lv];
@@ -224,41 +292,33 @@ static int vmem_map_st(uint64_t *p_vm, uint64_t *vm, intptr_t virt, intptr_t phy
 
     uint64_t idx = (virt & mask) >> shamt;
 
-    if (size % sz == 0 && largepage_avail[lv])
+    //Demand, copy-on-write and guard mappings are tracked per 4KiB page
+    if (size % sz == 0 && largepage_avail[lv] && (flags == vmem_map_none || sz == KiB(4)))
     {
-        uint64_t c_flags = 0;
-        c_flags |= PRESENT;
-
-        if (perms & vmem_flags_write)
-            c_flags |= WRITE;
-
-        if ((perms & vmem_flags_exec) == 0)
-            c_flags |= NOEXEC;
-
-        if (perms & vmem_flags_cachewritethrough)
-            c_flags |= WRITETHROUGH;
-        else if (perms & vmem_flags_uncached)
-            c_flags |= CACHEDISABLE;
-        else if (perms & vmem_flags_cachewritecomplete)
-            c_flags |= WRITECOMPLETE;
-        else if (perms & vmem_flags_cachewriteback)
-            c_flags |= WRITEBACK;
-
-        if (perms & vmem_flags_user)
-            c_flags |= USER;
+        uint64_t c_flags = vmem_permbits(perms) | PRESENT;
 
         if (sz != KiB(4))
             c_flags |= LARGEPAGE;
 
+        if (virt < 0)
+            c_flags |= GLOBALPAGE;
+
         while (size > 0)
         {
             if (idx >= 512)
                 return vmem_err_continue; //vmem_map_st(p_vm, p_vm, virt, phys, size, perms, flags, 0);
 
-            if (vm[idx] & PRESENT)
+            if (vm[idx] & (PRESENT | SW_DEMAND | SW_GUARD))
                 return vmem_err_alreadymapped;
 
-            vm[idx] = (phys & ADDR_MASK) | c_flags;
+            if (flags & vmem_map_guard)
+                vm[idx] = SW_GUARD;
+            else if (flags & vmem_map_demand)
+                vm[idx] = (c_flags & ~PRESENT) | SW_DEMAND;
+            else if (flags & vmem_map_cow)
+                vm[idx] = (phys & ADDR_MASK) | (c_flags & ~WRITE) | SW_SHARED | ((c_flags & WRITE) ? SW_COW : 0);
+            else
+                vm[idx] = (phys & ADDR_MASK) | c_flags;
 
             phys += sz;
             virt += sz;
@@ -308,70 +368,108 @@ static int vmem_map_st(uint64_t *p_vm, uint64_t *vm, intptr_t virt, intptr_t phy
     }
 }
 
-static int vmem_unmap_st(uint64_t *p_vt, uint64_t *vm, intptr_t virt, size_t size, int lv)
+//Queue a page or table to be freed once the shootdown for it has been acknowledged, caller holds vm->lock
+PRIVATE void vmem_release(vmem_t *vm, uintptr_t phys)
+{
+    if (vm->release_cnt == vm->release_cap)
+    {
+        size_t n_cap = (vm->release_cap == 0) ? 64 : vm->release_cap * 2;
+        uintptr_t *n_release = malloc(n_cap * sizeof(uintptr_t));
+        if (n_release == NULL)
+            PANIC("[SysVirtualMemory] Release list allocation failure.");
+        if (vm->release != NULL)
+        {
+            memcpy(n_release, vm->release, vm->release_cnt * sizeof(uintptr_t));
+            free(vm->release);
+        }
+        vm->release = n_release;
+        vm->release_cap = n_cap;
+    }
+    vm->release[vm->release_cnt++] = phys;
+}
+
+PRIVATE void vmem_release_free(uintptr_t *pages, size_t cnt)
+{
+    for (size_t i = 0; i < cnt; i++)
+        pagealloc_free(pages[i], KiB(4));
+    free(pages);
+}
+
+//Clear the entries covering [virt, virt + size) in this table. Only user tables hand back owned pages and emptied tables,
+//kernel tables are kept since their top level entries are shared by every address space.
+static int vmem_unmap_st(vmem_t *owner, uint64_t *vm, intptr_t virt, size_t size, int lv)
 {
     uint64_t mask = masks[lv];
     uint64_t shamt = shamts[lv];
     uint64_t sz = levels[lv];
+    bool release = (owner != &kmem);
 
     while (size > 0)
     {
         uint64_t idx = (virt & mask) >> shamt;
         uint64_t lv_ent = vm[idx];
-        uint64_t *n_lv_d = (uint64_t *)vmem_phystovirt(lv_ent & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
+        uint64_t cur = sz - (virt & (sz - 1));
+        if (cur > size)
+            cur = size;
 
-        if (lv_ent & PRESENT)
+        if ((lv_ent & PRESENT) == 0)
+            vm[idx] = 0; //Unbacked demand and guard entries
+        else if (sz == KiB(4) || (lv_ent & LARGEPAGE))
         {
-            if (size >= sz && ((lv_ent & LARGEPAGE) | (sz == KiB(4))))
-            {
-                vm[idx] = 0;
-                size -= sz;
-                virt += sz;
-            }
-            else if (size >= sz && (~lv_ent & LARGEPAGE))
-            {
-                //recurse lower
-                int err = vmem_unmap_st(p_vt, n_lv_d, virt, size, lv + 1);
-                if (err != 0)
-                    return err;
+            if (cur != sz)
+                PANIC("Unimplemented!"); //Splitting large pages
 
-                //free the lower level when done
-                pagealloc_free(lv_ent & ADDR_MASK, KiB(4));
-            }
-            else if (size < sz && (~lv_ent & LARGEPAGE))
-            {
-                //Recurse lower
-                return vmem_unmap_st(p_vt, n_lv_d, virt, size, lv + 1);
-            }
-            else if (size < sz && (lv_ent & LARGEPAGE))
-            {
-                //unmap large page
-                //determine maximum size for unmapping desired portion
-                //map at determined size
-                PANIC("Unimplemented!");
-            }
+            if (release && (lv_ent & SW_OWNED))
+                vmem_release(owner, lv_ent & ADDR_MASK);
+            vm[idx] = 0;
         }
-        else if (size >= sz)
+        else
         {
-            size -= sz;
-            virt += sz;
+            uint64_t *n_lv_d = (uint64_t *)vmem_phystovirt(lv_ent & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
+            int err = vmem_unmap_st(owner, n_lv_d, virt, cur, lv + 1);
+            if (err != 0)
+                return err;
+
+            //Free the lower level when it has been cleared entirely
+            if (release && cur == sz)
+            {
+                vmem_release(owner, lv_ent & ADDR_MASK);
+                vm[idx] = 0;
+            }
         }
-        else
-            return vmem_err_nomapping;
+
+        size -= cur;
+        virt += cur;
     }
 
     return 0;
 }
 
+//Entry for a 4KiB page, NULL if a table on the way is missing or the page is part of a large page
+PRIVATE uint64_t *vmem_getleaf(vmem_t *vm, intptr_t virt)
+{
+    uint64_t *pg = vm->ptable;
+    for (int lv = 0; lv < 3; lv++)
+    {
+        uint64_t ent = pg[(virt & masks[lv]) >> shamts[lv]];
+        if ((ent & PRESENT) == 0 || (ent & LARGEPAGE))
+            return NULL;
+        pg = (uint64_t *)vmem_phystovirt(ent & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
+    }
+    return &pg[(virt & masks[3]) >> shamts[3]];
+}
+
 int vmem_map(vmem_t *vm, intptr_t virt, intptr_t phys, size_t size, int perms, int flags)
 {
     uint64_t *ptable = 0;
 
+    //The fault handler takes the address space lock with interrupts off
+    int cli_state = cli();
     if (virt < 0)
     {
         //Add to kernel map
         local_spinlock_lock(&kmem.lock);
-        ptable = (uint64_t *)kmem.ptable - 256;
+        ptable = kmem.ptable;
     }
     else
     {
@@ -384,24 +482,22 @@ int vmem_map(vmem_t *vm, intptr_t virt, intptr_t phys, size_t size, int perms, i
     if (virt >= 0)
         local_spinlock_unlock(&vm->lock);
     else
-    {
-        uint64_t *p_table = (uint64_t *)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
-        memcpy(p_table + 256, kmem.ptable, 256 * sizeof(uint64_t));
         local_spinlock_unlock(&kmem.lock);
-    }
+    sti(cli_state);
     return rVal;
 }
 
 int vmem_unmap(vmem_t *vm, intptr_t virt, size_t size)
 {
     uint64_t *ptable = 0;
-    size = 0;
 
+    int cli_state = cli();
     if (virt < 0)
     {
         //Add to kernel map
         local_spinlock_lock(&kmem.lock);
-        ptable = (uint64_t *)kmem.ptable - 256;
+        ptable = kmem.ptable;
+        vm = &kmem;
     }
     else
     {
@@ -410,15 +506,16 @@ int vmem_unmap(vmem_t *vm, intptr_t virt, size_t size)
         ptable = vm->ptable;
     }
 
-    int rVal = vmem_unmap_st(ptable, ptable, virt, size, 0);
-    if (virt >= 0)
-        local_spinlock_unlock(&vm->lock);
-    else
-    {
-        uint64_t *p_table = (uint64_t *)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
-        memcpy(p_table + 256, kmem.ptable, 256 * sizeof(uint64_t));
-        local_spinlock_unlock(&kmem.lock);
-    }
+    int rVal = vmem_unmap_st(vm, ptable, virt, size, 0);
+    vmem_shootdown_queue(vm, virt, size);
+    vmem_shootdown_commit(vm);
+    local_spinlock_unlock(&vm->lock);
+    sti(cli_state);
+
+    //Kernel callers free or reuse the pages as soon as this returns, so wait for every core to drop
+    //them. User unmaps are waited on by their callers, who can batch several first.
+    if (vm == &kmem)
+        vmem_shootdown_wait(vm);
 
     return rVal;
 }
@@ -429,9 +526,28 @@ int vmem_create(vmem_t **vm_r)
     if (vm == NULL)
         return -1;
 
+    vm->ptable_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_pagetable, KiB(4));
+    if (vm->ptable_phys == (uintptr_t)-1)
+    {
+        free(vm);
+        return -1;
+    }
+    vm->ptable = (uint64_t *)vmem_phystovirt(vm->ptable_phys, KiB(4), vmem_flags_cachewriteback);
+
     vm->flags = vmem_flags_user;
     vm->lock = 0;
+    vm->active = 0;
+    vm->untagged = false;
+    vm->sd_cnt = 0;
+    vm->sd_pages = 0;
+    vm->sd_full = false;
+    vm->sd_pending = 0;
+    vm->release = NULL;
+    vm->release_cnt = 0;
+    vm->release_cap = 0;
     memset(vm->ptable, 0, 256 * sizeof(uint64_t));
+    memcpy(vm->ptable + 256, kmem.ptable + 256, 256 * sizeof(uint64_t));
+    vmem_pcid_invalidate(vm);
     *vm_r = vm;
 
     return 0;
@@ -441,44 +557,65 @@ void vmem_destroy(vmem_t *vm_r)
 {
     if (vm_r != NULL)
     {
+        //A core that just switched away from the owning task may not have loaded its next address space
+        //yet, wait for it to drop its bit before the tables go. PCIDs are only reused after a flush, so
+        //once nothing has it loaded no TLB can reach the pages released below.
+        if (vm_r == lcl->cur_vmem)
+            PANIC("[SysVirtualMemory] Destroying the active address space.");
+        while (__atomic_load_n(&vm_r->active, __ATOMIC_ACQUIRE) != 0)
+            __asm__ volatile("pause");
+
+        //Release every page the fault handler allocated along with the user half's tables
+        int cli_state = cli();
         local_spinlock_lock(&vm_r->lock);
+        vmem_unmap_st(vm_r, vm_r->ptable, 0, GiB(512) * 256, 0);
+        local_spinlock_unlock(&vm_r->lock);
+        sti(cli_state);
+
+        vmem_release_free(vm_r->release, vm_r->release_cnt);
+        pagealloc_free(vm_r->ptable_phys, KiB(4));
         free(vm_r);
     }
 }
 
-static void vmem_savestate()
+int vmem_setactive(vmem_t *vm)
 {
+    if (lcl->cur_vmem == vm)
+        return 0;
+
+    //Shootdowns change the tables and reset PCID generations before reading this mask,
+    //so publishing it before the generation check means either the check or an IPI catches every change
+    uint64_t core_bit = 1ull << lcl->core_idx;
     if (lcl->cur_vmem != NULL)
-    {
-        vmem_t *vmem = lcl->cur_vmem;
-        local_spinlock_lock(&vmem->lock);
-        //copy state from ktable
-        uint64_t *p_table = (uint64_t *)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
-        memcpy(vmem->ptable, p_table, 256 * sizeof(uint64_t));
-        local_spinlock_unlock(&vmem->lock);
-    }
+        lcl->cur_vmem->active &= ~core_bit;
+    vm->active |= core_bit;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
+    uint64_t cr3 = vm->ptable_phys;
+    if (pcid_avail && !vm->untagged)
     {
-        local_spinlock_lock(&kmem.lock);
-        //copy state from ktable
-        uint64_t *p_table = (uint64_t *)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
-        memcpy(kmem.ptable, p_table + 256, 256 * sizeof(uint64_t));
-        local_spinlock_unlock(&kmem.lock);
+        int core = lcl->core_idx;
+        if (vm->pcid_gen[core] == lcl->pcid_gen)
+        {
+            //Still tagged from the last time it ran here, keep its translations
+            cr3 |= vm->pcid[core] | CR3_NOFLUSH;
+        }
+        else
+        {
+            //Recycle PCIDs by generation, the load without CR3_NOFLUSH drops whatever a previous owner left behind
+            if (lcl->pcid_next > PCID_MAX)
+            {
+                lcl->pcid_gen++;
+                lcl->pcid_next = 1;
+            }
+            vm->pcid[core] = lcl->pcid_next++;
+            vm->pcid_gen[core] = lcl->pcid_gen;
+            cr3 |= vm->pcid[core];
+        }
     }
-}
-
-int vmem_setactive(vmem_t *vm)
-{
-    vmem_savestate();
-
-    //copy state to ktable
-    local_spinlock_lock(&vm->lock);
-    uint64_t *p_table = (uint64_t *)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
-    memcpy(p_table, vm->ptable, 256 * sizeof(uint64_t));
-    local_spinlock_unlock(&vm->lock);
 
     lcl->cur_vmem = vm;
-    __asm__ volatile("mov %0, %%cr3" ::"r"(lcl->ktable)
+    __asm__ volatile("mov %0, %%cr3" ::"r"(cr3)
                      :);
 
     return 0;
@@ -486,28 +623,52 @@ int vmem_setactive(vmem_t *vm)
 
 int vmem_getactive(vmem_t **vm)
 {
-    vmem_savestate();
     *vm = lcl->cur_vmem;
     return 0;
 }
 
-int vmem_flush(intptr_t virt, size_t sz)
+//Invalidate a range on this core only, large ranges and SHOOTDOWN_ALL drop everything belonging to the address space
+PRIVATE void vmem_flush_local(vmem_t *vm, intptr_t virt, size_t sz)
 {
-    //TODO: shootdown cores when kmem flushed
-    // Alternatively, every 'thread' has its own memory space, so changes don't affect other cores
-    //Thus, kernel can be flushed once every task switch
-
-    vmem_savestate();
-
-    if (sz > GiB(1))
-        __asm__ volatile("mov %0, %%cr3" ::"r"(lcl->ktable)
-                         :);
+    if (sz / KiB(4) > SHOOTDOWN_FULL_PAGES)
+    {
+        if (vm == &kmem)
+            vmem_flushall(); //Kernel mappings are global, a CR3 reload would not drop them
+        else
+        {
+            uint64_t cr3 = 0;
+            __asm__ volatile("mov %%cr3, %0"
+                             : "=r"(cr3)::);
+            cr3 &= ~CR3_NOFLUSH;
+            __asm__ volatile("mov %0, %%cr3" ::"r"(cr3)
+                             :);
+        }
+    }
     else
     {
+        //invlpg drops the current PCID's entry and any global entry for the page
         for (size_t n = 0; n < sz; n += KiB(4), virt += KiB(4))
             __asm__("invlpg (%0)" ::"r"(virt)
                     :);
     }
+}
+
+int vmem_flush(intptr_t virt, size_t sz)
+{
+    //Interrupts stay off while the lock is held, the shootdown IPI would otherwise spin on it
+    int cli_state = cli();
+    vmem_t *vm = (virt < 0) ? &kmem : lcl->cur_vmem;
+    if (vm == NULL)
+    {
+        sti(cli_state);
+        return -1;
+    }
+
+    local_spinlock_lock(&vm->lock);
+    vmem_shootdown_queue(vm, virt, sz);
+    vmem_shootdown_commit(vm);
+    local_spinlock_unlock(&vm->lock);
+    sti(cli_state);
     return 0;
 }
 
@@ -546,8 +707,7 @@ int vmem_virttophys(vmem_t *vm, intptr_t virt, intptr_t *phys)
     if (virt < 0)
     {
         //kernel address
-        uint64_t *n_lv_d = (uint64_t *)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
-        return vmem_virttophys_st(n_lv_d, (uint64_t)virt, phys, 0);
+        return vmem_virttophys_st(kmem.ptable, (uint64_t)virt, phys, 0);
     }
     else if (vm != NULL)
     {
@@ -0,0 +1,126 @@
+/**
+ * Copyright (c) 2021 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "SysVirtualMemory/vmem.h"
+#include "SysPhysicalMemory/phys_mem.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <types.h>
+
+// Address space switch benchmark, vmem_bench.
+// Two address spaces each map a small working set, the bench ping-pongs between them and times
+// the switch itself and then the first touch of every page, which is dominated by TLB misses when
+// the switch flushed. Run once with PCID tagging and once on address spaces that are never given a
+// PCID, so every switch flushes them, without touching how any other address space is switched.
+
+#define VMEM_BENCH_PAGES (64)
+#define VMEM_BENCH_ITERS (10000)
+#define VMEM_BENCH_BASE (0x40000000)
+
+PRIVATE void vmem_setuntagged(vmem_t *vm);
+PRIVATE bool vmem_pcid_enabled(void);
+
+static uint64_t vmem_bench_rdtsc()
+{
+    uint64_t edx = 0, eax = 0;
+    __asm__ volatile("rdtsc"
+                     : "=d"(edx), "=a"(eax));
+    return (edx << 32) | (eax & 0xffffffff);
+}
+
+static void vmem_bench_switch(vmem_t **vms, const char *mode)
+{
+    char tmp[20];
+    uint64_t switch_cycles = 0;
+    uint64_t touch_cycles = 0;
+
+    for (int i = 0; i < VMEM_BENCH_ITERS; i++)
+    {
+        uint64_t t0 = vmem_bench_rdtsc();
+        vmem_setactive(vms[i & 1]);
+        uint64_t t1 = vmem_bench_rdtsc();
+        for (int p = 0; p < VMEM_BENCH_PAGES; p++)
+            (void)*(volatile uint64_t *)(VMEM_BENCH_BASE + p * KiB(4));
+        uint64_t t2 = vmem_bench_rdtsc();
+
+        switch_cycles += t1 - t0;
+        touch_cycles += t2 - t1;
+    }
+
+    DEBUG_PRINT("[SysVirtualMemory] vmem_bench: mode=");
+    DEBUG_PRINT(mode);
+    DEBUG_PRINT(" switch_cycles=");
+    DEBUG_PRINT(ltoa(switch_cycles / VMEM_BENCH_ITERS, tmp, 10));
+    DEBUG_PRINT(" touch_cycles_per_page=");
+    DEBUG_PRINT(ltoa(touch_cycles / (VMEM_BENCH_ITERS * VMEM_BENCH_PAGES), tmp, 10));
+    DEBUG_PRINT("\r\n");
+}
+
+//Ping-pong between a fresh pair of address spaces, untagged ones are flushed on every switch
+static int vmem_bench_run(bool untagged, const char *mode)
+{
+    vmem_t *vms[2] = {NULL, NULL};
+    uintptr_t phys[2] = {(uintptr_t)-1, (uintptr_t)-1};
+    int err = 0;
+
+    for (int i = 0; i < 2 && err == 0; i++)
+    {
+        if (vmem_create(&vms[i]) != 0)
+        {
+            err = -1;
+            break;
+        }
+        if (untagged)
+            vmem_setuntagged(vms[i]);
+
+        phys[i] = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_zero, VMEM_BENCH_PAGES * KiB(4));
+        if (phys[i] == (uintptr_t)-1)
+        {
+            err = -1;
+            break;
+        }
+
+        //Kernel pages in the lower half, so SMAP doesn't get in the way of touching them
+        vmem_map(vms[i], VMEM_BENCH_BASE, phys[i], VMEM_BENCH_PAGES * KiB(4), vmem_flags_kernel | vmem_flags_rw | vmem_flags_cachewriteback, 0);
+    }
+
+    if (err == 0)
+    {
+        int cli_state = cli();
+        vmem_t *prev = NULL;
+        vmem_getactive(&prev);
+        vmem_bench_switch(vms, mode);
+        if (prev != NULL)
+            vmem_setactive(prev);
+        sti(cli_state);
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (phys[i] != (uintptr_t)-1)
+        {
+            vmem_unmap(vms[i], VMEM_BENCH_BASE, VMEM_BENCH_PAGES * KiB(4));
+            pagealloc_free(phys[i], VMEM_BENCH_PAGES * KiB(4));
+        }
+        if (vms[i] != NULL)
+            vmem_destroy(vms[i]);
+    }
+    return err;
+}
+
+int vmem_bench()
+{
+    if (vmem_pcid_enabled())
+    {
+        if (vmem_bench_run(false, "pcid") != 0)
+            return -1;
+    }
+    else
+        DEBUG_PRINT("[SysVirtualMemory] vmem_bench: PCID unavailable\r\n");
+
+    return vmem_bench_run(true, "flush");
+}
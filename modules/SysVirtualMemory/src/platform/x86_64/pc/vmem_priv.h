@@ -0,0 +1,129 @@
+// Copyright (c) 2018 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINAL_SYSVIRTUALMEMORY_PRIV_H
+#define CARDINAL_SYSVIRTUALMEMORY_PRIV_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <types.h>
+
+#include "SysVirtualMemory/vmem.h"
+
+#define PRESENT (1ull << 0)
+#define WRITE (1ull << 1)
+#define USER (1ull << 2)
+
+#define WRITETHROUGH (1ull << 3)
+#define CACHEDISABLE (1ull << 4)
+#define WRITEBACK (0)
+#define WRITECOMPLETE (3ull << 3)
+
+#define LARGEPAGE (1ull << 7)
+#define GLOBALPAGE (1ull << 8)
+#define NOEXEC (1ull << 63)
+#define ADDR_MASK (0x000ffffffffff000)
+
+//Software bits of present entries
+#define SW_OWNED (1ull << 9)     //Allocated on a fault, freed when unmapped
+#define SW_SHARED (1ull << 10)   //Owned by whoever mapped it, never freed here
+#define SW_COW (1ull << 11)      //Shared page of a writable mapping, copied on the first write
+
+//Software bits of non-present entries, the rest of the entry keeps the permissions to apply once backed
+#define SW_DEMAND (1ull << 52)
+#define SW_GUARD (1ull << 53)
+
+#define CR3_NOFLUSH (1ull << 63)
+#define CR4_PGE (1ull << 7)
+#define CR4_PCIDE (1ull << 17)
+#define PCID_MAX (4095)
+#define VMEM_MAX_CORES (64)
+
+#define SHOOTDOWN_BATCH_LEN (16)        //Ranges an address space can collect before degrading to a full flush
+#define SHOOTDOWN_MAILBOX_LEN (32)      //Ranges a core can have pending from all initiators
+#define SHOOTDOWN_FULL_PAGES (32)       //Past this many pages a full flush is cheaper than invlpg
+#define SHOOTDOWN_ALL ((size_t)-1)
+
+typedef struct
+{
+    intptr_t virt;
+    size_t sz;
+} vmem_range_t;
+
+struct vmem
+{
+    uint64_t *ptable;       //Top level table, the upper half mirrors the kernel entries
+    uintptr_t ptable_phys;
+    int flags;
+    int lock;
+
+    //PCID assigned on each core, only valid while its generation matches the core's
+    uint16_t pcid[VMEM_MAX_CORES];
+    uint64_t pcid_gen[VMEM_MAX_CORES];
+    bool untagged;          //Always loaded with PCID 0 and no CR3_NOFLUSH, i.e. flushed on every switch
+
+    //Cores that currently have this address space loaded
+    _Atomic uint64_t active;
+
+    //Invalidations collected under lock, sent out by vmem_shootdown_commit
+    int sd_cnt;
+    size_t sd_pages;
+    bool sd_full;
+    vmem_range_t sd_ranges[SHOOTDOWN_BATCH_LEN];
+
+    //Mailbox sequence per core that must be acknowledged before the old translations are gone everywhere
+    _Atomic uint64_t sd_pending;
+    uint64_t sd_ticket[VMEM_MAX_CORES];
+
+    //Pages and tables dropped by unmaps, freed by vmem_shootdown_wait once no core can reach them
+    uintptr_t *release;
+    size_t release_cnt;
+    size_t release_cap;
+};
+
+struct lcl_data
+{
+    uintptr_t ktable;
+    vmem_t *cur_vmem;
+    int core_idx;
+    uint16_t pcid_next;
+    uint64_t pcid_gen;
+};
+
+extern PRIVATE vmem_t kmem;
+
+PRIVATE TLS struct lcl_data *vmem_getlcl(void);
+
+PRIVATE void vmem_flushall(void);
+
+PRIVATE void vmem_flush_local(vmem_t *vm, intptr_t virt, size_t sz);
+
+PRIVATE void vmem_pcid_invalidate(vmem_t *vm);
+
+PRIVATE void vmem_setuntagged(vmem_t *vm);
+
+PRIVATE bool vmem_pcid_enabled(void);
+
+PRIVATE void vmem_shootdown_queue(vmem_t *vm, intptr_t virt, size_t sz);
+
+PRIVATE void vmem_shootdown_commit(vmem_t *vm);
+
+PRIVATE uint64_t vmem_permbits(int perms);
+
+PRIVATE uint64_t *vmem_getleaf(vmem_t *vm, intptr_t virt);
+
+PRIVATE void vmem_release(vmem_t *vm, uintptr_t phys);
+
+PRIVATE void vmem_release_free(uintptr_t *pages, size_t cnt);
+
+static inline uint64_t vmem_rdtsc(void)
+{
+    uint64_t edx = 0, eax = 0;
+    __asm__ volatile("rdtsc"
+                     : "=d"(edx), "=a"(eax));
+    return (edx << 32) | (eax & 0xffffffff);
+}
+
+#endif
@@ -16,4 +16,6 @@ void fp_platform_setstate(void* buf);
 
 void fp_platform_getdefaultstate(void* buf);
 
+int fp_mp_init(void);
+
 #endif
\ No newline at end of file
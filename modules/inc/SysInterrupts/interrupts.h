@@ -75,6 +75,9 @@ void interrupt_setregisterstate(interrupt_register_state_t *state);
 
 void interrupt_getregisterstate(interrupt_register_state_t *state);
 
+//Error code pushed by the exception currently being handled
+uint64_t interrupt_geterrorcode(void);
+
 uint32_t msi_register_addr(int cpu_idx);
 
 uint64_t msi_register_data(int vec);
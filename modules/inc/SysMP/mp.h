@@ -16,6 +16,8 @@ TLS void* mp_tls_get(int off);
 
 int mp_corecount(void);
 
+void mp_setapentry(void (*entry)(void));
+
 int mp_platform_getstatesize(void);
 
 void mp_platform_getstate(void* buf);
@@ -9,6 +9,15 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#define MEM_CACHE_NAME_LEN (32)
+
+typedef struct mem_cache mem_cache_t;
+
 void *stack_alloc(size_t, bool);
 
+//Dedicated cache for a frequently allocated object type, objects are released with free()
+mem_cache_t *mem_cache_create(const char *name, size_t obj_sz);
+
+void *mem_cache_alloc(mem_cache_t *cache);
+
 #endif
\ No newline at end of file
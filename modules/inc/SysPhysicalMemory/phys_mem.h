@@ -7,6 +7,7 @@
 #define CARDINAL_PHYS_MEM_H
 
 #include <stdint.h>
+#include <types.h>
 
 typedef enum {
     physmem_alloc_flags_reclaimable = (1 << 0),
@@ -17,9 +18,12 @@ typedef enum {
     physmem_alloc_flags_32bit = (1 << 5),
 } physmem_alloc_flags_t;
 
+//Pass -1 for domain or color when there is no preference
 uintptr_t pagealloc_alloc(int domain, int color, physmem_alloc_flags_t flags, uint64_t size);
 
 void pagealloc_free(uintptr_t addr, uint64_t size);
 
+bool pagealloc_zero_refill(void);
+
 
 #endif
\ No newline at end of file
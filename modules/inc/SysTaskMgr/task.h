@@ -10,9 +10,17 @@
 #include "cs_syscall.h"
 
 typedef void (*DescriptorResourceFreeAction)(void *);
+
+//Tasks blocked on an object, linked through the task descriptors
+typedef struct {
+    struct process_desc *head;
+    struct process_desc *tail;
+} task_waitqueue_t;
+
 typedef struct {
     volatile uint32_t count;
     int spinlock;
+    task_waitqueue_t waiters;
 } semaphore_t;
 
 typedef enum
@@ -51,10 +59,30 @@ cs_id task_current();
 
 cs_error task_sleep(cs_id id, uint64_t ns);
 
+cs_error task_setpriority(cs_id id, int priority);
+
+cs_error task_setaffinity(cs_id id, uint64_t affinity);
+
+//Number of cores the scheduler runs on, bit n of an affinity mask is core n
+int task_corecount(void);
+
+//APIC id of scheduler core core_idx, -1 if there is no such core
+int task_coreapicid(int core_idx);
+
 cs_error task_monitor(cs_id id, uint32_t *tgt, uint32_t cur_val);
 
+//Block the current task while *addr == val, waiters are keyed on the physical address of addr
+cs_error task_wait(uint32_t *addr, uint32_t val);
+
+//Wake up to n tasks waiting on addr, returns the number woken
+int task_wake(uint32_t *addr, int n);
+
 cs_error task_map(cs_id id, const char *name, intptr_t vaddr, size_t sz, task_map_flags_t flags, task_map_perms_t owner_perms, task_map_perms_t child_perms, int child_count, cs_id *shmem_id);
 
+//Map a region with vmem_map_flags, e.g. shared copy-on-write image pages or pages the caller allocated,
+//and track it as a descriptor. Pages passed in paddr stay owned by the caller.
+cs_error task_mapvmem(cs_id id, intptr_t vaddr, intptr_t paddr, size_t sz, task_map_perms_t perms, int map_flags, cs_id *shmem_id);
+
 cs_error task_virttophys(cs_id id, intptr_t vaddr, intptr_t *phys);
 
 cs_error task_updatemap(cs_id id, cs_id shmem_id, task_map_perms_t perms);
@@ -32,4 +32,7 @@ uint64_t timer_timestamp();
 
 uint64_t timer_timestamp_ns();
 
+//Arm this core's one-shot local timer to fire at the given timer_timestamp_ns() value, 0 disarms it
+int timer_local_deadline(uint64_t deadline_ns);
+
 #endif
\ No newline at end of file
@@ -21,4 +21,6 @@ void syscall_setfullstate(void *state);
 void syscall_getdefaultstate(void *state, void *kernel_stack, void *user_stack, void *rip);
 PURE int syscall_getfullstate_size(void);
 
+int user_mp_init(void);
+
 #endif
\ No newline at end of file
@@ -16,6 +16,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 typedef struct vmem vmem_t;
 
@@ -35,14 +36,33 @@ typedef enum
     vmem_flags_rw = (vmem_flags_read | vmem_flags_write),
 } vmem_flags;
 
+typedef enum
+{
+    vmem_map_none = 0,
+    vmem_map_demand = (1 << 0), //Backed by a zeroed page on first access, phys is ignored
+    vmem_map_cow = (1 << 1),    //Share phys, writable mappings get a private copy on the first write
+    vmem_map_guard = (1 << 2),  //Never backed, faults are reported as vmem_err_guard
+} vmem_map_flags;
+
 typedef enum
 {
     vmem_err_none = 0,
     vmem_err_alreadymapped = -1,
     vmem_err_continue = -2,
     vmem_err_nomapping = -3,
+    vmem_err_guard = -4,
+    vmem_err_nomem = -5,
 } vmem_errs;
 
+//Page fault error code bits, as the CPU reports them
+typedef enum
+{
+    vmem_fault_present = (1 << 0), //The entry was present, i.e. a protection violation
+    vmem_fault_write = (1 << 1),
+    vmem_fault_user = (1 << 2),
+    vmem_fault_fetch = (1 << 4),
+} vmem_fault_flags;
+
 int vmem_init();
 
 int vmem_map(vmem_t *vm, intptr_t virt, intptr_t phys, size_t size, int perms, int flags);
@@ -59,10 +79,24 @@ int vmem_getactive(vmem_t **vm);
 
 int vmem_flush(intptr_t virt, size_t sz);
 
+int vmem_shootdown_init();
+
+int vmem_shootdown_mp_init();
+
+void vmem_shootdown_wait(vmem_t *vm);
+
 int vmem_virttophys(vmem_t *vm, intptr_t virt, intptr_t *phys);
 
 intptr_t vmem_phystovirt(intptr_t phys, size_t sz, int flags);
 
+int vmem_handlefault(intptr_t virt, uint64_t err);
+
+int vmem_populate(vmem_t *vm, intptr_t virt, size_t size);
+
+int vmem_protect(vmem_t *vm, intptr_t virt, size_t size, int perms);
+
+int vmem_faultstats();
+
 intptr_t vmem_vmalloc(size_t sz);
 
 void vmem_vfree(intptr_t virt, size_t sz);
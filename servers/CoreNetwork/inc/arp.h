@@ -26,6 +26,14 @@ typedef struct {
     uint32_t dst_ip;
 } PACKED arp_t;
 
+#define ARP_HW_ETHERNET 0x0001
+
 int arp_rx(interface_def_t *interface, void *packet, int len);
 
+//Ask who has ip, broadcast unless a cached mac is given to probe
+PRIVATE int arp_solicit(interface_def_t *interface, uint32_t ip, const uint8_t *unicast_mac);
+
+//Gratuitous ARP for the interface's IPv4 address, lets peers refresh their caches
+PRIVATE int arp_announce(interface_def_t *interface);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,91 @@
+// Copyright (c) 2018 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINALSEMI_CORENETWORK_CHECKSUM_H
+#define CARDINALSEMI_CORENETWORK_CHECKSUM_H
+
+#include <stdint.h>
+#include <types.h>
+
+#include "CoreNetwork/netbuf.h"
+
+// Internet checksum (RFC 1071).
+// Partial sums are kept unfolded in 64 bits and in memory byte order, ones' complement addition
+// doesn't care about byte order as long as every term uses the same one, so the folded result can
+// be stored into a header as-is and the per word byte swapping disappears. Addresses and ports
+// are passed exactly as they sit in the packet.
+//
+// The SIMD implementations are only safe from task context, the task switch saves the vector
+// state but interrupt handlers don't.
+
+typedef uint64_t (*network_csum_fn_t)(const void *buf, int len, uint64_t sum);
+typedef uint64_t (*network_csum_copy_fn_t)(void *dst, const void *src, int len, uint64_t sum);
+
+typedef struct {
+    const char *name;
+    network_csum_fn_t partial;
+    network_csum_copy_fn_t copy;
+} network_csum_impl_t;
+
+//Add len bytes at buf to sum
+PRIVATE uint64_t network_csum_partial(const void *buf, int len, uint64_t sum);
+
+//Copy len bytes and add them to sum in the same pass
+PRIVATE uint64_t network_csum_copy(void *dst, const void *src, int len, uint64_t sum);
+
+//Sum len bytes of a netbuf chain starting at offset, segments may have odd lengths
+PRIVATE uint64_t network_csum_netbuf(netbuf_t *nb, int offset, int len, uint64_t sum);
+
+//Pick the fastest implementation the processor supports
+PRIVATE int network_csum_init(void);
+
+//Implementations the processor supports, best first and terminated by a NULL name, scalar finishes their tails
+PRIVATE const network_csum_impl_t *network_csum_platform_impls(const network_csum_impl_t *scalar);
+
+static inline uint64_t network_csum_add(uint64_t sum, uint64_t val) {
+    sum += val;
+    return sum + (sum < val);
+}
+
+//Fold to 16 bits and complement, ready to be stored. A sum over data that includes a valid checksum folds to 0.
+static inline uint16_t network_csum_fold(uint64_t sum) {
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+//TCP/UDP pseudo-headers, len is the length of the transport header and payload in host order
+static inline uint64_t network_csum_pseudo4(uint32_t src_ip, uint32_t dst_ip, uint8_t protocol, uint32_t len) {
+    uint64_t sum = (uint64_t)src_ip + dst_ip;
+    sum += TO_BE_FRM_LE_32(len);
+    sum += TO_BE_FRM_LE_32((uint32_t)protocol);
+    return sum;
+}
+
+static inline uint64_t network_csum_pseudo6(const uint8_t *src_ip, const uint8_t *dst_ip, uint8_t protocol, uint32_t len) {
+    uint64_t sum = network_csum_partial(src_ip, 16, 0);
+    sum = network_csum_partial(dst_ip, 16, sum);
+    sum = network_csum_add(sum, TO_BE_FRM_LE_32(len));
+    return network_csum_add(sum, TO_BE_FRM_LE_32((uint32_t)protocol));
+}
+
+//Incremental update after rewriting a header field (RFC 1624, eqn. 3): HC' = ~(~HC + ~m + m')
+static inline void network_csum_replace2(uint16_t *csum, uint16_t from, uint16_t to) {
+    uint64_t sum = (uint16_t)~*csum;
+    sum += (uint16_t)~from;
+    sum += to;
+    *csum = network_csum_fold(sum);
+}
+
+static inline void network_csum_replace4(uint16_t *csum, uint32_t from, uint32_t to) {
+    uint64_t sum = (uint16_t)~*csum;
+    sum += (uint32_t)~from;
+    sum += to;
+    *csum = network_csum_fold(sum);
+}
+
+#endif
@@ -14,6 +14,7 @@
 #define IP_PROTOCOL_ICMP (1)
 #define IP_PROTOCOL_TCP (6)
 #define IP_PROTOCOL_UDP (17)
+#define IP_PROTOCOL_ICMPV6 (58)
 
 typedef struct {
     uint8_t ihl : 4;        //Only accept value = 5
@@ -42,7 +43,13 @@ typedef struct {
     uint8_t body[0];
 } ipv6_t;
 
-int ipv4_rx(interface_def_t *interface, void *packet, int len);
-int ipv6_rx(interface_def_t *interface, void *packet, int len);
+//packet points into the head segment of nb, len counts the whole chain
+int ipv4_rx(interface_def_t *interface, netbuf_t *nb, void *packet, int len);
+int ipv6_rx(interface_def_t *interface, netbuf_t *nb, void *packet, int len);
+
+//Send IP packets linked through q_next to an on-link next hop (IPv4 in the ::ffff mapped form).
+//The first goes through the neighbor cache, once the link address is known the rest are queued
+//to the interface together. A NULL interface sends them through the loopback device.
+PRIVATE int ip_output(interface_def_t *interface, const uint8_t *next_hop, netbuf_t *list);
 
 #endif
\ No newline at end of file
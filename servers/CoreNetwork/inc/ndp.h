@@ -0,0 +1,50 @@
+// Copyright (c) 2018 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINALSEMI_CORENETWORK_NDP_H
+#define CARDINALSEMI_CORENETWORK_NDP_H
+
+#include <stdint.h>
+#include <types.h>
+
+#include "net_priv.h"
+#include "ip.h"
+
+#define ICMPV6_NEIGHBOR_SOLICIT (135)
+#define ICMPV6_NEIGHBOR_ADVERT (136)
+
+#define NDP_OPT_SRC_LLADDR (1)
+#define NDP_OPT_TGT_LLADDR (2)
+
+//ndp_t.flags of an advertisement
+#define NDP_NA_ROUTER (1 << 7)
+#define NDP_NA_SOLICITED (1 << 6)
+#define NDP_NA_OVERRIDE (1 << 5)
+
+//Neighbor solicitation and advertisement share their layout
+typedef struct {
+    uint8_t type;
+    uint8_t code;
+    uint16_t csum;
+    uint8_t flags;
+    uint8_t rsvd[3];
+    uint8_t target[16];
+    uint8_t options[0];
+} PACKED ndp_t;
+
+//Link-layer address option for ethernet, len counts 8 byte units
+typedef struct {
+    uint8_t type;
+    uint8_t len;
+    uint8_t mac[6];
+} PACKED ndp_lladdr_opt_t;
+
+//ICMPv6 packets, only neighbor discovery is handled so far
+int ndp_rx(interface_def_t *interface, netbuf_t *nb, ipv6_t *packet, int len);
+
+//Ask who has addr, to its solicited-node multicast group unless a cached mac is given to probe
+PRIVATE int ndp_solicit(interface_def_t *interface, const uint8_t *addr, const uint8_t *unicast_mac);
+
+#endif
@@ -0,0 +1,50 @@
+// Copyright (c) 2018 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINALSEMI_CORENETWORK_NEIGH_H
+#define CARDINALSEMI_CORENETWORK_NEIGH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <types.h>
+
+#include "net_priv.h"
+
+//Addresses are kept as IPv6, IPv4 ones in the ::ffff:a.b.c.d mapped form
+#define NEIGH_ADDR_LEN (16)
+
+typedef enum {
+    neigh_state_incomplete = 0,     //Solicited, no answer yet, packets are parked
+    neigh_state_reachable = 1,      //Confirmed within NEIGH_REACHABLE_NS
+    neigh_state_stale = 2,          //Usable, reachability has to be reconfirmed on next use
+    neigh_state_probe = 3,          //In use while unicast probes reconfirm it
+} neigh_state_t;
+
+#define NEIGH_F_CREATE (1 << 0)     //Add the neighbor if it isn't cached yet
+#define NEIGH_F_CONFIRM (1 << 1)    //Answer to one of our solicitations, the neighbor is reachable
+#define NEIGH_F_OVERRIDE (1 << 2)   //Replace a cached link address that differs
+
+static inline void neigh_addr4(uint32_t ip, uint8_t *addr) {
+    for (int i = 0; i < 10; i++)
+        addr[i] = 0;
+    addr[10] = 0xff;
+    addr[11] = 0xff;
+    *(uint32_t *)&addr[12] = ip;
+}
+
+PRIVATE int neigh_init(void);
+
+//Transmit an IP packet to an on-link next hop, resolving its link address first if needed.
+//Takes ownership of nb, while resolution is in progress it is parked on the neighbor entry.
+PRIVATE int neigh_output4(interface_def_t *interface, uint32_t next_hop, netbuf_t *nb);
+PRIVATE int neigh_output6(interface_def_t *interface, const uint8_t *next_hop, netbuf_t *nb);
+
+//Record a link address learnt from ARP/NDP, NEIGH_F_* say how much to trust it
+PRIVATE void neigh_update(interface_def_t *interface, const uint8_t *addr, const uint8_t *mac, int flags);
+
+//Lock-free lookup, copies the link address out if the neighbor is resolved
+PRIVATE bool neigh_lookup(interface_def_t *interface, const uint8_t *addr, uint8_t *mac);
+
+#endif
@@ -7,21 +7,153 @@
 #define CARDINALSEMI_NET_PRIV_DRIV_H
 
 #include <stdint.h>
+#include "SysInterrupts/interrupts.h"
 #include "CoreNetwork/driver.h"
+#include "CoreNetwork/netbuf.h"
 
+#define NETWORK_TX_QUEUE_LEN (1024)
+#define NETWORK_TX_BURST (32)
+#define NETWORK_MAX_QUEUES (16)
+#define NETWORK_MAX_CPUS (256)
+
+//Counters are kept per queue, each queue is only ever serviced from its own core
+typedef struct {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_errors;
+    uint64_t tx_bursts;         //Calls into the driver, each rings the doorbell at most once
+    uint64_t tx_cycles;         //Spent inside the driver's transmit handlers
+} __attribute__((aligned(64))) network_stats_t;
+
+struct interface_def;
+
+//Packets waiting for a queue's transmit task, linked through q_next
 typedef struct {
+    struct interface_def *interface;
+    int idx;
+    netbuf_t *head;
+    netbuf_t *tail;
+    int len;
+    int lock;
+    _Atomic uint32_t signal;
+} network_txq_t;
+
+typedef struct interface_def {
     network_device_type_t type;
     network_device_desc_t device;
     uint8_t mac[6];
     int idx;
+
+    uint32_t ipv4_addr;                     //Network byte order, 0 until one is configured
+    uint32_t ipv4_netmask;                  //Network byte order, destinations outside it go through the gateway
+    uint32_t ipv4_gateway;                  //Network byte order, 0 if there is none
+    uint8_t ipv6_ll[16];                    //Link-local address derived from the MAC
+
+    int queue_cnt;
+    network_txq_t txqs[NETWORK_MAX_QUEUES];
+    uint8_t cpu_queue[NETWORK_MAX_CPUS];    //Queue serviced by each core, indexed by APIC id
+    network_stats_t stats[NETWORK_MAX_QUEUES];
 } interface_def_t;
 
+//Queue belonging to the core the caller is running on
+static inline int network_curqueue(interface_def_t *def) {
+    return def->cpu_queue[interrupt_get_cpuidx() % NETWORK_MAX_CPUS];
+}
+
+#define NETWORK_POLL_BUDGET (64)
+
+typedef struct network_poll {
+    network_poll_handlers_t handlers;
+    void *state;
+    interface_def_t *interface;
+    _Atomic uint32_t signal;
+
+    uint64_t rate;              //Smoothed packets per second seen while polling
+    uint64_t holdoff_ns;        //How long rearming is deferred at that rate
+
+    _Atomic uint64_t interrupts;
+    uint64_t polls;
+    uint64_t packets;
+    uint64_t rearms;
+
+    struct network_poll *next;
+} network_poll_t;
+
+static inline uint64_t network_rdtsc(void) {
+    uint64_t edx = 0, eax = 0;
+    __asm__ volatile("rdtsc"
+                     : "=d"(edx), "=a"(eax));
+    return (edx << 32) | (eax & 0xffffffff);
+}
+
+//Per layer receive/transmit costs, sampled with the TSC while profiling is enabled.
+//Each layer counts everything below it, tx_frame is separate from the receive path.
+typedef enum {
+    network_prof_rx = 0,        //network_rx_packet, the whole receive path of a packet
+    network_prof_ip,            //ipv4_rx/ipv6_rx
+    network_prof_udp,
+    network_prof_tcp,
+    network_prof_tx_frame,      //Link header and software checksums on transmit
+    network_prof_count,
+} network_prof_layer_t;
+
+PRIVATE extern bool network_prof_on;
+
+static inline uint64_t network_prof_begin(void) {
+    return network_prof_on ? network_rdtsc() : 0;
+}
+
+//Charge the cycles since start to the layer, a no-op for samples taken while profiling was off
+PRIVATE void network_prof_end(network_prof_layer_t layer, uint64_t start);
+
+PRIVATE void network_prof_enable(bool on);
+
+PRIVATE void network_prof_reset(void);
+
+//Print the counters gathered since the last reset
+int network_prof();
+
 PRIVATE int network_init(void);
 
-PRIVATE int ethernet_rx(interface_def_t *interface, void *packet, int len);
+PRIVATE int loopback_init(void);
+
+//The loopback interface, NULL until loopback_init has registered it
+PRIVATE interface_def_t *network_loopback(void);
+
+PRIVATE int netbuf_init(void);
+
+PRIVATE int ethernet_rx(interface_def_t *interface, netbuf_t *nb);
+
+PRIVATE int wifi_rx(interface_def_t *interface, netbuf_t *nb);
+
+//Takes ownership of nb, the frame header is prepended into its headroom and the packet is queued
+//for the interface's transmit task. Fails if the queue already holds NETWORK_TX_QUEUE_LEN packets.
+//Offload offsets in nb count from the network header, checksums the device can't fill in are
+//computed here, super-packets are rejected unless the device segments them.
+int network_tx_packet(interface_def_t *interface, netbuf_t *nb, const uint8_t *dst_mac, uint16_t protocol_type);
+
+//network_tx_packet for a list of packets linked through q_next, queued together behind a single wakeup
+PRIVATE int network_tx_list(interface_def_t *interface, netbuf_t *list, const uint8_t *dst_mac, uint16_t protocol_type);
+
+PRIVATE interface_def_t *network_getinterface(network_device_type_t type, int idx);
+
+//Assign the interface's IPv4 configuration (network byte order) and announce the address with a gratuitous ARP
+PRIVATE void network_setipv4(interface_def_t *def, uint32_t addr, uint32_t netmask, uint32_t gateway);
+
+//Interface and on-link next hop for a destination, NULL if nothing routes there
+PRIVATE interface_def_t *network_route4(uint32_t dst, uint32_t *next_hop);
+PRIVATE interface_def_t *network_route6(const uint8_t *dst, uint8_t *next_hop);
+
+//Interface the address is configured on, NULL if it isn't one of ours
+PRIVATE interface_def_t *network_local4(uint32_t addr);
+PRIVATE interface_def_t *network_local6(const uint8_t *addr);
 
-PRIVATE int wifi_rx(interface_def_t *interface, void *packet, int len);
+//Sum the per queue counters
+PRIVATE void network_getstats(interface_def_t *def, network_stats_t *total);
 
-int network_tx_packet(interface_def_t *interface, void *packet, int len, uint16_t protocol_type);
+//Packets waiting across all of the interface's transmit queues
+PRIVATE int network_txqueued(interface_def_t *def);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,274 @@
+// Copyright (c) 2018 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINALSEMI_CORENETWORK_TCP_H
+#define CARDINALSEMI_CORENETWORK_TCP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <types.h>
+
+#include "SysTimer/timer.h"
+
+#include "CoreNetwork/socket.h"
+#include "net_priv.h"
+#include "ip.h"
+
+#define TCP_FLAG_FIN (1 << 0)
+#define TCP_FLAG_SYN (1 << 1)
+#define TCP_FLAG_RST (1 << 2)
+#define TCP_FLAG_PSH (1 << 3)
+#define TCP_FLAG_ACK (1 << 4)
+
+#define TCP_OPT_END (0)
+#define TCP_OPT_NOP (1)
+#define TCP_OPT_MSS (2)
+#define TCP_OPT_WSCALE (3)
+#define TCP_OPT_SACK_PERM (4)
+#define TCP_OPT_SACK (5)
+#define TCP_OPT_TIMESTAMP (8)
+
+#define TCP_SNDBUF KiB(512)
+#define TCP_RCVBUF KiB(512)
+#define TCP_MAX_SACK (4)            //Blocks remembered from the peer's SACK option
+#define TCP_MAX_OOO (64)            //Out of order segments held while waiting for a hole to fill
+#define TCP_DEFAULT_MSS (536)
+#define TCP_INIT_CWND (10)          //Segments (RFC 6928)
+
+#define TCP_LOOP_MSS (32768)        //Looped back segments never meet a device MTU
+#define TCP_MAX_GSO_SEGS (32)       //Segments per super-packet, keeps the chain within what drivers can post
+
+#define TCP_TICK_MS (5)
+#define TCP_RTO_INIT_MS (1000)
+#define TCP_RTO_MIN_MS (200)
+#define TCP_RTO_MAX_MS (60000)
+#define TCP_DELACK_MS (40)
+#define TCP_TIMEWAIT_MS (60000)
+#define TCP_SYN_RETRIES (5)
+#define TCP_RETRIES (12)
+
+#define TCP_SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define TCP_SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define TCP_SEQ_GT(a, b) ((int32_t)((a) - (b)) > 0)
+#define TCP_SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+typedef struct {
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t rsvd : 4;
+    uint8_t data_off : 4;       //Header length in 32-bit words
+    uint8_t flags;
+    uint16_t window;
+    uint16_t csum;
+    uint16_t urgent;
+    uint8_t options[0];
+} PACKED tcp_t;
+
+typedef enum {
+    tcp_state_closed = 0,
+    tcp_state_listen,
+    tcp_state_syn_sent,
+    tcp_state_syn_rcvd,
+    tcp_state_established,
+    tcp_state_fin_wait1,
+    tcp_state_fin_wait2,
+    tcp_state_close_wait,
+    tcp_state_closing,
+    tcp_state_last_ack,
+    tcp_state_time_wait,
+} tcp_state_t;
+
+typedef enum {
+    tcp_timer_rexmt = 0,        //Retransmission, also drives SYN retries and zero window probes
+    tcp_timer_delack,
+    tcp_timer_timewait,
+    tcp_timer_count,
+} tcp_timer_kind_t;
+
+struct tcp_conn;
+
+typedef struct tcp_timer {
+    struct tcp_timer *next;
+    struct tcp_timer **pprev;   //NULL while the timer isn't armed
+    uint64_t expires;           //In TCP_TICK_MS ticks
+    struct tcp_conn *conn;
+    uint8_t kind;
+    bool pending;               //Expired and waiting for the timer task, cleared when re-armed or cancelled
+} tcp_timer_t;
+
+//Congestion control, called with the connection locked. cwnd and ssthresh live in the connection,
+//anything else the algorithm needs goes in cc_priv.
+typedef struct tcp_cc_ops {
+    const char *name;
+    void (*init)(struct tcp_conn *c);
+    //acked bytes were newly acknowledged outside of loss recovery
+    void (*on_ack)(struct tcp_conn *c, uint32_t acked, uint64_t now_ms);
+    //Loss detected, returns the new ssthresh
+    uint32_t (*ssthresh)(struct tcp_conn *c, uint64_t now_ms);
+    struct tcp_cc_ops *next;
+} tcp_cc_ops_t;
+
+//Parsed options of a received segment
+typedef struct {
+    uint16_t mss;
+    int8_t wscale;              //-1 if absent
+    bool sack_perm;
+    bool has_ts;
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+    int sack_cnt;
+    uint32_t sack[TCP_MAX_SACK][2];
+} tcp_opts_t;
+
+//Out of order data, linked in sequence order
+typedef struct tcp_ooo {
+    uint32_t seq;
+    uint32_t end;
+    netbuf_t *data;             //Payload clones linked through next
+    struct tcp_ooo *next;
+} tcp_ooo_t;
+
+struct tcp_conn {
+    network_sockaddr_t local;
+    network_sockaddr_t remote;
+    bool v4;
+    interface_def_t *interface;     //NULL when the peer is ourselves
+    uint8_t next_hop[16];
+    network_device_features_t features;
+    uint32_t gso_max_size;
+
+    int lock;
+    _Atomic int refcnt;
+    _Atomic uint32_t event;         //Bumped whenever a waiter might be able to make progress
+    tcp_state_t state;
+    int error;
+    bool user_closed;
+    bool hashed;
+    bool wakeup;                    //Waiters need waking once the lock is dropped
+
+    struct tcp_conn *hash_next;
+    struct tcp_conn *listener;      //Owning listener while waiting to be accepted
+    struct tcp_conn *accept_head;   //Established children waiting for tcp_accept, on a listener
+    struct tcp_conn *accept_tail;
+    struct tcp_conn *accept_next;
+    int accept_cnt;
+    int backlog;
+
+    //Send side, sndq holds everything from snd_una onwards, linked through q_next
+    uint32_t iss;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t snd_max;               //Highest sequence number sent
+    uint32_t snd_wnd;
+    uint32_t snd_wl1;
+    uint32_t snd_wl2;
+    uint8_t snd_wscale;
+    uint16_t mss;                   //Payload bytes per segment towards the peer
+    netbuf_t *sndq_head;
+    netbuf_t *sndq_tail;
+    uint32_t sndq_bytes;
+    uint16_t sndq_off;              //Bytes of sndq_head already acknowledged
+    netbuf_t *sndq_hint;            //Where the last segment was cut from, saves walking sndq while sending in order
+    uint32_t sndq_hint_seq;         //Sequence number of sndq_hint's first byte
+    bool fin_queued;
+    bool fin_sent;
+    bool nodelay;
+    bool cork;
+    bool more;                      //Last send asked to hold back a partial segment
+
+    //Receive side, rcvq holds in order data waiting to be read, linked through q_next
+    uint32_t irs;
+    uint32_t rcv_nxt;
+    uint32_t rcv_adv;               //Right edge of the window last advertised
+    uint8_t rcv_wscale;
+    netbuf_t *rcvq_head;
+    netbuf_t *rcvq_tail;
+    uint32_t rcvq_bytes;
+    uint16_t rcvq_off;              //Bytes of rcvq_head already read
+    bool fin_rcvd;
+    tcp_ooo_t *ooo;
+    int ooo_cnt;
+    uint32_t last_ooo_seq;          //Most recently received out of order block, reported first
+    bool ack_now;
+    int ack_pending;                //Full segments received since the last ACK
+
+    //Options
+    bool ws_ok;
+    bool sack_ok;
+    bool ts_ok;
+    uint32_t ts_recent;
+
+    //Peer's SACK blocks above snd_una, sorted and disjoint
+    uint32_t sacked[TCP_MAX_SACK][2];
+    int sacked_cnt;
+    uint32_t rexmit_nxt;            //Next hole to fill during recovery
+
+    //Round trip time, in ms scaled by 8 and 4 like RFC 6298 suggests
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+    uint32_t rtt_seq;               //Segment being timed without timestamps, 0 if none
+    uint64_t rtt_start;
+    int backoff;
+    int retries;
+
+    //Congestion control
+    const tcp_cc_ops_t *cc;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t cwnd_cnt;              //Bytes acknowledged towards the next increase in avoidance
+    int dupacks;
+    bool in_recovery;
+    uint32_t recover;               //snd_max when recovery started
+    uint64_t cc_priv[8];
+
+    tcp_timer_t timers[tcp_timer_count];
+
+    uint64_t stat_retrans;
+    uint64_t stat_fast_retrans;
+    uint64_t stat_timeouts;
+};
+
+static inline uint64_t tcp_now_ms(void) {
+    return timer_timestamp_ns() / 1000000;
+}
+
+//Receive path, nb carries the IP packet
+int tcp_ipv4_rx(interface_def_t *interface, netbuf_t *nb, ipv4_t *packet, int len);
+int tcp_ipv6_rx(interface_def_t *interface, netbuf_t *nb, ipv6_t *packet, int len);
+
+PRIVATE int tcp_init(void);
+
+//tcp_output.c, connection locked
+PRIVATE void tcp_output(tcp_conn_t *c);
+PRIVATE void tcp_send_ack(tcp_conn_t *c);
+PRIVATE void tcp_send_syn(tcp_conn_t *c);
+PRIVATE void tcp_send_rst(tcp_conn_t *c);
+PRIVATE void tcp_retransmit(tcp_conn_t *c, uint32_t seq);
+PRIVATE void tcp_send_reset(interface_def_t *interface, const network_sockaddr_t *local, const network_sockaddr_t *remote, uint32_t seq, uint32_t ack, bool has_ack);
+PRIVATE uint32_t tcp_rcv_window(tcp_conn_t *c);
+PRIVATE uint16_t tcp_our_mss(tcp_conn_t *c);
+PRIVATE int tcp_route(tcp_conn_t *c);
+
+//tcp_timer.c
+PRIVATE int tcp_timer_init(void);
+PRIVATE void tcp_timer_arm(tcp_conn_t *c, tcp_timer_kind_t kind, uint32_t ms);
+PRIVATE void tcp_timer_cancel(tcp_conn_t *c, tcp_timer_kind_t kind);
+PRIVATE bool tcp_timer_armed(tcp_conn_t *c, tcp_timer_kind_t kind);
+//Whether an expired timer is still due, the handler calls this with the connection locked
+PRIVATE bool tcp_timer_claim(tcp_conn_t *c, tcp_timer_kind_t kind);
+
+//tcp.c, called by the timer task with a reference held and the connection unlocked
+PRIVATE void tcp_timer_fire(tcp_conn_t *c, tcp_timer_kind_t kind);
+PRIVATE void tcp_put(tcp_conn_t *c);
+
+//tcp_cc.c
+PRIVATE void tcp_cc_register(tcp_cc_ops_t *ops);
+PRIVATE const tcp_cc_ops_t *tcp_cc_find(const char *name);
+PRIVATE void tcp_cc_init(void);
+
+#endif
@@ -19,7 +19,7 @@ typedef struct {
     uint8_t body[0];
 } udp_t;
 
-int udp_ipv4_rx(interface_def_t *interface, ipv4_t *packet, int len);
-int udp_ipv6_rx(interface_def_t *interface, ipv6_t *packet, int len);
+int udp_ipv4_rx(interface_def_t *interface, netbuf_t *nb, ipv4_t *packet, int len);
+int udp_ipv6_rx(interface_def_t *interface, netbuf_t *nb, ipv6_t *packet, int len);
 
 #endif
\ No newline at end of file
@@ -6,25 +6,85 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "arp.h"
+#include "neigh.h"
 
-//TODO: Create a task to run the arp state machine
-//TODO: Add a scheduler based lock to reduce lock contention, lock pulls the thread out of the scheduler until it's available
+static const uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+static int arp_send(interface_def_t *interface, uint16_t opcode, const uint8_t *dst_mac, const uint8_t *target_mac, uint32_t target_ip, uint32_t sender_ip) {
+    netbuf_t *nb = netbuf_alloc();
+    if (nb == NULL)
+        return -1;
+
+    arp_t *pkt = (arp_t *)netbuf_put(nb, sizeof(arp_t));
+    pkt->hw_type = TO_BE_FRM_LE_16(ARP_HW_ETHERNET);
+    pkt->protocol_type = TO_BE_FRM_LE_16(0x0800);
+    pkt->hw_addr_len = 6;
+    pkt->protocol_addr_len = 4;
+    pkt->opcode = TO_BE_FRM_LE_16(opcode);
+    memcpy(pkt->src_mac, interface->mac, 6);
+    pkt->src_ip = sender_ip;
+    memcpy(pkt->dst_mac, target_mac, 6);
+    pkt->dst_ip = target_ip;
+
+    return network_tx_packet(interface, nb, dst_mac, 0x0806);
+}
+
+PRIVATE int arp_solicit(interface_def_t *interface, uint32_t ip, const uint8_t *unicast_mac) {
+    static const uint8_t zero_mac[6] = {0, 0, 0, 0, 0, 0};
+    return arp_send(interface, ARP_REQUEST, unicast_mac != NULL ? unicast_mac : broadcast_mac, zero_mac, ip, interface->ipv4_addr);
+}
+
+PRIVATE int arp_announce(interface_def_t *interface) {
+    //Sender and target are both our address, so nobody mistakes it for a request needing a reply
+    return arp_send(interface, ARP_REQUEST, broadcast_mac, broadcast_mac, interface->ipv4_addr, interface->ipv4_addr);
+}
 
 int arp_rx(interface_def_t *interface, void *packet, int len) {
-    //TODO: update the arp cache or respond to a request
-    interface = NULL;
-    len = 0;
+    if (len < (int)sizeof(arp_t))
+        return -1;
 
     arp_t *pkt = (arp_t *)packet;
+    if (pkt->hw_type != TO_BE_FRM_LE_16(ARP_HW_ETHERNET) || pkt->protocol_type != TO_BE_FRM_LE_16(0x0800))
+        return -1;
+    if (pkt->hw_addr_len != 6 || pkt->protocol_addr_len != 4)
+        return -1;
+
+    //Broadcast and multicast senders are bogus, an all zero sender is a probe for address conflicts
+    if (pkt->src_mac[0] & 1)
+        return -1;
+
+    uint16_t opcode = TO_LE_FRM_BE_16(pkt->opcode);
+    uint32_t src_ip = pkt->src_ip;
+    uint32_t dst_ip = pkt->dst_ip;
+    uint32_t our_ip = interface->ipv4_addr;
+    bool for_us = our_ip != 0 && dst_ip == our_ip;
+
+    if (src_ip != 0 && src_ip != our_ip) {
+        uint8_t addr[NEIGH_ADDR_LEN];
+        neigh_addr4(src_ip, addr);
+
+        if (src_ip == dst_ip) {
+            //Gratuitous ARP, refresh an existing entry but don't let anyone fill the cache this way
+            neigh_update(interface, addr, pkt->src_mac, NEIGH_F_OVERRIDE);
+        } else if (opcode == ARP_REPLY && for_us) {
+            //Answer to our request, the sender is known to be reachable
+            neigh_update(interface, addr, pkt->src_mac, NEIGH_F_CONFIRM | NEIGH_F_OVERRIDE);
+        } else if (for_us) {
+            //Whoever asks for us is about to talk to us, save ourselves a request
+            neigh_update(interface, addr, pkt->src_mac, NEIGH_F_CREATE | NEIGH_F_OVERRIDE);
+        } else {
+            neigh_update(interface, addr, pkt->src_mac, NEIGH_F_OVERRIDE);
+        }
+    }
 
-    /*if (TO_LE_FRM_BE_16(pkt->opcode) == ARP_REQUEST)
-        DEBUG_PRINT("ARP_REQUEST\r\n");
-    else if (TO_LE_FRM_BE_16(pkt->opcode) == ARP_REPLY)
-        DEBUG_PRINT("ARP_REPLY\r\n");
-    else
-        DEBUG_PRINT("ARP_UNKNOWN\r\n");*/
+    if (opcode == ARP_REQUEST && for_us) {
+        uint8_t src_mac[6];
+        memcpy(src_mac, pkt->src_mac, 6);
+        return arp_send(interface, ARP_REPLY, src_mac, src_mac, src_ip, our_ip);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
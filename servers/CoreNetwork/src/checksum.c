@@ -0,0 +1,286 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SysTimer/timer.h"
+
+#include "checksum.h"
+
+// Checksum dispatch.
+// The scalar path sums 64-bit words with an end-around carry, the platform code supplies SIMD
+// variants which are picked at init from the CPUID bits SysReg records. Every implementation
+// produces the same unfolded sum modulo folding, network_csum_selftest checks exactly that.
+
+#define CSUM_BENCH_BYTES (256 * 1024 * 1024ull)
+#define CSUM_SELFTEST_ROUNDS (4096)
+#define CSUM_SELFTEST_MAX_LEN (4096)
+
+static uint64_t csum_scalar(const void *buf, int len, uint64_t sum) {
+    const uint8_t *p = (const uint8_t *)buf;
+
+    while (len >= 32) {
+        uint64_t w[4];
+        memcpy(w, p, sizeof(w));
+        sum = network_csum_add(sum, w[0]);
+        sum = network_csum_add(sum, w[1]);
+        sum = network_csum_add(sum, w[2]);
+        sum = network_csum_add(sum, w[3]);
+        p += 32;
+        len -= 32;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        sum = network_csum_add(sum, w);
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, sizeof(w));
+        sum = network_csum_add(sum, w);
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, p, sizeof(w));
+        sum = network_csum_add(sum, w);
+        p += 2;
+        len -= 2;
+    }
+    //A trailing byte is the first half of a word, the low half in memory order
+    if (len > 0)
+        sum = network_csum_add(sum, *p);
+    return sum;
+}
+
+static uint64_t csum_scalar_copy(void *dst, const void *src, int len, uint64_t sum) {
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, s, sizeof(w));
+        memcpy(d, &w, sizeof(w));
+        sum = network_csum_add(sum, w);
+        s += 8;
+        d += 8;
+        len -= 8;
+    }
+    memcpy(d, s, len);
+    return csum_scalar(s, len, sum);
+}
+
+static const network_csum_impl_t csum_scalar_impl = {
+    .name = "scalar",
+    .partial = csum_scalar,
+    .copy = csum_scalar_copy,
+};
+
+static const network_csum_impl_t *csum_impl = &csum_scalar_impl;
+
+PRIVATE uint64_t network_csum_partial(const void *buf, int len, uint64_t sum) {
+    return csum_impl->partial(buf, len, sum);
+}
+
+PRIVATE uint64_t network_csum_copy(void *dst, const void *src, int len, uint64_t sum) {
+    return csum_impl->copy(dst, src, len, sum);
+}
+
+PRIVATE uint64_t network_csum_netbuf(netbuf_t *nb, int offset, int len, uint64_t sum) {
+    bool odd = false;
+    for (; nb != NULL && len > 0; nb = nb->next) {
+        if (offset >= nb->len) {
+            offset -= nb->len;
+            continue;
+        }
+
+        int seg_len = MIN(nb->len - offset, len);
+        uint64_t seg = network_csum_partial(nb->data + offset, seg_len, 0);
+        if (odd) {
+            //This segment starts halfway through a word, swapping the bytes of its sum puts them in place
+            uint16_t folded = (uint16_t)~network_csum_fold(seg);
+            seg = (uint16_t)((folded << 8) | (folded >> 8));
+        }
+        sum = network_csum_add(sum, seg);
+        odd ^= (seg_len & 1);
+        len -= seg_len;
+        offset = 0;
+    }
+    return sum;
+}
+
+PRIVATE int network_csum_init(void) {
+    const network_csum_impl_t *impls = network_csum_platform_impls(&csum_scalar_impl);
+    if (impls != NULL && impls[0].name != NULL)
+        csum_impl = &impls[0];
+
+    DEBUG_PRINT("[CoreNetwork] Checksum implementation: ");
+    DEBUG_PRINT(csum_impl->name);
+    DEBUG_PRINT("\r\n");
+    return 0;
+}
+
+static uint64_t csum_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+//Straight from RFC 1071, one big-endian word at a time
+static uint16_t csum_reference(const uint8_t *p, int len) {
+    uint32_t sum = 0;
+    for (int i = 0; i + 1 < len; i += 2)
+        sum += ((uint32_t)p[i] << 8) | p[i + 1];
+    if (len & 1)
+        sum += (uint32_t)p[len - 1] << 8;
+    while (sum > 0xffff)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+static int csum_selftest_impl(const network_csum_impl_t *impl, uint8_t *src, uint8_t *dst, uint64_t *seed) {
+    int failures = 0;
+    for (int i = 0; i < CSUM_SELFTEST_ROUNDS; i++) {
+        int off = csum_rand(seed) % 64;
+        int len = csum_rand(seed) % (CSUM_SELFTEST_MAX_LEN - 64);
+        for (int j = 0; j < len; j++)
+            src[off + j] = (uint8_t)csum_rand(seed);
+
+        //Results come back in memory order, the reference works in network order
+        uint16_t expected = TO_BE_FRM_LE_16(csum_reference(src + off, len));
+        if (network_csum_fold(impl->partial(src + off, len, 0)) != expected)
+            failures++;
+
+        int dst_off = csum_rand(seed) % 64;
+        if (network_csum_fold(impl->copy(dst + dst_off, src + off, len, 0)) != expected ||
+            memcmp(dst + dst_off, src + off, len) != 0)
+            failures++;
+    }
+    return failures;
+}
+
+//Check every implementation against the RFC 1071 reference on random lengths and alignments, as
+//well as the incremental update
+int network_csum_selftest() {
+    char tmp[20];
+    uint8_t *src = malloc(CSUM_SELFTEST_MAX_LEN);
+    uint8_t *dst = malloc(CSUM_SELFTEST_MAX_LEN);
+    if (src == NULL || dst == NULL) {
+        free(src);
+        free(dst);
+        return -1;
+    }
+
+    int total = 0;
+    uint64_t seed = timer_timestamp_ns() | 1;
+    const network_csum_impl_t *impls = network_csum_platform_impls(&csum_scalar_impl);
+    for (int i = 0; impls != NULL && impls[i].name != NULL; i++) {
+        int failures = csum_selftest_impl(&impls[i], src, dst, &seed);
+        DEBUG_PRINT("[CoreNetwork] Checksum ");
+        DEBUG_PRINT(impls[i].name);
+        DEBUG_PRINT(" failures: ");
+        DEBUG_PRINT(itoa(failures, tmp, 10));
+        DEBUG_PRINT("\r\n");
+        total += failures;
+    }
+    int failures = csum_selftest_impl(&csum_scalar_impl, src, dst, &seed);
+    total += failures;
+
+    //Rewriting a word and patching the checksum has to match recomputing it
+    for (int i = 0; i < CSUM_SELFTEST_ROUNDS; i++) {
+        int len = 2 * (1 + csum_rand(&seed) % 32);
+        for (int j = 0; j < len; j++)
+            src[j] = (uint8_t)csum_rand(&seed);
+
+        uint16_t csum = network_csum_fold(csum_scalar(src, len, 0));
+        uint16_t *word = (uint16_t *)(src + 2 * (csum_rand(&seed) % (len / 2)));
+        uint16_t from = *word;
+        *word = (uint16_t)csum_rand(&seed);
+        network_csum_replace2(&csum, from, *word);
+
+        //0 and 0xffff are the same value in ones' complement
+        uint16_t expected = network_csum_fold(csum_scalar(src, len, 0));
+        if (csum != expected && (uint16_t)(csum ^ expected) != 0xffff)
+            failures++;
+    }
+    total += failures;
+
+    DEBUG_PRINT("[CoreNetwork] Checksum scalar and incremental failures: ");
+    DEBUG_PRINT(itoa(failures, tmp, 10));
+    DEBUG_PRINT("\r\n");
+
+    free(src);
+    free(dst);
+    return total;
+}
+
+static void csum_bench_print(const char *name, const char *what, int len, uint64_t bytes, uint64_t ns) {
+    char tmp[20];
+    uint64_t centi_gbps = (ns == 0) ? 0 : (bytes * 100) / ns;
+
+    DEBUG_PRINT("[CoreNetwork] ");
+    DEBUG_PRINT(name);
+    DEBUG_PRINT(what);
+    DEBUG_PRINT(itoa(len, tmp, 10));
+    DEBUG_PRINT(" GB/s=");
+    DEBUG_PRINT(ltoa(centi_gbps / 100, tmp, 10));
+    DEBUG_PRINT(centi_gbps % 100 < 10 ? ".0" : ".");
+    DEBUG_PRINT(ltoa(centi_gbps % 100, tmp, 10));
+    DEBUG_PRINT("\r\n");
+}
+
+static void csum_bench_impl(const network_csum_impl_t *impl, uint8_t *src, uint8_t *dst) {
+    static const int sizes[] = {64, 1500, 65536};
+    volatile uint64_t sink = 0;
+
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int len = sizes[s];
+        uint64_t iters = CSUM_BENCH_BYTES / len;
+
+        uint64_t t0 = timer_timestamp_ns();
+        for (uint64_t i = 0; i < iters; i++)
+            sink += impl->partial(src, len, 0);
+        uint64_t t1 = timer_timestamp_ns();
+        csum_bench_print(impl->name, " sum size=", len, iters * len, t1 - t0);
+
+        t0 = timer_timestamp_ns();
+        for (uint64_t i = 0; i < iters; i++)
+            sink += impl->copy(dst, src, len, 0);
+        t1 = timer_timestamp_ns();
+        csum_bench_print(impl->name, " copy+sum size=", len, iters * len, t1 - t0);
+    }
+}
+
+//Throughput of every implementation
+int network_csum_bench() {
+    uint8_t *src = malloc(KiB(64));
+    uint8_t *dst = malloc(KiB(64));
+    if (src == NULL || dst == NULL) {
+        free(src);
+        free(dst);
+        return -1;
+    }
+    for (uint64_t i = 0; i < KiB(64); i++)
+        src[i] = (uint8_t)(i * 31);
+
+    const network_csum_impl_t *impls = network_csum_platform_impls(&csum_scalar_impl);
+    for (int i = 0; impls != NULL && impls[i].name != NULL; i++)
+        csum_bench_impl(&impls[i], src, dst);
+    csum_bench_impl(&csum_scalar_impl, src, dst);
+
+    free(src);
+    free(dst);
+    return 0;
+}
@@ -15,12 +15,17 @@
 #include "arp.h"
 #include "ip.h"
 
-int ethernet_rx(interface_def_t *interface, void *packet, int len) {
+int ethernet_rx(interface_def_t *interface, netbuf_t *nb) {
     //Decode the ethernet frame and pass it up the stack (to the IP layer?)
-    ethernet_frame_t *ether = (ethernet_frame_t*)packet;
+    if (nb->len < (int)sizeof(ethernet_frame_t))
+        return -1;
+
+    ethernet_frame_t *ether = (ethernet_frame_t*)nb->data;
+    int len = nb->tot_len;
 
     bool mac_match = true;
     bool broadcast = true;
+    bool ipv6_multicast = ether->dst_mac[0] == 0x33 && ether->dst_mac[1] == 0x33;
     for(int i = 0; i < 6; i++) {
         if(ether->dst_mac[i] != interface->mac[i])
             mac_match = false;
@@ -39,23 +44,28 @@ int ethernet_rx(interface_def_t *interface, void *packet, int len) {
     if(mac_match | broadcast) {
         if(ether->type == ETHERNET_TYPE_ARP) {
             //Forward to the arp layer
-            arp_rx(interface, ether->body, len - sizeof(ethernet_frame_t));
+            arp_rx(interface, ether->body, nb->len - sizeof(ethernet_frame_t));
         } else if(ether->type == ETHERNET_TYPE_IPv4) {
             //Forward to the ipv4 layer
-            ipv4_rx(interface, ether->body, len - sizeof(ethernet_frame_t));
+            ipv4_rx(interface, nb, ether->body, len - sizeof(ethernet_frame_t));
         } else if(ether->type == ETHERNET_TYPE_IPv6) {
             //Forward to the ipv6 layer
-            ipv6_rx(interface, ether->body, len - sizeof(ethernet_frame_t));
+            ipv6_rx(interface, nb, ether->body, len - sizeof(ethernet_frame_t));
+        }
+    } else if(ipv6_multicast) {
+        //Neighbor discovery relies on multicast
+        if(ether->type == ETHERNET_TYPE_IPv6) {
+            //Forward to the ipv6 layer
+            ipv6_rx(interface, nb, ether->body, len - sizeof(ethernet_frame_t));
         }
     }
 
     return 0;
 }
 
-int wifi_rx(interface_def_t *interface, void *packet, int len) {
+int wifi_rx(interface_def_t *interface, netbuf_t *nb) {
     interface = NULL;
-    packet = NULL;
-    len = 0;
+    nb = NULL;
 
     return 0;
 }
\ No newline at end of file
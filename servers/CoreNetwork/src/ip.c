@@ -6,25 +6,20 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "ip.h"
 #include "udp.h"
+#include "tcp.h"
+#include "checksum.h"
+#include "ndp.h"
+#include "neigh.h"
 
 uint16_t ipv4_verify_csum(ipv4_t *packet) {
-
-    uint32_t csum = 0;
-    uint16_t *packet_ptr = (uint16_t*)packet;
-    for(uint32_t i = 0; i < sizeof(ipv4_t) / sizeof(uint16_t); i++)
-        csum += TO_LE_FRM_BE_16(packet_ptr[i]);
-
-    while(csum > 0xffff) {
-        csum = (csum & 0xffff) + (csum >> 16);
-    }
-
-    return ~csum;
+    return network_csum_fold(network_csum_partial(packet, packet->ihl * 4, 0));
 }
 
-int ipv4_rx(interface_def_t *interface, void *packet, int len) {
+int ipv4_rx(interface_def_t *interface, netbuf_t *nb, void *packet, int len) {
     ipv4_t *ip_pack = (ipv4_t*)packet;
 
     /*{
@@ -34,39 +29,102 @@ int ipv4_rx(interface_def_t *interface, void *packet, int len) {
         DEBUG_PRINT("\r\n");
     }*/
 
+    uint64_t prof_start = network_prof_begin();
     if(ipv4_verify_csum(ip_pack) == 0) {
         if (ip_pack->protocol == IP_PROTOCOL_ICMP) {
             //TODO: Forward to ICMP layer
             DEBUG_PRINT("ICMP\r\n");
         } else if (ip_pack->protocol == IP_PROTOCOL_TCP) {
-            //TODO: Forward to TCP layer
-            DEBUG_PRINT("TCP\r\n");
+            //Forward to TCP layer
+            uint64_t tcp_start = network_prof_begin();
+            tcp_ipv4_rx(interface, nb, ip_pack, len - sizeof(ipv4_t));
+            network_prof_end(network_prof_tcp, tcp_start);
         } else if (ip_pack->protocol == IP_PROTOCOL_UDP) {
             //Forward to UDP layer
-            udp_ipv4_rx(interface, ip_pack, len - sizeof(ipv4_t));
+            uint64_t udp_start = network_prof_begin();
+            udp_ipv4_rx(interface, nb, ip_pack, len - sizeof(ipv4_t));
+            network_prof_end(network_prof_udp, udp_start);
         } else {
             //TODO: Queue this packet into the raw queue, for potential user mode processing
         }
     }
+    network_prof_end(network_prof_ip, prof_start);
 
     return 0;
 }
 
-int ipv6_rx(interface_def_t *interface, void *packet, int len) {
+int ipv6_rx(interface_def_t *interface, netbuf_t *nb, void *packet, int len) {
     ipv6_t *ip_pack = (ipv6_t*)packet;
 
-    if (ip_pack->protocol == IP_PROTOCOL_ICMP) {
-        //TODO: Forward to ICMP layer
-        DEBUG_PRINT("ICMPv6\r\n");
+    uint64_t prof_start = network_prof_begin();
+    if (ip_pack->protocol == IP_PROTOCOL_ICMPV6) {
+        //Forward to ICMPv6, which handles neighbor discovery
+        if (interface != NULL)
+            ndp_rx(interface, nb, ip_pack, len - sizeof(ipv6_t));
     } else if (ip_pack->protocol == IP_PROTOCOL_TCP) {
-        //TODO: Forward to TCP layer
-        DEBUG_PRINT("TCPv6\r\n");
+        //Forward to TCP layer
+        uint64_t tcp_start = network_prof_begin();
+        tcp_ipv6_rx(interface, nb, ip_pack, len - sizeof(ipv6_t));
+        network_prof_end(network_prof_tcp, tcp_start);
     } else if (ip_pack->protocol == IP_PROTOCOL_UDP) {
         //Forward to UDP layer
-        udp_ipv6_rx(interface, ip_pack, len - sizeof(ipv6_t));
+        uint64_t udp_start = network_prof_begin();
+        udp_ipv6_rx(interface, nb, ip_pack, len - sizeof(ipv6_t));
+        network_prof_end(network_prof_udp, udp_start);
     } else {
         //TODO: Queue this packet into the raw queue, for potential user mode processing
     }
+    network_prof_end(network_prof_ip, prof_start);
 
     return 0;
-}
\ No newline at end of file
+}
+
+PRIVATE int ip_output(interface_def_t *interface, const uint8_t *next_hop, netbuf_t *list) {
+    if (list == NULL)
+        return 0;
+
+    if (interface == NULL)
+        interface = network_loopback();
+    if (interface == NULL) {
+        while (list != NULL) {
+            netbuf_t *nb = list;
+            list = nb->q_next;
+            netbuf_free(nb);
+        }
+        return -1;
+    }
+
+    //Whatever goes out comes straight back in, there's no neighbor to resolve
+    if (interface->device.features & network_device_features_loopback)
+        return network_tx_list(interface, list, interface->mac, (list->data[0] >> 4) == 4 ? 0x0800 : 0x86DD);
+
+    bool v4 = next_hop[10] == 0xff && next_hop[11] == 0xff;
+    for (int i = 0; i < 10; i++)
+        if (next_hop[i] != 0)
+            v4 = false;
+
+    netbuf_t *nb = list;
+    list = nb->q_next;
+    nb->q_next = NULL;
+
+    uint32_t ip;
+    memcpy(&ip, &next_hop[12], sizeof(ip));
+    int ret = v4 ? neigh_output4(interface, ip, nb) : neigh_output6(interface, next_hop, nb);
+
+    uint8_t mac[6];
+    if (list != NULL && neigh_lookup(interface, next_hop, mac)) {
+        if (network_tx_list(interface, list, mac, v4 ? 0x0800 : 0x86DD) != 0)
+            ret = -1;
+        return ret;
+    }
+
+    //Still being resolved, let the neighbor entry park them
+    while (list != NULL) {
+        nb = list;
+        list = nb->q_next;
+        nb->q_next = NULL;
+        if ((v4 ? neigh_output4(interface, ip, nb) : neigh_output6(interface, next_hop, nb)) != 0)
+            ret = -1;
+    }
+    return ret;
+}
@@ -6,10 +6,26 @@
  */
 
 #include "net_priv.h"
+#include "checksum.h"
+#include "neigh.h"
+#include "tcp.h"
 
 int module_init() {
 
     network_init();
+    network_csum_init();
+
+    if (netbuf_init() != 0)
+        PANIC("[CoreNetwork] Failed to set up the packet buffer pool.");
+
+    if (neigh_init() != 0)
+        PANIC("[CoreNetwork] Failed to set up the neighbor cache.");
+
+    if (loopback_init() != 0)
+        PANIC("[CoreNetwork] Failed to register the loopback device.");
+
+    if (tcp_init() != 0)
+        PANIC("[CoreNetwork] Failed to set up TCP.");
 
     return 0;
 }
\ No newline at end of file
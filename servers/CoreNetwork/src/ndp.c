@@ -0,0 +1,162 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ndp.h"
+#include "neigh.h"
+#include "checksum.h"
+
+// Neighbor Discovery (RFC 4861), the address resolution half of it.
+// Solicitations and advertisements feed the neighbor cache the same way ARP does, the only
+// address answered for is the interface's link-local one.
+
+static const uint8_t all_nodes[16] = {0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01};
+
+static inline bool ndp_unspecified(const uint8_t *addr) {
+    for (int i = 0; i < 16; i++)
+        if (addr[i] != 0)
+            return false;
+    return true;
+}
+
+//ff02::1:ffXX:XXXX, every node listens on the group formed from the low 24 bits of its addresses
+static void ndp_solicited_node(const uint8_t *addr, uint8_t *group) {
+    memset(group, 0, 16);
+    group[0] = 0xff;
+    group[1] = 0x02;
+    group[11] = 0x01;
+    group[12] = 0xff;
+    group[13] = addr[13];
+    group[14] = addr[14];
+    group[15] = addr[15];
+}
+
+//IPv6 multicast maps onto 33:33 followed by the low 32 bits of the group
+static void ndp_multicast_mac(const uint8_t *group, uint8_t *mac) {
+    mac[0] = 0x33;
+    mac[1] = 0x33;
+    memcpy(&mac[2], &group[12], 4);
+}
+
+static int ndp_send(interface_def_t *interface, const uint8_t *dst_ip, const uint8_t *dst_mac, uint8_t type, uint8_t flags, const uint8_t *target, uint8_t opt_type) {
+    netbuf_t *nb = netbuf_alloc();
+    if (nb == NULL)
+        return -1;
+
+    int icmp_len = sizeof(ndp_t) + sizeof(ndp_lladdr_opt_t);
+    ipv6_t *ip = (ipv6_t *)netbuf_put(nb, sizeof(ipv6_t) + icmp_len);
+    ip->version_traffic_flow = TO_BE_FRM_LE_32(0x60000000);
+    ip->payload_len = TO_BE_FRM_LE_16((uint16_t)icmp_len);
+    ip->protocol = IP_PROTOCOL_ICMPV6;
+    ip->ttl = 255;
+    memcpy(ip->src_ip, interface->ipv6_ll, 16);
+    memcpy(ip->dst_ip, dst_ip, 16);
+
+    ndp_t *ndp = (ndp_t *)ip->body;
+    memset(ndp, 0, icmp_len);
+    ndp->type = type;
+    ndp->flags = flags;
+    memcpy(ndp->target, target, 16);
+
+    ndp_lladdr_opt_t *opt = (ndp_lladdr_opt_t *)ndp->options;
+    opt->type = opt_type;
+    opt->len = 1;
+    memcpy(opt->mac, interface->mac, 6);
+
+    uint64_t sum = network_csum_pseudo6(ip->src_ip, ip->dst_ip, IP_PROTOCOL_ICMPV6, icmp_len);
+    ndp->csum = network_csum_fold(network_csum_partial(ndp, icmp_len, sum));
+
+    return network_tx_packet(interface, nb, dst_mac, 0x86DD);
+}
+
+PRIVATE int ndp_solicit(interface_def_t *interface, const uint8_t *addr, const uint8_t *unicast_mac) {
+    if (unicast_mac != NULL)
+        return ndp_send(interface, addr, unicast_mac, ICMPV6_NEIGHBOR_SOLICIT, 0, addr, NDP_OPT_SRC_LLADDR);
+
+    uint8_t group[16];
+    uint8_t mac[6];
+    ndp_solicited_node(addr, group);
+    ndp_multicast_mac(group, mac);
+    return ndp_send(interface, group, mac, ICMPV6_NEIGHBOR_SOLICIT, 0, addr, NDP_OPT_SRC_LLADDR);
+}
+
+//Link-layer address option of the given type, NULL if absent, fails on malformed options
+static int ndp_find_lladdr(const uint8_t *opts, int len, uint8_t type, const uint8_t **mac) {
+    *mac = NULL;
+    while (len > 0) {
+        if (len < 2 || opts[1] == 0 || opts[1] * 8 > len)
+            return -1;
+        if (opts[0] == type && opts[1] == 1)
+            *mac = &opts[2];
+        len -= opts[1] * 8;
+        opts += opts[1] * 8;
+    }
+    return 0;
+}
+
+int ndp_rx(interface_def_t *interface, netbuf_t *nb, ipv6_t *packet, int len) {
+    ndp_t *ndp = (ndp_t *)packet->body;
+    int icmp_len = MIN(len, (int)TO_LE_FRM_BE_16(packet->payload_len));
+    int offset = (int)((uint8_t *)ndp - nb->data);
+
+    //Anything not sent by an on-link neighbor has a lower hop limit, and these are short enough to sit in one segment
+    if (icmp_len < (int)sizeof(ndp_t) || offset + icmp_len > nb->len)
+        return -1;
+    if (ndp->type != ICMPV6_NEIGHBOR_SOLICIT && ndp->type != ICMPV6_NEIGHBOR_ADVERT)
+        return 0;
+    if (packet->ttl != 255 || ndp->code != 0)
+        return -1;
+
+    uint64_t sum = network_csum_pseudo6(packet->src_ip, packet->dst_ip, IP_PROTOCOL_ICMPV6, icmp_len);
+    if (network_csum_fold(network_csum_partial(ndp, icmp_len, sum)) != 0)
+        return -1;
+    if (ndp->target[0] == 0xff)
+        return -1;
+
+    const uint8_t *lladdr;
+    if (ndp->type == ICMPV6_NEIGHBOR_SOLICIT) {
+        if (ndp_find_lladdr(ndp->options, icmp_len - sizeof(ndp_t), NDP_OPT_SRC_LLADDR, &lladdr) != 0)
+            return -1;
+        if (memcmp(ndp->target, interface->ipv6_ll, 16) != 0)
+            return 0;
+
+        if (ndp_unspecified(packet->src_ip)) {
+            //Duplicate address detection, defend the address to everyone
+            uint8_t mac[6];
+            ndp_multicast_mac(all_nodes, mac);
+            return ndp_send(interface, all_nodes, mac, ICMPV6_NEIGHBOR_ADVERT, NDP_NA_OVERRIDE, ndp->target, NDP_OPT_TGT_LLADDR);
+        }
+
+        //A solicitation without the sender's address can only be a unicast probe of an entry we already have
+        uint8_t src_ip[16];
+        uint8_t src_mac[6];
+        memcpy(src_ip, packet->src_ip, 16);
+        if (lladdr != NULL) {
+            memcpy(src_mac, lladdr, 6);
+            neigh_update(interface, src_ip, src_mac, NEIGH_F_CREATE | NEIGH_F_OVERRIDE);
+        } else if (!neigh_lookup(interface, src_ip, src_mac))
+            return 0;
+
+        return ndp_send(interface, src_ip, src_mac, ICMPV6_NEIGHBOR_ADVERT, NDP_NA_SOLICITED | NDP_NA_OVERRIDE, ndp->target, NDP_OPT_TGT_LLADDR);
+    }
+
+    if (ndp_find_lladdr(ndp->options, icmp_len - sizeof(ndp_t), NDP_OPT_TGT_LLADDR, &lladdr) != 0)
+        return -1;
+    if (lladdr == NULL)
+        return 0;
+
+    //Unsolicited advertisements, like gratuitous ARP, only refresh entries we already have
+    int flags = 0;
+    if (ndp->flags & NDP_NA_SOLICITED)
+        flags |= NEIGH_F_CONFIRM;
+    if (ndp->flags & NDP_NA_OVERRIDE)
+        flags |= NEIGH_F_OVERRIDE;
+    neigh_update(interface, ndp->target, lladdr, flags);
+    return 0;
+}
@@ -0,0 +1,534 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cardinal/local_spinlock.h>
+
+#include "SysTaskMgr/task.h"
+#include "SysTimer/timer.h"
+
+#include "neigh.h"
+#include "arp.h"
+#include "ndp.h"
+
+// Neighbor cache shared by ARP and NDP.
+// Lookups on the transmit path take no lock. Entries live in a fixed size hash table whose chains
+// end in a 'nulls' marker naming the bucket, and entry memory is never handed back to malloc, only
+// recycled. Each entry carries a sequence count that is odd while a writer rewrites it, a reader
+// copies what it needs and retries if the count moved. If an entry it walked through got recycled
+// into another chain the walk ends on the wrong nulls marker and it starts over. Writers serialize
+// on neigh_lock. The state machine follows RFC 4861 (without DELAY, a stale entry is probed as
+// soon as it's used) and is driven by the net_neigh task, which also ages entries out a slice of
+// the table at a time.
+
+#define NEIGH_BUCKETS (32768)
+#define NEIGH_MAX_ENTRIES (65536)
+#define NEIGH_CHUNK (256)
+#define NEIGH_PARK_MAX (8)
+#define NEIGH_MAX_SOLICIT (3)
+#define NEIGH_TICK_NS (100 * 1000 * 1000ull)
+#define NEIGH_RETRANS_NS (1000 * 1000 * 1000ull)
+#define NEIGH_REACHABLE_NS (30 * 1000 * 1000 * 1000ull)
+#define NEIGH_GC_NS (300 * 1000 * 1000 * 1000ull)
+#define NEIGH_GC_SLICE (128)
+#define NEIGH_TICK_MAX_SOLICIT (64)
+
+#define NEIGH_NULLS(b) ((((uintptr_t)(b)) << 1) | 1)
+#define NEIGH_IS_NULLS(p) (((p) & 1) != 0)
+#define NEIGH_NULLS_BUCKET(p) ((uint32_t)((p) >> 1))
+
+typedef struct neigh_entry {
+    uintptr_t next;                 //Next entry in the chain or the bucket's nulls marker
+    _Atomic uint32_t seq;           //Odd while a writer is rewriting the entry
+    interface_def_t *interface;
+    uint8_t addr[NEIGH_ADDR_LEN];
+    uint8_t mac[6];
+    uint8_t state;
+    uint8_t solicits;               //Solicitations sent for the current resolution or probe
+    uint64_t confirmed_ns;          //Last time reachability was confirmed
+    uint64_t updated_ns;            //Last time the entry was created, updated or used while stale
+    uint64_t timer_ns;              //Next solicitation is due at this time
+
+    netbuf_t *parked;               //Waiting for resolution, linked through q_next
+    netbuf_t *parked_tail;
+    int parked_cnt;
+
+    bool active;                    //On the active list, being resolved or probed
+    struct neigh_entry *active_next;
+    struct neigh_entry *free_next;
+} neigh_entry_t;
+
+typedef struct {
+    interface_def_t *interface;
+    uint8_t addr[NEIGH_ADDR_LEN];
+    uint8_t mac[6];
+    bool unicast;
+} neigh_solicit_t;
+
+static uintptr_t *buckets;
+static int neigh_lock = 0;
+static uint64_t hash_seed;
+
+static neigh_entry_t *free_entries = NULL;
+static neigh_entry_t *active_entries = NULL;
+static int entry_cnt = 0;
+static int entry_total = 0;
+static uint32_t gc_cursor = 0;
+
+static uint64_t stat_parked = 0;
+static uint64_t stat_park_drops = 0;
+static uint64_t stat_failed = 0;
+static uint64_t stat_evicted = 0;
+static uint64_t stat_alloc_failures = 0;
+
+static inline bool neigh_isv4(const uint8_t *addr) {
+    for (int i = 0; i < 10; i++)
+        if (addr[i] != 0)
+            return false;
+    return addr[10] == 0xff && addr[11] == 0xff;
+}
+
+static inline uint16_t neigh_ethertype(const uint8_t *addr) {
+    return neigh_isv4(addr) ? 0x0800 : 0x86DD;
+}
+
+static uint32_t neigh_hash(interface_def_t *interface, const uint8_t *addr) {
+    uint64_t w[2];
+    memcpy(w, addr, sizeof(w));
+
+    uint64_t h = hash_seed ^ (uintptr_t)interface;
+    h = (h ^ w[0]) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 29) ^ w[1]) * 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return (uint32_t)h & (NEIGH_BUCKETS - 1);
+}
+
+static inline void neigh_write_begin(neigh_entry_t *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void neigh_write_end(neigh_entry_t *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+//Lock-free, copies out the entry's state and link address
+static bool neigh_read(interface_def_t *interface, const uint8_t *addr, uint8_t *mac, int *state, uint64_t *confirmed_ns) {
+    uint32_t b = neigh_hash(interface, addr);
+
+retry:;
+    uintptr_t cur = __atomic_load_n(&buckets[b], __ATOMIC_ACQUIRE);
+    while (!NEIGH_IS_NULLS(cur)) {
+        neigh_entry_t *e = (neigh_entry_t *)cur;
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            goto retry;
+
+        bool match = e->interface == interface && memcmp(e->addr, addr, NEIGH_ADDR_LEN) == 0;
+        if (match) {
+            memcpy(mac, e->mac, 6);
+            *state = e->state;
+            *confirmed_ns = e->confirmed_ns;
+        }
+        uintptr_t next = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+            goto retry;
+        if (match)
+            return true;
+        cur = next;
+    }
+
+    //Ended up on another bucket's chain, an entry was recycled while we walked through it
+    if (NEIGH_NULLS_BUCKET(cur) != b)
+        goto retry;
+    return false;
+}
+
+//Caller holds neigh_lock
+static neigh_entry_t *neigh_find(interface_def_t *interface, const uint8_t *addr, uint32_t b) {
+    for (uintptr_t cur = buckets[b]; !NEIGH_IS_NULLS(cur); cur = ((neigh_entry_t *)cur)->next) {
+        neigh_entry_t *e = (neigh_entry_t *)cur;
+        if (e->interface == interface && memcmp(e->addr, addr, NEIGH_ADDR_LEN) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+//Caller holds neigh_lock, the entry comes back already linked into bucket b and in the incomplete state
+static neigh_entry_t *neigh_create(interface_def_t *interface, const uint8_t *addr, uint32_t b, uint64_t now) {
+    if (free_entries == NULL && entry_total < NEIGH_MAX_ENTRIES) {
+        //Entries are never freed, readers may still be looking at recycled ones
+        neigh_entry_t *chunk = malloc(sizeof(neigh_entry_t) * NEIGH_CHUNK);
+        if (chunk != NULL) {
+            memset(chunk, 0, sizeof(neigh_entry_t) * NEIGH_CHUNK);
+            for (int i = 0; i < NEIGH_CHUNK; i++) {
+                chunk[i].next = NEIGH_NULLS(0);
+                chunk[i].free_next = free_entries;
+                free_entries = &chunk[i];
+            }
+            entry_total += NEIGH_CHUNK;
+        }
+    }
+
+    neigh_entry_t *e = free_entries;
+    if (e == NULL) {
+        stat_alloc_failures++;
+        return NULL;
+    }
+    free_entries = e->free_next;
+    entry_cnt++;
+
+    neigh_write_begin(e);
+    e->interface = interface;
+    memcpy(e->addr, addr, NEIGH_ADDR_LEN);
+    memset(e->mac, 0, 6);
+    e->state = neigh_state_incomplete;
+    e->solicits = 0;
+    e->confirmed_ns = 0;
+    e->updated_ns = now;
+    e->timer_ns = 0;
+    e->parked = NULL;
+    e->parked_tail = NULL;
+    e->parked_cnt = 0;
+    e->active = false;
+    e->next = buckets[b];
+    neigh_write_end(e);
+
+    __atomic_store_n(&buckets[b], (uintptr_t)e, __ATOMIC_RELEASE);
+    return e;
+}
+
+//Caller holds neigh_lock, parked packets are handed back through drop
+static void neigh_remove(neigh_entry_t *e, netbuf_t **drop) {
+    uint32_t b = neigh_hash(e->interface, e->addr);
+    uintptr_t *link = &buckets[b];
+    while (!NEIGH_IS_NULLS(*link) && *link != (uintptr_t)e)
+        link = &((neigh_entry_t *)*link)->next;
+    if (*link != (uintptr_t)e)
+        return;
+    __atomic_store_n(link, e->next, __ATOMIC_RELEASE);
+
+    if (e->parked != NULL) {
+        e->parked_tail->q_next = *drop;
+        *drop = e->parked;
+        stat_park_drops += e->parked_cnt;
+    }
+    e->parked = NULL;
+    e->parked_tail = NULL;
+    e->parked_cnt = 0;
+
+    //Still linked into the active list, neigh_tick unlinks it once it sees it's gone
+    e->state = neigh_state_incomplete;
+    e->interface = NULL;
+    if (!e->active) {
+        e->free_next = free_entries;
+        free_entries = e;
+    }
+    entry_cnt--;
+}
+
+//Caller holds neigh_lock
+static void neigh_activate(neigh_entry_t *e, uint64_t now) {
+    e->solicits = 1;
+    e->timer_ns = now + NEIGH_RETRANS_NS;
+    if (!e->active) {
+        e->active = true;
+        e->active_next = active_entries;
+        active_entries = e;
+    }
+}
+
+static void neigh_solicit(neigh_solicit_t *s) {
+    if (neigh_isv4(s->addr)) {
+        uint32_t ip;
+        memcpy(&ip, &s->addr[12], sizeof(ip));
+        arp_solicit(s->interface, ip, s->unicast ? s->mac : NULL);
+    } else
+        ndp_solicit(s->interface, s->addr, s->unicast ? s->mac : NULL);
+}
+
+static void neigh_freelist(netbuf_t *nb) {
+    while (nb != NULL) {
+        netbuf_t *next = nb->q_next;
+        nb->q_next = NULL;
+        netbuf_free(nb);
+        nb = next;
+    }
+}
+
+//Slow path, takes the lock to create or probe the entry and parks the packet if it can't be sent yet
+static int neigh_resolve(interface_def_t *interface, const uint8_t *addr, netbuf_t *nb) {
+    uint32_t b = neigh_hash(interface, addr);
+    uint64_t now = timer_timestamp_ns();
+    neigh_solicit_t solicit;
+    bool send_solicit = false;
+    netbuf_t *drop = NULL;
+    uint8_t mac[6];
+
+    int cli_state = cli();
+    local_spinlock_lock(&neigh_lock);
+    neigh_entry_t *e = neigh_find(interface, addr, b);
+    if (e == NULL) {
+        e = neigh_create(interface, addr, b, now);
+        if (e != NULL) {
+            neigh_activate(e, now);
+            solicit.interface = interface;
+            memcpy(solicit.addr, addr, NEIGH_ADDR_LEN);
+            solicit.unicast = false;
+            send_solicit = true;
+        }
+    }
+
+    if (e == NULL) {
+        drop = nb;
+        nb = NULL;
+    } else if (e->state == neigh_state_incomplete) {
+        //Park it, the oldest packet makes room once the queue is full
+        if (e->parked_cnt >= NEIGH_PARK_MAX) {
+            drop = e->parked;
+            e->parked = drop->q_next;
+            drop->q_next = NULL;
+            e->parked_cnt--;
+            stat_park_drops++;
+        }
+        nb->q_next = NULL;
+        if (e->parked_tail != NULL && e->parked != NULL)
+            e->parked_tail->q_next = nb;
+        else
+            e->parked = nb;
+        e->parked_tail = nb;
+        e->parked_cnt++;
+        stat_parked++;
+        nb = NULL;
+    } else {
+        //Resolved but not recently confirmed, keep using it while a unicast probe reconfirms it
+        if (e->state != neigh_state_probe) {
+            neigh_write_begin(e);
+            e->state = neigh_state_probe;
+            e->updated_ns = now;
+            neigh_write_end(e);
+            neigh_activate(e, now);
+
+            solicit.interface = interface;
+            memcpy(solicit.addr, addr, NEIGH_ADDR_LEN);
+            memcpy(solicit.mac, e->mac, 6);
+            solicit.unicast = true;
+            send_solicit = true;
+        }
+        memcpy(mac, e->mac, 6);
+    }
+    local_spinlock_unlock(&neigh_lock);
+    sti(cli_state);
+
+    if (send_solicit)
+        neigh_solicit(&solicit);
+    if (drop != NULL) {
+        neigh_freelist(drop);
+        if (nb == NULL && e == NULL)
+            return -1;
+    }
+    if (nb != NULL)
+        return network_tx_packet(interface, nb, mac, neigh_ethertype(addr));
+    return 0;
+}
+
+static int neigh_output(interface_def_t *interface, const uint8_t *addr, netbuf_t *nb) {
+    uint8_t mac[6];
+    int state;
+    uint64_t confirmed_ns;
+
+    if (neigh_read(interface, addr, mac, &state, &confirmed_ns)) {
+        //Fast path, reachable and recently confirmed or already being probed
+        if ((state == neigh_state_reachable && timer_timestamp_ns() - confirmed_ns < NEIGH_REACHABLE_NS) ||
+            state == neigh_state_probe)
+            return network_tx_packet(interface, nb, mac, neigh_ethertype(addr));
+    }
+    return neigh_resolve(interface, addr, nb);
+}
+
+PRIVATE int neigh_output4(interface_def_t *interface, uint32_t next_hop, netbuf_t *nb) {
+    uint8_t addr[NEIGH_ADDR_LEN];
+    neigh_addr4(next_hop, addr);
+    return neigh_output(interface, addr, nb);
+}
+
+PRIVATE int neigh_output6(interface_def_t *interface, const uint8_t *next_hop, netbuf_t *nb) {
+    return neigh_output(interface, next_hop, nb);
+}
+
+PRIVATE bool neigh_lookup(interface_def_t *interface, const uint8_t *addr, uint8_t *mac) {
+    int state;
+    uint64_t confirmed_ns;
+    return neigh_read(interface, addr, mac, &state, &confirmed_ns) && state != neigh_state_incomplete;
+}
+
+PRIVATE void neigh_update(interface_def_t *interface, const uint8_t *addr, const uint8_t *mac, int flags) {
+    uint32_t b = neigh_hash(interface, addr);
+    uint64_t now = timer_timestamp_ns();
+    netbuf_t *flush = NULL;
+
+    int cli_state = cli();
+    local_spinlock_lock(&neigh_lock);
+    neigh_entry_t *e = neigh_find(interface, addr, b);
+    if (e == NULL && (flags & NEIGH_F_CREATE))
+        e = neigh_create(interface, addr, b, now);
+
+    if (e != NULL) {
+        bool changed = memcmp(e->mac, mac, 6) != 0;
+        neigh_write_begin(e);
+        if (e->state == neigh_state_incomplete) {
+            //Resolved, whatever was parked goes out in one batch
+            memcpy(e->mac, mac, 6);
+            e->state = (flags & NEIGH_F_CONFIRM) ? neigh_state_reachable : neigh_state_stale;
+            flush = e->parked;
+            e->parked = NULL;
+            e->parked_tail = NULL;
+            e->parked_cnt = 0;
+        } else if (changed && !(flags & NEIGH_F_OVERRIDE)) {
+            //Don't trust a different address without the override, but stop treating the old one as confirmed
+            if (e->state == neigh_state_reachable)
+                e->state = neigh_state_stale;
+        } else {
+            memcpy(e->mac, mac, 6);
+            if (flags & NEIGH_F_CONFIRM)
+                e->state = neigh_state_reachable;
+            else if (changed)
+                e->state = neigh_state_stale;
+        }
+        if ((flags & NEIGH_F_CONFIRM) && e->state == neigh_state_reachable)
+            e->confirmed_ns = now;
+        e->updated_ns = now;
+        neigh_write_end(e);
+    }
+    local_spinlock_unlock(&neigh_lock);
+    sti(cli_state);
+
+    if (flush != NULL)
+        network_tx_list(interface, flush, mac, neigh_ethertype(addr));
+}
+
+static void neigh_tick(void) {
+    neigh_solicit_t solicits[NEIGH_TICK_MAX_SOLICIT];
+    int solicit_cnt = 0;
+    netbuf_t *drop = NULL;
+    uint64_t now = timer_timestamp_ns();
+
+    int cli_state = cli();
+    local_spinlock_lock(&neigh_lock);
+
+    //Retransmit solicitations for entries being resolved or probed, give up after NEIGH_MAX_SOLICIT
+    neigh_entry_t **link = &active_entries;
+    while (*link != NULL) {
+        neigh_entry_t *e = *link;
+        bool resolving = e->interface != NULL && (e->state == neigh_state_incomplete || e->state == neigh_state_probe);
+        if (!resolving) {
+            *link = e->active_next;
+            e->active = false;
+            if (e->interface == NULL) {
+                e->free_next = free_entries;
+                free_entries = e;
+            }
+            continue;
+        }
+
+        if (now >= e->timer_ns) {
+            if (e->solicits >= NEIGH_MAX_SOLICIT) {
+                stat_failed++;
+                *link = e->active_next;
+                e->active = false;
+                neigh_remove(e, &drop);
+                continue;
+            }
+
+            if (solicit_cnt < NEIGH_TICK_MAX_SOLICIT) {
+                neigh_solicit_t *s = &solicits[solicit_cnt++];
+                s->interface = e->interface;
+                memcpy(s->addr, e->addr, NEIGH_ADDR_LEN);
+                memcpy(s->mac, e->mac, 6);
+                s->unicast = e->state == neigh_state_probe;
+                e->solicits++;
+                e->timer_ns = now + NEIGH_RETRANS_NS;
+            }
+        }
+        link = &e->active_next;
+    }
+
+    //Age out entries nobody has confirmed or used for a while, a slice of the table per tick
+    for (int i = 0; i < NEIGH_GC_SLICE; i++) {
+        uint32_t b = gc_cursor;
+        gc_cursor = (gc_cursor + 1) & (NEIGH_BUCKETS - 1);
+
+        uintptr_t cur = buckets[b];
+        while (!NEIGH_IS_NULLS(cur)) {
+            neigh_entry_t *e = (neigh_entry_t *)cur;
+            cur = e->next;
+            if (!e->active && now - e->updated_ns > NEIGH_GC_NS) {
+                stat_evicted++;
+                neigh_remove(e, &drop);
+            }
+        }
+    }
+
+    local_spinlock_unlock(&neigh_lock);
+    sti(cli_state);
+
+    for (int i = 0; i < solicit_cnt; i++)
+        neigh_solicit(&solicits[i]);
+    neigh_freelist(drop);
+}
+
+static void neigh_task(void *arg) {
+    arg = NULL;
+    while (true) {
+        task_sleep(task_current(), NEIGH_TICK_NS);
+        task_yield();
+        neigh_tick();
+    }
+}
+
+//Dump cache counters
+int neigh_stats() {
+    char tmp[20];
+    DEBUG_PRINT("[CoreNetwork] Neighbors: ");
+    DEBUG_PRINT(itoa(entry_cnt, tmp, 10));
+    DEBUG_PRINT(" allocated: ");
+    DEBUG_PRINT(itoa(entry_total, tmp, 10));
+    DEBUG_PRINT(" resolution failures: ");
+    DEBUG_PRINT(ltoa(stat_failed, tmp, 10));
+    DEBUG_PRINT(" evicted: ");
+    DEBUG_PRINT(ltoa(stat_evicted, tmp, 10));
+    DEBUG_PRINT(" table full: ");
+    DEBUG_PRINT(ltoa(stat_alloc_failures, tmp, 10));
+    DEBUG_PRINT("\r\n[CoreNetwork] Packets parked: ");
+    DEBUG_PRINT(ltoa(stat_parked, tmp, 10));
+    DEBUG_PRINT(" dropped while parked: ");
+    DEBUG_PRINT(ltoa(stat_park_drops, tmp, 10));
+    DEBUG_PRINT("\r\n");
+    return 0;
+}
+
+PRIVATE int neigh_init(void) {
+    buckets = malloc(sizeof(uintptr_t) * NEIGH_BUCKETS);
+    if (buckets == NULL)
+        return -1;
+    for (uint32_t i = 0; i < NEIGH_BUCKETS; i++)
+        buckets[i] = NEIGH_NULLS(i);
+
+    //Keep peers from choosing addresses that all land in one chain
+    hash_seed = network_rdtsc() * 0x9E3779B97F4A7C15ull;
+
+    cs_id id = 0;
+    if (create_task_kernel("net_neigh", task_permissions_kernel, &id) != CS_OK)
+        return -1;
+    if (start_task_kernel(id, neigh_task, NULL) != CS_OK)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SysTimer/timer.h"
+#include "SysTaskMgr/task.h"
+
+#include "net_priv.h"
+#include "ethernet.h"
+#include "arp.h"
+
+// Throughput run, network_bench.
+// Floods the first ethernet interface with ARP requests for the gateway of QEMU's user
+// network backend (10.0.2.2, asking as 10.0.2.15), padded to a few frame sizes. The backend
+// answers each of them, so the same run measures both the transmit path and the receive path.
+
+#define NET_BENCH_PACKETS (100000)
+#define NET_BENCH_DRAIN_NS (100 * 1000 * 1000)
+#define NET_BENCH_RETRIES (1000)
+
+static const int bench_sizes[] = {64, 512, 1514};
+
+static void bench_print_rate(const char *what, uint64_t cnt, uint64_t ns) {
+    char tmp[20];
+    DEBUG_PRINT(what);
+    DEBUG_PRINT(ltoa(ns == 0 ? 0 : (cnt * 1000000000ull) / ns, tmp, 10));
+}
+
+static netbuf_t *bench_buildframe(interface_def_t *interface, int frame_len) {
+    netbuf_t *nb = netbuf_alloc();
+    if (nb == NULL)
+        return NULL;
+
+    int body_len = frame_len - (int)sizeof(ethernet_frame_t);
+    arp_t *arp = (arp_t *)netbuf_put(nb, body_len);
+    memset(arp, 0, body_len);
+
+    arp->hw_type = TO_BE_FRM_LE_16(1);
+    arp->protocol_type = TO_BE_FRM_LE_16(0x0800);
+    arp->hw_addr_len = 6;
+    arp->protocol_addr_len = 4;
+    arp->opcode = TO_BE_FRM_LE_16(ARP_REQUEST);
+    for (int i = 0; i < 6; i++)
+        arp->src_mac[i] = interface->mac[i];
+    arp->src_ip = TO_BE_FRM_LE_32(0x0A00020F);
+    arp->dst_ip = TO_BE_FRM_LE_32(0x0A000202);
+
+    return nb;
+}
+
+int network_bench() {
+    static const uint8_t broadcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    char tmp[20];
+
+    interface_def_t *interface = network_getinterface(network_device_type_ethernet, 0);
+    if (interface == NULL) {
+        DEBUG_PRINT("[CoreNetwork] No ethernet interface to benchmark.\r\n");
+        return -1;
+    }
+
+    for (uint32_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        int frame_len = bench_sizes[s];
+        network_stats_t before, after;
+        network_getstats(interface, &before);
+        uint64_t sent = 0;
+        uint64_t dropped = 0;
+
+        uint64_t t0 = timer_timestamp_ns();
+        for (int i = 0; i < NET_BENCH_PACKETS; i++) {
+            //Buffers come back as the device completes them, give it a chance to catch up
+            netbuf_t *nb = NULL;
+            for (int r = 0; r < NET_BENCH_RETRIES && nb == NULL; r++) {
+                nb = bench_buildframe(interface, frame_len);
+                if (nb == NULL)
+                    task_yield();
+            }
+
+            //Don't overrun the transmit queue, the benchmark is after the device's rate
+            while (interface->txqs[network_curqueue(interface)].len >= NETWORK_TX_QUEUE_LEN)
+                task_yield();
+
+            if (nb == NULL || network_tx_packet(interface, nb, broadcast, 0x0806) != 0)
+                dropped++;
+            else
+                sent++;
+        }
+        while (network_txqueued(interface) > 0)
+            task_yield();
+        uint64_t t1 = timer_timestamp_ns();
+
+        //Let the replies arrive before sampling the receive counters
+        while (timer_timestamp_ns() - t1 < NET_BENCH_DRAIN_NS)
+            task_yield();
+        uint64_t t2 = timer_timestamp_ns();
+        network_getstats(interface, &after);
+
+        DEBUG_PRINT("[CoreNetwork] Frame size=");
+        DEBUG_PRINT(itoa(frame_len, tmp, 10));
+        DEBUG_PRINT(" sent=");
+        DEBUG_PRINT(ltoa(sent, tmp, 10));
+        DEBUG_PRINT(" dropped=");
+        DEBUG_PRINT(ltoa(dropped, tmp, 10));
+        bench_print_rate(" tx pkts/s=", sent, t1 - t0);
+        bench_print_rate(" tx bytes/s=", sent * frame_len, t1 - t0);
+        bench_print_rate(" rx pkts/s=", after.rx_packets - before.rx_packets, t2 - t0);
+        bench_print_rate(" rx bytes/s=", after.rx_bytes - before.rx_bytes, t2 - t0);
+
+        uint64_t tx_done = after.tx_packets - before.tx_packets;
+        uint64_t bursts = after.tx_bursts - before.tx_bursts;
+        DEBUG_PRINT(" pkts/doorbell=");
+        DEBUG_PRINT(ltoa(bursts == 0 ? 0 : tx_done / bursts, tmp, 10));
+        DEBUG_PRINT(" cycles/pkt=");
+        DEBUG_PRINT(ltoa(tx_done == 0 ? 0 : (after.tx_cycles - before.tx_cycles) / tx_done, tmp, 10));
+        DEBUG_PRINT("\r\n");
+    }
+
+    return 0;
+}
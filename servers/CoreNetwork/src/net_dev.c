@@ -7,11 +7,17 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdlist.h>
 #include <cardinal/local_spinlock.h>
 
+#include "SysTaskMgr/task.h"
+
 #include "net_priv.h"
 #include "CoreNetwork/driver.h"
+#include "ethernet.h"
+#include "checksum.h"
+#include "arp.h"
 
 static list_t dev_list;
 static int dev_list_lock = 0;
@@ -21,6 +27,8 @@ static int interface_list_lock = 0;
 
 static int devIDs[network_device_type_count];
 
+static void network_tx_task(void *arg);
+
 PRIVATE int network_init(void)
 {
     list_init(&dev_list);
@@ -57,49 +65,509 @@ int network_register(network_device_desc_t *desc, void **network_handle)
     local_spinlock_lock(&interface_list_lock);
     {
         interface_def_t *def = (interface_def_t *)malloc(sizeof(interface_def_t));
+        memset(def, 0, sizeof(interface_def_t));
         def->type = devType;
         def->device = *desc;
         def->idx = devIDs[def->type]++;
         for (int i = 0; i < 6; i++)
             def->mac[i] = mac[i];
 
+        //fe80::/64 with the modified EUI-64 interface identifier, ::1 on loopback
+        if (desc->features & network_device_features_loopback)
+            def->ipv6_ll[15] = 1;
+        else
+        {
+            def->ipv6_ll[0] = 0xfe;
+            def->ipv6_ll[1] = 0x80;
+            def->ipv6_ll[8] = mac[0] ^ 0x02;
+            def->ipv6_ll[9] = mac[1];
+            def->ipv6_ll[10] = mac[2];
+            def->ipv6_ll[11] = 0xff;
+            def->ipv6_ll[12] = 0xfe;
+            def->ipv6_ll[13] = mac[3];
+            def->ipv6_ll[14] = mac[4];
+            def->ipv6_ll[15] = mac[5];
+        }
+
+        //Spread the cores over the queues, queue n itself is serviced on core n
+        int core_cnt = task_corecount();
+        def->queue_cnt = MIN(MAX(desc->queue_cnt, 1), MIN(MAX(core_cnt, 1), NETWORK_MAX_QUEUES));
+        for (int i = 0; i < core_cnt; i++)
+        {
+            int apic_id = task_coreapicid(i);
+            if (apic_id >= 0)
+                def->cpu_queue[apic_id % NETWORK_MAX_CPUS] = (uint8_t)(i % def->queue_cnt);
+        }
+
         *network_handle = def;
 
         list_append(&interface_list, def);
     }
     local_spinlock_unlock(&interface_list_lock);
 
+    //Every transmit queue gets its own task, kept on the queue's core when there are several
+    interface_def_t *def = (interface_def_t *)*network_handle;
+    for (int i = 0; i < def->queue_cnt; i++)
+    {
+        network_txq_t *txq = &def->txqs[i];
+        txq->interface = def;
+        txq->idx = i;
+
+        cs_id tx_id = 0;
+        if (create_task_kernel("net_tx", task_permissions_kernel, &tx_id) != CS_OK)
+            PANIC("[CoreNetwork] Failed to create transmit task.");
+        if (def->queue_cnt > 1)
+            task_setaffinity(tx_id, 1ull << i);
+        if (start_task_kernel(tx_id, network_tx_task, txq) != CS_OK)
+            PANIC("[CoreNetwork] Failed to start transmit task.");
+    }
+
     return 0;
 }
 
 //Can be called from any thread, make sure it's thread safe
-int network_rx_packet(void *interface_handle, void *packet, int len)
+int network_rx_packet(void *interface_handle, netbuf_t *nb)
 {
     interface_def_t *def = (interface_def_t *)interface_handle;
+    int ret = 0;
+
+    nb->interface = def;
+    network_stats_t *stats = &def->stats[network_curqueue(def)];
+    stats->rx_packets++;
+    stats->rx_bytes += nb->tot_len;
 
-    //Process this packet
+    //Process this packet, the layers above take their own reference if they hold on to it
+    uint64_t prof_start = network_prof_begin();
     switch (def->type)
     {
     case network_device_type_ethernet:
-        return ethernet_rx(def, packet, len);
+        ret = ethernet_rx(def, nb);
+        break;
     case network_device_type_wifi:
-        return wifi_rx(def, packet, len);
+        ret = wifi_rx(def, nb);
+        break;
     default:
         DEBUG_PRINT("[CoreNetwork] Network RX device type unknown.\r\n");
+        ret = -1;
+        break;
+    }
+    network_prof_end(network_prof_rx, prof_start);
+
+    netbuf_free(nb);
+    return ret;
+}
+
+//Hand a batch to the driver, waits for ring space until every packet has been taken
+static void network_tx_burst(network_txq_t *txq, netbuf_t **nbs, int cnt)
+{
+    interface_def_t *def = txq->interface;
+    network_stats_t *stats = &def->stats[txq->idx];
+
+    int lens[NETWORK_TX_BURST];
+    for (int i = 0; i < cnt; i++)
+        lens[i] = nbs[i]->tot_len;
+
+    int done = 0;
+    while (done < cnt)
+    {
+        uint64_t start = network_rdtsc();
+        int n = 0;
+        if (def->device.handlers.ether.tx_burst != NULL)
+            n = def->device.handlers.ether.tx_burst(def->device.state, txq->idx, nbs + done, cnt - done, 0);
+        else if (def->device.handlers.ether.tx(def->device.state, nbs[done], 0) == 0)
+            n = 1;
+        else
+        {
+            stats->tx_errors++;
+            done++;
+            continue;
+        }
+        stats->tx_cycles += network_rdtsc() - start;
+        stats->tx_bursts++;
+
+        //The ring is full, let the device catch up
+        if (n == 0)
+        {
+            task_yield();
+            continue;
+        }
+
+        for (int i = done; i < done + n; i++)
+            stats->tx_bytes += lens[i];
+        stats->tx_packets += n;
+        done += n;
+    }
+}
+
+static void network_tx_task(void *arg)
+{
+    network_txq_t *txq = (network_txq_t *)arg;
+    netbuf_t *burst[NETWORK_TX_BURST];
+
+    while (true)
+    {
+        task_wait((uint32_t *)&txq->signal, 0);
+        txq->signal = 0;
+
+        //Drain the queue a burst at a time so the driver can post them all behind a single doorbell
+        while (true)
+        {
+            int cnt = 0;
+            int cli_state = cli();
+            local_spinlock_lock(&txq->lock);
+            while (cnt < NETWORK_TX_BURST && txq->head != NULL)
+            {
+                netbuf_t *nb = txq->head;
+                txq->head = nb->q_next;
+                nb->q_next = NULL;
+                burst[cnt++] = nb;
+            }
+            if (txq->head == NULL)
+                txq->tail = NULL;
+            txq->len -= cnt;
+            local_spinlock_unlock(&txq->lock);
+            sti(cli_state);
+
+            if (cnt == 0)
+                break;
+            network_tx_burst(txq, burst, cnt);
+        }
+    }
+}
+
+//Fill in the checksum for a device without checksum offload, the field already holds the pseudo-header sum
+static void network_tx_swcsum(netbuf_t *nb, int csum_offset)
+{
+    uint64_t sum = network_csum_netbuf(nb, nb->csum_start, nb->tot_len - nb->csum_start, 0);
+    uint16_t csum = network_csum_fold(sum);
+    if (csum == 0 && csum_offset == 6)
+        csum = 0xffff;  //UDP reserves 0 for 'no checksum'
+
+    //Already in network byte order
+    memcpy(nb->data + nb->csum_start + csum_offset, &csum, sizeof(csum));
+}
+
+//Prepend the link header and settle the offloads, frees nb and returns false if it can't be sent
+static bool network_tx_frame(interface_def_t *interface, int q, netbuf_t *nb, const uint8_t *dst_mac, uint16_t protocol_type)
+{
+    //Only ethernet framing exists, wifi interfaces receive but refuse to transmit
+    if (interface->type != network_device_type_ethernet)
+    {
+        interface->stats[q].tx_errors++;
+        netbuf_free(nb);
+        return false;
+    }
+
+    ethernet_frame_t *frame = (ethernet_frame_t *)netbuf_push(nb, sizeof(ethernet_frame_t));
+    if (frame == NULL)
+    {
+        interface->stats[q].tx_errors++;
+        netbuf_free(nb);
+        return false;
+    }
+
+    for (int i = 0; i < 6; i++)
+    {
+        frame->dst_mac[i] = dst_mac[i];
+        frame->src_mac[i] = interface->mac[i];
+    }
+    frame->type = TO_BE_FRM_LE_16(protocol_type);
+
+    if (nb->tx_flags != 0)
+    {
+        //Offload offsets are relative to the frame from here on
+        nb->csum_start += sizeof(ethernet_frame_t);
+        nb->hdr_len += sizeof(ethernet_frame_t);
+
+        network_device_features_t features = interface->device.features;
+        bool tso4 = (nb->tx_flags & network_device_tx_flag_tcpv4_tso) != 0;
+        bool tso6 = (nb->tx_flags & network_device_tx_flag_tcpv6_tso) != 0;
+        if ((tso4 && !(features & network_device_features_tso4)) ||
+            (tso6 && !(features & network_device_features_tso6)) ||
+            ((tso4 || tso6) && nb->tot_len > interface->device.gso_max_size))
+        {
+            //Protocols only build super-packets for interfaces that advertise segmentation
+            interface->stats[q].tx_errors++;
+            netbuf_free(nb);
+            return false;
+        }
+
+        int csum_offset = network_tx_csum_offset(nb->tx_flags);
+        if (csum_offset >= 0 && !(tso4 || tso6) && !(features & network_device_features_checksum_offload))
+        {
+            network_tx_swcsum(nb, csum_offset);
+            nb->tx_flags &= ~(network_device_tx_flag_tcpv4_csum | network_device_tx_flag_udpv4_csum |
+                              network_device_tx_flag_tcpv6_csum | network_device_tx_flag_udpv6_csum);
+        }
+    }
+    return true;
+}
+
+//Queue already framed packets linked through q_next, waking the transmit task once for all of them
+static int network_tx_enqueue(interface_def_t *interface, int q, netbuf_t *head)
+{
+    //Transmit from the queue owned by this core, so a flow's replies stay where it was received
+    network_txq_t *txq = &interface->txqs[q];
+    int dropped = 0;
+
+    int cli_state = cli();
+    local_spinlock_lock(&txq->lock);
+    while (head != NULL)
+    {
+        netbuf_t *nb = head;
+        head = nb->q_next;
+        nb->q_next = NULL;
+
+        if (txq->len >= NETWORK_TX_QUEUE_LEN)
+        {
+            interface->stats[q].tx_errors++;
+            netbuf_free(nb);
+            dropped++;
+            continue;
+        }
+
+        if (txq->tail != NULL)
+            txq->tail->q_next = nb;
+        else
+            txq->head = nb;
+        txq->tail = nb;
+        txq->len++;
+    }
+    local_spinlock_unlock(&txq->lock);
+    sti(cli_state);
+
+    //Only wake the transmit task if it isn't already on its way
+    if (__atomic_exchange_n(&txq->signal, 1, __ATOMIC_SEQ_CST) == 0)
+        task_wake((uint32_t *)&txq->signal, 1);
+    return dropped == 0 ? 0 : -1;
+}
+
+int network_tx_packet(interface_def_t *interface, netbuf_t *nb, const uint8_t *dst_mac, uint16_t protocol_type)
+{
+    int q = network_curqueue(interface);
+    uint64_t prof_start = network_prof_begin();
+    bool framed = network_tx_frame(interface, q, nb, dst_mac, protocol_type);
+    network_prof_end(network_prof_tx_frame, prof_start);
+    if (!framed)
         return -1;
+
+    nb->q_next = NULL;
+    return network_tx_enqueue(interface, q, nb);
+}
+
+PRIVATE int network_tx_list(interface_def_t *interface, netbuf_t *list, const uint8_t *dst_mac, uint16_t protocol_type)
+{
+    int q = network_curqueue(interface);
+    netbuf_t *head = NULL;
+    netbuf_t *tail = NULL;
+    int ret = 0;
+
+    while (list != NULL)
+    {
+        netbuf_t *nb = list;
+        list = nb->q_next;
+        nb->q_next = NULL;
+
+        uint64_t prof_start = network_prof_begin();
+        bool framed = network_tx_frame(interface, q, nb, dst_mac, protocol_type);
+        network_prof_end(network_prof_tx_frame, prof_start);
+        if (!framed)
+        {
+            ret = -1;
+            continue;
+        }
+        if (tail != NULL)
+            tail->q_next = nb;
+        else
+            head = nb;
+        tail = nb;
     }
 
-    return 0;
+    if (head != NULL && network_tx_enqueue(interface, q, head) != 0)
+        ret = -1;
+    return ret;
+}
+
+PRIVATE void network_getstats(interface_def_t *def, network_stats_t *total)
+{
+    memset(total, 0, sizeof(network_stats_t));
+    for (int i = 0; i < def->queue_cnt; i++)
+    {
+        total->rx_packets += def->stats[i].rx_packets;
+        total->rx_bytes += def->stats[i].rx_bytes;
+        total->tx_packets += def->stats[i].tx_packets;
+        total->tx_bytes += def->stats[i].tx_bytes;
+        total->tx_errors += def->stats[i].tx_errors;
+        total->tx_bursts += def->stats[i].tx_bursts;
+        total->tx_cycles += def->stats[i].tx_cycles;
+    }
+}
+
+PRIVATE int network_txqueued(interface_def_t *def)
+{
+    int cnt = 0;
+    for (int i = 0; i < def->queue_cnt; i++)
+        cnt += def->txqs[i].len;
+    return cnt;
+}
+
+PRIVATE void network_setipv4(interface_def_t *def, uint32_t addr, uint32_t netmask, uint32_t gateway)
+{
+    def->ipv4_addr = addr;
+    def->ipv4_netmask = netmask;
+    def->ipv4_gateway = gateway;
+    if (addr != 0)
+        arp_announce(def);
+}
+
+PRIVATE interface_def_t *network_route4(uint32_t dst, uint32_t *next_hop)
+{
+    interface_def_t *ret = NULL;
+    interface_def_t *gateway = NULL;
+
+    //Directly attached subnets win, otherwise the first interface with a gateway
+    local_spinlock_lock(&interface_list_lock);
+    for (uint64_t i = 0; i < list_len(&interface_list); i++)
+    {
+        interface_def_t *def = (interface_def_t *)list_at(&interface_list, i);
+        if (def->ipv4_addr == 0)
+            continue;
+        if (((def->ipv4_addr ^ dst) & def->ipv4_netmask) == 0)
+        {
+            ret = def;
+            break;
+        }
+        if (gateway == NULL && def->ipv4_gateway != 0)
+            gateway = def;
+    }
+    local_spinlock_unlock(&interface_list_lock);
+
+    if (ret != NULL)
+        *next_hop = dst;
+    else if (gateway != NULL)
+    {
+        ret = gateway;
+        *next_hop = gateway->ipv4_gateway;
+    }
+    return ret;
+}
+
+PRIVATE interface_def_t *network_route6(const uint8_t *dst, uint8_t *next_hop)
+{
+    //Without router discovery every destination is treated as on-link, out of the first real interface
+    interface_def_t *ret = NULL;
+
+    local_spinlock_lock(&interface_list_lock);
+    for (uint64_t i = 0; i < list_len(&interface_list); i++)
+    {
+        interface_def_t *def = (interface_def_t *)list_at(&interface_list, i);
+        if (!(def->device.features & network_device_features_loopback))
+        {
+            ret = def;
+            break;
+        }
+    }
+    local_spinlock_unlock(&interface_list_lock);
+
+    if (ret != NULL)
+        memcpy(next_hop, dst, 16);
+    return ret;
 }
 
-//Switch to allocation pattern? Read up on network stack designs
-int network_tx_packet(interface_def_t *interface, void *packet, int len, uint16_t protocol_type)
+PRIVATE interface_def_t *network_local4(uint32_t addr)
 {
-    //TODO: build a transmission frame around the packet based on the interface type and submit to the driver for transmission
-    interface = NULL;
-    packet = NULL;
-    len = 0;
-    protocol_type = 0;
+    interface_def_t *ret = NULL;
 
+    local_spinlock_lock(&interface_list_lock);
+    for (uint64_t i = 0; i < list_len(&interface_list); i++)
+    {
+        interface_def_t *def = (interface_def_t *)list_at(&interface_list, i);
+        if (addr != 0 && def->ipv4_addr == addr)
+        {
+            ret = def;
+            break;
+        }
+    }
+    local_spinlock_unlock(&interface_list_lock);
+    return ret;
+}
+
+PRIVATE interface_def_t *network_local6(const uint8_t *addr)
+{
+    interface_def_t *ret = NULL;
+
+    local_spinlock_lock(&interface_list_lock);
+    for (uint64_t i = 0; i < list_len(&interface_list); i++)
+    {
+        interface_def_t *def = (interface_def_t *)list_at(&interface_list, i);
+        if (memcmp(def->ipv6_ll, addr, 16) == 0)
+        {
+            ret = def;
+            break;
+        }
+    }
+    local_spinlock_unlock(&interface_list_lock);
+    return ret;
+}
+
+PRIVATE interface_def_t *network_getinterface(network_device_type_t type, int idx)
+{
+    interface_def_t *ret = NULL;
+
+    local_spinlock_lock(&interface_list_lock);
+    for (uint64_t i = 0; i < list_len(&interface_list); i++)
+    {
+        interface_def_t *def = (interface_def_t *)list_at(&interface_list, i);
+        if (def->type == type && def->idx == idx)
+        {
+            ret = def;
+            break;
+        }
+    }
+    local_spinlock_unlock(&interface_list_lock);
+
+    return ret;
+}
+
+//Dump per interface counters
+int network_stats()
+{
+    char tmp[20];
+
+    local_spinlock_lock(&interface_list_lock);
+    for (uint64_t i = 0; i < list_len(&interface_list); i++)
+    {
+        interface_def_t *def = (interface_def_t *)list_at(&interface_list, i);
+        network_stats_t total;
+        network_getstats(def, &total);
+
+        DEBUG_PRINT("[CoreNetwork] ");
+        DEBUG_PRINT(def->device.name);
+        DEBUG_PRINT(" rx pkts: ");
+        DEBUG_PRINT(ltoa(total.rx_packets, tmp, 10));
+        DEBUG_PRINT(" tx pkts: ");
+        DEBUG_PRINT(ltoa(total.tx_packets, tmp, 10));
+        DEBUG_PRINT(" tx errors: ");
+        DEBUG_PRINT(ltoa(total.tx_errors, tmp, 10));
+        DEBUG_PRINT(" queued: ");
+        DEBUG_PRINT(itoa(network_txqueued(def), tmp, 10));
+        DEBUG_PRINT("\r\n[CoreNetwork] Packets per doorbell: ");
+        DEBUG_PRINT(ltoa(total.tx_bursts == 0 ? 0 : total.tx_packets / total.tx_bursts, tmp, 10));
+        DEBUG_PRINT(" driver cycles per packet: ");
+        DEBUG_PRINT(ltoa(total.tx_packets == 0 ? 0 : total.tx_cycles / total.tx_packets, tmp, 10));
+        DEBUG_PRINT("\r\n");
+
+        for (int q = 0; def->queue_cnt > 1 && q < def->queue_cnt; q++)
+        {
+            DEBUG_PRINT("[CoreNetwork]   queue ");
+            DEBUG_PRINT(itoa(q, tmp, 10));
+            DEBUG_PRINT(" rx pkts: ");
+            DEBUG_PRINT(ltoa(def->stats[q].rx_packets, tmp, 10));
+            DEBUG_PRINT(" tx pkts: ");
+            DEBUG_PRINT(ltoa(def->stats[q].tx_packets, tmp, 10));
+            DEBUG_PRINT("\r\n");
+        }
+    }
+    local_spinlock_unlock(&interface_list_lock);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,148 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <cardinal/local_spinlock.h>
+
+#include "SysTaskMgr/task.h"
+#include "SysTimer/timer.h"
+
+#include "net_priv.h"
+
+// Receive polling shared by the NIC drivers.
+// A receive interrupt only masks itself and wakes the queue's poll task. The task pulls up to
+// NETWORK_POLL_BUDGET packets per pass, yielding between passes while the ring stays busy, and
+// unmasks the interrupt once a pass comes up short. While packets keep arriving faster than
+// NETWORK_POLL_LOW_RATE, rearming is deferred so that roughly NETWORK_POLL_TARGET packets collect
+// per pass, which is what turns one interrupt per packet into one per burst under load.
+
+#define NETWORK_POLL_LOW_RATE (20000)
+#define NETWORK_POLL_TARGET (32)
+#define NETWORK_POLL_MAX_HOLDOFF_NS (500 * 1000)
+
+static network_poll_t *polls = NULL;
+static int polls_lock = 0;
+
+//Called each time the ring is drained, with the packets seen since the poll task woke up
+static void network_poll_moderate(network_poll_t *np, uint64_t pkts, uint64_t ns) {
+    uint64_t sample = (ns == 0) ? 0 : (pkts * 1000000000ull) / ns;
+    np->rate = (np->rate * 3 + sample) / 4;
+
+    if (np->rate < NETWORK_POLL_LOW_RATE)
+        np->holdoff_ns = 0;
+    else
+        np->holdoff_ns = MIN((NETWORK_POLL_TARGET * 1000000000ull) / np->rate, NETWORK_POLL_MAX_HOLDOFF_NS);
+}
+
+static void network_poll_task(void *arg) {
+    network_poll_t *np = (network_poll_t *)arg;
+
+    while (true) {
+        task_wait((uint32_t *)&np->signal, 0);
+        np->signal = 0;
+
+        uint64_t start = timer_timestamp_ns();
+        uint64_t pkts = 0;
+        while (true) {
+            int n = np->handlers.poll(np->state, NETWORK_POLL_BUDGET);
+            np->polls++;
+            np->packets += n;
+            pkts += n;
+
+            //Budget used up, there is likely more waiting but let other tasks run first
+            if (n >= NETWORK_POLL_BUDGET) {
+                task_yield();
+                continue;
+            }
+
+            network_poll_moderate(np, pkts, timer_timestamp_ns() - start);
+
+            //Traffic is still flowing, keep the interrupt masked and come back for the next batch
+            if (n > 0 && np->holdoff_ns != 0) {
+                task_sleep(task_current(), np->holdoff_ns);
+                task_yield();
+                continue;
+            }
+
+            np->rearms++;
+            if (!np->handlers.rearm(np->state))
+                break;
+        }
+    }
+}
+
+int network_poll_create(void *interface_handle, int queue, network_poll_handlers_t *handlers, void *state, void **poll_handle) {
+    network_poll_t *np = (network_poll_t *)malloc(sizeof(network_poll_t));
+    if (np == NULL)
+        return -1;
+
+    np->handlers = *handlers;
+    np->state = state;
+    np->interface = (interface_def_t *)interface_handle;
+    np->signal = 0;
+    np->rate = 0;
+    np->holdoff_ns = 0;
+    np->interrupts = 0;
+    np->polls = 0;
+    np->packets = 0;
+    np->rearms = 0;
+
+    cs_id id = 0;
+    if (create_task_kernel("net_poll", task_permissions_kernel, &id) != CS_OK) {
+        free(np);
+        return -1;
+    }
+    if (np->interface->queue_cnt > 1)
+        task_setaffinity(id, 1ull << (queue % np->interface->queue_cnt));
+    if (start_task_kernel(id, network_poll_task, np) != CS_OK)
+        PANIC("[CoreNetwork] Failed to start poll task.");
+
+    local_spinlock_lock(&polls_lock);
+    np->next = polls;
+    polls = np;
+    local_spinlock_unlock(&polls_lock);
+
+    *poll_handle = np;
+    return 0;
+}
+
+void network_poll_schedule(void *poll_handle) {
+    network_poll_t *np = (network_poll_t *)poll_handle;
+    np->interrupts++;
+
+    if (__atomic_exchange_n(&np->signal, 1, __ATOMIC_SEQ_CST) == 0)
+        task_wake((uint32_t *)&np->signal, 1);
+}
+
+//Dump receive polling counters
+int network_pollstats() {
+    char tmp[20];
+
+    local_spinlock_lock(&polls_lock);
+    for (network_poll_t *np = polls; np != NULL; np = np->next) {
+        DEBUG_PRINT("[CoreNetwork] ");
+        DEBUG_PRINT(np->interface->device.name);
+        DEBUG_PRINT(" interrupts: ");
+        DEBUG_PRINT(ltoa(np->interrupts, tmp, 10));
+        DEBUG_PRINT(" polls: ");
+        DEBUG_PRINT(ltoa(np->polls, tmp, 10));
+        DEBUG_PRINT(" packets: ");
+        DEBUG_PRINT(ltoa(np->packets, tmp, 10));
+        DEBUG_PRINT(" rearms: ");
+        DEBUG_PRINT(ltoa(np->rearms, tmp, 10));
+        DEBUG_PRINT("\r\n[CoreNetwork] Packets per interrupt: ");
+        DEBUG_PRINT(ltoa(np->interrupts == 0 ? 0 : np->packets / np->interrupts, tmp, 10));
+        DEBUG_PRINT(" rate: ");
+        DEBUG_PRINT(ltoa(np->rate, tmp, 10));
+        DEBUG_PRINT(" pkts/s holdoff: ");
+        DEBUG_PRINT(ltoa(np->holdoff_ns, tmp, 10));
+        DEBUG_PRINT("ns\r\n");
+    }
+    local_spinlock_unlock(&polls_lock);
+    return 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "net_priv.h"
+
+// Per layer cycle accounting.
+// Layers bracket their work with network_prof_begin/network_prof_end, which cost a flag test while
+// profiling is off. Counters are kept per core so the hot path never shares a cache line, and are
+// only summed when dumped by network_prof.
+
+typedef struct {
+    uint64_t cycles[network_prof_count];
+    uint64_t calls[network_prof_count];
+} __attribute__((aligned(64))) network_prof_t;
+
+static const char *prof_names[network_prof_count] = {"rx", "ip", "udp", "tcp", "tx_frame"};
+
+//Layer each one is nested in, its own cost is what's left after taking out the nested layers
+static const int prof_parent[network_prof_count] = {-1, network_prof_rx, network_prof_ip, network_prof_ip, -1};
+
+static network_prof_t prof[NETWORK_MAX_CPUS];
+
+PRIVATE bool network_prof_on = false;
+
+PRIVATE void network_prof_end(network_prof_layer_t layer, uint64_t start) {
+    if (start == 0)
+        return;
+
+    network_prof_t *p = &prof[interrupt_get_cpuidx() % NETWORK_MAX_CPUS];
+    p->cycles[layer] += network_rdtsc() - start;
+    p->calls[layer]++;
+}
+
+PRIVATE void network_prof_enable(bool on) {
+    __atomic_store_n(&network_prof_on, on, __ATOMIC_SEQ_CST);
+}
+
+PRIVATE void network_prof_reset(void) {
+    memset(prof, 0, sizeof(prof));
+}
+
+//Dump cycles per call for each layer
+int network_prof() {
+    char tmp[20];
+    uint64_t cycles[network_prof_count];
+    uint64_t calls[network_prof_count];
+    memset(cycles, 0, sizeof(cycles));
+    memset(calls, 0, sizeof(calls));
+
+    for (int i = 0; i < NETWORK_MAX_CPUS; i++)
+        for (int l = 0; l < network_prof_count; l++) {
+            cycles[l] += prof[i].cycles[l];
+            calls[l] += prof[i].calls[l];
+        }
+
+    uint64_t self[network_prof_count];
+    memcpy(self, cycles, sizeof(self));
+    for (int l = 0; l < network_prof_count; l++)
+        if (prof_parent[l] >= 0)
+            self[prof_parent[l]] -= MIN(cycles[l], self[prof_parent[l]]);
+
+    for (int l = 0; l < network_prof_count; l++) {
+        if (calls[l] == 0)
+            continue;
+        DEBUG_PRINT("[CoreNetwork] prof ");
+        DEBUG_PRINT(prof_names[l]);
+        DEBUG_PRINT(" calls: ");
+        DEBUG_PRINT(ltoa(calls[l], tmp, 10));
+        DEBUG_PRINT(" cycles/call: ");
+        DEBUG_PRINT(ltoa(cycles[l] / calls[l], tmp, 10));
+        DEBUG_PRINT(" self cycles/call: ");
+        DEBUG_PRINT(ltoa(self[l] / calls[l], tmp, 10));
+        DEBUG_PRINT("\r\n");
+    }
+    return 0;
+}
@@ -0,0 +1,301 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cardinal/local_spinlock.h>
+
+#include "SysPhysicalMemory/phys_mem.h"
+#include "SysVirtualMemory/vmem.h"
+#include "SysInterrupts/interrupts.h"
+
+#include "net_priv.h"
+#include "CoreNetwork/netbuf.h"
+
+// Packet buffer pool.
+// Buffers are carved out of physically contiguous chunks so drivers can hand netbuf_phys()
+// straight to their descriptor rings. Each core keeps a small cache of free netbufs that it
+// refills from and flushes to the shared free list in batches, so the common rx/tx path
+// only touches the shared lock once every NETBUF_CACHE_BATCH packets.
+
+#define NETBUF_CHUNK_SIZE KiB(64)
+#define NETBUF_PER_CHUNK (NETBUF_CHUNK_SIZE / NETBUF_SIZE)
+#define NETBUF_MAX_COUNT (8192)
+#define NETBUF_CACHE_LEN (64)
+#define NETBUF_CACHE_BATCH (32)
+#define NETBUF_MAX_CPUS (256)
+
+typedef struct {
+    netbuf_t *free;
+    int cnt;
+    uint64_t allocs;
+    uint64_t failures;
+} netbuf_cache_t;
+
+static netbuf_t *pool_free = NULL;
+static int pool_free_cnt = 0;
+static int pool_total = 0;
+static int pool_lock = 0;
+static netbuf_cache_t *caches[NETBUF_MAX_CPUS];
+
+static uint64_t stat_refills = 0;
+static uint64_t stat_flushes = 0;
+
+//Caller holds pool_lock
+static bool netbuf_grow(void) {
+    if (pool_total + NETBUF_PER_CHUNK > NETBUF_MAX_COUNT)
+        return false;
+
+    uintptr_t phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data, NETBUF_CHUNK_SIZE);
+    if (phys == (uintptr_t)-1)
+        return false;
+
+    netbuf_t *descs = malloc(NETBUF_PER_CHUNK * sizeof(netbuf_t));
+    if (descs == NULL) {
+        pagealloc_free(phys, NETBUF_CHUNK_SIZE);
+        return false;
+    }
+
+    uint8_t *virt = (uint8_t *)vmem_phystovirt((intptr_t)phys, NETBUF_CHUNK_SIZE, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+    for (uint64_t i = 0; i < NETBUF_PER_CHUNK; i++) {
+        descs[i].buf = virt + i * NETBUF_SIZE;
+        descs[i].buf_phys = phys + i * NETBUF_SIZE;
+        descs[i].refcnt = 0;
+        descs[i].q_next = pool_free;
+        pool_free = &descs[i];
+    }
+    pool_free_cnt += NETBUF_PER_CHUNK;
+    pool_total += NETBUF_PER_CHUNK;
+    return true;
+}
+
+//Must be called with interrupts disabled
+static netbuf_cache_t *netbuf_getcache(void) {
+    int cpu = interrupt_get_cpuidx() % NETBUF_MAX_CPUS;
+    if (caches[cpu] == NULL) {
+        netbuf_cache_t *cache = malloc(sizeof(netbuf_cache_t));
+        if (cache == NULL)
+            PANIC("[CoreNetwork] Failed to allocate netbuf cache.");
+        cache->free = NULL;
+        cache->cnt = 0;
+        cache->allocs = 0;
+        cache->failures = 0;
+        caches[cpu] = cache;
+    }
+    return caches[cpu];
+}
+
+static void netbuf_refill(netbuf_cache_t *cache) {
+    local_spinlock_lock(&pool_lock);
+    if (pool_free_cnt < NETBUF_CACHE_BATCH)
+        netbuf_grow();
+
+    while (cache->cnt < NETBUF_CACHE_BATCH && pool_free != NULL) {
+        netbuf_t *nb = pool_free;
+        pool_free = nb->q_next;
+        pool_free_cnt--;
+
+        nb->q_next = cache->free;
+        cache->free = nb;
+        cache->cnt++;
+    }
+    stat_refills++;
+    local_spinlock_unlock(&pool_lock);
+}
+
+static void netbuf_flush(netbuf_cache_t *cache) {
+    local_spinlock_lock(&pool_lock);
+    while (cache->cnt > NETBUF_CACHE_LEN - NETBUF_CACHE_BATCH) {
+        netbuf_t *nb = cache->free;
+        cache->free = nb->q_next;
+        cache->cnt--;
+
+        nb->q_next = pool_free;
+        pool_free = nb;
+        pool_free_cnt++;
+    }
+    stat_flushes++;
+    local_spinlock_unlock(&pool_lock);
+}
+
+netbuf_t *netbuf_alloc(void) {
+    int state = cli();
+    netbuf_cache_t *cache = netbuf_getcache();
+    if (cache->cnt == 0)
+        netbuf_refill(cache);
+
+    netbuf_t *nb = cache->free;
+    if (nb != NULL) {
+        cache->free = nb->q_next;
+        cache->cnt--;
+        cache->allocs++;
+    } else
+        cache->failures++;
+    sti(state);
+
+    if (nb == NULL)
+        return NULL;
+
+    nb->data = nb->buf + NETBUF_HEADROOM;
+    nb->len = 0;
+    nb->tot_len = 0;
+    nb->refcnt = 1;
+    nb->flags = 0;
+    nb->tx_flags = 0;
+    nb->csum_start = 0;
+    nb->hdr_len = 0;
+    nb->gso_size = 0;
+    nb->hash = 0;
+    nb->next = NULL;
+    nb->q_next = NULL;
+    nb->interface = NULL;
+    nb->parent = NULL;
+    return nb;
+}
+
+void netbuf_free(netbuf_t *nb) {
+    int state = cli();
+    netbuf_cache_t *cache = netbuf_getcache();
+    while (nb != NULL) {
+        netbuf_t *next = nb->next;
+        if (--nb->refcnt == 0) {
+            //A clone keeps its parent's buffer alive, drop that reference as well
+            netbuf_t *parent = nb->parent;
+            if (parent != NULL && --parent->refcnt == 0) {
+                parent->q_next = cache->free;
+                cache->free = parent;
+                if (++cache->cnt >= NETBUF_CACHE_LEN)
+                    netbuf_flush(cache);
+            }
+            nb->parent = NULL;
+
+            nb->q_next = cache->free;
+            cache->free = nb;
+            if (++cache->cnt >= NETBUF_CACHE_LEN)
+                netbuf_flush(cache);
+        }
+        nb = next;
+    }
+    sti(state);
+}
+
+netbuf_t *netbuf_ref(netbuf_t *nb) {
+    for (netbuf_t *seg = nb; seg != NULL; seg = seg->next)
+        seg->refcnt++;
+    return nb;
+}
+
+netbuf_t *netbuf_clone(netbuf_t *nb, int offset, int len) {
+    netbuf_t *clone = netbuf_alloc();
+    if (clone == NULL)
+        return NULL;
+
+    //Clones of clones refer to the original buffer directly
+    netbuf_t *owner = (nb->parent != NULL) ? nb->parent : nb;
+    owner->refcnt++;
+    clone->parent = owner;
+    clone->data = nb->data + offset;
+    clone->len = (uint16_t)len;
+    clone->tot_len = len;
+    return clone;
+}
+
+void *netbuf_push(netbuf_t *nb, int len) {
+    if (nb->parent != NULL || nb->data - nb->buf < len)
+        return NULL;
+
+    nb->data -= len;
+    nb->len += len;
+    nb->tot_len += len;
+    return nb->data;
+}
+
+void *netbuf_pull(netbuf_t *nb, int len) {
+    if (nb->len < len)
+        return NULL;
+
+    nb->data += len;
+    nb->len -= len;
+    nb->tot_len -= len;
+    return nb->data;
+}
+
+void *netbuf_put(netbuf_t *nb, int len) {
+    if (netbuf_tailroom(nb) < len)
+        return NULL;
+
+    uint8_t *tail = nb->data + nb->len;
+    nb->len += len;
+    nb->tot_len += len;
+    return tail;
+}
+
+void netbuf_chain(netbuf_t *nb, netbuf_t *seg) {
+    netbuf_t *last = nb;
+    while (last->next != NULL)
+        last = last->next;
+    last->next = seg;
+
+    for (; seg != NULL; seg = seg->next)
+        nb->tot_len += seg->len;
+}
+
+int netbuf_copyout(netbuf_t *nb, void *dst, int len) {
+    uint8_t *dst_u8 = (uint8_t *)dst;
+    int copied = 0;
+    for (; nb != NULL && copied < len; nb = nb->next) {
+        int cp_sz = MIN(len - copied, nb->len);
+        memcpy(dst_u8 + copied, nb->data, cp_sz);
+        copied += cp_sz;
+    }
+    return copied;
+}
+
+int netbuf_segcount(netbuf_t *nb) {
+    int cnt = 0;
+    for (; nb != NULL; nb = nb->next)
+        cnt++;
+    return cnt;
+}
+
+//Dump pool counters
+int netbuf_stats() {
+    char tmp[20];
+    uint64_t allocs = 0;
+    uint64_t failures = 0;
+    for (int i = 0; i < NETBUF_MAX_CPUS; i++)
+        if (caches[i] != NULL) {
+            allocs += caches[i]->allocs;
+            failures += caches[i]->failures;
+        }
+
+    DEBUG_PRINT("[CoreNetwork] Netbufs: ");
+    DEBUG_PRINT(itoa(pool_total, tmp, 10));
+    DEBUG_PRINT(" free in pool: ");
+    DEBUG_PRINT(itoa(pool_free_cnt, tmp, 10));
+    DEBUG_PRINT("\r\n[CoreNetwork] Allocations: ");
+    DEBUG_PRINT(ltoa(allocs, tmp, 10));
+    DEBUG_PRINT(" failed: ");
+    DEBUG_PRINT(ltoa(failures, tmp, 10));
+    DEBUG_PRINT(" refills: ");
+    DEBUG_PRINT(ltoa(stat_refills, tmp, 10));
+    DEBUG_PRINT(" flushes: ");
+    DEBUG_PRINT(ltoa(stat_flushes, tmp, 10));
+    DEBUG_PRINT("\r\n");
+    return 0;
+}
+
+PRIVATE int netbuf_init(void) {
+    for (int i = 0; i < NETBUF_MAX_CPUS; i++)
+        caches[i] = NULL;
+
+    local_spinlock_lock(&pool_lock);
+    bool ok = netbuf_grow();
+    local_spinlock_unlock(&pool_lock);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,292 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cardinal/local_spinlock.h>
+
+#include "SysTimer/timer.h"
+#include "SysTaskMgr/task.h"
+
+#include "CoreNetwork/socket.h"
+#include "net_priv.h"
+#include "ethernet.h"
+#include "checksum.h"
+#include "neigh.h"
+#include "udp.h"
+
+// Software traffic generator, pktgen_bench.
+// pktgen0 is a driverless ethernet device on 198.18.0.1/15, the benchmarking range. The generator
+// synthesizes UDP/IPv4 frames from 198.18.0.2, spread over a number of source ports (flows), at a
+// fixed frame size or the simple IMIX (7:4:1 of 64, 570 and 1518 byte frames), and hands them to
+// network_rx_packet the way a driver's poll loop would, paced to a packet rate or flat out. A sink
+// endpoint drains them on the other side, anything the stack transmits on pktgen0 is counted and
+// dropped. Profiling is on for every run, so the rates come with what each layer cost.
+// TCP has no generator of its own, tcp_bench runs over the loopback device with the same per layer
+// accounting in network_prof.
+
+#define PKTGEN_PACKETS (200000)
+#define PKTGEN_BATCH (32)               //Frames injected between yields, like a poll budget
+#define PKTGEN_PORT (9)
+#define PKTGEN_SRC_PORT (10000)
+#define PKTGEN_MAX_FRAME (1518)
+#define PKTGEN_DRAIN_NS (10 * 1000 * 1000)
+
+#define PKTGEN_LOCAL_IP (0xC6120001)    //198.18.0.1
+#define PKTGEN_PEER_IP (0xC6120002)     //198.18.0.2
+#define PKTGEN_NETMASK (0xFFFE0000)
+
+static const uint8_t pktgen_peer_mac[6] = {0x02, 0x70, 0x6b, 0x74, 0x00, 0x02};
+
+//One period of IMIX, indices into imix_frames
+static const int imix_frames[] = {64, 570, 1518};
+static const uint8_t imix_pattern[] = {0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2};
+
+static const int bench_sizes[] = {64, 512, 1518, 0};
+static const int bench_flows[] = {1, 1024};
+
+typedef struct {
+    _Atomic uint64_t tx_packets;
+    _Atomic uint64_t tx_bytes;
+} pktgen_dev_t;
+
+typedef struct {
+    udp_endpoint_t *ep;
+    uint64_t received;
+    _Atomic uint32_t stop;
+    _Atomic uint32_t done;
+} pktgen_sink_t;
+
+static pktgen_dev_t pktgen_dev;
+static interface_def_t *pktgen_interface = NULL;
+static int pktgen_lock = 0;
+
+//Whatever the stack sends out of pktgen0 ends here
+static int pktgen_tx(void *state, netbuf_t *nb, network_device_tx_flags_t flags) {
+    pktgen_dev_t *dev = (pktgen_dev_t *)state;
+    flags = 0;
+
+    __atomic_add_fetch(&dev->tx_packets, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dev->tx_bytes, nb->tot_len, __ATOMIC_RELAXED);
+    netbuf_free(nb);
+    return 0;
+}
+
+static int pktgen_linkstatus(void *state) {
+    state = NULL;
+    return 1;
+}
+
+static network_device_desc_t pktgen_desc = {
+    .name = "pktgen0",
+    .state = (void *)&pktgen_dev,
+    .features = network_device_features_checksum_offload | network_device_features_rx_checksum,
+    .type = network_device_type_ethernet,
+    .mac = {0x02, 0x70, 0x6b, 0x74, 0x00, 0x01},
+    .gso_max_size = 0,
+    .queue_cnt = 1,
+    .handlers.ether = {
+        .tx = pktgen_tx,
+        .tx_burst = NULL,
+        .link_status = pktgen_linkstatus,
+    },
+    .spec_features.ether = 0,
+    .lock = 0,
+};
+
+//pktgen0 is only registered once something asks for it, so it never shows up otherwise
+static interface_def_t *pktgen_setup(void) {
+    local_spinlock_lock(&pktgen_lock);
+    if (pktgen_interface == NULL) {
+        void *handle = NULL;
+        if (network_register(&pktgen_desc, &handle) == 0) {
+            pktgen_interface = (interface_def_t *)handle;
+            network_setipv4(pktgen_interface, TO_BE_FRM_LE_32(PKTGEN_LOCAL_IP), TO_BE_FRM_LE_32(PKTGEN_NETMASK), 0);
+        }
+    }
+    local_spinlock_unlock(&pktgen_lock);
+    return pktgen_interface;
+}
+
+//Ethernet, IPv4 and UDP headers of a frame_len byte frame from the peer, the UDP checksum is left out
+static void pktgen_template(uint8_t *frame, int frame_len) {
+    memset(frame, 0, frame_len);
+
+    ethernet_frame_t *ether = (ethernet_frame_t *)frame;
+    memcpy(ether->dst_mac, pktgen_desc.mac, 6);
+    memcpy(ether->src_mac, pktgen_peer_mac, 6);
+    ether->type = ETHERNET_TYPE_IPv4;
+
+    ipv4_t *ip = (ipv4_t *)ether->body;
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->total_len = TO_BE_FRM_LE_16((uint16_t)(frame_len - sizeof(ethernet_frame_t)));
+    ip->ttl = 64;
+    ip->protocol = IP_PROTOCOL_UDP;
+    ip->src_ip = TO_BE_FRM_LE_32(PKTGEN_PEER_IP);
+    ip->dst_ip = TO_BE_FRM_LE_32(PKTGEN_LOCAL_IP);
+    ip->hdr_csum = network_csum_fold(network_csum_partial(ip, sizeof(ipv4_t), 0));
+
+    udp_t *udp = (udp_t *)ip->body;
+    udp->src_port = TO_BE_FRM_LE_16(PKTGEN_SRC_PORT);
+    udp->dst_port = TO_BE_FRM_LE_16(PKTGEN_PORT);
+    udp->len = TO_BE_FRM_LE_16((uint16_t)(frame_len - sizeof(ethernet_frame_t) - sizeof(ipv4_t)));
+    udp->csum = 0;
+}
+
+//Drain the sink ring until told to stop, slots are released without being read
+static void pktgen_sink_task(void *arg) {
+    pktgen_sink_t *sink = (pktgen_sink_t *)arg;
+    network_ring_t *ring = udp_ring(sink->ep);
+
+    while (true) {
+        uint32_t avail = network_ring_avail(ring);
+        if (avail != 0) {
+            sink->received += avail;
+            network_ring_release(ring, avail);
+        } else if (__atomic_load_n(&sink->stop, __ATOMIC_SEQ_CST) != 0)
+            break;
+        else
+            task_yield();
+    }
+
+    __atomic_store_n(&sink->done, 1, __ATOMIC_SEQ_CST);
+    task_wake((uint32_t *)&sink->done, 1);
+    while (true) {
+        task_sleep(task_current(), 1000 * 1000 * 1000ull);
+        task_yield();
+    }
+}
+
+static void pktgen_print(const char *what, uint64_t val) {
+    char tmp[20];
+    DEBUG_PRINT(what);
+    DEBUG_PRINT(ltoa(val, tmp, 10));
+}
+
+//Inject cnt frames of frame_len bytes (0 for IMIX) over flows source ports at pps packets per second
+//(0 for as fast as possible) and report the rates and per layer costs
+int pktgen_run(int frame_len, int flows, int pps, int cnt) {
+    if ((frame_len != 0 && (frame_len < 64 || frame_len > PKTGEN_MAX_FRAME)) || flows <= 0 || pps < 0 || cnt <= 0)
+        return -1;
+
+    interface_def_t *interface = pktgen_setup();
+    if (interface == NULL)
+        return -1;
+
+    int tmpl_cnt = (frame_len == 0) ? (int)sizeof(imix_frames) / (int)sizeof(imix_frames[0]) : 1;
+    uint8_t *templates = malloc(PKTGEN_MAX_FRAME * tmpl_cnt);
+    if (templates == NULL)
+        return -1;
+    for (int i = 0; i < tmpl_cnt; i++)
+        pktgen_template(templates + i * PKTGEN_MAX_FRAME, (frame_len == 0) ? imix_frames[i] : frame_len);
+
+    network_sockaddr_t addr;
+    neigh_addr4(TO_BE_FRM_LE_32(PKTGEN_LOCAL_IP), addr.addr);
+    addr.port = PKTGEN_PORT;
+
+    pktgen_sink_t sink;
+    sink.ep = udp_create();
+    sink.received = 0;
+    sink.stop = 0;
+    sink.done = 0;
+    if (sink.ep == NULL || udp_bind(sink.ep, &addr) != 0) {
+        if (sink.ep != NULL)
+            udp_close(sink.ep);
+        free(templates);
+        return -1;
+    }
+
+    cs_id sink_id = 0;
+    if (create_task_kernel("pktgen_sink", task_permissions_kernel, &sink_id) != CS_OK ||
+        start_task_kernel(sink_id, pktgen_sink_task, &sink) != CS_OK) {
+        udp_close(sink.ep);
+        free(templates);
+        return -1;
+    }
+
+    network_prof_reset();
+    network_prof_enable(true);
+
+    uint64_t bytes = 0;
+    uint64_t cycles = 0;
+    int sent = 0;
+    uint64_t start = timer_timestamp_ns();
+    while (sent < cnt) {
+        //Paced runs wait for the batch's slot, flat out runs only let the sink catch up
+        if (pps != 0) {
+            uint64_t due = start + ((uint64_t)sent * 1000000000ull) / pps;
+            while (timer_timestamp_ns() < due)
+                task_yield();
+        }
+
+        int batch = MIN(PKTGEN_BATCH, cnt - sent);
+        uint64_t batch_start = network_rdtsc();
+        for (int i = 0; i < batch; i++, sent++) {
+            int t = (frame_len == 0) ? imix_pattern[sent % sizeof(imix_pattern)] : 0;
+            int len = (frame_len == 0) ? imix_frames[t] : frame_len;
+
+            netbuf_t *nb = netbuf_alloc();
+            if (nb == NULL)
+                continue;
+            uint8_t *frame = netbuf_put(nb, len);
+            memcpy(frame, templates + t * PKTGEN_MAX_FRAME, len);
+
+            udp_t *udp = (udp_t *)(frame + sizeof(ethernet_frame_t) + sizeof(ipv4_t));
+            udp->src_port = TO_BE_FRM_LE_16((uint16_t)(PKTGEN_SRC_PORT + sent % flows));
+
+            nb->flags |= NETBUF_F_CSUM_VALID;
+            network_rx_packet(interface, nb);
+            bytes += len;
+        }
+        cycles += network_rdtsc() - batch_start;
+        task_yield();
+    }
+    uint64_t ns = timer_timestamp_ns() - start;
+
+    //Give the sink a moment to empty the ring before it stops
+    task_sleep(task_current(), PKTGEN_DRAIN_NS);
+    task_yield();
+    network_prof_enable(false);
+
+    __atomic_store_n(&sink.stop, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&sink.done, __ATOMIC_SEQ_CST) == 0)
+        task_wait((uint32_t *)&sink.done, 0);
+    end_task_kernel(sink_id);
+    udp_close(sink.ep);
+    free(templates);
+
+    DEBUG_PRINT("[CoreNetwork] pktgen size=");
+    if (frame_len == 0)
+        DEBUG_PRINT("imix");
+    else
+        pktgen_print("", frame_len);
+    pktgen_print(" flows=", flows);
+    pktgen_print(" pkts/s=", ns == 0 ? 0 : (cnt * 1000000000ull) / ns);
+    pktgen_print(" Mbit/s=", ns == 0 ? 0 : (bytes * 8000) / ns);
+    pktgen_print(" delivered=", sink.received);
+    pktgen_print(" dropped=", cnt - MIN(sink.received, (uint64_t)cnt));
+    pktgen_print(" cycles/pkt=", cycles / cnt);
+    DEBUG_PRINT("\r\n");
+    network_prof();
+    return 0;
+}
+
+//Flat out runs over the standard frame sizes and IMIX, with one flow and with many
+int pktgen_bench() {
+    int ret = 0;
+    for (uint32_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++)
+        for (uint32_t j = 0; j < sizeof(bench_flows) / sizeof(bench_flows[0]); j++)
+            if (pktgen_run(bench_sizes[i], bench_flows[j], 0, PKTGEN_PACKETS) != 0)
+                ret = -1;
+
+    pktgen_print("[CoreNetwork] pktgen0 tx pkts=", pktgen_dev.tx_packets);
+    pktgen_print(" tx bytes=", pktgen_dev.tx_bytes);
+    DEBUG_PRINT("\r\n");
+    return ret;
+}
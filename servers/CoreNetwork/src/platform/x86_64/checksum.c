@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "SysReg/registry.h"
+
+#include "checksum.h"
+
+// SSE2 and AVX2 checksums.
+// Each 64-bit lane accumulates the low and high 32-bit halves of its input separately, so the
+// adds never carry out and no end-around carry is needed until the lanes are combined at the end.
+// The kernel is built without SSE, the target attribute enables it for these functions alone.
+
+typedef uint64_t csum_v2u64 __attribute__((vector_size(16)));
+typedef uint64_t csum_v4u64 __attribute__((vector_size(32)));
+
+static network_csum_impl_t impls[3];
+
+__attribute__((target("sse2"))) static uint64_t csum_sse2_loop(const uint8_t *src, uint8_t *dst, int *len, uint64_t sum) {
+    const csum_v2u64 mask = {0xffffffff, 0xffffffff};
+    csum_v2u64 acc0 = {0, 0};
+    csum_v2u64 acc1 = {0, 0};
+
+    int left = *len;
+    while (left >= 32) {
+        csum_v2u64 a, b;
+        __builtin_memcpy(&a, src, sizeof(a));
+        __builtin_memcpy(&b, src + 16, sizeof(b));
+        if (dst != NULL) {
+            __builtin_memcpy(dst, &a, sizeof(a));
+            __builtin_memcpy(dst + 16, &b, sizeof(b));
+            dst += 32;
+        }
+        acc0 += (a & mask) + (a >> 32);
+        acc1 += (b & mask) + (b >> 32);
+        src += 32;
+        left -= 32;
+    }
+    *len = left;
+
+    acc0 += acc1;
+    sum = network_csum_add(sum, acc0[0]);
+    return network_csum_add(sum, acc0[1]);
+}
+
+__attribute__((target("avx2"))) static uint64_t csum_avx2_loop(const uint8_t *src, uint8_t *dst, int *len, uint64_t sum) {
+    const csum_v4u64 mask = {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff};
+    csum_v4u64 acc0 = {0, 0, 0, 0};
+    csum_v4u64 acc1 = {0, 0, 0, 0};
+
+    int left = *len;
+    while (left >= 64) {
+        csum_v4u64 a, b;
+        __builtin_memcpy(&a, src, sizeof(a));
+        __builtin_memcpy(&b, src + 32, sizeof(b));
+        if (dst != NULL) {
+            __builtin_memcpy(dst, &a, sizeof(a));
+            __builtin_memcpy(dst + 32, &b, sizeof(b));
+            dst += 64;
+        }
+        acc0 += (a & mask) + (a >> 32);
+        acc1 += (b & mask) + (b >> 32);
+        src += 64;
+        left -= 64;
+    }
+    *len = left;
+
+    acc0 += acc1;
+    sum = network_csum_add(sum, acc0[0]);
+    sum = network_csum_add(sum, acc0[1]);
+    sum = network_csum_add(sum, acc0[2]);
+    return network_csum_add(sum, acc0[3]);
+}
+
+//The tails are shorter than one iteration, the scalar path from the generic code finishes them
+static uint64_t csum_tail(const network_csum_impl_t *scalar, const uint8_t *src, uint8_t *dst, int done, int left, uint64_t sum) {
+    if (dst != NULL)
+        return scalar->copy(dst + done, src + done, left, sum);
+    return scalar->partial(src + done, left, sum);
+}
+
+static const network_csum_impl_t *scalar_impl;
+
+static uint64_t csum_sse2(const void *buf, int len, uint64_t sum) {
+    int left = len;
+    sum = csum_sse2_loop((const uint8_t *)buf, NULL, &left, sum);
+    return csum_tail(scalar_impl, (const uint8_t *)buf, NULL, len - left, left, sum);
+}
+
+static uint64_t csum_sse2_copy(void *dst, const void *src, int len, uint64_t sum) {
+    int left = len;
+    sum = csum_sse2_loop((const uint8_t *)src, (uint8_t *)dst, &left, sum);
+    return csum_tail(scalar_impl, (const uint8_t *)src, (uint8_t *)dst, len - left, left, sum);
+}
+
+static uint64_t csum_avx2(const void *buf, int len, uint64_t sum) {
+    int left = len;
+    sum = csum_avx2_loop((const uint8_t *)buf, NULL, &left, sum);
+    return csum_tail(scalar_impl, (const uint8_t *)buf, NULL, len - left, left, sum);
+}
+
+static uint64_t csum_avx2_copy(void *dst, const void *src, int len, uint64_t sum) {
+    int left = len;
+    sum = csum_avx2_loop((const uint8_t *)src, (uint8_t *)dst, &left, sum);
+    return csum_tail(scalar_impl, (const uint8_t *)src, (uint8_t *)dst, len - left, left, sum);
+}
+
+PRIVATE const network_csum_impl_t *network_csum_platform_impls(const network_csum_impl_t *scalar) {
+    if (scalar_impl != NULL)
+        return impls;
+    scalar_impl = scalar;
+
+    bool sse2 = false;
+    bool avx2 = false;
+    registry_readkey_bool("HW/PROC", "SSE2", &sse2);
+    registry_readkey_bool("HW/PROC", "AVX2", &avx2);
+
+    int cnt = 0;
+    if (avx2)
+        impls[cnt++] = (network_csum_impl_t){.name = "avx2", .partial = csum_avx2, .copy = csum_avx2_copy};
+    if (sse2)
+        impls[cnt++] = (network_csum_impl_t){.name = "sse2", .partial = csum_sse2, .copy = csum_sse2_copy};
+    impls[cnt].name = NULL;
+    return impls;
+}
@@ -0,0 +1,1584 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <cardinal/local_spinlock.h>
+
+#include "SysTaskMgr/task.h"
+
+#include "CoreNetwork/socket.h"
+#include "tcp.h"
+#include "checksum.h"
+#include "neigh.h"
+
+// TCP connections.
+// Segments are matched by 4-tuple against the connection table and then by port against the
+// listeners, each table hashed with a lock per bucket. The lookup takes a reference and the segment
+// is processed under the connection's own lock, so connections never contend with each other.
+// In order payload is queued by reference: small segments are copied into the tail of the receive
+// queue so a stream of tiny writes doesn't pin a receive buffer each, everything else is cloned.
+//
+// References: the user holds one until tcp_close, the tables hold one while the connection is
+// hashed, and lookups and the timer task hold theirs while they work on it.
+
+#define TCP_CONN_BUCKETS (4096)
+#define TCP_LISTEN_BUCKETS (256)
+#define TCP_EPHEMERAL_FIRST (49152)
+#define TCP_EPHEMERAL_CNT (65536 - TCP_EPHEMERAL_FIRST)
+#define TCP_COPY_MAX (256)          //Payloads up to this long are copied instead of cloned
+#define TCP_WAKE_ALL (0x7fffffff)
+
+typedef struct {
+    tcp_conn_t *head;
+    int lock;
+} tcp_bucket_t;
+
+//A received segment, payload is len bytes starting off bytes into nb
+typedef struct {
+    netbuf_t *nb;
+    int off;
+    uint32_t seq;
+    uint32_t ack;
+    uint32_t len;
+    uint32_t wnd;
+    uint8_t flags;
+    tcp_opts_t opts;
+} tcp_seg_t;
+
+static tcp_bucket_t conn_table[TCP_CONN_BUCKETS];
+static tcp_bucket_t listen_table[TCP_LISTEN_BUCKETS];
+static int bind_lock = 0;
+static _Atomic uint32_t ephemeral_cursor = 0;
+
+static uint64_t stat_rx_segs = 0;
+static uint64_t stat_rx_csum_errors = 0;
+static uint64_t stat_rx_no_conn = 0;
+
+static inline bool tcp_addr_any(const uint8_t *addr) {
+    for (int i = 0; i < 16; i++)
+        if (addr[i] != 0)
+            return false;
+    return true;
+}
+
+static inline bool tcp_addr_match(const uint8_t *bound, const uint8_t *addr) {
+    return tcp_addr_any(bound) || memcmp(bound, addr, 16) == 0;
+}
+
+static inline uint32_t tcp_port_hash(uint16_t port) {
+    return (port * 0x9E3779B1u) >> (32 - 8);
+}
+
+static uint32_t tcp_tuple_hash(uint16_t local_port, const network_sockaddr_t *remote) {
+    uint64_t w[2];
+    memcpy(w, remote->addr, sizeof(w));
+
+    uint64_t h = ((uint64_t)local_port << 16) | remote->port;
+    h = (h ^ w[0]) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 29) ^ w[1]) * 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return (uint32_t)h;
+}
+
+static inline tcp_bucket_t *tcp_conn_bucket(uint16_t local_port, const network_sockaddr_t *remote) {
+    return &conn_table[tcp_tuple_hash(local_port, remote) & (TCP_CONN_BUCKETS - 1)];
+}
+
+static inline void tcp_bucket_lock(tcp_bucket_t *b, int *cli_state) {
+    *cli_state = cli();
+    local_spinlock_lock(&b->lock);
+}
+
+static inline void tcp_bucket_unlock(tcp_bucket_t *b, int cli_state) {
+    local_spinlock_unlock(&b->lock);
+    sti(cli_state);
+}
+
+static inline void tcp_lock(tcp_conn_t *c, int *cli_state) {
+    *cli_state = cli();
+    local_spinlock_lock(&c->lock);
+}
+
+//Wake anyone waiting on the connection once the lock is released
+static void tcp_unlock(tcp_conn_t *c, int cli_state) {
+    bool wakeup = c->wakeup;
+    c->wakeup = false;
+    local_spinlock_unlock(&c->lock);
+    sti(cli_state);
+
+    if (wakeup) {
+        __atomic_add_fetch(&c->event, 1, __ATOMIC_SEQ_CST);
+        task_wake((uint32_t *)&c->event, TCP_WAKE_ALL);
+    }
+}
+
+static inline void tcp_get(tcp_conn_t *c) {
+    __atomic_add_fetch(&c->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void tcp_queue_free(netbuf_t *nb) {
+    while (nb != NULL) {
+        netbuf_t *next = nb->q_next;
+        nb->q_next = NULL;
+        netbuf_free(nb);
+        nb = next;
+    }
+}
+
+static void tcp_ooo_free(tcp_conn_t *c) {
+    while (c->ooo != NULL) {
+        tcp_ooo_t *o = c->ooo;
+        c->ooo = o->next;
+        netbuf_free(o->data);
+        free(o);
+    }
+    c->ooo_cnt = 0;
+}
+
+PRIVATE void tcp_put(tcp_conn_t *c) {
+    if (__atomic_sub_fetch(&c->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    tcp_queue_free(c->sndq_head);
+    tcp_queue_free(c->rcvq_head);
+    tcp_ooo_free(c);
+    free(c);
+}
+
+static tcp_conn_t *tcp_alloc(void) {
+    tcp_conn_t *c = malloc(sizeof(tcp_conn_t));
+    if (c == NULL)
+        return NULL;
+    memset(c, 0, sizeof(tcp_conn_t));
+
+    c->refcnt = 1;
+    c->mss = TCP_DEFAULT_MSS;
+    c->rto = TCP_RTO_INIT_MS;
+    c->ssthresh = 0xffffffff;
+    c->rcv_wscale = 4;              //TCP_RCVBUF in a 16-bit window
+    c->cc = tcp_cc_find(NULL);
+    c->cc->init(c);
+    for (int i = 0; i < tcp_timer_count; i++) {
+        c->timers[i].conn = c;
+        c->timers[i].kind = (uint8_t)i;
+    }
+    return c;
+}
+
+static uint32_t tcp_new_iss(tcp_conn_t *c) {
+    return (uint32_t)(network_rdtsc() >> 4) ^ (tcp_tuple_hash(c->local.port, &c->remote) * 0x9E3779B1u);
+}
+
+//Insert into the connection table, fails if the 4-tuple is already taken
+static bool tcp_hash(tcp_conn_t *c) {
+    int cli_state;
+    tcp_bucket_t *b = tcp_conn_bucket(c->local.port, &c->remote);
+    tcp_bucket_lock(b, &cli_state);
+    for (tcp_conn_t *o = b->head; o != NULL; o = o->hash_next)
+        if (o->local.port == c->local.port && o->remote.port == c->remote.port &&
+            memcmp(o->remote.addr, c->remote.addr, 16) == 0 && memcmp(o->local.addr, c->local.addr, 16) == 0) {
+            tcp_bucket_unlock(b, cli_state);
+            return false;
+        }
+    tcp_get(c);
+    c->hash_next = b->head;
+    b->head = c;
+    c->hashed = true;
+    tcp_bucket_unlock(b, cli_state);
+    return true;
+}
+
+//Caller holds the connection lock and a reference besides the table's
+static void tcp_unhash(tcp_conn_t *c) {
+    if (!c->hashed)
+        return;
+
+    int cli_state;
+    tcp_bucket_t *b = (c->state == tcp_state_listen) ? &listen_table[tcp_port_hash(c->local.port)] : tcp_conn_bucket(c->local.port, &c->remote);
+    tcp_bucket_lock(b, &cli_state);
+    tcp_conn_t **link = &b->head;
+    while (*link != NULL && *link != c)
+        link = &(*link)->hash_next;
+    if (*link == c)
+        *link = c->hash_next;
+    c->hashed = false;
+    tcp_bucket_unlock(b, cli_state);
+    tcp_put(c);
+}
+
+//Connection or listener the segment belongs to with a reference held, NULL if there is none
+static tcp_conn_t *tcp_lookup(const network_sockaddr_t *src, const network_sockaddr_t *dst) {
+    tcp_conn_t *ret = NULL;
+    int cli_state;
+
+    tcp_bucket_t *b = tcp_conn_bucket(dst->port, src);
+    tcp_bucket_lock(b, &cli_state);
+    for (tcp_conn_t *c = b->head; c != NULL; c = c->hash_next)
+        if (c->local.port == dst->port && c->remote.port == src->port &&
+            memcmp(c->remote.addr, src->addr, 16) == 0 && memcmp(c->local.addr, dst->addr, 16) == 0) {
+            ret = c;
+            tcp_get(ret);
+            break;
+        }
+    tcp_bucket_unlock(b, cli_state);
+    if (ret != NULL)
+        return ret;
+
+    b = &listen_table[tcp_port_hash(dst->port)];
+    tcp_bucket_lock(b, &cli_state);
+    for (tcp_conn_t *c = b->head; c != NULL; c = c->hash_next)
+        if (c->local.port == dst->port && tcp_addr_match(c->local.addr, dst->addr)) {
+            ret = c;
+            tcp_get(ret);
+            break;
+        }
+    tcp_bucket_unlock(b, cli_state);
+    return ret;
+}
+
+//Caller holds bind_lock
+static bool tcp_port_listening(uint16_t port, const uint8_t *addr) {
+    for (tcp_conn_t *c = listen_table[tcp_port_hash(port)].head; c != NULL; c = c->hash_next)
+        if (c->local.port == port && (tcp_addr_any(addr) || tcp_addr_match(c->local.addr, addr)))
+            return true;
+    return false;
+}
+
+static void tcp_rtt_update(tcp_conn_t *c, uint32_t rtt) {
+    rtt = MAX(rtt, 1);
+    if (c->srtt == 0) {
+        c->srtt = rtt << 3;
+        c->rttvar = rtt << 1;
+    } else {
+        int32_t delta = (int32_t)rtt - (int32_t)(c->srtt >> 3);
+        c->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        delta -= (int32_t)(c->rttvar >> 2);
+        c->rttvar += delta;
+    }
+    c->rto = (c->srtt >> 3) + MAX(c->rttvar, (uint32_t)TCP_TICK_MS);
+    c->rto = MAX(MIN(c->rto, (uint32_t)TCP_RTO_MAX_MS), (uint32_t)TCP_RTO_MIN_MS);
+}
+
+static inline uint32_t tcp_backoff_rto(tcp_conn_t *c) {
+    return (uint32_t)MIN((uint64_t)c->rto << c->backoff, (uint64_t)TCP_RTO_MAX_MS);
+}
+
+//Tear the connection down, the caller holds the lock and a reference besides the table's
+static void tcp_drop(tcp_conn_t *c, int error) {
+    c->state = tcp_state_closed;
+    if (error != 0)
+        c->error = error;
+    for (int i = 0; i < tcp_timer_count; i++)
+        tcp_timer_cancel(c, (tcp_timer_kind_t)i);
+    tcp_unhash(c);
+    c->wakeup = true;
+
+    //Never made it to the accept queue, the reference meant for the user goes as well
+    if (c->listener != NULL) {
+        tcp_put(c->listener);
+        c->listener = NULL;
+        tcp_put(c);
+    }
+}
+
+static void tcp_enter_time_wait(tcp_conn_t *c) {
+    c->state = tcp_state_time_wait;
+    tcp_timer_cancel(c, tcp_timer_rexmt);
+    tcp_timer_cancel(c, tcp_timer_delack);
+    tcp_timer_arm(c, tcp_timer_timewait, TCP_TIMEWAIT_MS);
+    c->wakeup = true;
+}
+
+static void tcp_parse_opts(tcp_t *tcp, int hdr_len, tcp_opts_t *opts) {
+    memset(opts, 0, sizeof(tcp_opts_t));
+    opts->wscale = -1;
+
+    uint8_t *p = tcp->options;
+    int len = hdr_len - (int)sizeof(tcp_t);
+    while (len > 0) {
+        uint8_t kind = p[0];
+        if (kind == TCP_OPT_END)
+            break;
+        if (kind == TCP_OPT_NOP) {
+            p++;
+            len--;
+            continue;
+        }
+        if (len < 2 || p[1] < 2 || p[1] > len)
+            break;
+
+        uint8_t olen = p[1];
+        if (kind == TCP_OPT_MSS && olen == 4)
+            opts->mss = (uint16_t)((p[2] << 8) | p[3]);
+        else if (kind == TCP_OPT_WSCALE && olen == 3)
+            opts->wscale = (int8_t)MIN(p[2], 14);
+        else if (kind == TCP_OPT_SACK_PERM && olen == 2)
+            opts->sack_perm = true;
+        else if (kind == TCP_OPT_TIMESTAMP && olen == 10) {
+            opts->has_ts = true;
+            opts->ts_val = ((uint32_t)p[2] << 24) | ((uint32_t)p[3] << 16) | ((uint32_t)p[4] << 8) | p[5];
+            opts->ts_ecr = ((uint32_t)p[6] << 24) | ((uint32_t)p[7] << 16) | ((uint32_t)p[8] << 8) | p[9];
+        } else if (kind == TCP_OPT_SACK && olen >= 10 && ((olen - 2) % 8) == 0) {
+            for (int i = 2; i + 8 <= olen && opts->sack_cnt < TCP_MAX_SACK; i += 8) {
+                uint8_t *b = &p[i];
+                opts->sack[opts->sack_cnt][0] = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+                opts->sack[opts->sack_cnt][1] = ((uint32_t)b[4] << 24) | ((uint32_t)b[5] << 16) | ((uint32_t)b[6] << 8) | b[7];
+                opts->sack_cnt++;
+            }
+        }
+        p += olen;
+        len -= olen;
+    }
+}
+
+//Negotiate from the peer's SYN, the options we offered are still set on the connection
+static void tcp_syn_opts(tcp_conn_t *c, const tcp_opts_t *opts) {
+    c->ws_ok = c->ws_ok && opts->wscale >= 0;
+    c->sack_ok = c->sack_ok && opts->sack_perm;
+    c->ts_ok = c->ts_ok && opts->has_ts;
+    if (c->ws_ok)
+        c->snd_wscale = (uint8_t)opts->wscale;
+    else {
+        c->snd_wscale = 0;
+        c->rcv_wscale = 0;
+    }
+    if (c->ts_ok)
+        c->ts_recent = opts->ts_val;
+
+    uint16_t mss = (opts->mss != 0) ? opts->mss : TCP_DEFAULT_MSS;
+    mss = MIN(mss, tcp_our_mss(c));
+    //Every segment carries the timestamp option, it comes out of the payload
+    if (c->ts_ok)
+        mss -= 12;
+    c->mss = mss;
+    c->cwnd = TCP_INIT_CWND * (uint32_t)c->mss;
+    c->cc->init(c);
+}
+
+//Clones covering len bytes of nb starting at off, linked through next
+static netbuf_t *tcp_chain_clone(netbuf_t *nb, int off, int len) {
+    netbuf_t *head = NULL;
+    netbuf_t *tail = NULL;
+    for (; nb != NULL && len > 0; nb = nb->next) {
+        if (off >= nb->len) {
+            off -= nb->len;
+            continue;
+        }
+        int n = MIN(nb->len - off, len);
+        netbuf_t *clone = netbuf_clone(nb, off, n);
+        if (clone == NULL) {
+            netbuf_free(head);
+            return NULL;
+        }
+        if (tail != NULL)
+            tail->next = clone;
+        else
+            head = clone;
+        tail = clone;
+        len -= n;
+        off = 0;
+    }
+    return head;
+}
+
+static void tcp_chain_copy(netbuf_t *nb, int off, uint8_t *dst, int len) {
+    for (; nb != NULL && len > 0; nb = nb->next) {
+        if (off >= nb->len) {
+            off -= nb->len;
+            continue;
+        }
+        int n = MIN(nb->len - off, len);
+        memcpy(dst, nb->data + off, n);
+        dst += n;
+        len -= n;
+        off = 0;
+    }
+}
+
+//Drop n bytes from the front of a clone chain
+static netbuf_t *tcp_chain_trim(netbuf_t *nb, uint32_t n) {
+    while (nb != NULL && n > 0) {
+        if (n < nb->len) {
+            nb->data += n;
+            nb->len -= n;
+            nb->tot_len = nb->len;
+            break;
+        }
+        n -= nb->len;
+        netbuf_t *next = nb->next;
+        nb->next = NULL;
+        netbuf_free(nb);
+        nb = next;
+    }
+    return nb;
+}
+
+//Move a clone chain onto the receive queue segment by segment
+static void tcp_rcvq_append_chain(tcp_conn_t *c, netbuf_t *nb) {
+    while (nb != NULL) {
+        netbuf_t *next = nb->next;
+        nb->next = NULL;
+        nb->tot_len = nb->len;
+        nb->q_next = NULL;
+        if (c->rcvq_tail != NULL)
+            c->rcvq_tail->q_next = nb;
+        else
+            c->rcvq_head = nb;
+        c->rcvq_tail = nb;
+        c->rcvq_bytes += nb->len;
+        nb = next;
+    }
+}
+
+//Queue in order payload, false if out of netbufs
+static bool tcp_rcvq_append(tcp_conn_t *c, netbuf_t *nb, int off, int len) {
+    netbuf_t *tail = c->rcvq_tail;
+
+    //Netbufs we allocated ourselves have no parent, top those up first
+    if (tail != NULL && tail->parent == NULL && netbuf_tailroom(tail) >= len) {
+        tcp_chain_copy(nb, off, netbuf_put(tail, len), len);
+        tail->tot_len = tail->len;
+        c->rcvq_bytes += len;
+        return true;
+    }
+
+    if (len <= TCP_COPY_MAX) {
+        netbuf_t *copy = netbuf_alloc();
+        if (copy == NULL)
+            return false;
+        tcp_chain_copy(nb, off, netbuf_put(copy, len), len);
+        tcp_rcvq_append_chain(c, copy);
+        return true;
+    }
+
+    netbuf_t *clones = tcp_chain_clone(nb, off, len);
+    if (clones == NULL)
+        return false;
+    tcp_rcvq_append_chain(c, clones);
+    return true;
+}
+
+//Move out of order data that became contiguous onto the receive queue
+static void tcp_ooo_drain(tcp_conn_t *c) {
+    while (c->ooo != NULL && TCP_SEQ_LEQ(c->ooo->seq, c->rcv_nxt)) {
+        tcp_ooo_t *o = c->ooo;
+        c->ooo = o->next;
+        c->ooo_cnt--;
+
+        if (TCP_SEQ_GT(o->end, c->rcv_nxt)) {
+            netbuf_t *data = tcp_chain_trim(o->data, c->rcv_nxt - o->seq);
+            tcp_rcvq_append_chain(c, data);
+            c->rcv_nxt = o->end;
+        } else
+            netbuf_free(o->data);
+        free(o);
+    }
+}
+
+//Hold on to a segment beyond rcv_nxt, merged into the sorted out of order queue
+static void tcp_ooo_insert(tcp_conn_t *c, netbuf_t *nb, int off, uint32_t seq, uint32_t len) {
+    uint32_t end = seq + len;
+    c->last_ooo_seq = seq;
+
+    tcp_ooo_t *prev = NULL;
+    tcp_ooo_t **link = &c->ooo;
+    while (*link != NULL && TCP_SEQ_LEQ((*link)->end, seq)) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+
+    //Overlaps the block before it
+    if (*link != NULL && TCP_SEQ_LEQ((*link)->seq, seq)) {
+        if (TCP_SEQ_GEQ((*link)->end, end))
+            return;
+        off += (*link)->end - seq;
+        seq = (*link)->end;
+        prev = *link;
+        link = &(*link)->next;
+    }
+
+    //Swallows the blocks it covers entirely
+    while (*link != NULL && TCP_SEQ_LEQ((*link)->end, end)) {
+        tcp_ooo_t *o = *link;
+        *link = o->next;
+        netbuf_free(o->data);
+        free(o);
+        c->ooo_cnt--;
+    }
+    if (*link != NULL && TCP_SEQ_LT((*link)->seq, end))
+        end = (*link)->seq;
+    if (seq == end)
+        return;
+
+    netbuf_t *data = tcp_chain_clone(nb, off, end - seq);
+    if (data == NULL)
+        return;
+
+    //Extend a neighbor rather than fragmenting the queue
+    if (prev != NULL && prev->end == seq) {
+        netbuf_chain(prev->data, data);
+        prev->end = end;
+        if (*link != NULL && (*link)->seq == end) {
+            tcp_ooo_t *o = *link;
+            netbuf_chain(prev->data, o->data);
+            prev->end = o->end;
+            prev->next = o->next;
+            free(o);
+            c->ooo_cnt--;
+        }
+        return;
+    }
+    if (*link != NULL && (*link)->seq == end) {
+        netbuf_chain(data, (*link)->data);
+        (*link)->data = data;
+        (*link)->seq = seq;
+        return;
+    }
+
+    if (c->ooo_cnt >= TCP_MAX_OOO) {
+        netbuf_free(data);
+        return;
+    }
+    tcp_ooo_t *o = malloc(sizeof(tcp_ooo_t));
+    if (o == NULL) {
+        netbuf_free(data);
+        return;
+    }
+    o->seq = seq;
+    o->end = end;
+    o->data = data;
+    o->next = *link;
+    *link = o;
+    c->ooo_cnt++;
+}
+
+//Merge the peer's SACK blocks into the scoreboard, dropping whatever snd_una passed
+static void tcp_sack_update(tcp_conn_t *c, const tcp_opts_t *opts) {
+    uint32_t blocks[TCP_MAX_SACK * 2][2];
+    int cnt = 0;
+    for (int i = 0; i < c->sacked_cnt; i++) {
+        blocks[cnt][0] = c->sacked[i][0];
+        blocks[cnt][1] = c->sacked[i][1];
+        cnt++;
+    }
+    for (int i = 0; opts != NULL && i < opts->sack_cnt; i++) {
+        if (TCP_SEQ_GEQ(opts->sack[i][0], opts->sack[i][1]) || TCP_SEQ_GT(opts->sack[i][1], c->snd_max))
+            continue;
+        blocks[cnt][0] = opts->sack[i][0];
+        blocks[cnt][1] = opts->sack[i][1];
+        cnt++;
+    }
+
+    //Insertion sort by left edge, then merge overlaps
+    for (int i = 1; i < cnt; i++)
+        for (int j = i; j > 0 && TCP_SEQ_LT(blocks[j][0], blocks[j - 1][0]); j--) {
+            uint32_t l = blocks[j][0], r = blocks[j][1];
+            blocks[j][0] = blocks[j - 1][0];
+            blocks[j][1] = blocks[j - 1][1];
+            blocks[j - 1][0] = l;
+            blocks[j - 1][1] = r;
+        }
+
+    c->sacked_cnt = 0;
+    for (int i = 0; i < cnt; i++) {
+        uint32_t l = blocks[i][0], r = blocks[i][1];
+        if (TCP_SEQ_LEQ(r, c->snd_una))
+            continue;
+        if (TCP_SEQ_LT(l, c->snd_una))
+            l = c->snd_una;
+
+        int n = c->sacked_cnt;
+        if (n > 0 && TCP_SEQ_LEQ(l, c->sacked[n - 1][1])) {
+            if (TCP_SEQ_GT(r, c->sacked[n - 1][1]))
+                c->sacked[n - 1][1] = r;
+        } else if (n < TCP_MAX_SACK) {
+            //The lowest blocks bound the holes that need filling first
+            c->sacked[n][0] = l;
+            c->sacked[n][1] = r;
+            c->sacked_cnt++;
+        }
+    }
+}
+
+static uint32_t tcp_sacked_bytes(tcp_conn_t *c) {
+    uint32_t bytes = 0;
+    for (int i = 0; i < c->sacked_cnt; i++)
+        bytes += c->sacked[i][1] - c->sacked[i][0];
+    return bytes;
+}
+
+//Release acknowledged bytes from the front of the send queue
+static void tcp_sndq_ack(tcp_conn_t *c, uint32_t n) {
+    c->sndq_bytes -= n;
+    while (n > 0 && c->sndq_head != NULL) {
+        netbuf_t *nb = c->sndq_head;
+        uint32_t rem = nb->len - c->sndq_off;
+        if (n < rem) {
+            c->sndq_off += n;
+            break;
+        }
+
+        n -= rem;
+        c->sndq_off = 0;
+        c->sndq_head = nb->q_next;
+        if (c->sndq_head == NULL)
+            c->sndq_tail = NULL;
+        if (c->sndq_hint == nb)
+            c->sndq_hint = NULL;
+        nb->q_next = NULL;
+        netbuf_free(nb);
+    }
+}
+
+static void tcp_enter_recovery(tcp_conn_t *c, uint64_t now) {
+    c->ssthresh = c->cc->ssthresh(c, now);
+    c->cwnd = c->ssthresh + 3 * (uint32_t)c->mss;
+    c->in_recovery = true;
+    c->recover = c->snd_max;
+    c->rexmit_nxt = c->snd_una;
+    c->stat_fast_retrans++;
+    tcp_retransmit(c, c->snd_una);
+}
+
+//Move an established child from its listener's care to the accept queue
+static void tcp_accept_ready(tcp_conn_t *c) {
+    tcp_conn_t *l = c->listener;
+    if (l == NULL)
+        return;
+
+    int cli_state;
+    tcp_lock(l, &cli_state);
+    bool ok = l->state == tcp_state_listen && l->accept_cnt < l->backlog;
+    if (ok) {
+        c->accept_next = NULL;
+        if (l->accept_tail != NULL)
+            l->accept_tail->accept_next = c;
+        else
+            l->accept_head = c;
+        l->accept_tail = c;
+        l->accept_cnt++;
+        l->wakeup = true;
+    }
+    tcp_unlock(l, cli_state);
+
+    if (!ok) {
+        tcp_send_rst(c);
+        tcp_drop(c, -1);
+        return;
+    }
+    c->listener = NULL;
+    tcp_put(l);
+}
+
+//Processes an ACK, returns false if the segment should be dropped
+static bool tcp_ack(tcp_conn_t *c, tcp_seg_t *s) {
+    uint64_t now = tcp_now_ms();
+
+    if (TCP_SEQ_GT(s->ack, c->snd_max)) {
+        c->ack_now = true;
+        return false;
+    }
+
+    if (c->sack_ok && s->opts.sack_cnt > 0)
+        tcp_sack_update(c, &s->opts);
+
+    if (TCP_SEQ_GT(s->ack, c->snd_una)) {
+        uint32_t acked = s->ack - c->snd_una;
+
+        //RTT from the timestamp echo, or from the one segment being timed (Karn)
+        if (c->ts_ok && s->opts.has_ts && s->opts.ts_ecr != 0)
+            tcp_rtt_update(c, (uint32_t)now - s->opts.ts_ecr);
+        else if (c->rtt_seq != 0 && TCP_SEQ_GEQ(s->ack, c->rtt_seq)) {
+            tcp_rtt_update(c, (uint32_t)(now - c->rtt_start));
+            c->rtt_seq = 0;
+        }
+
+        //Our FIN takes a sequence number but no space in the queue
+        tcp_sndq_ack(c, MIN(acked, c->sndq_bytes));
+        c->snd_una = s->ack;
+        if (TCP_SEQ_LT(c->snd_nxt, c->snd_una))
+            c->snd_nxt = c->snd_una;
+        c->backoff = 0;
+        c->retries = 0;
+        c->dupacks = 0;
+        tcp_sack_update(c, NULL);
+
+        if (c->in_recovery) {
+            if (TCP_SEQ_GEQ(s->ack, c->recover)) {
+                c->in_recovery = false;
+                c->cwnd = c->ssthresh;
+            } else {
+                //Partial ACK, the next hole was lost as well (RFC 6582)
+                c->cwnd = (c->cwnd > acked) ? c->cwnd - acked + c->mss : c->mss;
+                if (TCP_SEQ_LT(c->rexmit_nxt, c->snd_una))
+                    c->rexmit_nxt = c->snd_una;
+                tcp_retransmit(c, c->snd_una);
+            }
+        } else
+            c->cc->on_ack(c, acked, now);
+
+        if (c->snd_una == c->snd_max)
+            tcp_timer_cancel(c, tcp_timer_rexmt);
+        else
+            tcp_timer_arm(c, tcp_timer_rexmt, c->rto);
+        c->wakeup = true;
+    } else if (s->ack == c->snd_una && s->len == 0 && c->snd_una != c->snd_max &&
+               (s->wnd << c->snd_wscale) == c->snd_wnd && !(s->flags & (TCP_FLAG_SYN | TCP_FLAG_FIN))) {
+        c->dupacks++;
+        if (c->in_recovery) {
+            c->cwnd += c->mss;
+            if (c->sacked_cnt > 0 && TCP_SEQ_LT(c->rexmit_nxt, c->sacked[c->sacked_cnt - 1][0]))
+                tcp_retransmit(c, c->rexmit_nxt);
+        } else if (c->dupacks == 3 || (c->sack_ok && tcp_sacked_bytes(c) > 3 * (uint32_t)c->mss))
+            tcp_enter_recovery(c, now);
+    }
+
+    //Window update, only from segments at least as new as the last one used (RFC 793)
+    if (TCP_SEQ_LT(c->snd_wl1, s->seq) || (c->snd_wl1 == s->seq && TCP_SEQ_LEQ(c->snd_wl2, s->ack))) {
+        c->snd_wnd = s->wnd << c->snd_wscale;
+        c->snd_wl1 = s->seq;
+        c->snd_wl2 = s->ack;
+    }
+
+    //Our FIN got acknowledged
+    if (c->fin_sent && c->snd_una == c->snd_max) {
+        if (c->state == tcp_state_fin_wait1) {
+            c->state = tcp_state_fin_wait2;
+            //Nobody is left to read, don't wait forever for the peer's FIN
+            if (c->user_closed)
+                tcp_timer_arm(c, tcp_timer_timewait, TCP_TIMEWAIT_MS);
+            c->wakeup = true;
+        } else if (c->state == tcp_state_closing) {
+            tcp_enter_time_wait(c);
+        } else if (c->state == tcp_state_last_ack) {
+            tcp_drop(c, 0);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tcp_data(tcp_conn_t *c, tcp_seg_t *s) {
+    if (s->len > 0 && (c->state == tcp_state_established || c->state == tcp_state_fin_wait1 || c->state == tcp_state_fin_wait2)) {
+        if (s->seq == c->rcv_nxt) {
+            if (!tcp_rcvq_append(c, s->nb, s->off, s->len))
+                return;
+            c->rcv_nxt += s->len;
+
+            bool filled = c->ooo != NULL;
+            tcp_ooo_drain(c);
+            c->wakeup = true;
+
+            //ACK every second segment and anything that filled a hole, the rest waits for the timer
+            c->ack_pending++;
+            if (filled || c->ack_pending >= 2)
+                c->ack_now = true;
+            else if (!tcp_timer_armed(c, tcp_timer_delack))
+                tcp_timer_arm(c, tcp_timer_delack, TCP_DELACK_MS);
+        } else {
+            //A gap, tell the peer right away so it can start recovering
+            tcp_ooo_insert(c, s->nb, s->off, s->seq, s->len);
+            tcp_send_ack(c);
+            return;
+        }
+    }
+
+    //FINs are only taken in order, the peer retransmits one that arrives early
+    if ((s->flags & TCP_FLAG_FIN) && s->seq + s->len == c->rcv_nxt && !c->fin_rcvd) {
+        c->rcv_nxt++;
+        c->fin_rcvd = true;
+        c->ack_now = true;
+        c->wakeup = true;
+
+        if (c->state == tcp_state_established)
+            c->state = tcp_state_close_wait;
+        else if (c->state == tcp_state_fin_wait1)
+            c->state = tcp_state_closing;
+        else if (c->state == tcp_state_fin_wait2)
+            tcp_enter_time_wait(c);
+    }
+}
+
+static void tcp_syn_sent(tcp_conn_t *c, tcp_seg_t *s) {
+    bool ack_ok = (s->flags & TCP_FLAG_ACK) && TCP_SEQ_GT(s->ack, c->iss) && TCP_SEQ_LEQ(s->ack, c->snd_max);
+    if ((s->flags & TCP_FLAG_ACK) && !ack_ok) {
+        if (!(s->flags & TCP_FLAG_RST))
+            tcp_send_reset(c->interface, &c->local, &c->remote, s->ack, 0, false);
+        return;
+    }
+    if (s->flags & TCP_FLAG_RST) {
+        if (ack_ok)
+            tcp_drop(c, -1);
+        return;
+    }
+    if (!(s->flags & TCP_FLAG_SYN))
+        return;
+
+    c->irs = s->seq;
+    c->rcv_nxt = s->seq + 1;
+    c->rcv_adv = c->rcv_nxt;
+    tcp_syn_opts(c, &s->opts);
+
+    if (!ack_ok) {
+        //Simultaneous open
+        c->state = tcp_state_syn_rcvd;
+        tcp_send_syn(c);
+        return;
+    }
+
+    c->snd_una = s->ack;
+    c->snd_wnd = s->wnd;
+    c->snd_wl1 = s->seq;
+    c->snd_wl2 = s->ack;
+    if (c->backoff == 0 && c->ts_ok && s->opts.ts_ecr != 0)
+        tcp_rtt_update(c, (uint32_t)tcp_now_ms() - s->opts.ts_ecr);
+    else if (c->backoff == 0)
+        tcp_rtt_update(c, (uint32_t)(tcp_now_ms() - c->rtt_start));
+    c->backoff = 0;
+    c->retries = 0;
+    tcp_timer_cancel(c, tcp_timer_rexmt);
+
+    c->state = tcp_state_established;
+    c->wakeup = true;
+    tcp_send_ack(c);
+}
+
+//Passive open from a listener's SYN, the listener is unlocked
+static void tcp_listen_syn(tcp_conn_t *l, tcp_seg_t *s, const network_sockaddr_t *src, const network_sockaddr_t *dst) {
+    tcp_conn_t *c = tcp_alloc();
+    if (c == NULL)
+        return;
+
+    c->local = *dst;
+    c->remote = *src;
+    if (tcp_route(c) != 0) {
+        tcp_put(c);
+        return;
+    }
+
+    c->ws_ok = true;
+    c->sack_ok = true;
+    c->ts_ok = true;
+    tcp_syn_opts(c, &s->opts);
+
+    c->irs = s->seq;
+    c->rcv_nxt = s->seq + 1;
+    c->rcv_adv = c->rcv_nxt;
+    c->iss = tcp_new_iss(c);
+    c->snd_una = c->iss;
+    c->snd_nxt = c->iss;
+    c->snd_max = c->iss;
+    c->snd_wnd = s->wnd;
+    c->snd_wl1 = s->seq;
+    c->state = tcp_state_syn_rcvd;
+    c->rtt_start = tcp_now_ms();
+
+    tcp_get(l);
+    c->listener = l;
+
+    int cli_state;
+    tcp_lock(c, &cli_state);
+    if (!tcp_hash(c)) {
+        //Another core raced us to the same SYN
+        c->listener = NULL;
+        tcp_unlock(c, cli_state);
+        tcp_put(l);
+        tcp_put(c);
+        return;
+    }
+    tcp_send_syn(c);
+    tcp_timer_arm(c, tcp_timer_rexmt, c->rto);
+    tcp_unlock(c, cli_state);
+}
+
+static void tcp_input(interface_def_t *interface, netbuf_t *nb, tcp_t *tcp, int tcp_len, const network_sockaddr_t *src, const network_sockaddr_t *dst) {
+    int hdr_len = tcp->data_off * 4;
+    if (hdr_len < (int)sizeof(tcp_t) || hdr_len > tcp_len)
+        return;
+    //Headers have to be contiguous
+    if ((uint8_t *)tcp + hdr_len > nb->data + nb->len)
+        return;
+
+    tcp_seg_t s;
+    s.nb = nb;
+    s.off = (int)((uint8_t *)tcp - nb->data) + hdr_len;
+    s.seq = TO_LE_FRM_BE_32(tcp->seq);
+    s.ack = TO_LE_FRM_BE_32(tcp->ack);
+    s.len = (uint32_t)(tcp_len - hdr_len);
+    s.wnd = TO_LE_FRM_BE_16(tcp->window);
+    s.flags = tcp->flags;
+    tcp_parse_opts(tcp, hdr_len, &s.opts);
+    stat_rx_segs++;
+
+    tcp_conn_t *c = tcp_lookup(src, dst);
+    if (c == NULL) {
+        stat_rx_no_conn++;
+        if (s.flags & TCP_FLAG_RST)
+            return;
+        if (s.flags & TCP_FLAG_ACK)
+            tcp_send_reset(interface, dst, src, s.ack, 0, false);
+        else
+            tcp_send_reset(interface, dst, src, 0, s.seq + s.len + ((s.flags & TCP_FLAG_SYN) ? 1 : 0) + ((s.flags & TCP_FLAG_FIN) ? 1 : 0), true);
+        return;
+    }
+
+    int cli_state;
+    tcp_lock(c, &cli_state);
+
+    if (c->state == tcp_state_listen) {
+        bool syn = (s.flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST)) == TCP_FLAG_SYN;
+        bool room = c->accept_cnt < c->backlog;
+        tcp_unlock(c, cli_state);
+
+        if (syn && room)
+            tcp_listen_syn(c, &s, src, dst);
+        else if ((s.flags & TCP_FLAG_ACK) && !(s.flags & TCP_FLAG_RST))
+            tcp_send_reset(interface, dst, src, s.ack, 0, false);
+        tcp_put(c);
+        return;
+    }
+
+    if (c->state == tcp_state_syn_sent) {
+        tcp_syn_sent(c, &s);
+        tcp_output(c);
+        tcp_unlock(c, cli_state);
+        tcp_put(c);
+        return;
+    }
+    if (c->state == tcp_state_closed)
+        goto done;
+
+    //PAWS (RFC 7323), an old timestamp means an old duplicate
+    if (c->ts_ok && s.opts.has_ts && !(s.flags & TCP_FLAG_RST) && TCP_SEQ_LT(s.opts.ts_val, c->ts_recent)) {
+        tcp_send_ack(c);
+        goto done;
+    }
+
+    //Acceptability against the window we advertised
+    uint32_t wnd = TCP_SEQ_GT(c->rcv_adv, c->rcv_nxt) ? c->rcv_adv - c->rcv_nxt : 0;
+    bool acceptable;
+    if (s.len == 0)
+        acceptable = (wnd == 0) ? s.seq == c->rcv_nxt : TCP_SEQ_GEQ(s.seq, c->rcv_nxt) && TCP_SEQ_LT(s.seq, c->rcv_nxt + wnd);
+    else
+        acceptable = wnd > 0 && TCP_SEQ_LT(s.seq, c->rcv_nxt + wnd) && TCP_SEQ_GT(s.seq + s.len, c->rcv_nxt);
+    if (!acceptable) {
+        //Duplicates and data beyond a closed window may still acknowledge something new
+        if (!(s.flags & TCP_FLAG_RST)) {
+            if ((s.flags & TCP_FLAG_ACK) && c->state != tcp_state_syn_rcvd && TCP_SEQ_GT(s.ack, c->snd_una)) {
+                s.len = 0;
+                s.flags &= (uint8_t)~(TCP_FLAG_SYN | TCP_FLAG_FIN);
+                tcp_ack(c, &s);
+            }
+            if (c->state != tcp_state_closed) {
+                tcp_send_ack(c);
+                tcp_output(c);
+            }
+        }
+        goto done;
+    }
+
+    //Trim what we already have from the front, and what doesn't fit the window from the back
+    if (TCP_SEQ_LT(s.seq, c->rcv_nxt)) {
+        uint32_t d = c->rcv_nxt - s.seq;
+        if (s.flags & TCP_FLAG_SYN) {
+            s.flags &= (uint8_t)~TCP_FLAG_SYN;
+            d--;
+            s.seq++;
+        }
+        d = MIN(d, s.len);
+        s.off += d;
+        s.len -= d;
+        s.seq += d;
+    }
+    if (TCP_SEQ_GT(s.seq + s.len, c->rcv_nxt + wnd)) {
+        s.len = c->rcv_nxt + wnd - s.seq;
+        s.flags &= (uint8_t)~TCP_FLAG_FIN;
+    }
+
+    if (c->ts_ok && s.opts.has_ts && TCP_SEQ_LEQ(s.seq, c->rcv_nxt))
+        c->ts_recent = s.opts.ts_val;
+
+    if (s.flags & TCP_FLAG_RST) {
+        //Only an exact match tears the connection down, anything else in the window gets a challenge ACK (RFC 5961)
+        if (s.seq == c->rcv_nxt)
+            tcp_drop(c, -1);
+        else
+            tcp_send_ack(c);
+        goto done;
+    }
+
+    if (s.flags & TCP_FLAG_SYN) {
+        tcp_send_ack(c);
+        goto done;
+    }
+
+    if (!(s.flags & TCP_FLAG_ACK))
+        goto done;
+
+    if (c->state == tcp_state_syn_rcvd) {
+        if (TCP_SEQ_LEQ(s.ack, c->snd_una) || TCP_SEQ_GT(s.ack, c->snd_max)) {
+            tcp_send_reset(c->interface, &c->local, &c->remote, s.ack, 0, false);
+            goto done;
+        }
+        c->state = tcp_state_established;
+        c->snd_wnd = s.wnd << c->snd_wscale;
+        c->snd_wl1 = s.seq;
+        c->snd_wl2 = s.ack;
+        c->wakeup = true;
+        tcp_accept_ready(c);
+        if (c->state == tcp_state_closed)
+            goto done;
+    }
+
+    if (!tcp_ack(c, &s)) {
+        if (c->ack_now && c->state != tcp_state_closed)
+            tcp_send_ack(c);
+        goto done;
+    }
+
+    tcp_data(c, &s);
+    tcp_output(c);
+
+done:
+    tcp_unlock(c, cli_state);
+    tcp_put(c);
+}
+
+//The segment's length according to the IP header, payloads can be padded
+static int tcp_len_ipv4(ipv4_t *packet, int len) {
+    int total = TO_LE_FRM_BE_16(packet->total_len) - packet->ihl * 4;
+    return MIN(total, len);
+}
+
+int tcp_ipv4_rx(interface_def_t *interface, netbuf_t *nb, ipv4_t *packet, int len) {
+    tcp_t *tcp = (tcp_t *)packet->body;
+    len = tcp_len_ipv4(packet, len);
+    if (len < (int)sizeof(tcp_t))
+        return -1;
+
+    if (!(nb->flags & NETBUF_F_CSUM_VALID)) {
+        uint64_t sum = network_csum_pseudo4(packet->src_ip, packet->dst_ip, IP_PROTOCOL_TCP, len);
+        if (network_csum_fold(network_csum_netbuf(nb, (int)((uint8_t *)tcp - nb->data), len, sum)) != 0) {
+            stat_rx_csum_errors++;
+            return -1;
+        }
+    }
+
+    network_sockaddr_t src, dst;
+    neigh_addr4(packet->src_ip, src.addr);
+    src.port = TO_LE_FRM_BE_16(tcp->src_port);
+    neigh_addr4(packet->dst_ip, dst.addr);
+    dst.port = TO_LE_FRM_BE_16(tcp->dst_port);
+
+    tcp_input(interface, nb, tcp, len, &src, &dst);
+    return 0;
+}
+
+int tcp_ipv6_rx(interface_def_t *interface, netbuf_t *nb, ipv6_t *packet, int len) {
+    tcp_t *tcp = (tcp_t *)packet->body;
+    len = MIN(TO_LE_FRM_BE_16(packet->payload_len), len);
+    if (len < (int)sizeof(tcp_t))
+        return -1;
+
+    if (!(nb->flags & NETBUF_F_CSUM_VALID)) {
+        uint64_t sum = network_csum_pseudo6(packet->src_ip, packet->dst_ip, IP_PROTOCOL_TCP, len);
+        if (network_csum_fold(network_csum_netbuf(nb, (int)((uint8_t *)tcp - nb->data), len, sum)) != 0) {
+            stat_rx_csum_errors++;
+            return -1;
+        }
+    }
+
+    network_sockaddr_t src, dst;
+    memcpy(src.addr, packet->src_ip, 16);
+    src.port = TO_LE_FRM_BE_16(tcp->src_port);
+    memcpy(dst.addr, packet->dst_ip, 16);
+    dst.port = TO_LE_FRM_BE_16(tcp->dst_port);
+
+    tcp_input(interface, nb, tcp, len, &src, &dst);
+    return 0;
+}
+
+PRIVATE void tcp_timer_fire(tcp_conn_t *c, tcp_timer_kind_t kind) {
+    int cli_state;
+    tcp_lock(c, &cli_state);
+    if (!tcp_timer_claim(c, kind) || c->state == tcp_state_closed) {
+        tcp_unlock(c, cli_state);
+        return;
+    }
+
+    if (kind == tcp_timer_delack) {
+        if (c->ack_pending > 0 || c->ack_now)
+            tcp_send_ack(c);
+    } else if (kind == tcp_timer_timewait) {
+        tcp_drop(c, 0);
+    } else if (c->state == tcp_state_syn_sent || c->state == tcp_state_syn_rcvd) {
+        if (++c->retries > TCP_SYN_RETRIES)
+            tcp_drop(c, -1);
+        else {
+            c->backoff++;
+            tcp_send_syn(c);
+            tcp_timer_arm(c, tcp_timer_rexmt, tcp_backoff_rto(c));
+        }
+    } else if (c->snd_una == c->snd_max) {
+        //Zero window probe, a byte past the closed window makes the peer repeat its window
+        if (c->snd_wnd == 0 && c->sndq_bytes > 0) {
+            c->snd_wnd = 1;
+            tcp_output(c);
+            c->backoff = MIN(c->backoff + 1, 16);
+            tcp_timer_arm(c, tcp_timer_rexmt, tcp_backoff_rto(c));
+        }
+    } else if (c->snd_wnd != 0 && ++c->retries > TCP_RETRIES) {
+        tcp_send_rst(c);
+        tcp_drop(c, -1);
+    } else {
+        //Everything in flight is presumed lost, go back to snd_una with a single segment window
+        c->stat_timeouts++;
+        c->ssthresh = c->cc->ssthresh(c, tcp_now_ms());
+        c->cwnd = c->mss;
+        c->in_recovery = false;
+        c->dupacks = 0;
+        c->sacked_cnt = 0;
+        c->rtt_seq = 0;
+        c->backoff = MIN(c->backoff + 1, 16);
+
+        //tcp_output picks up from the end of the retransmitted segment as the window reopens
+        c->rexmit_nxt = c->snd_una;
+        tcp_retransmit(c, c->snd_una);
+        c->snd_nxt = c->rexmit_nxt;
+        tcp_timer_arm(c, tcp_timer_rexmt, tcp_backoff_rto(c));
+    }
+    tcp_unlock(c, cli_state);
+}
+
+//Sleep until the connection's state changes past ev, the value read before checking it
+static void tcp_wait(tcp_conn_t *c, uint32_t ev) {
+    task_wait((uint32_t *)&c->event, ev);
+}
+
+tcp_conn_t *tcp_listen(network_sockaddr_t *local, int backlog) {
+    tcp_conn_t *c = tcp_alloc();
+    if (c == NULL)
+        return NULL;
+
+    int cli_state = cli();
+    local_spinlock_lock(&bind_lock);
+    if (local->port == 0) {
+        uint32_t start = __atomic_fetch_add(&ephemeral_cursor, 1, __ATOMIC_RELAXED);
+        for (uint32_t i = 0; i < TCP_EPHEMERAL_CNT; i++) {
+            uint16_t port = (uint16_t)(TCP_EPHEMERAL_FIRST + (start + i) % TCP_EPHEMERAL_CNT);
+            if (!tcp_port_listening(port, local->addr)) {
+                local->port = port;
+                break;
+            }
+        }
+    }
+    bool ok = local->port != 0 && !tcp_port_listening(local->port, local->addr);
+    if (ok) {
+        c->local = *local;
+        c->state = tcp_state_listen;
+        c->backlog = MAX(backlog, 1);
+
+        tcp_bucket_t *b = &listen_table[tcp_port_hash(local->port)];
+        local_spinlock_lock(&b->lock);
+        tcp_get(c);
+        c->hash_next = b->head;
+        b->head = c;
+        c->hashed = true;
+        local_spinlock_unlock(&b->lock);
+    }
+    local_spinlock_unlock(&bind_lock);
+    sti(cli_state);
+
+    if (!ok) {
+        tcp_put(c);
+        return NULL;
+    }
+    return c;
+}
+
+tcp_conn_t *tcp_accept(tcp_conn_t *l, bool wait) {
+    while (true) {
+        uint32_t ev = __atomic_load_n(&l->event, __ATOMIC_SEQ_CST);
+
+        int cli_state;
+        tcp_lock(l, &cli_state);
+        tcp_conn_t *c = l->accept_head;
+        if (c != NULL) {
+            l->accept_head = c->accept_next;
+            if (l->accept_head == NULL)
+                l->accept_tail = NULL;
+            c->accept_next = NULL;
+            l->accept_cnt--;
+        }
+        bool listening = l->state == tcp_state_listen;
+        tcp_unlock(l, cli_state);
+
+        if (c != NULL || !wait || !listening)
+            return c;
+        tcp_wait(l, ev);
+    }
+}
+
+//Pick an ephemeral port nobody uses towards this remote, the connection gets hashed with it
+static bool tcp_bind_ephemeral(tcp_conn_t *c) {
+    int cli_state = cli();
+    local_spinlock_lock(&bind_lock);
+    uint32_t start = __atomic_fetch_add(&ephemeral_cursor, 1, __ATOMIC_RELAXED);
+    bool ok = false;
+    for (uint32_t i = 0; i < TCP_EPHEMERAL_CNT && !ok; i++) {
+        c->local.port = (uint16_t)(TCP_EPHEMERAL_FIRST + (start + i) % TCP_EPHEMERAL_CNT);
+        ok = !tcp_port_listening(c->local.port, c->local.addr) && tcp_hash(c);
+    }
+    local_spinlock_unlock(&bind_lock);
+    sti(cli_state);
+    return ok;
+}
+
+tcp_conn_t *tcp_connect(const network_sockaddr_t *remote) {
+    if (remote->port == 0 || tcp_addr_any(remote->addr))
+        return NULL;
+
+    tcp_conn_t *c = tcp_alloc();
+    if (c == NULL)
+        return NULL;
+    c->remote = *remote;
+    if (tcp_route(c) != 0 || !tcp_bind_ephemeral(c)) {
+        tcp_put(c);
+        return NULL;
+    }
+
+    int cli_state;
+    tcp_lock(c, &cli_state);
+    c->ws_ok = true;
+    c->sack_ok = true;
+    c->ts_ok = true;
+    c->iss = tcp_new_iss(c);
+    c->snd_una = c->iss;
+    c->snd_nxt = c->iss;
+    c->snd_max = c->iss;
+    c->state = tcp_state_syn_sent;
+    c->rtt_start = tcp_now_ms();
+    tcp_send_syn(c);
+    tcp_timer_arm(c, tcp_timer_rexmt, c->rto);
+    tcp_unlock(c, cli_state);
+
+    while (true) {
+        uint32_t ev = __atomic_load_n(&c->event, __ATOMIC_SEQ_CST);
+        tcp_lock(c, &cli_state);
+        tcp_state_t state = c->state;
+        tcp_unlock(c, cli_state);
+
+        if (state == tcp_state_closed) {
+            tcp_close(c);
+            return NULL;
+        }
+        if (state != tcp_state_syn_sent && state != tcp_state_syn_rcvd)
+            return c;
+        tcp_wait(c, ev);
+    }
+}
+
+static inline bool tcp_can_send(tcp_conn_t *c) {
+    return (c->state == tcp_state_established || c->state == tcp_state_close_wait) && !c->fin_queued;
+}
+
+int tcp_send(tcp_conn_t *c, const void *data, int len, int flags) {
+    const uint8_t *src = (const uint8_t *)data;
+    int sent = 0;
+    while (sent < len) {
+        uint32_t ev = __atomic_load_n(&c->event, __ATOMIC_SEQ_CST);
+
+        int cli_state;
+        tcp_lock(c, &cli_state);
+        if (!tcp_can_send(c)) {
+            tcp_unlock(c, cli_state);
+            return sent > 0 ? sent : -1;
+        }
+
+        while (sent < len && c->sndq_bytes < TCP_SNDBUF) {
+            //Top up the tail if we allocated it, clones of it in flight only cover what's already there
+            netbuf_t *tail = c->sndq_tail;
+            if (tail == NULL || tail->parent != NULL || netbuf_tailroom(tail) == 0) {
+                tail = netbuf_alloc();
+                if (tail == NULL)
+                    break;
+                if (c->sndq_tail != NULL)
+                    c->sndq_tail->q_next = tail;
+                else
+                    c->sndq_head = tail;
+                c->sndq_tail = tail;
+            }
+
+            int n = MIN(MIN(len - sent, netbuf_tailroom(tail)), (int)(TCP_SNDBUF - c->sndq_bytes));
+            memcpy(netbuf_put(tail, n), src + sent, n);
+            tail->tot_len = tail->len;
+            c->sndq_bytes += n;
+            sent += n;
+        }
+
+        c->more = (flags & TCP_SEND_MORE) != 0 || sent < len;
+        tcp_output(c);
+        tcp_unlock(c, cli_state);
+
+        if (sent < len)
+            tcp_wait(c, ev);
+    }
+    return sent;
+}
+
+int tcp_send_netbuf(tcp_conn_t *c, netbuf_t *nb, int flags) {
+    int len = 0;
+    int cli_state;
+    while (true) {
+        uint32_t ev = __atomic_load_n(&c->event, __ATOMIC_SEQ_CST);
+
+        tcp_lock(c, &cli_state);
+        if (!tcp_can_send(c)) {
+            tcp_unlock(c, cli_state);
+            netbuf_free(nb);
+            return -1;
+        }
+        if (c->sndq_bytes < TCP_SNDBUF)
+            break;
+        tcp_unlock(c, cli_state);
+        tcp_wait(c, ev);
+    }
+
+    //Queue a clone of every segment, the caller's chain may still be referenced elsewhere
+    for (netbuf_t *seg = nb; seg != NULL; seg = seg->next) {
+        if (seg->len == 0)
+            continue;
+        netbuf_t *clone = netbuf_clone(seg, 0, seg->len);
+        if (clone == NULL)
+            break;
+        if (c->sndq_tail != NULL)
+            c->sndq_tail->q_next = clone;
+        else
+            c->sndq_head = clone;
+        c->sndq_tail = clone;
+        c->sndq_bytes += seg->len;
+        len += seg->len;
+    }
+    c->more = (flags & TCP_SEND_MORE) != 0;
+    tcp_output(c);
+    tcp_unlock(c, cli_state);
+
+    netbuf_free(nb);
+    return len;
+}
+
+int tcp_recv(tcp_conn_t *c, void *data, int len, bool wait) {
+    uint8_t *dst = (uint8_t *)data;
+    while (true) {
+        uint32_t ev = __atomic_load_n(&c->event, __ATOMIC_SEQ_CST);
+
+        int cli_state;
+        tcp_lock(c, &cli_state);
+        if (c->rcvq_bytes > 0) {
+            int copied = 0;
+            while (copied < len && c->rcvq_head != NULL) {
+                netbuf_t *nb = c->rcvq_head;
+                int n = MIN(len - copied, nb->len - c->rcvq_off);
+                memcpy(dst + copied, nb->data + c->rcvq_off, n);
+                copied += n;
+                c->rcvq_off += n;
+                if (c->rcvq_off == nb->len) {
+                    c->rcvq_head = nb->q_next;
+                    if (c->rcvq_head == NULL)
+                        c->rcvq_tail = NULL;
+                    c->rcvq_off = 0;
+                    nb->q_next = NULL;
+                    netbuf_free(nb);
+                }
+            }
+            c->rcvq_bytes -= copied;
+
+            //Let the peer know once the window opened by a useful amount
+            uint32_t adv = TCP_SEQ_GT(c->rcv_adv, c->rcv_nxt) ? c->rcv_adv - c->rcv_nxt : 0;
+            uint32_t wnd = tcp_rcv_window(c);
+            if (c->state != tcp_state_closed && c->state != tcp_state_syn_rcvd && c->state != tcp_state_syn_sent &&
+                !c->fin_rcvd && wnd >= adv + MIN(2u * c->mss, TCP_RCVBUF / 2))
+                tcp_send_ack(c);
+            tcp_unlock(c, cli_state);
+            return copied;
+        }
+
+        bool eof = c->fin_rcvd;
+        bool closed = c->state == tcp_state_closed;
+        tcp_unlock(c, cli_state);
+
+        if (eof)
+            return 0;
+        if (closed || !wait)
+            return -1;
+        tcp_wait(c, ev);
+    }
+}
+
+int tcp_setopt(tcp_conn_t *c, tcp_opt_t opt, int val) {
+    int cli_state;
+    tcp_lock(c, &cli_state);
+    int ret = 0;
+    if (opt == tcp_opt_nodelay)
+        c->nodelay = val != 0;
+    else if (opt == tcp_opt_cork)
+        c->cork = val != 0;
+    else
+        ret = -1;
+    //Uncorking or turning off Nagle may release a held back segment
+    if (ret == 0 && c->state >= tcp_state_established)
+        tcp_output(c);
+    tcp_unlock(c, cli_state);
+    return ret;
+}
+
+int tcp_setcc(tcp_conn_t *c, const char *name) {
+    const tcp_cc_ops_t *cc = tcp_cc_find(name);
+    if (cc == NULL)
+        return -1;
+
+    int cli_state;
+    tcp_lock(c, &cli_state);
+    c->cc = cc;
+    cc->init(c);
+    tcp_unlock(c, cli_state);
+    return 0;
+}
+
+//Caller holds the lock
+static void tcp_queue_fin(tcp_conn_t *c) {
+    if (c->fin_queued)
+        return;
+    if (c->state == tcp_state_established)
+        c->state = tcp_state_fin_wait1;
+    else if (c->state == tcp_state_close_wait)
+        c->state = tcp_state_last_ack;
+    else
+        return;
+    c->fin_queued = true;
+    c->more = false;
+    c->cork = false;
+    tcp_output(c);
+}
+
+int tcp_shutdown(tcp_conn_t *c) {
+    int cli_state;
+    tcp_lock(c, &cli_state);
+    tcp_queue_fin(c);
+    int ret = c->fin_queued ? 0 : -1;
+    tcp_unlock(c, cli_state);
+    return ret;
+}
+
+//Reset and drop a connection nobody will ever read from
+static void tcp_abort(tcp_conn_t *c) {
+    int cli_state;
+    tcp_lock(c, &cli_state);
+    if (c->state != tcp_state_closed) {
+        if (c->state != tcp_state_syn_sent)
+            tcp_send_rst(c);
+        tcp_drop(c, -1);
+    }
+    tcp_unlock(c, cli_state);
+}
+
+void tcp_close(tcp_conn_t *c) {
+    int cli_state;
+    tcp_lock(c, &cli_state);
+    c->user_closed = true;
+
+    if (c->state == tcp_state_listen) {
+        tcp_conn_t *pending = c->accept_head;
+        c->accept_head = NULL;
+        c->accept_tail = NULL;
+        c->accept_cnt = 0;
+        tcp_unhash(c);
+        c->state = tcp_state_closed;
+        c->wakeup = true;
+        tcp_unlock(c, cli_state);
+
+        //Established children nobody accepted, ours to release
+        while (pending != NULL) {
+            tcp_conn_t *child = pending;
+            pending = child->accept_next;
+            tcp_abort(child);
+            tcp_put(child);
+        }
+        tcp_put(c);
+        return;
+    }
+
+    if (c->rcvq_bytes > 0 || c->state == tcp_state_syn_sent || c->state == tcp_state_syn_rcvd) {
+        //Unread data is lost, the peer has to know (RFC 2525)
+        tcp_unlock(c, cli_state);
+        tcp_abort(c);
+    } else {
+        tcp_queue_fin(c);
+        tcp_unlock(c, cli_state);
+    }
+
+    //The stack keeps its own reference until the close handshake finishes
+    tcp_put(c);
+}
+
+static const char *tcp_state_names[] = {
+    "closed", "listen", "syn_sent", "syn_rcvd", "established", "fin_wait1",
+    "fin_wait2", "close_wait", "closing", "last_ack", "time_wait",
+};
+
+//Per connection state and counters
+int tcp_stats() {
+    char tmp[20];
+    DEBUG_PRINT("[CoreNetwork] TCP segments: ");
+    DEBUG_PRINT(ltoa(stat_rx_segs, tmp, 10));
+    DEBUG_PRINT(" bad checksum: ");
+    DEBUG_PRINT(ltoa(stat_rx_csum_errors, tmp, 10));
+    DEBUG_PRINT(" no connection: ");
+    DEBUG_PRINT(ltoa(stat_rx_no_conn, tmp, 10));
+    DEBUG_PRINT("\r\n");
+
+    for (int i = 0; i < TCP_CONN_BUCKETS; i++) {
+        int cli_state;
+        tcp_bucket_lock(&conn_table[i], &cli_state);
+        for (tcp_conn_t *c = conn_table[i].head; c != NULL; c = c->hash_next) {
+            DEBUG_PRINT("[CoreNetwork] TCP ");
+            DEBUG_PRINT(itoa(c->local.port, tmp, 10));
+            DEBUG_PRINT(" -> ");
+            DEBUG_PRINT(itoa(c->remote.port, tmp, 10));
+            DEBUG_PRINT(" ");
+            DEBUG_PRINT(tcp_state_names[c->state]);
+            DEBUG_PRINT(" cc: ");
+            DEBUG_PRINT(c->cc->name);
+            DEBUG_PRINT(" cwnd: ");
+            DEBUG_PRINT(ltoa(c->cwnd, tmp, 10));
+            DEBUG_PRINT(" ssthresh: ");
+            DEBUG_PRINT(ltoa(c->ssthresh, tmp, 10));
+            DEBUG_PRINT(" srtt ms: ");
+            DEBUG_PRINT(ltoa(c->srtt >> 3, tmp, 10));
+            DEBUG_PRINT(" rto: ");
+            DEBUG_PRINT(ltoa(c->rto, tmp, 10));
+            DEBUG_PRINT(" retrans: ");
+            DEBUG_PRINT(ltoa(c->stat_retrans, tmp, 10));
+            DEBUG_PRINT(" fast: ");
+            DEBUG_PRINT(ltoa(c->stat_fast_retrans, tmp, 10));
+            DEBUG_PRINT(" timeouts: ");
+            DEBUG_PRINT(ltoa(c->stat_timeouts, tmp, 10));
+            DEBUG_PRINT("\r\n");
+        }
+        tcp_bucket_unlock(&conn_table[i], cli_state);
+    }
+    return 0;
+}
+
+PRIVATE int tcp_init(void) {
+    memset(conn_table, 0, sizeof(conn_table));
+    memset(listen_table, 0, sizeof(listen_table));
+    tcp_cc_init();
+    return tcp_timer_init();
+}
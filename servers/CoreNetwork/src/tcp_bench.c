@@ -0,0 +1,225 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SysTimer/timer.h"
+#include "SysTaskMgr/task.h"
+
+#include "CoreNetwork/socket.h"
+#include "neigh.h"
+
+// TCP throughput and latency over 127.0.0.1, tcp_bench.
+// The bulk run streams TCP_BENCH_BULK_BYTES from a client to a server task that only reads, once
+// with each congestion control. The request/response run bounces small messages off an echo task
+// with Nagle off and reports round trip percentiles. tcp_stats afterwards shows what the
+// connections went through.
+
+#define TCP_BENCH_PORT (7778)
+#define TCP_BENCH_BULK_BYTES (256ull * 1024 * 1024)
+#define TCP_BENCH_CHUNK KiB(64)
+#define TCP_BENCH_RR_CNT (20000)
+#define TCP_BENCH_RR_SIZE (64)
+
+typedef struct {
+    tcp_conn_t *listener;
+    bool echo;
+    uint64_t bytes;
+    _Atomic uint32_t done;
+} tcp_bench_srv_t;
+
+static void tcp_bench_srv_task(void *arg) {
+    tcp_bench_srv_t *srv = (tcp_bench_srv_t *)arg;
+    uint8_t *buf = malloc(TCP_BENCH_CHUNK);
+
+    tcp_conn_t *c = (buf != NULL) ? tcp_accept(srv->listener, true) : NULL;
+    if (c != NULL) {
+        if (srv->echo)
+            tcp_setopt(c, tcp_opt_nodelay, 1);
+
+        int n;
+        while ((n = tcp_recv(c, buf, TCP_BENCH_CHUNK, true)) > 0) {
+            srv->bytes += n;
+            if (srv->echo && tcp_send(c, buf, n, 0) != n)
+                break;
+        }
+        tcp_close(c);
+    }
+    free(buf);
+
+    __atomic_store_n(&srv->done, 1, __ATOMIC_SEQ_CST);
+    task_wake((uint32_t *)&srv->done, 1);
+    while (true) {
+        task_sleep(task_current(), 1000 * 1000 * 1000ull);
+        task_yield();
+    }
+}
+
+static void tcp_bench_sift(uint32_t *v, int root, int cnt) {
+    while (2 * root + 1 < cnt) {
+        int child = 2 * root + 1;
+        if (child + 1 < cnt && v[child + 1] > v[child])
+            child++;
+        if (v[root] >= v[child])
+            return;
+        uint32_t t = v[root];
+        v[root] = v[child];
+        v[child] = t;
+        root = child;
+    }
+}
+
+static void tcp_bench_sort(uint32_t *v, int cnt) {
+    for (int i = cnt / 2 - 1; i >= 0; i--)
+        tcp_bench_sift(v, i, cnt);
+    for (int i = cnt - 1; i > 0; i--) {
+        uint32_t t = v[0];
+        v[0] = v[i];
+        v[i] = t;
+        tcp_bench_sift(v, 0, i);
+    }
+}
+
+static void tcp_bench_print(const char *what, uint64_t val) {
+    char tmp[20];
+    DEBUG_PRINT(what);
+    DEBUG_PRINT(ltoa(val, tmp, 10));
+}
+
+//Listen on the bench port and start a server task for one connection
+static tcp_conn_t *tcp_bench_serve(tcp_bench_srv_t *srv, bool echo, cs_id *id) {
+    network_sockaddr_t addr;
+    neigh_addr4(TO_BE_FRM_LE_32(0x7F000001), addr.addr);
+    addr.port = TCP_BENCH_PORT;
+
+    srv->listener = tcp_listen(&addr, 1);
+    srv->echo = echo;
+    srv->bytes = 0;
+    srv->done = 0;
+    if (srv->listener == NULL)
+        return NULL;
+
+    if (create_task_kernel("tcp_bench_srv", task_permissions_kernel, id) != CS_OK ||
+        start_task_kernel(*id, tcp_bench_srv_task, srv) != CS_OK) {
+        tcp_close(srv->listener);
+        return NULL;
+    }
+
+    tcp_conn_t *c = tcp_connect(&addr);
+    if (c == NULL) {
+        //Closing the listener lets the server task's accept give up
+        tcp_close(srv->listener);
+        while (__atomic_load_n(&srv->done, __ATOMIC_SEQ_CST) == 0)
+            task_wait((uint32_t *)&srv->done, 0);
+        end_task_kernel(*id);
+    }
+    return c;
+}
+
+static void tcp_bench_finish(tcp_bench_srv_t *srv, cs_id id) {
+    while (__atomic_load_n(&srv->done, __ATOMIC_SEQ_CST) == 0)
+        task_wait((uint32_t *)&srv->done, 0);
+    end_task_kernel(id);
+    tcp_close(srv->listener);
+}
+
+static int tcp_bench_bulk(const char *cc, uint8_t *buf) {
+    tcp_bench_srv_t srv;
+    cs_id id = 0;
+    tcp_conn_t *c = tcp_bench_serve(&srv, false, &id);
+    if (c == NULL)
+        return -1;
+    tcp_setcc(c, cc);
+
+    uint64_t start = timer_timestamp_ns();
+    uint64_t sent = 0;
+    while (sent < TCP_BENCH_BULK_BYTES) {
+        int n = tcp_send(c, buf, TCP_BENCH_CHUNK, 0);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    tcp_close(c);
+    tcp_bench_finish(&srv, id);
+    uint64_t ns = timer_timestamp_ns() - start;
+
+    DEBUG_PRINT("[CoreNetwork] TCP loopback bulk cc=");
+    DEBUG_PRINT(cc);
+    tcp_bench_print(" bytes=", srv.bytes);
+    tcp_bench_print(" Mbit/s=", ns == 0 ? 0 : (srv.bytes * 8000) / ns);
+    DEBUG_PRINT("\r\n");
+    return srv.bytes == TCP_BENCH_BULK_BYTES ? 0 : -1;
+}
+
+static int tcp_bench_rr(uint8_t *buf, uint32_t *latencies) {
+    tcp_bench_srv_t srv;
+    cs_id id = 0;
+    tcp_conn_t *c = tcp_bench_serve(&srv, true, &id);
+    if (c == NULL)
+        return -1;
+    tcp_setopt(c, tcp_opt_nodelay, 1);
+
+    int done = 0;
+    uint64_t start = timer_timestamp_ns();
+    for (; done < TCP_BENCH_RR_CNT; done++) {
+        uint64_t t0 = timer_timestamp_ns();
+        if (tcp_send(c, buf, TCP_BENCH_RR_SIZE, 0) != TCP_BENCH_RR_SIZE)
+            break;
+
+        int got = 0;
+        while (got < TCP_BENCH_RR_SIZE) {
+            int n = tcp_recv(c, buf + got, TCP_BENCH_RR_SIZE - got, true);
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        if (got < TCP_BENCH_RR_SIZE)
+            break;
+        latencies[done] = (uint32_t)MIN(timer_timestamp_ns() - t0, 0xffffffffull);
+    }
+    uint64_t ns = timer_timestamp_ns() - start;
+    tcp_close(c);
+    tcp_bench_finish(&srv, id);
+
+    if (done == 0)
+        return -1;
+    tcp_bench_sort(latencies, done);
+    tcp_bench_print("[CoreNetwork] TCP loopback request/response size=", TCP_BENCH_RR_SIZE);
+    tcp_bench_print(" transactions/s=", ns == 0 ? 0 : (done * 1000000000ull) / ns);
+    tcp_bench_print(" latency ns p50=", latencies[done / 2]);
+    tcp_bench_print(" p90=", latencies[(done * 90) / 100]);
+    tcp_bench_print(" p99=", latencies[(done * 99) / 100]);
+    tcp_bench_print(" p99.9=", latencies[(done * 999) / 1000]);
+    tcp_bench_print(" max=", latencies[done - 1]);
+    DEBUG_PRINT("\r\n");
+    return done == TCP_BENCH_RR_CNT ? 0 : -1;
+}
+
+int tcp_bench() {
+    uint8_t *buf = malloc(TCP_BENCH_CHUNK);
+    uint32_t *latencies = malloc(sizeof(uint32_t) * TCP_BENCH_RR_CNT);
+    if (buf == NULL || latencies == NULL) {
+        free(buf);
+        free(latencies);
+        return -1;
+    }
+    memset(buf, 0xA5, TCP_BENCH_CHUNK);
+
+    int ret = 0;
+    if (tcp_bench_bulk("cubic", buf) != 0)
+        ret = -1;
+    if (tcp_bench_bulk("newreno", buf) != 0)
+        ret = -1;
+    if (tcp_bench_rr(buf, latencies) != 0)
+        ret = -1;
+
+    free(buf);
+    free(latencies);
+    return ret;
+}
@@ -0,0 +1,196 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcp.h"
+
+// TCP congestion control.
+// Algorithms register a tcp_cc_ops_t and are picked per connection by name, the first one
+// registered is the default. Loss recovery itself lives in tcp.c, the algorithms only decide
+// how cwnd grows and where ssthresh lands after a loss.
+
+static tcp_cc_ops_t *cc_list = NULL;
+static tcp_cc_ops_t *cc_default = NULL;
+
+PRIVATE void tcp_cc_register(tcp_cc_ops_t *ops) {
+    ops->next = cc_list;
+    cc_list = ops;
+    if (cc_default == NULL)
+        cc_default = ops;
+}
+
+PRIVATE const tcp_cc_ops_t *tcp_cc_find(const char *name) {
+    if (name == NULL)
+        return cc_default;
+    for (tcp_cc_ops_t *ops = cc_list; ops != NULL; ops = ops->next)
+        if (strcmp(ops->name, name) == 0)
+            return ops;
+    return NULL;
+}
+
+//Slow start with appropriate byte counting (RFC 3465, L = 2)
+static void tcp_slow_start(tcp_conn_t *c, uint32_t acked) {
+    c->cwnd += MIN(acked, 2u * c->mss);
+}
+
+//NewReno (RFC 5681, RFC 6582)
+
+static void newreno_init(tcp_conn_t *c) {
+    c->cwnd_cnt = 0;
+}
+
+static void newreno_on_ack(tcp_conn_t *c, uint32_t acked, uint64_t now_ms) {
+    now_ms = 0;
+    if (c->cwnd < c->ssthresh) {
+        tcp_slow_start(c, acked);
+        return;
+    }
+
+    //One segment per window acknowledged
+    c->cwnd_cnt += acked;
+    if (c->cwnd_cnt >= c->cwnd) {
+        c->cwnd_cnt -= c->cwnd;
+        c->cwnd += c->mss;
+    }
+}
+
+static uint32_t newreno_ssthresh(tcp_conn_t *c, uint64_t now_ms) {
+    now_ms = 0;
+    uint32_t flight = c->snd_max - c->snd_una;
+    c->cwnd_cnt = 0;
+    return MAX(flight / 2, 2u * c->mss);
+}
+
+static tcp_cc_ops_t newreno_ops = {
+    .name = "newreno",
+    .init = newreno_init,
+    .on_ack = newreno_on_ack,
+    .ssthresh = newreno_ssthresh,
+    .next = NULL,
+};
+
+//CUBIC (RFC 8312), C = 0.4 and beta = 0.7. Windows are in segments scaled by 1024, times in ms.
+
+#define CUBIC_SCALE (1024)
+#define CUBIC_BETA (717)            //0.7 * CUBIC_SCALE
+#define CUBIC_FRIENDLY (542)        //3 * (1 - beta) / (1 + beta) * CUBIC_SCALE
+#define CUBIC_MAX_DELTA_MS (100000)
+
+//cc_priv layout
+#define CUBIC_W_MAX (0)             //Window before the last reduction
+#define CUBIC_W_LAST_MAX (1)        //w_max before that, for fast convergence
+#define CUBIC_EPOCH (2)             //Start of the current avoidance epoch, 0 if none
+#define CUBIC_K (3)                 //Time to get back to w_max
+#define CUBIC_W_ORIGIN (4)          //Window at the start of the epoch
+#define CUBIC_ACC (5)               //Fractional growth carried between ACKs, bytes scaled by 1024
+
+static uint64_t cubic_cbrt(uint64_t v) {
+    uint64_t lo = 0;
+    uint64_t hi = 2097152;          //2^21, cubes to 2^63
+    while (lo < hi) {
+        uint64_t mid = (lo + hi + 1) / 2;
+        if (mid * mid * mid <= v)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+static inline uint64_t cubic_segs(tcp_conn_t *c, uint32_t bytes) {
+    return ((uint64_t)bytes * CUBIC_SCALE) / c->mss;
+}
+
+static void cubic_init(tcp_conn_t *c) {
+    memset(c->cc_priv, 0, sizeof(c->cc_priv));
+    c->cwnd_cnt = 0;
+}
+
+static void cubic_on_ack(tcp_conn_t *c, uint32_t acked, uint64_t now_ms) {
+    uint64_t *p = c->cc_priv;
+    if (c->cwnd < c->ssthresh) {
+        tcp_slow_start(c, acked);
+        return;
+    }
+
+    uint64_t cwnd = cubic_segs(c, c->cwnd);
+    if (p[CUBIC_EPOCH] == 0) {
+        p[CUBIC_EPOCH] = MAX(now_ms, 1);
+        p[CUBIC_W_ORIGIN] = cwnd;
+        if (p[CUBIC_W_MAX] > cwnd) {
+            //K = cbrt((w_max - cwnd) / C), in ms
+            p[CUBIC_K] = cubic_cbrt(((p[CUBIC_W_MAX] - cwnd) * 2500000000ull) / CUBIC_SCALE);
+        } else {
+            p[CUBIC_K] = 0;
+            p[CUBIC_W_MAX] = cwnd;
+        }
+    }
+
+    //Aim for where the curve will be one RTT from now
+    uint64_t rtt = MAX(c->srtt >> 3, 1);
+    uint64_t t = now_ms - p[CUBIC_EPOCH] + rtt;
+    int64_t d = (int64_t)t - (int64_t)p[CUBIC_K];
+    d = MAX(MIN(d, CUBIC_MAX_DELTA_MS), -CUBIC_MAX_DELTA_MS);
+
+    //W(t) = C * (t - K)^3 + w_max
+    int64_t offs = (4 * d * d * d * CUBIC_SCALE) / 10000000000ll;
+    int64_t target = (int64_t)p[CUBIC_W_MAX] + offs;
+    if (target < 0)
+        target = 0;
+
+    //Never grow slower than Reno would have since the epoch started
+    uint64_t w_est = p[CUBIC_W_ORIGIN] + (CUBIC_FRIENDLY * (t - rtt)) / rtt;
+    if ((int64_t)w_est > target)
+        target = (int64_t)w_est;
+
+    //Bytes scaled by 1024 to grow by for this ACK, at most one segment for every two acknowledged
+    uint64_t inc;
+    if ((uint64_t)target > cwnd) {
+        uint64_t gap = MIN((uint64_t)target - cwnd, cwnd);
+        inc = MIN((gap * acked * CUBIC_SCALE) / cwnd, (uint64_t)acked * CUBIC_SCALE / 2);
+    } else
+        inc = ((uint64_t)acked * c->mss * CUBIC_SCALE) / (100 * (uint64_t)c->cwnd);
+
+    p[CUBIC_ACC] += inc;
+    if (p[CUBIC_ACC] >= (uint64_t)c->mss * CUBIC_SCALE) {
+        uint64_t segs = p[CUBIC_ACC] / ((uint64_t)c->mss * CUBIC_SCALE);
+        c->cwnd += (uint32_t)(segs * c->mss);
+        p[CUBIC_ACC] -= segs * c->mss * CUBIC_SCALE;
+    }
+}
+
+static uint32_t cubic_ssthresh(tcp_conn_t *c, uint64_t now_ms) {
+    uint64_t *p = c->cc_priv;
+    uint64_t cwnd = cubic_segs(c, c->cwnd);
+    now_ms = 0;
+
+    //Fast convergence, release bandwidth to newer flows when the window keeps shrinking
+    if (cwnd < p[CUBIC_W_LAST_MAX])
+        p[CUBIC_W_MAX] = cwnd * (CUBIC_SCALE + CUBIC_BETA) / (2 * CUBIC_SCALE);
+    else
+        p[CUBIC_W_MAX] = cwnd;
+    p[CUBIC_W_LAST_MAX] = cwnd;
+    p[CUBIC_EPOCH] = 0;
+    p[CUBIC_ACC] = 0;
+
+    return MAX((uint32_t)(((uint64_t)c->cwnd * CUBIC_BETA) / CUBIC_SCALE), 2u * c->mss);
+}
+
+static tcp_cc_ops_t cubic_ops = {
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .ssthresh = cubic_ssthresh,
+    .next = NULL,
+};
+
+PRIVATE void tcp_cc_init(void) {
+    tcp_cc_register(&cubic_ops);
+    tcp_cc_register(&newreno_ops);
+}
@@ -0,0 +1,542 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcp.h"
+#include "checksum.h"
+#include "neigh.h"
+
+// TCP segment construction.
+// Payload is never copied on the way out: every segment is a header netbuf followed by clones of
+// the send queue, which stays untouched until the data is acknowledged. Checksums are left to the
+// device, or to net_dev when it can't, and interfaces that segment get super-packets.
+
+static _Atomic uint16_t ip_ident = 0;
+
+static inline void tcp_put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline void tcp_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline int tcp_ip_len(bool v4) {
+    return v4 ? (int)sizeof(ipv4_t) : (int)sizeof(ipv6_t);
+}
+
+//MSS we can receive, the MTU less the headers
+PRIVATE uint16_t tcp_our_mss(tcp_conn_t *c) {
+    if (c->interface == NULL)
+        return TCP_LOOP_MSS;
+    return (uint16_t)(1500 - tcp_ip_len(c->v4) - sizeof(tcp_t));
+}
+
+PRIVATE uint32_t tcp_rcv_window(tcp_conn_t *c) {
+    uint32_t space = (c->rcvq_bytes < TCP_RCVBUF) ? TCP_RCVBUF - c->rcvq_bytes : 0;
+
+    //Advertising a few bytes at a time only invites tiny segments (receiver side SWS avoidance)
+    if (space < MIN(TCP_RCVBUF / 4, (uint32_t)c->mss))
+        space = 0;
+
+    //Never take back what was already offered
+    if (TCP_SEQ_GT(c->rcv_adv, c->rcv_nxt + space))
+        space = c->rcv_adv - c->rcv_nxt;
+    return MIN(space, (uint32_t)0xffff << c->rcv_wscale);
+}
+
+//SACK blocks for our out of order queue, the most recently changed one first (RFC 2018)
+static int tcp_sack_blocks(tcp_conn_t *c, uint32_t blocks[][2], int max) {
+    int cnt = 0;
+    for (tcp_ooo_t *o = c->ooo; o != NULL; o = o->next)
+        if (TCP_SEQ_LEQ(o->seq, c->last_ooo_seq) && TCP_SEQ_LT(c->last_ooo_seq, o->end)) {
+            blocks[cnt][0] = o->seq;
+            blocks[cnt][1] = o->end;
+            cnt++;
+            break;
+        }
+    for (tcp_ooo_t *o = c->ooo; o != NULL && cnt < max; o = o->next) {
+        if (cnt > 0 && blocks[0][0] == o->seq)
+            continue;
+        blocks[cnt][0] = o->seq;
+        blocks[cnt][1] = o->end;
+        cnt++;
+    }
+    return cnt;
+}
+
+static int tcp_build_opts(tcp_conn_t *c, uint8_t flags, bool data, uint8_t *p) {
+    int n = 0;
+    uint32_t now = (uint32_t)tcp_now_ms();
+
+    if (flags & TCP_FLAG_SYN) {
+        p[n++] = TCP_OPT_MSS;
+        p[n++] = 4;
+        tcp_put16(&p[n], tcp_our_mss(c));
+        n += 2;
+
+        if (c->sack_ok) {
+            p[n++] = TCP_OPT_SACK_PERM;
+            p[n++] = 2;
+        } else if (c->ts_ok) {
+            p[n++] = TCP_OPT_NOP;
+            p[n++] = TCP_OPT_NOP;
+        }
+        if (c->ts_ok) {
+            p[n++] = TCP_OPT_TIMESTAMP;
+            p[n++] = 10;
+            tcp_put32(&p[n], now);
+            tcp_put32(&p[n + 4], c->ts_recent);
+            n += 8;
+        }
+        if (c->ws_ok) {
+            p[n++] = TCP_OPT_NOP;
+            p[n++] = TCP_OPT_WSCALE;
+            p[n++] = 3;
+            p[n++] = c->rcv_wscale;
+        }
+        while (n & 3)
+            p[n++] = TCP_OPT_NOP;
+        return n;
+    }
+
+    if (c->ts_ok) {
+        p[n++] = TCP_OPT_NOP;
+        p[n++] = TCP_OPT_NOP;
+        p[n++] = TCP_OPT_TIMESTAMP;
+        p[n++] = 10;
+        tcp_put32(&p[n], now);
+        tcp_put32(&p[n + 4], c->ts_recent);
+        n += 8;
+    }
+    //Blocks only ride on pure ACKs, on data they could push the segment past the MSS
+    if (c->sack_ok && c->ooo != NULL && !data) {
+        uint32_t blocks[4][2];
+        int cnt = tcp_sack_blocks(c, blocks, c->ts_ok ? 3 : 4);
+        p[n++] = TCP_OPT_NOP;
+        p[n++] = TCP_OPT_NOP;
+        p[n++] = TCP_OPT_SACK;
+        p[n++] = (uint8_t)(2 + 8 * cnt);
+        for (int i = 0; i < cnt; i++) {
+            tcp_put32(&p[n], blocks[i][0]);
+            tcp_put32(&p[n + 4], blocks[i][1]);
+            n += 8;
+        }
+    }
+    return n;
+}
+
+//Clones covering len bytes of the send queue starting at seq, linked through next
+static netbuf_t *tcp_sndq_clone(tcp_conn_t *c, uint32_t seq, int len) {
+    netbuf_t *nb = c->sndq_head;
+    uint32_t off = seq - c->snd_una + c->sndq_off;
+    if (c->sndq_hint != NULL && TCP_SEQ_GEQ(seq, c->sndq_hint_seq)) {
+        nb = c->sndq_hint;
+        off = seq - c->sndq_hint_seq;
+    }
+
+    netbuf_t *head = NULL;
+    netbuf_t *tail = NULL;
+    for (; nb != NULL && len > 0; nb = nb->q_next) {
+        if (off >= nb->len) {
+            off -= nb->len;
+            continue;
+        }
+
+        int n = MIN((int)(nb->len - off), len);
+        netbuf_t *clone = netbuf_clone(nb, off, n);
+        if (clone == NULL) {
+            netbuf_free(head);
+            return NULL;
+        }
+        if (tail != NULL)
+            tail->next = clone;
+        else
+            head = clone;
+        tail = clone;
+
+        c->sndq_hint = nb;
+        c->sndq_hint_seq = seq - off;
+        seq += n;
+        len -= n;
+        off = 0;
+    }
+    return head;
+}
+
+//Write the IP header in front of a TCP header of tcp_len bytes including payload
+static void tcp_fill_ip(uint8_t *hdr, bool v4, const network_sockaddr_t *local, const network_sockaddr_t *remote, int tcp_len) {
+    if (v4) {
+        ipv4_t *ip = (ipv4_t *)hdr;
+        memset(ip, 0, sizeof(ipv4_t));
+        ip->version = 4;
+        ip->ihl = 5;
+        uint16_t total = (uint16_t)MIN(sizeof(ipv4_t) + tcp_len, 0xffff);
+        ip->total_len = TO_BE_FRM_LE_16(total);
+        uint16_t ident = __atomic_fetch_add(&ip_ident, 1, __ATOMIC_RELAXED);
+        ip->ident = TO_BE_FRM_LE_16(ident);
+        ip->ttl = 64;
+        ip->protocol = IP_PROTOCOL_TCP;
+        memcpy(&ip->src_ip, &local->addr[12], 4);
+        memcpy(&ip->dst_ip, &remote->addr[12], 4);
+        ip->hdr_csum = network_csum_fold(network_csum_partial(ip, sizeof(ipv4_t), 0));
+    } else {
+        ipv6_t *ip = (ipv6_t *)hdr;
+        ip->version_traffic_flow = TO_BE_FRM_LE_32(0x60000000);
+        uint16_t payload = (uint16_t)tcp_len;
+        ip->payload_len = TO_BE_FRM_LE_16(payload);
+        ip->protocol = IP_PROTOCOL_TCP;
+        ip->ttl = 64;
+        memcpy(ip->src_ip, local->addr, 16);
+        memcpy(ip->dst_ip, remote->addr, 16);
+    }
+}
+
+//Leave the checksum to the device, the field gets the pseudo-header sum it completes
+static void tcp_fill_csum(netbuf_t *nb, bool v4, int ip_len, int tcp_len, bool gso) {
+    uint8_t *ip = nb->data;
+    tcp_t *tcp = (tcp_t *)(ip + ip_len);
+
+    //Segmentation computes the length of every segment itself, it's left out of the pseudo-header
+    uint32_t pseudo_len = gso ? 0 : (uint32_t)tcp_len;
+    uint64_t sum;
+    if (v4) {
+        ipv4_t *hdr = (ipv4_t *)ip;
+        sum = network_csum_pseudo4(hdr->src_ip, hdr->dst_ip, IP_PROTOCOL_TCP, pseudo_len);
+    } else {
+        ipv6_t *hdr = (ipv6_t *)ip;
+        sum = network_csum_pseudo6(hdr->src_ip, hdr->dst_ip, IP_PROTOCOL_TCP, pseudo_len);
+    }
+    tcp->csum = (uint16_t)~network_csum_fold(sum);
+
+    nb->csum_start = (uint16_t)ip_len;
+    if (gso)
+        nb->tx_flags = v4 ? network_device_tx_flag_tcpv4_tso : network_device_tx_flag_tcpv6_tso;
+    else
+        nb->tx_flags = v4 ? network_device_tx_flag_tcpv4_csum : network_device_tx_flag_tcpv6_csum;
+}
+
+//A segment carrying len bytes of the send queue from seq, NULL if out of netbufs
+static netbuf_t *tcp_build(tcp_conn_t *c, uint32_t seq, int len, uint8_t flags) {
+    netbuf_t *nb = netbuf_alloc();
+    if (nb == NULL)
+        return NULL;
+
+    uint8_t opts[40];
+    int opt_len = tcp_build_opts(c, flags, len > 0, opts);
+    int ip_len = tcp_ip_len(c->v4);
+    int tcp_hdr_len = sizeof(tcp_t) + opt_len;
+
+    uint8_t *hdr = netbuf_put(nb, ip_len + tcp_hdr_len);
+    if (len > 0) {
+        netbuf_t *payload = tcp_sndq_clone(c, seq, len);
+        if (payload == NULL) {
+            netbuf_free(nb);
+            return NULL;
+        }
+        netbuf_chain(nb, payload);
+    }
+
+    tcp_t *tcp = (tcp_t *)(hdr + ip_len);
+    tcp->src_port = TO_BE_FRM_LE_16(c->local.port);
+    tcp->dst_port = TO_BE_FRM_LE_16(c->remote.port);
+    tcp->seq = TO_BE_FRM_LE_32(seq);
+    tcp->ack = (flags & TCP_FLAG_ACK) ? TO_BE_FRM_LE_32(c->rcv_nxt) : 0;
+    tcp->rsvd = 0;
+    tcp->data_off = (uint8_t)(tcp_hdr_len / 4);
+    tcp->flags = flags;
+    tcp->urgent = 0;
+    memcpy(tcp->options, opts, opt_len);
+
+    //Windows in SYNs are never scaled
+    uint32_t wnd = tcp_rcv_window(c);
+    uint16_t wnd_field = (uint16_t)((flags & TCP_FLAG_SYN) ? MIN(wnd, 0xffff) : (wnd >> c->rcv_wscale));
+    tcp->window = TO_BE_FRM_LE_16(wnd_field);
+    if (flags & TCP_FLAG_ACK)
+        c->rcv_adv = c->rcv_nxt + ((uint32_t)wnd_field << ((flags & TCP_FLAG_SYN) ? 0 : c->rcv_wscale));
+
+    int tcp_len = tcp_hdr_len + len;
+    bool gso = len > c->mss;
+    tcp_fill_ip(hdr, c->v4, &c->local, &c->remote, tcp_len);
+    tcp_fill_csum(nb, c->v4, ip_len, tcp_len, gso);
+    if (gso) {
+        nb->gso_size = c->mss;
+        nb->hdr_len = (uint16_t)(ip_len + tcp_hdr_len);
+    }
+
+    //Whatever goes out carries our latest ACK
+    if (flags & TCP_FLAG_ACK) {
+        c->ack_pending = 0;
+        c->ack_now = false;
+        tcp_timer_cancel(c, tcp_timer_delack);
+    }
+    return nb;
+}
+
+static inline void tcp_list_add(netbuf_t **head, netbuf_t **tail, netbuf_t *nb) {
+    nb->q_next = NULL;
+    if (*tail != NULL)
+        (*tail)->q_next = nb;
+    else
+        *head = nb;
+    *tail = nb;
+}
+
+PRIVATE void tcp_send_ack(tcp_conn_t *c) {
+    netbuf_t *nb = tcp_build(c, c->snd_nxt, 0, TCP_FLAG_ACK);
+    if (nb != NULL)
+        ip_output(c->interface, c->next_hop, nb);
+}
+
+PRIVATE void tcp_send_syn(tcp_conn_t *c) {
+    uint8_t flags = TCP_FLAG_SYN | ((c->state == tcp_state_syn_rcvd) ? TCP_FLAG_ACK : 0);
+    netbuf_t *nb = tcp_build(c, c->iss, 0, flags);
+    if (nb != NULL)
+        ip_output(c->interface, c->next_hop, nb);
+    c->snd_nxt = c->iss + 1;
+    if (TCP_SEQ_GT(c->snd_nxt, c->snd_max))
+        c->snd_max = c->snd_nxt;
+}
+
+PRIVATE void tcp_send_rst(tcp_conn_t *c) {
+    netbuf_t *nb = tcp_build(c, c->snd_nxt, 0, TCP_FLAG_RST | TCP_FLAG_ACK);
+    if (nb != NULL)
+        ip_output(c->interface, c->next_hop, nb);
+}
+
+PRIVATE void tcp_send_reset(interface_def_t *interface, const network_sockaddr_t *local, const network_sockaddr_t *remote, uint32_t seq, uint32_t ack, bool has_ack) {
+    bool v4 = remote->addr[10] == 0xff && remote->addr[11] == 0xff;
+    uint8_t next_hop[16];
+    if (interface != NULL) {
+        if (v4) {
+            uint32_t hop;
+            uint32_t dst;
+            memcpy(&dst, &remote->addr[12], sizeof(dst));
+            interface = network_route4(dst, &hop);
+            neigh_addr4(hop, next_hop);
+        } else
+            interface = network_route6(remote->addr, next_hop);
+        if (interface == NULL)
+            return;
+    }
+
+    netbuf_t *nb = netbuf_alloc();
+    if (nb == NULL)
+        return;
+
+    int ip_len = tcp_ip_len(v4);
+    uint8_t *hdr = netbuf_put(nb, ip_len + sizeof(tcp_t));
+    tcp_t *tcp = (tcp_t *)(hdr + ip_len);
+    memset(tcp, 0, sizeof(tcp_t));
+    tcp->src_port = TO_BE_FRM_LE_16(local->port);
+    tcp->dst_port = TO_BE_FRM_LE_16(remote->port);
+    tcp->seq = TO_BE_FRM_LE_32(seq);
+    tcp->ack = TO_BE_FRM_LE_32(ack);
+    tcp->data_off = sizeof(tcp_t) / 4;
+    tcp->flags = TCP_FLAG_RST | (has_ack ? TCP_FLAG_ACK : 0);
+
+    tcp_fill_ip(hdr, v4, local, remote, sizeof(tcp_t));
+    tcp_fill_csum(nb, v4, ip_len, sizeof(tcp_t), false);
+    ip_output(interface, next_hop, nb);
+}
+
+//Next stretch of [from, snd_max) the peer hasn't selectively acknowledged, false if there is none below its highest SACK
+static bool tcp_next_hole(tcp_conn_t *c, uint32_t from, uint32_t *seq, uint32_t *len) {
+    if (c->sacked_cnt == 0)
+        return false;
+
+    for (int i = 0; i < c->sacked_cnt; i++) {
+        if (TCP_SEQ_GEQ(from, c->sacked[i][0]) && TCP_SEQ_LT(from, c->sacked[i][1]))
+            from = c->sacked[i][1];
+        if (TCP_SEQ_LT(from, c->sacked[i][0])) {
+            *seq = from;
+            *len = MIN(c->sacked[i][0] - from, (uint32_t)c->mss);
+            return true;
+        }
+    }
+    return false;
+}
+
+PRIVATE void tcp_retransmit(tcp_conn_t *c, uint32_t seq) {
+    uint32_t data_end = c->snd_una + c->sndq_bytes;
+    uint32_t len = 0;
+
+    uint32_t hole_seq, hole_len;
+    if (tcp_next_hole(c, seq, &hole_seq, &hole_len)) {
+        seq = hole_seq;
+        len = hole_len;
+    } else if (TCP_SEQ_LT(seq, data_end))
+        len = MIN(data_end - seq, (uint32_t)c->mss);
+
+    if (TCP_SEQ_GT(seq + len, c->snd_max))
+        len = c->snd_max - seq;
+
+    uint8_t flags = TCP_FLAG_ACK;
+    if (len == 0) {
+        //Only the FIN is outstanding
+        if (!c->fin_sent)
+            return;
+        seq = c->snd_max - 1;
+        flags |= TCP_FLAG_FIN;
+    }
+
+    netbuf_t *nb = tcp_build(c, seq, len, flags);
+    if (nb == NULL)
+        return;
+    c->rexmit_nxt = seq + len;
+    c->stat_retrans++;
+    //Karn: a retransmitted segment can't be timed
+    c->rtt_seq = 0;
+    ip_output(c->interface, c->next_hop, nb);
+}
+
+//Sacked bytes above snd_una, they left the network
+static uint32_t tcp_sacked_bytes(tcp_conn_t *c) {
+    uint32_t bytes = 0;
+    for (int i = 0; i < c->sacked_cnt; i++)
+        bytes += c->sacked[i][1] - c->sacked[i][0];
+    return bytes;
+}
+
+PRIVATE void tcp_output(tcp_conn_t *c) {
+    if (c->state < tcp_state_established && c->state != tcp_state_close_wait)
+        return;
+
+    netbuf_t *head = NULL;
+    netbuf_t *tail = NULL;
+    bool sent = false;
+
+    uint32_t wnd = MIN(c->snd_wnd, c->cwnd);
+    uint32_t data_end = c->snd_una + c->sndq_bytes;
+    uint32_t max_len = c->mss;
+    if (c->interface != NULL && (c->features & (c->v4 ? network_device_features_tso4 : network_device_features_tso6))) {
+        //gso_max_size counts the ethernet header as well
+        uint32_t hdrs = 14 + tcp_ip_len(c->v4) + sizeof(tcp_t) + 40;
+        max_len = MIN(c->gso_max_size - hdrs, (uint32_t)c->mss * TCP_MAX_GSO_SEGS);
+        max_len -= max_len % c->mss;
+    }
+
+    while (TCP_SEQ_LT(c->snd_nxt, data_end)) {
+        uint32_t in_flight = c->snd_nxt - c->snd_una;
+        if (c->in_recovery)
+            in_flight -= MIN(in_flight, tcp_sacked_bytes(c));
+        if (in_flight >= wnd)
+            break;
+
+        uint32_t avail = data_end - c->snd_nxt;
+        uint32_t len = MIN(MIN(avail, wnd - in_flight), max_len);
+        if (len > c->mss)
+            len -= len % c->mss;
+
+        if (len < c->mss) {
+            //Partial segment: only when it's all there is and Nagle, corking and the sender allow it, or the
+            //peer's window is what limits it and it's at least half the window it ever offered
+            bool last = len == avail;
+            bool nagle_ok = c->nodelay || c->snd_nxt == c->snd_una;
+            bool sws_ok = !last && len >= c->snd_wnd / 2;
+            if (!((last && nagle_ok && !c->cork && !c->more) || sws_ok))
+                break;
+        }
+
+        uint8_t flags = TCP_FLAG_ACK;
+        if (c->snd_nxt + len == data_end)
+            flags |= TCP_FLAG_PSH;
+        netbuf_t *nb = tcp_build(c, c->snd_nxt, len, flags);
+        if (nb == NULL)
+            break;
+        tcp_list_add(&head, &tail, nb);
+
+        if (c->rtt_seq == 0 && !c->ts_ok && c->snd_nxt == c->snd_max) {
+            c->rtt_seq = c->snd_nxt + len;
+            c->rtt_start = tcp_now_ms();
+        }
+        c->snd_nxt += len;
+        if (TCP_SEQ_GT(c->snd_nxt, c->snd_max))
+            c->snd_max = c->snd_nxt;
+        sent = true;
+    }
+
+    //The FIN follows the last byte of data, again after a timeout rewound snd_nxt
+    if (c->fin_queued && c->snd_nxt == data_end && (!c->fin_sent || TCP_SEQ_LT(c->snd_nxt, c->snd_max))) {
+        netbuf_t *nb = tcp_build(c, c->snd_nxt, 0, TCP_FLAG_FIN | TCP_FLAG_ACK);
+        if (nb != NULL) {
+            tcp_list_add(&head, &tail, nb);
+            c->fin_sent = true;
+            c->snd_nxt++;
+            c->snd_max = c->snd_nxt;
+            sent = true;
+        }
+    }
+
+    if (sent) {
+        if (!tcp_timer_armed(c, tcp_timer_rexmt))
+            tcp_timer_arm(c, tcp_timer_rexmt, c->rto);
+        ip_output(c->interface, c->next_hop, head);
+    } else if (c->ack_now) {
+        tcp_send_ack(c);
+    }
+
+    //Data waiting behind a closed window with nothing in flight, the retransmission timer probes it
+    if (!sent && c->snd_wnd == 0 && c->snd_una == c->snd_max && TCP_SEQ_LT(c->snd_nxt, data_end) &&
+        !tcp_timer_armed(c, tcp_timer_rexmt))
+        tcp_timer_arm(c, tcp_timer_rexmt, c->rto);
+}
+
+PRIVATE int tcp_route(tcp_conn_t *c) {
+    const uint8_t *dst = c->remote.addr;
+    c->v4 = dst[10] == 0xff && dst[11] == 0xff;
+    for (int i = 0; i < 10; i++)
+        if (dst[i] != 0)
+            c->v4 = false;
+
+    static const uint8_t loopback6[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    bool local;
+    uint32_t dst4;
+    memcpy(&dst4, &dst[12], sizeof(dst4));
+    if (c->v4)
+        local = (TO_LE_FRM_BE_32(dst4) >> 24) == 127 || network_local4(dst4) != NULL;
+    else
+        local = memcmp(dst, loopback6, 16) == 0 || network_local6(dst) != NULL;
+
+    bool any = true;
+    for (int i = 0; i < 16; i++)
+        if (c->local.addr[i] != 0)
+            any = false;
+
+    if (local) {
+        //Talking to ourselves, segments are looped straight back into the stack
+        c->interface = NULL;
+        if (any)
+            memcpy(c->local.addr, dst, 16);
+        return 0;
+    }
+
+    if (c->v4) {
+        uint32_t hop;
+        c->interface = network_route4(dst4, &hop);
+        if (c->interface == NULL)
+            return -1;
+        neigh_addr4(hop, c->next_hop);
+        if (any)
+            neigh_addr4(c->interface->ipv4_addr, c->local.addr);
+    } else {
+        c->interface = network_route6(dst, c->next_hop);
+        if (c->interface == NULL)
+            return -1;
+        if (any)
+            memcpy(c->local.addr, c->interface->ipv6_ll, 16);
+    }
+    c->features = c->interface->device.features;
+    c->gso_max_size = c->interface->device.gso_max_size;
+    return 0;
+}
@@ -0,0 +1,167 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <cardinal/local_spinlock.h>
+
+#include "SysTaskMgr/task.h"
+
+#include "tcp.h"
+
+// TCP timer wheel.
+// Every connection timer lives in one of TCP_WHEEL_SLOTS slots picked by its absolute expiry tick,
+// so arming and cancelling are O(1) no matter how many connections exist. The net_tcp task walks the
+// slots once per tick, timers further than a full turn away stay in their slot until their round
+// comes. Expired timers are collected under the wheel lock and handled after it's dropped, with a
+// reference on the connection, a timer re-armed or cancelled in between is no longer pending and is
+// skipped by the handler.
+
+#define TCP_WHEEL_SLOTS (512)
+#define TCP_WHEEL_BATCH (256)           //Timers handled per pass over the wheel
+
+typedef struct {
+    tcp_conn_t *conn;
+    tcp_timer_kind_t kind;
+} tcp_expired_t;
+
+static tcp_timer_t *wheel[TCP_WHEEL_SLOTS];
+static uint64_t wheel_tick = 0;         //Last tick whose slot was walked
+static int wheel_lock = 0;
+
+static inline uint64_t tcp_tick_now(void) {
+    return tcp_now_ms() / TCP_TICK_MS;
+}
+
+//Caller holds wheel_lock
+static void tcp_timer_unlink(tcp_timer_t *t) {
+    if (t->pprev == NULL)
+        return;
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+PRIVATE void tcp_timer_arm(tcp_conn_t *c, tcp_timer_kind_t kind, uint32_t ms) {
+    tcp_timer_t *t = &c->timers[kind];
+    uint64_t ticks = MAX((ms + TCP_TICK_MS - 1) / TCP_TICK_MS, 1);
+
+    int cli_state = cli();
+    local_spinlock_lock(&wheel_lock);
+    tcp_timer_unlink(t);
+    //Never land in a slot the task has already walked for this turn
+    t->expires = MAX(tcp_tick_now(), wheel_tick) + ticks;
+    t->pending = false;
+
+    tcp_timer_t **slot = &wheel[t->expires & (TCP_WHEEL_SLOTS - 1)];
+    t->next = *slot;
+    if (*slot != NULL)
+        (*slot)->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+    local_spinlock_unlock(&wheel_lock);
+    sti(cli_state);
+}
+
+PRIVATE void tcp_timer_cancel(tcp_conn_t *c, tcp_timer_kind_t kind) {
+    tcp_timer_t *t = &c->timers[kind];
+
+    int cli_state = cli();
+    local_spinlock_lock(&wheel_lock);
+    tcp_timer_unlink(t);
+    t->pending = false;
+    local_spinlock_unlock(&wheel_lock);
+    sti(cli_state);
+}
+
+PRIVATE bool tcp_timer_armed(tcp_conn_t *c, tcp_timer_kind_t kind) {
+    return __atomic_load_n(&c->timers[kind].pprev, __ATOMIC_RELAXED) != NULL;
+}
+
+PRIVATE bool tcp_timer_claim(tcp_conn_t *c, tcp_timer_kind_t kind) {
+    tcp_timer_t *t = &c->timers[kind];
+
+    int cli_state = cli();
+    local_spinlock_lock(&wheel_lock);
+    bool due = t->pending;
+    t->pending = false;
+    local_spinlock_unlock(&wheel_lock);
+    sti(cli_state);
+    return due;
+}
+
+//Collect up to TCP_WHEEL_BATCH expired timers, taking a connection reference for each
+static int tcp_timer_collect(tcp_expired_t *expired) {
+    int cnt = 0;
+    uint64_t now = tcp_tick_now();
+
+    int cli_state = cli();
+    local_spinlock_lock(&wheel_lock);
+    //Once the task fell a whole turn behind every slot is due for a look anyway
+    if (now - wheel_tick > TCP_WHEEL_SLOTS)
+        wheel_tick = now - TCP_WHEEL_SLOTS;
+
+    while (wheel_tick < now) {
+        uint64_t tick = wheel_tick + 1;
+        tcp_timer_t *t = wheel[tick & (TCP_WHEEL_SLOTS - 1)];
+        while (t != NULL && cnt < TCP_WHEEL_BATCH) {
+            tcp_timer_t *next = t->next;
+            if (t->expires <= tick) {
+                tcp_timer_unlink(t);
+                t->pending = true;
+                __atomic_add_fetch(&t->conn->refcnt, 1, __ATOMIC_RELAXED);
+                expired[cnt].conn = t->conn;
+                expired[cnt].kind = (tcp_timer_kind_t)t->kind;
+                cnt++;
+            }
+            t = next;
+        }
+
+        //Batch is full, the rest of this slot is picked up on the next pass
+        if (cnt == TCP_WHEEL_BATCH)
+            break;
+        wheel_tick = tick;
+    }
+    local_spinlock_unlock(&wheel_lock);
+    sti(cli_state);
+    return cnt;
+}
+
+static void tcp_timer_task(void *arg) {
+    tcp_expired_t *expired = (tcp_expired_t *)arg;
+    while (true) {
+        int cnt;
+        do {
+            cnt = tcp_timer_collect(expired);
+            for (int i = 0; i < cnt; i++) {
+                tcp_timer_fire(expired[i].conn, expired[i].kind);
+                tcp_put(expired[i].conn);
+            }
+        } while (cnt == TCP_WHEEL_BATCH);
+
+        task_sleep(task_current(), TCP_TICK_MS * 1000 * 1000ull);
+        task_yield();
+    }
+}
+
+PRIVATE int tcp_timer_init(void) {
+    memset(wheel, 0, sizeof(wheel));
+    wheel_tick = tcp_tick_now();
+
+    tcp_expired_t *expired = malloc(sizeof(tcp_expired_t) * TCP_WHEEL_BATCH);
+    if (expired == NULL)
+        return -1;
+
+    cs_id id = 0;
+    if (create_task_kernel("net_tcp", task_permissions_kernel, &id) != CS_OK)
+        return -1;
+    if (start_task_kernel(id, tcp_timer_task, expired) != CS_OK)
+        return -1;
+    return 0;
+}
@@ -6,103 +6,638 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <cardinal/local_spinlock.h>
 
+#include "SysPhysicalMemory/phys_mem.h"
+#include "SysVirtualMemory/vmem.h"
+#include "SysTaskMgr/task.h"
+#include "SysTimer/timer.h"
+
+#include "CoreNetwork/socket.h"
 #include "udp.h"
+#include "checksum.h"
+#include "neigh.h"
 
-static uint16_t udp_ipv4_verify_csum(ipv4_t *packet, udp_t *udp) {
+// UDP endpoints.
+// Received datagrams are matched against connected endpoints by 4-tuple first and then against
+// the endpoints bound to the destination port, each table is hashed with a lock per bucket.
+// The lookup takes a reference so the datagram can be copied into the endpoint's ring with no
+// table lock held. Datagrams to our own or a loopback address never leave CoreNetwork, they
+// are copied from the sender's buffer straight into the receiving ring.
 
-    uint16_t csum_bkp = udp->csum;
-    udp->csum = 0;
+#define UDP_PORT_BUCKETS (1024)
+#define UDP_CONN_BUCKETS (4096)
+#define UDP_EPHEMERAL_FIRST (49152)
+#define UDP_EPHEMERAL_CNT (65536 - UDP_EPHEMERAL_FIRST)
+#define UDP_TTL (64)
+#define UDP_MTU (1500)
+
+struct udp_endpoint {
+    network_sockaddr_t local;
+    network_sockaddr_t remote;
+    bool bound;
+    bool connected;
+    _Atomic int refcnt;
+
+    network_ring_t *ring;
+    uintptr_t ring_phys;
+    int ring_lock;                  //Serializes the producers, datagrams arrive on every receive queue's core
+    cs_id map_task;
+    cs_id map_id;
+    bool mapped;
+
+    uint16_t ip_ident;
+
+    struct udp_endpoint *port_next;
+    struct udp_endpoint *conn_next;
+
+    uint64_t rx_packets;
+    uint64_t rx_drops;              //Ring was full
+    uint64_t rx_truncated;          //Longer than a ring slot
+    uint64_t tx_packets;
+    uint64_t tx_errors;
+};
+
+typedef struct {
+    udp_endpoint_t *head;
+    int lock;
+} udp_bucket_t;
+
+static udp_bucket_t port_table[UDP_PORT_BUCKETS];
+static udp_bucket_t conn_table[UDP_CONN_BUCKETS];
+static int bind_lock = 0;
+static _Atomic uint32_t ephemeral_cursor = 0;
+
+static const uint8_t loopback6[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+
+static inline bool udp_addr_any(const uint8_t *addr) {
+    for (int i = 0; i < 16; i++)
+        if (addr[i] != 0)
+            return false;
+    return true;
+}
+
+static inline bool udp_addr_isv4(const uint8_t *addr) {
+    for (int i = 0; i < 10; i++)
+        if (addr[i] != 0)
+            return false;
+    return addr[10] == 0xff && addr[11] == 0xff;
+}
+
+static inline uint32_t udp_addr_v4(const uint8_t *addr) {
+    uint32_t ip;
+    memcpy(&ip, &addr[12], sizeof(ip));
+    return ip;
+}
+
+static inline bool udp_addr_match(const uint8_t *bound, const uint8_t *addr) {
+    return udp_addr_any(bound) || memcmp(bound, addr, 16) == 0;
+}
+
+static inline uint32_t udp_port_hash(uint16_t port) {
+    return (port * 0x9E3779B1u) >> (32 - 10);
+}
+
+static uint32_t udp_conn_hash(uint16_t local_port, const network_sockaddr_t *remote) {
+    uint64_t w[2];
+    memcpy(w, remote->addr, sizeof(w));
 
-    uint32_t csum = 0;
-    uint8_t *udp_u8 = (uint8_t*)udp;
-    uint16_t *packet_ptr = (uint16_t*)udp;
+    uint64_t h = ((uint64_t)local_port << 16) | remote->port;
+    h = (h ^ w[0]) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 29) ^ w[1]) * 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return (uint32_t)h & (UDP_CONN_BUCKETS - 1);
+}
 
-    uint32_t src_ip = (packet->src_ip);
-    uint32_t dst_ip = (packet->dst_ip);
+static inline void udp_lock(udp_bucket_t *b, int *cli_state) {
+    *cli_state = cli();
+    local_spinlock_lock(&b->lock);
+}
 
-    uint16_t *src_ip_a = (uint16_t *)&src_ip;
-    uint16_t *dst_ip_a = (uint16_t *)&dst_ip;
+static inline void udp_unlock(udp_bucket_t *b, int cli_state) {
+    local_spinlock_unlock(&b->lock);
+    sti(cli_state);
+}
+
+static void udp_put(udp_endpoint_t *ep) {
+    if (__atomic_sub_fetch(&ep->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    if (ep->mapped)
+        task_unmap(ep->map_task, ep->map_id);
+    pagealloc_free(ep->ring_phys, NETWORK_RING_BYTES);
+    free(ep);
+}
+
+//Endpoint the datagram belongs to with a reference held, NULL if there is none
+static udp_endpoint_t *udp_lookup(const network_sockaddr_t *src, const network_sockaddr_t *dst) {
+    udp_endpoint_t *ret = NULL;
+    int cli_state;
+
+    udp_bucket_t *b = &conn_table[udp_conn_hash(dst->port, src)];
+    udp_lock(b, &cli_state);
+    for (udp_endpoint_t *ep = b->head; ep != NULL; ep = ep->conn_next)
+        if (ep->local.port == dst->port && ep->remote.port == src->port &&
+            memcmp(ep->remote.addr, src->addr, 16) == 0 && udp_addr_match(ep->local.addr, dst->addr)) {
+            ret = ep;
+            __atomic_add_fetch(&ret->refcnt, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    udp_unlock(b, cli_state);
+    if (ret != NULL)
+        return ret;
+
+    b = &port_table[udp_port_hash(dst->port)];
+    udp_lock(b, &cli_state);
+    for (udp_endpoint_t *ep = b->head; ep != NULL; ep = ep->port_next)
+        if (!ep->connected && ep->local.port == dst->port && udp_addr_match(ep->local.addr, dst->addr)) {
+            ret = ep;
+            __atomic_add_fetch(&ret->refcnt, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    udp_unlock(b, cli_state);
+    return ret;
+}
 
-    csum += (src_ip >> 16) & 0xffff;
-    csum += (src_ip) & 0xffff;
-    csum += (dst_ip >> 16) & 0xffff;
-    csum += (dst_ip) & 0xffff;
-    csum += ((uint16_t)packet->protocol) << 8;
+//Claim the next free slot, holds ring_lock until udp_ring_commit unless it returns NULL
+static network_ring_slot_t *udp_ring_reserve(udp_endpoint_t *ep, int *cli_state) {
+    network_ring_t *ring = ep->ring;
 
-    csum += udp->len;
-    
-    uint32_t udp_len = TO_LE_FRM_BE_16(udp->len);
-    while (udp_len > 1){
-        csum += *packet_ptr++;
-        udp_len -= 2;
+    *cli_state = cli();
+    local_spinlock_lock(&ep->ring_lock);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= NETWORK_RING_SLOTS) {
+        ep->rx_drops++;
+        local_spinlock_unlock(&ep->ring_lock);
+        sti(*cli_state);
+        return NULL;
     }
+    return &ring->slots[head & (NETWORK_RING_SLOTS - 1)];
+}
+
+static void udp_ring_commit(udp_endpoint_t *ep, int cli_state) {
+    network_ring_t *ring = ep->ring;
 
-    if(udp_len > 0)
-        csum += *packet_ptr & 0x00ff;
+    __atomic_store_n(&ring->head, __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + 1, __ATOMIC_SEQ_CST);
+    ep->rx_packets++;
+    local_spinlock_unlock(&ep->ring_lock);
+    sti(cli_state);
 
-    while(csum > 0xffff)
-        csum = (csum & 0xffff) + (csum >> 16);
+    //Pairs with the consumer setting waiting before its last look at head
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST))
+        task_wake((uint32_t *)&ring->head, 1);
+}
 
-    return !(((uint16_t)~csum) == csum_bkp);
+static void udp_slot_fill(network_ring_slot_t *slot, const network_sockaddr_t *src, int len) {
+    memcpy(slot->addr, src->addr, 16);
+    slot->port = src->port;
+    slot->len = (uint16_t)len;
+    slot->timestamp = timer_timestamp_ns();
 }
 
-int udp_ipv4_rx(interface_def_t *interface, ipv4_t *packet, int len) {
+//Copy a received datagram into its endpoint's ring, payload starts offset bytes into nb
+static int udp_deliver(const network_sockaddr_t *src, const network_sockaddr_t *dst, netbuf_t *nb, int offset, int len) {
+    udp_endpoint_t *ep = udp_lookup(src, dst);
+    if (ep == NULL)
+        return -1;
+
+    int ret = -1;
+    if (len > NETWORK_RING_PAYLOAD) {
+        ep->rx_truncated++;
+    } else {
+        int cli_state;
+        network_ring_slot_t *slot = udp_ring_reserve(ep, &cli_state);
+        if (slot != NULL) {
+            udp_slot_fill(slot, src, len);
+
+            uint8_t *dst_data = slot->data;
+            int left = len;
+            for (netbuf_t *seg = nb; seg != NULL && left > 0; seg = seg->next) {
+                if (offset >= seg->len) {
+                    offset -= seg->len;
+                    continue;
+                }
+                int seg_len = MIN(seg->len - offset, left);
+                memcpy(dst_data, seg->data + offset, seg_len);
+                dst_data += seg_len;
+                left -= seg_len;
+                offset = 0;
+            }
+            udp_ring_commit(ep, cli_state);
+            ret = 0;
+        }
+    }
+
+    udp_put(ep);
+    return ret;
+}
+
+static uint16_t udp_ipv4_verify_csum(netbuf_t *nb, ipv4_t *packet, udp_t *udp) {
+    int udp_len = TO_LE_FRM_BE_16(udp->len);
+    uint64_t sum = network_csum_pseudo4(packet->src_ip, packet->dst_ip, packet->protocol, udp_len);
+    return network_csum_fold(network_csum_netbuf(nb, (int)((uint8_t*)udp - nb->data), udp_len, sum));
+}
+
+//The datagram can't claim more bytes than the packet holds
+static bool udp_len_ok(udp_t *udp, int len) {
+    int udp_len = TO_LE_FRM_BE_16(udp->len);
+    return udp_len >= (int)sizeof(udp_t) && udp_len <= len;
+}
+
+int udp_ipv4_rx(interface_def_t *interface, netbuf_t *nb, ipv4_t *packet, int len) {
     udp_t *udp = (udp_t*)packet->body;
+    interface = NULL;
+
+    if (!udp_len_ok(udp, len))
+        return -1;
 
-    if((udp_ipv4_verify_csum(packet, udp) == 0) | (udp->csum == 0)) {
-        //DEBUG_PRINT("UDP!!\r\n");
-        //TODO: Interface for services to subscribe to ports
-        //  From here, the packet gets queued into the destination udp port, if present
-        //  If not present, the packet is dropped
-        //TODO: Setup tx infrastructure:
-        //  CoreNetwork has a separate tx queue per device
-        //  Has a tx thread which handles pushing packets out to the driver
+    if((nb->flags & NETBUF_F_CSUM_VALID) || (udp->csum == 0) || (udp_ipv4_verify_csum(nb, packet, udp) == 0)) {
+        network_sockaddr_t src, dst;
+        neigh_addr4(packet->src_ip, src.addr);
+        src.port = TO_LE_FRM_BE_16(udp->src_port);
+        neigh_addr4(packet->dst_ip, dst.addr);
+        dst.port = TO_LE_FRM_BE_16(udp->dst_port);
+
+        return udp_deliver(&src, &dst, nb, (int)(udp->body - nb->data), TO_LE_FRM_BE_16(udp->len) - sizeof(udp_t));
     }
 
+    return -1;
+}
+
+static uint16_t udp_ipv6_verify_csum(netbuf_t *nb, ipv6_t *packet, udp_t *udp) {
+    int udp_len = TO_LE_FRM_BE_16(udp->len);
+    uint64_t sum = network_csum_pseudo6(packet->src_ip, packet->dst_ip, packet->protocol, udp_len);
+    return network_csum_fold(network_csum_netbuf(nb, (int)((uint8_t*)udp - nb->data), udp_len, sum));
+}
+
+int udp_ipv6_rx(interface_def_t *interface, netbuf_t *nb, ipv6_t *packet, int len) {
+    udp_t *udp = (udp_t*)packet->body;
     interface = NULL;
-    len = 0;
 
+    if (!udp_len_ok(udp, len))
+        return -1;
+
+    //The checksum is mandatory over IPv6
+    if((nb->flags & NETBUF_F_CSUM_VALID) || (udp->csum != 0 && udp_ipv6_verify_csum(nb, packet, udp) == 0)) {
+        network_sockaddr_t src, dst;
+        memcpy(src.addr, packet->src_ip, 16);
+        src.port = TO_LE_FRM_BE_16(udp->src_port);
+        memcpy(dst.addr, packet->dst_ip, 16);
+        dst.port = TO_LE_FRM_BE_16(udp->dst_port);
+
+        return udp_deliver(&src, &dst, nb, (int)(udp->body - nb->data), TO_LE_FRM_BE_16(udp->len) - sizeof(udp_t));
+    }
+
+    return -1;
+}
+
+udp_endpoint_t *udp_create(void) {
+    udp_endpoint_t *ep = malloc(sizeof(udp_endpoint_t));
+    if (ep == NULL)
+        return NULL;
+    memset(ep, 0, sizeof(udp_endpoint_t));
+
+    ep->ring_phys = pagealloc_alloc(-1, -1, physmem_alloc_flags_data | physmem_alloc_flags_zero, NETWORK_RING_BYTES);
+    if (ep->ring_phys == (uintptr_t)-1) {
+        free(ep);
+        return NULL;
+    }
+    ep->ring = (network_ring_t *)vmem_phystovirt((intptr_t)ep->ring_phys, NETWORK_RING_BYTES, vmem_flags_cachewriteback | vmem_flags_kernel | vmem_flags_rw);
+    ep->refcnt = 1;
+    ep->ip_ident = (uint16_t)timer_timestamp_ns();
+    return ep;
+}
+
+//Caller holds bind_lock
+static bool udp_port_used(uint16_t port, const uint8_t *addr) {
+    for (udp_endpoint_t *ep = port_table[udp_port_hash(port)].head; ep != NULL; ep = ep->port_next)
+        if (ep->local.port == port && (udp_addr_any(addr) || udp_addr_match(ep->local.addr, addr)))
+            return true;
+    return false;
+}
+
+int udp_bind(udp_endpoint_t *ep, network_sockaddr_t *local) {
+    if (ep->bound)
+        return -1;
+
+    int ret = -1;
+    int cli_state = cli();
+    local_spinlock_lock(&bind_lock);
+    if (local->port == 0) {
+        uint32_t start = __atomic_fetch_add(&ephemeral_cursor, 1, __ATOMIC_RELAXED);
+        for (uint32_t i = 0; i < UDP_EPHEMERAL_CNT; i++) {
+            uint16_t port = (uint16_t)(UDP_EPHEMERAL_FIRST + (start + i) % UDP_EPHEMERAL_CNT);
+            if (!udp_port_used(port, local->addr)) {
+                local->port = port;
+                __atomic_store_n(&ephemeral_cursor, start + i + 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+    if (local->port != 0 && !udp_port_used(local->port, local->addr)) {
+        ep->local = *local;
+        ep->bound = true;
+
+        udp_bucket_t *b = &port_table[udp_port_hash(local->port)];
+        local_spinlock_lock(&b->lock);
+        ep->port_next = b->head;
+        b->head = ep;
+        local_spinlock_unlock(&b->lock);
+        ret = 0;
+    }
+    local_spinlock_unlock(&bind_lock);
+    sti(cli_state);
+    return ret;
+}
+
+int udp_connect(udp_endpoint_t *ep, const network_sockaddr_t *remote) {
+    if (ep->connected || remote->port == 0 || udp_addr_any(remote->addr))
+        return -1;
+
+    if (!ep->bound) {
+        network_sockaddr_t local;
+        memset(&local, 0, sizeof(local));
+        if (udp_bind(ep, &local) != 0)
+            return -1;
+    }
+
+    int cli_state;
+    ep->remote = *remote;
+    udp_bucket_t *b = &conn_table[udp_conn_hash(ep->local.port, remote)];
+    udp_lock(b, &cli_state);
+    ep->connected = true;
+    ep->conn_next = b->head;
+    b->head = ep;
+    udp_unlock(b, cli_state);
     return 0;
 }
 
-static uint16_t udp_ipv6_verify_csum(ipv6_t *packet, udp_t *udp) {
+//Loop the datagram back to an endpoint of ours, the source is the destination address itself
+static int udp_send_local(udp_endpoint_t *ep, const network_sockaddr_t *dst, const void *data, int len) {
+    network_sockaddr_t src;
+    memcpy(src.addr, dst->addr, 16);
+    src.port = ep->local.port;
 
-    uint32_t csum = 0;
-    uint8_t *udp_u8 = (uint8_t*)udp;
-    uint16_t *packet_ptr = (uint16_t*)udp;
+    udp_endpoint_t *rx_ep = udp_lookup(&src, dst);
+    if (rx_ep == NULL)
+        return -1;
 
-    uint16_t *pseudo_ip = (uint16_t*)packet->src_ip;
+    int ret = -1;
+    int cli_state;
+    network_ring_slot_t *slot = len <= NETWORK_RING_PAYLOAD ? udp_ring_reserve(rx_ep, &cli_state) : NULL;
+    if (slot != NULL) {
+        udp_slot_fill(slot, &src, len);
+        memcpy(slot->data, data, len);
+        udp_ring_commit(rx_ep, cli_state);
+        ret = len;
+    }
 
-    csum += packet->protocol;
-    for(uint32_t i = 0; i < 16; i++)
-        csum += TO_LE_FRM_BE_16(pseudo_ip[i]);
+    udp_put(rx_ep);
+    return ret;
+}
 
-    for(uint32_t i = 0; i < udp->len / 2; i++)
-        csum += TO_LE_FRM_BE_16(packet_ptr[i]);
+//Build the IP and UDP headers in front of a copy of the payload, the checksum is summed during the copy
+static netbuf_t *udp_build(udp_endpoint_t *ep, interface_def_t *interface, const network_sockaddr_t *dst, const void *data, int len) {
+    bool v4 = udp_addr_isv4(dst->addr);
+    int ip_len = v4 ? (int)sizeof(ipv4_t) : (int)sizeof(ipv6_t);
+    if (ip_len + (int)sizeof(udp_t) + len > UDP_MTU)
+        return NULL;
 
-    if(udp->len & 1)
-        csum += udp_u8[udp->len - 1];
+    netbuf_t *nb = netbuf_alloc();
+    if (nb == NULL)
+        return NULL;
 
-    csum += TO_LE_FRM_BE_16(udp->len);
+    uint8_t *hdr = netbuf_put(nb, ip_len + sizeof(udp_t) + len);
+    udp_t *udp = (udp_t *)(hdr + ip_len);
+    uint16_t udp_len = (uint16_t)(sizeof(udp_t) + len);
+    udp->src_port = TO_BE_FRM_LE_16(ep->local.port);
+    udp->dst_port = TO_BE_FRM_LE_16(dst->port);
+    udp->len = TO_BE_FRM_LE_16(udp_len);
+    udp->csum = 0;
+    uint64_t sum = network_csum_copy(udp->body, data, len, 0);
 
-    while(csum > 0xffff)
-        csum = (csum & 0xffff) + (csum >> 16);
+    if (v4) {
+        ipv4_t *ip = (ipv4_t *)hdr;
+        memset(ip, 0, sizeof(ipv4_t));
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->total_len = TO_BE_FRM_LE_16((uint16_t)(sizeof(ipv4_t) + udp_len));
+        uint16_t ident = ep->ip_ident++;
+        ip->ident = TO_BE_FRM_LE_16(ident);
+        ip->ttl = UDP_TTL;
+        ip->protocol = IP_PROTOCOL_UDP;
+        ip->src_ip = udp_addr_any(ep->local.addr) ? interface->ipv4_addr : udp_addr_v4(ep->local.addr);
+        ip->dst_ip = udp_addr_v4(dst->addr);
+        ip->hdr_csum = network_csum_fold(network_csum_partial(ip, sizeof(ipv4_t), 0));
+        sum = network_csum_add(sum, network_csum_pseudo4(ip->src_ip, ip->dst_ip, IP_PROTOCOL_UDP, udp_len));
+    } else {
+        ipv6_t *ip = (ipv6_t *)hdr;
+        ip->version_traffic_flow = TO_BE_FRM_LE_32(0x60000000);
+        ip->payload_len = TO_BE_FRM_LE_16(udp_len);
+        ip->protocol = IP_PROTOCOL_UDP;
+        ip->ttl = UDP_TTL;
+        memcpy(ip->src_ip, udp_addr_any(ep->local.addr) ? interface->ipv6_ll : ep->local.addr, 16);
+        memcpy(ip->dst_ip, dst->addr, 16);
+        sum = network_csum_add(sum, network_csum_pseudo6(ip->src_ip, ip->dst_ip, IP_PROTOCOL_UDP, udp_len));
+    }
 
-    return ~csum;
+    sum = network_csum_partial(udp, sizeof(udp_t), sum);
+    udp->csum = network_csum_fold(sum);
+    //A computed 0 goes out as all ones, 0 means no checksum
+    if (udp->csum == 0)
+        udp->csum = 0xffff;
+    return nb;
 }
 
-int udp_ipv6_rx(interface_def_t *interface, ipv6_t *packet, int len) {
-    udp_t *udp = (udp_t*)packet->body;
+static inline bool udp_dst_local(const network_sockaddr_t *dst) {
+    if (udp_addr_isv4(dst->addr)) {
+        uint32_t ip = udp_addr_v4(dst->addr);
+        return (TO_LE_FRM_BE_32(ip) >> 24) == 127 || network_local4(ip) != NULL;
+    }
+    return memcmp(dst->addr, loopback6, 16) == 0 || network_local6(dst->addr) != NULL;
+}
+
+//Send a run of messages that all go to dst, returns how many went out
+static int udp_send_run(udp_endpoint_t *ep, const network_sockaddr_t *dst, const network_msg_t *msgs, int cnt) {
+    if (dst->port == 0)
+        return 0;
 
-    if((udp_ipv6_verify_csum(packet, udp) == 0) | (udp->csum == 0)) {
-        DEBUG_PRINT("UDPv6!!\r\n");
-        //From here, the packet gets queued into the destination udp port, if present
-        //If not present, the packet is dropped
+    if (udp_dst_local(dst)) {
+        int sent = 0;
+        while (sent < cnt && udp_send_local(ep, dst, msgs[sent].data, msgs[sent].len) >= 0)
+            sent++;
+        return sent;
     }
 
-    interface = NULL;
-    len = 0;
+    bool v4 = udp_addr_isv4(dst->addr);
+    uint8_t next_hop[16];
+    uint32_t next_hop4 = 0;
+    interface_def_t *interface;
+    if (v4) {
+        interface = network_route4(udp_addr_v4(dst->addr), &next_hop4);
+        neigh_addr4(next_hop4, next_hop);
+    } else
+        interface = network_route6(dst->addr, next_hop);
+    if (interface == NULL)
+        return 0;
+
+    netbuf_t *head = NULL;
+    netbuf_t *tail = NULL;
+    int sent = 0;
+    for (int i = 0; i < cnt; i++) {
+        netbuf_t *nb = udp_build(ep, interface, dst, msgs[i].data, msgs[i].len);
+        if (nb == NULL)
+            break;
+        sent++;
+
+        if (tail != NULL)
+            tail->q_next = nb;
+        else
+            head = nb;
+        tail = nb;
+    }
+
+    if (ip_output(interface, next_hop, head) != 0)
+        ep->tx_errors++;
+    ep->tx_packets += sent;
+    return sent;
+}
+
+int udp_sendmmsg(udp_endpoint_t *ep, const network_msg_t *msgs, int cnt) {
+    if (!ep->bound) {
+        network_sockaddr_t local;
+        memset(&local, 0, sizeof(local));
+        if (udp_bind(ep, &local) != 0)
+            return -1;
+    }
 
+    int sent = 0;
+    while (sent < cnt) {
+        const network_sockaddr_t *dst = (ep->connected && msgs[sent].addr.port == 0) ? &ep->remote : &msgs[sent].addr;
+
+        int run = 1;
+        while (sent + run < cnt) {
+            const network_msg_t *m = &msgs[sent + run];
+            const network_sockaddr_t *next = (ep->connected && m->addr.port == 0) ? &ep->remote : &m->addr;
+            if (next->port != dst->port || memcmp(next->addr, dst->addr, 16) != 0)
+                break;
+            run++;
+        }
+
+        int done = udp_send_run(ep, dst, &msgs[sent], run);
+        sent += done;
+        if (done < run)
+            break;
+    }
+    return sent;
+}
+
+int udp_sendmsg(udp_endpoint_t *ep, const network_msg_t *msg) {
+    if (udp_sendmmsg(ep, msg, 1) != 1)
+        return -1;
+    return msg->len;
+}
+
+int udp_recvmmsg(udp_endpoint_t *ep, network_msg_t *msgs, int cnt, bool wait) {
+    network_ring_t *ring = ep->ring;
+
+    uint32_t avail = network_ring_avail(ring);
+    while (avail == 0 && wait) {
+        //Announce that we're going to sleep, then look once more so a datagram published in between isn't missed
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+        if (head == __atomic_load_n(&ring->tail, __ATOMIC_RELAXED))
+            task_wait((uint32_t *)&ring->head, head);
+        avail = network_ring_avail(ring);
+    }
+
+    int n = MIN((int)avail, cnt);
+    for (int i = 0; i < n; i++) {
+        network_ring_slot_t *slot = network_ring_slot(ring, i);
+        memcpy(msgs[i].addr.addr, slot->addr, 16);
+        msgs[i].addr.port = slot->port;
+        msgs[i].len = MIN(msgs[i].len, (int)slot->len);
+        memcpy(msgs[i].data, slot->data, msgs[i].len);
+    }
+    network_ring_release(ring, n);
+    return n;
+}
+
+int udp_recvmsg(udp_endpoint_t *ep, network_msg_t *msg) {
+    if (udp_recvmmsg(ep, msg, 1, false) != 1)
+        return -1;
+    return msg->len;
+}
+
+network_ring_t *udp_ring(udp_endpoint_t *ep) {
+    return ep->ring;
+}
+
+int udp_ring_map(udp_endpoint_t *ep, cs_id task, intptr_t vaddr) {
+    if (ep->mapped)
+        return -1;
+    if (task_mapvmem(task, vaddr, (intptr_t)ep->ring_phys, NETWORK_RING_BYTES, task_map_perm_writeonly | task_map_perm_cachewriteback, vmem_map_none, &ep->map_id) != CS_OK)
+        return -1;
+    ep->map_task = task;
+    ep->mapped = true;
+    return 0;
+}
+
+void udp_close(udp_endpoint_t *ep) {
+    int cli_state;
+
+    if (ep->connected) {
+        udp_bucket_t *b = &conn_table[udp_conn_hash(ep->local.port, &ep->remote)];
+        udp_lock(b, &cli_state);
+        udp_endpoint_t **link = &b->head;
+        while (*link != NULL && *link != ep)
+            link = &(*link)->conn_next;
+        if (*link == ep)
+            *link = ep->conn_next;
+        udp_unlock(b, cli_state);
+    }
+
+    if (ep->bound) {
+        cli_state = cli();
+        local_spinlock_lock(&bind_lock);
+        udp_bucket_t *b = &port_table[udp_port_hash(ep->local.port)];
+        local_spinlock_lock(&b->lock);
+        udp_endpoint_t **link = &b->head;
+        while (*link != NULL && *link != ep)
+            link = &(*link)->port_next;
+        if (*link == ep)
+            *link = ep->port_next;
+        local_spinlock_unlock(&b->lock);
+        local_spinlock_unlock(&bind_lock);
+        sti(cli_state);
+    }
+
+    //Datagrams being delivered still hold references, the last one frees the endpoint
+    udp_put(ep);
+}
+
+//Per endpoint counters
+int udp_stats() {
+    char tmp[20];
+    for (int i = 0; i < UDP_PORT_BUCKETS; i++) {
+        int cli_state;
+        udp_lock(&port_table[i], &cli_state);
+        for (udp_endpoint_t *ep = port_table[i].head; ep != NULL; ep = ep->port_next) {
+            DEBUG_PRINT("[CoreNetwork] UDP port ");
+            DEBUG_PRINT(itoa(ep->local.port, tmp, 10));
+            DEBUG_PRINT(" rx: ");
+            DEBUG_PRINT(ltoa(ep->rx_packets, tmp, 10));
+            DEBUG_PRINT(" rx ring full: ");
+            DEBUG_PRINT(ltoa(ep->rx_drops, tmp, 10));
+            DEBUG_PRINT(" rx too long: ");
+            DEBUG_PRINT(ltoa(ep->rx_truncated, tmp, 10));
+            DEBUG_PRINT(" tx: ");
+            DEBUG_PRINT(ltoa(ep->tx_packets, tmp, 10));
+            DEBUG_PRINT(" tx errors: ");
+            DEBUG_PRINT(ltoa(ep->tx_errors, tmp, 10));
+            DEBUG_PRINT("\r\n");
+        }
+        udp_unlock(&port_table[i], cli_state);
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,187 @@
+/**
+ * Copyright (c) 2018 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SysTimer/timer.h"
+#include "SysTaskMgr/task.h"
+
+#include "CoreNetwork/socket.h"
+#include "neigh.h"
+
+// Datagram rate and latency over 127.0.0.1, udp_bench.
+// A receiver task drains the ring the way a mapped consumer would, reading slots in place, and
+// measures each datagram's latency from the send timestamp carried in its payload. The sender
+// keeps the ring from overflowing, so the run measures the endpoint path rather than drops.
+
+#define UDP_BENCH_PACKETS (100000)
+#define UDP_BENCH_BATCH (32)
+#define UDP_BENCH_PORT (7777)
+
+static const int bench_sizes[] = {64, 512, 1400};
+
+typedef struct {
+    udp_endpoint_t *ep;
+    uint32_t *latencies;
+    int cnt;
+    _Atomic uint32_t done;
+} udp_bench_rx_t;
+
+static void udp_bench_rx_task(void *arg) {
+    udp_bench_rx_t *rx = (udp_bench_rx_t *)arg;
+    network_ring_t *ring = udp_ring(rx->ep);
+
+    int received = 0;
+    while (received < rx->cnt) {
+        uint32_t avail = network_ring_avail(ring);
+        if (avail == 0) {
+            __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+            uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+            if (head == __atomic_load_n(&ring->tail, __ATOMIC_RELAXED))
+                task_wait((uint32_t *)&ring->head, head);
+            continue;
+        }
+
+        uint64_t now = timer_timestamp_ns();
+        for (uint32_t i = 0; i < avail && received < rx->cnt; i++) {
+            uint64_t sent;
+            memcpy(&sent, network_ring_slot(ring, i)->data, sizeof(sent));
+            rx->latencies[received++] = (uint32_t)MIN(now - sent, 0xffffffffull);
+        }
+        network_ring_release(ring, avail);
+    }
+
+    __atomic_store_n(&rx->done, 1, __ATOMIC_SEQ_CST);
+    task_wake((uint32_t *)&rx->done, 1);
+    while (true) {
+        task_sleep(task_current(), 1000 * 1000 * 1000ull);
+        task_yield();
+    }
+}
+
+static void udp_bench_sift(uint32_t *v, int root, int cnt) {
+    while (2 * root + 1 < cnt) {
+        int child = 2 * root + 1;
+        if (child + 1 < cnt && v[child + 1] > v[child])
+            child++;
+        if (v[root] >= v[child])
+            return;
+        uint32_t t = v[root];
+        v[root] = v[child];
+        v[child] = t;
+        root = child;
+    }
+}
+
+static void udp_bench_sort(uint32_t *v, int cnt) {
+    for (int i = cnt / 2 - 1; i >= 0; i--)
+        udp_bench_sift(v, i, cnt);
+    for (int i = cnt - 1; i > 0; i--) {
+        uint32_t t = v[0];
+        v[0] = v[i];
+        v[i] = t;
+        udp_bench_sift(v, 0, i);
+    }
+}
+
+static void udp_bench_print(const char *what, uint64_t val) {
+    char tmp[20];
+    DEBUG_PRINT(what);
+    DEBUG_PRINT(ltoa(val, tmp, 10));
+}
+
+static int udp_bench_size(int size, uint8_t *payload, uint32_t *latencies) {
+    network_sockaddr_t rx_addr;
+    neigh_addr4(TO_BE_FRM_LE_32(0x7F000001), rx_addr.addr);
+    rx_addr.port = UDP_BENCH_PORT;
+
+    udp_endpoint_t *rx_ep = udp_create();
+    udp_endpoint_t *tx_ep = udp_create();
+    if (rx_ep == NULL || tx_ep == NULL || udp_bind(rx_ep, &rx_addr) != 0 || udp_connect(tx_ep, &rx_addr) != 0) {
+        if (rx_ep != NULL)
+            udp_close(rx_ep);
+        if (tx_ep != NULL)
+            udp_close(tx_ep);
+        return -1;
+    }
+
+    udp_bench_rx_t rx;
+    rx.ep = rx_ep;
+    rx.latencies = latencies;
+    rx.cnt = UDP_BENCH_PACKETS;
+    rx.done = 0;
+
+    cs_id rx_id = 0;
+    if (create_task_kernel("udp_bench_rx", task_permissions_kernel, &rx_id) != CS_OK ||
+        start_task_kernel(rx_id, udp_bench_rx_task, &rx) != CS_OK) {
+        udp_close(rx_ep);
+        udp_close(tx_ep);
+        return -1;
+    }
+
+    network_msg_t msgs[UDP_BENCH_BATCH];
+    network_ring_t *ring = udp_ring(rx_ep);
+    uint64_t start = timer_timestamp_ns();
+    int sent = 0;
+    while (sent < UDP_BENCH_PACKETS) {
+        int batch = MIN(UDP_BENCH_BATCH, UDP_BENCH_PACKETS - sent);
+        if (NETWORK_RING_SLOTS - network_ring_avail(ring) < (uint32_t)batch) {
+            task_yield();
+            continue;
+        }
+
+        uint64_t now = timer_timestamp_ns();
+        memcpy(payload, &now, sizeof(now));
+        for (int i = 0; i < batch; i++) {
+            memset(&msgs[i].addr, 0, sizeof(network_sockaddr_t));
+            msgs[i].data = payload;
+            msgs[i].len = size;
+        }
+        sent += udp_sendmmsg(tx_ep, msgs, batch);
+    }
+
+    while (__atomic_load_n(&rx.done, __ATOMIC_SEQ_CST) == 0)
+        task_wait((uint32_t *)&rx.done, 0);
+    uint64_t ns = timer_timestamp_ns() - start;
+    end_task_kernel(rx_id);
+
+    udp_bench_sort(latencies, UDP_BENCH_PACKETS);
+    udp_bench_print("[CoreNetwork] UDP loopback size=", size);
+    udp_bench_print(" datagrams/s=", ns == 0 ? 0 : (UDP_BENCH_PACKETS * 1000000000ull) / ns);
+    udp_bench_print(" latency ns p50=", latencies[UDP_BENCH_PACKETS / 2]);
+    udp_bench_print(" p90=", latencies[(UDP_BENCH_PACKETS * 90) / 100]);
+    udp_bench_print(" p99=", latencies[(UDP_BENCH_PACKETS * 99) / 100]);
+    udp_bench_print(" p99.9=", latencies[(UDP_BENCH_PACKETS * 999) / 1000]);
+    udp_bench_print(" max=", latencies[UDP_BENCH_PACKETS - 1]);
+    DEBUG_PRINT("\r\n");
+
+    udp_close(tx_ep);
+    udp_close(rx_ep);
+    return 0;
+}
+
+int udp_bench() {
+    uint8_t *payload = malloc(NETWORK_RING_PAYLOAD);
+    uint32_t *latencies = malloc(sizeof(uint32_t) * UDP_BENCH_PACKETS);
+    if (payload == NULL || latencies == NULL) {
+        free(payload);
+        free(latencies);
+        return -1;
+    }
+    memset(payload, 0xA5, NETWORK_RING_PAYLOAD);
+
+    int ret = 0;
+    for (uint32_t i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++)
+        if (udp_bench_size(bench_sizes[i], payload, latencies) != 0)
+            ret = -1;
+
+    free(payload);
+    free(latencies);
+    return ret;
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2019 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINALSEMI_BLOCK_PRIV_H
+#define CARDINALSEMI_BLOCK_PRIV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <types.h>
+#include "SysInterrupts/interrupts.h"
+#include "CoreStorage/block.h"
+
+#define BLOCK_MAX_HWQS (64)
+#define BLOCK_MAX_CPUS (256)
+#define BLOCK_MERGE_SCAN (8)            //Requests at the back of a software queue a new bio is checked against
+
+#define BLOCK_READ_EXPIRE_NS (500 * 1000 * 1000ull)
+#define BLOCK_WRITE_EXPIRE_NS (5000 * 1000 * 1000ull)
+#define BLOCK_SCHED_BATCH (16)          //Requests dispatched in one sweep before the direction is reconsidered
+#define BLOCK_SCHED_WRITES_STARVED (2)  //Read batches allowed to go ahead of waiting writes
+
+//Per core queue a bio is placed in on the no-op path, drained by the hardware queue it maps to
+typedef struct {
+    block_request_t *head;
+    block_request_t *tail;
+    _Atomic int len;
+    int hwq;
+    int lock;
+} __attribute__((aligned(64))) block_swq_t;
+
+//Deadline scheduler state, requests are kept sorted by lba and in arrival order per direction
+typedef struct {
+    block_request_t *sort_head[2];
+    block_request_t *sort_tail[2];
+    block_request_t *fifo_head[2];
+    block_request_t *fifo_tail[2];
+    block_request_t *cursor[2];     //First request at or above head_pos, where the sweep continues
+    uint64_t head_pos[2];           //Sector just past the last request dispatched
+    int batch_dir;
+    int batch_left;
+    int writes_starved;
+} block_sched_t;
+
+typedef struct {
+    int idx;
+    int lock;
+    int inflight;
+
+    //Requests that go ahead of everything else, the ones without data and ones the driver turned away as busy
+    block_request_t *requeue_head;
+    block_request_t *requeue_tail;
+
+    //Software queues mapped to this one, drained round robin
+    int *swqs;
+    int swq_cnt;
+    int swq_rr;
+
+    block_sched_t sched;
+
+    uint64_t dispatched;
+    uint64_t busy;
+} __attribute__((aligned(64))) block_hwq_t;
+
+typedef struct block_dev {
+    block_device_desc_t desc;
+    bool scheduled;
+
+    int hwq_cnt;
+    block_hwq_t *hwqs;
+
+    int swq_cnt;
+    block_swq_t *swqs;
+    uint16_t cpu_swq[BLOCK_MAX_CPUS];   //Software queue of each core, indexed by APIC id
+
+    _Atomic uint64_t bios;
+    _Atomic uint64_t merges;
+    _Atomic uint64_t completions;
+    _Atomic uint64_t errors;
+
+    struct block_dev *next;
+} block_dev_t;
+
+static inline int block_dir(block_op_t op) {
+    return (op == block_op_write) ? 1 : 0;
+}
+
+//Software queue belonging to the core the caller is running on
+static inline block_swq_t *block_curswq(block_dev_t *dev) {
+    return &dev->swqs[dev->cpu_swq[interrupt_get_cpuidx() % BLOCK_MAX_CPUS]];
+}
+
+PRIVATE int block_init(void);
+
+//Append bio to the end of req, or put it in front, if the result is still something the device takes
+PRIVATE bool block_merge_back(block_dev_t *dev, block_request_t *req, block_bio_t *bio);
+PRIVATE bool block_merge_front(block_dev_t *dev, block_request_t *req, block_bio_t *bio);
+
+//Move every bio of next onto the end of req, next is done with afterwards
+PRIVATE bool block_merge_requests(block_dev_t *dev, block_request_t *req, block_request_t *next);
+
+//Deadline scheduler, called with the hardware queue locked
+PRIVATE void block_sched_init(block_sched_t *s);
+PRIVATE bool block_sched_merge(block_dev_t *dev, block_sched_t *s, block_bio_t *bio);
+PRIVATE void block_sched_insert(block_sched_t *s, block_request_t *req);
+PRIVATE block_request_t *block_sched_next(block_sched_t *s, uint64_t now);
+
+int block_stats();
+
+#endif
@@ -0,0 +1,511 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cardinal/local_spinlock.h>
+
+#include "SysTaskMgr/task.h"
+#include "SysTimer/timer.h"
+
+#include "block_priv.h"
+
+// Block device layer.
+// Every core submits into its own software queue, each of which feeds one of the device's hardware
+// queues, so cores sharing nothing never contend on a lock. A bio that continues a request still
+// waiting in the queue is merged into it instead of becoming a request of its own. Rotational
+// devices skip the software queues and go through a per hardware queue deadline scheduler, which
+// sweeps up the disk in batches while making sure no request waits past its deadline. Requests
+// are dispatched whenever a bio is queued or a request completes, as long as the hardware queue
+// has room, so nothing ever has to poll for completions.
+
+static block_dev_t *devs = NULL;
+static int devs_lock = 0;
+
+PRIVATE int block_init(void) {
+    devs = NULL;
+    return 0;
+}
+
+//Whether the data can run from the end of segment a straight into segment b within one request
+static bool block_seg_joinable(block_dev_t *dev, block_seg_t *a, block_seg_t *b) {
+    uint32_t bound = dev->desc.seg_boundary;
+    if (bound == 0)
+        return true;
+    return (((uintptr_t)a->addr + a->len) % bound) == 0 && ((uintptr_t)b->addr % bound) == 0;
+}
+
+static bool block_can_merge(block_dev_t *dev, block_request_t *req, block_op_t op, uint32_t sectors, uint32_t seg_cnt) {
+    return req->op == op && (op == block_op_read || op == block_op_write) &&
+           req->sectors + sectors <= dev->desc.max_sectors &&
+           req->seg_cnt + seg_cnt <= dev->desc.max_segs;
+}
+
+PRIVATE bool block_merge_back(block_dev_t *dev, block_request_t *req, block_bio_t *bio) {
+    block_bio_t *tail = req->bios_tail;
+    if (req->lba + req->sectors != bio->lba || !block_can_merge(dev, req, bio->op, bio->sectors, bio->seg_cnt))
+        return false;
+    if (!block_seg_joinable(dev, &tail->segs[tail->seg_cnt - 1], &bio->segs[0]))
+        return false;
+
+    bio->next = NULL;
+    tail->next = bio;
+    req->bios_tail = bio;
+    req->sectors += bio->sectors;
+    req->seg_cnt += bio->seg_cnt;
+    __atomic_add_fetch(&dev->merges, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+PRIVATE bool block_merge_front(block_dev_t *dev, block_request_t *req, block_bio_t *bio) {
+    if (bio->lba + bio->sectors != req->lba || !block_can_merge(dev, req, bio->op, bio->sectors, bio->seg_cnt))
+        return false;
+    if (!block_seg_joinable(dev, &bio->segs[bio->seg_cnt - 1], &req->bios->segs[0]))
+        return false;
+
+    bio->next = req->bios;
+    req->bios = bio;
+    req->lba = bio->lba;
+    req->sectors += bio->sectors;
+    req->seg_cnt += bio->seg_cnt;
+    __atomic_add_fetch(&dev->merges, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+PRIVATE bool block_merge_requests(block_dev_t *dev, block_request_t *req, block_request_t *next) {
+    block_bio_t *tail = req->bios_tail;
+    if (req->lba + req->sectors != next->lba || !block_can_merge(dev, req, next->op, next->sectors, next->seg_cnt))
+        return false;
+    if (!block_seg_joinable(dev, &tail->segs[tail->seg_cnt - 1], &next->bios->segs[0]))
+        return false;
+
+    tail->next = next->bios;
+    req->bios_tail = next->bios_tail;
+    req->sectors += next->sectors;
+    req->seg_cnt += next->seg_cnt;
+    __atomic_add_fetch(&dev->merges, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+int block_register(block_device_desc_t *desc, void **block_handle) {
+    if (desc->ops.submit == NULL || desc->sector_size == 0)
+        return -1;
+
+    block_dev_t *dev = (block_dev_t *)malloc(sizeof(block_dev_t));
+    if (dev == NULL)
+        return -1;
+    memset(dev, 0, sizeof(block_dev_t));
+    dev->desc = *desc;
+    dev->desc.queue_depth = MAX(desc->queue_depth, 1);
+    dev->desc.max_sectors = MAX(desc->max_sectors, 1);
+    dev->desc.max_segs = MAX(desc->max_segs, 1);
+    dev->scheduled = (desc->features & block_device_features_rotational) != 0;
+
+    //Every core gets its own software queue, spread over the hardware queues
+    int core_cnt = MIN(MAX(task_corecount(), 1), BLOCK_MAX_CPUS);
+    dev->hwq_cnt = MIN(MAX(desc->hwq_cnt, 1), BLOCK_MAX_HWQS);
+    dev->swq_cnt = core_cnt;
+    dev->hwqs = (block_hwq_t *)malloc(dev->hwq_cnt * sizeof(block_hwq_t));
+    dev->swqs = (block_swq_t *)malloc(dev->swq_cnt * sizeof(block_swq_t));
+    if (dev->hwqs == NULL || dev->swqs == NULL)
+        PANIC("[CoreStorage] Failed to allocate device queues.");
+    memset(dev->hwqs, 0, dev->hwq_cnt * sizeof(block_hwq_t));
+    memset(dev->swqs, 0, dev->swq_cnt * sizeof(block_swq_t));
+
+    for (int i = 0; i < dev->swq_cnt; i++) {
+        dev->swqs[i].hwq = i % dev->hwq_cnt;
+        int apic_id = task_coreapicid(i);
+        if (apic_id >= 0)
+            dev->cpu_swq[apic_id % BLOCK_MAX_CPUS] = (uint16_t)i;
+    }
+
+    for (int h = 0; h < dev->hwq_cnt; h++) {
+        block_hwq_t *hwq = &dev->hwqs[h];
+        hwq->idx = h;
+        block_sched_init(&hwq->sched);
+
+        hwq->swqs = (int *)malloc(((dev->swq_cnt + dev->hwq_cnt - 1) / dev->hwq_cnt) * sizeof(int));
+        if (hwq->swqs == NULL)
+            PANIC("[CoreStorage] Failed to allocate device queues.");
+        for (int i = h; i < dev->swq_cnt; i += dev->hwq_cnt)
+            hwq->swqs[hwq->swq_cnt++] = i;
+    }
+
+    int cli_state = cli();
+    local_spinlock_lock(&devs_lock);
+    dev->next = devs;
+    devs = dev;
+    local_spinlock_unlock(&devs_lock);
+    sti(cli_state);
+
+    DEBUG_PRINT("[CoreStorage] Registered Device: ");
+    DEBUG_PRINT(dev->desc.name);
+    DEBUG_PRINT(dev->scheduled ? " (deadline)\r\n" : " (none)\r\n");
+
+    *block_handle = dev;
+    return 0;
+}
+
+void *block_find(const char *name) {
+    block_dev_t *dev = NULL;
+
+    int cli_state = cli();
+    local_spinlock_lock(&devs_lock);
+    for (dev = devs; dev != NULL; dev = dev->next)
+        if (strncmp(dev->desc.name, name, sizeof(dev->desc.name)) == 0)
+            break;
+    local_spinlock_unlock(&devs_lock);
+    sti(cli_state);
+
+    return dev;
+}
+
+block_device_desc_t *block_getdesc(void *block_handle) {
+    return &((block_dev_t *)block_handle)->desc;
+}
+
+//Check the bio against the device's limits and set it up as a request of its own
+static int block_prepare(block_dev_t *dev, block_bio_t *bio) {
+    if (bio->callback == NULL)
+        return -1;
+
+    bio->next = NULL;
+    if (bio->op == block_op_flush) {
+        if (bio->seg_cnt != 0)
+            return -1;
+        bio->sectors = 0;
+    } else if (bio->op == block_op_discard || bio->op == block_op_write_zeroes) {
+        bool discard = bio->op == block_op_discard;
+        if (!(dev->desc.features & (discard ? block_device_features_discard : block_device_features_write_zeroes)))
+            return -1;
+        if (bio->seg_cnt != 0 || bio->sectors == 0 || bio->sectors > (discard ? dev->desc.max_discard_sectors : dev->desc.max_write_zeroes_sectors))
+            return -1;
+        if (bio->lba + bio->sectors > dev->desc.sector_cnt || bio->lba + bio->sectors < bio->lba)
+            return -1;
+    } else if (bio->op == block_op_read || bio->op == block_op_write) {
+        if (bio->seg_cnt == 0 || bio->seg_cnt > dev->desc.max_segs || bio->segs == NULL)
+            return -1;
+
+        uint64_t len = 0;
+        for (uint32_t i = 0; i < bio->seg_cnt; i++) {
+            if (bio->segs[i].len == 0)
+                return -1;
+            if (i > 0 && !block_seg_joinable(dev, &bio->segs[i - 1], &bio->segs[i]))
+                return -1;
+            len += bio->segs[i].len;
+        }
+
+        if (len % dev->desc.sector_size != 0)
+            return -1;
+        uint64_t sectors = len / dev->desc.sector_size;
+        if (sectors > dev->desc.max_sectors || bio->lba + sectors > dev->desc.sector_cnt || bio->lba + sectors < bio->lba)
+            return -1;
+        bio->sectors = (uint32_t)sectors;
+    } else
+        return -1;
+
+    block_request_t *req = &bio->req;
+    memset(req, 0, sizeof(block_request_t));
+    req->op = bio->op;
+    req->lba = bio->lba;
+    req->sectors = bio->sectors;
+    req->seg_cnt = bio->seg_cnt;
+    req->bios = bio;
+    req->bios_tail = bio;
+    return 0;
+}
+
+//Try the requests at the back of the software queue, the most recently queued are the likeliest neighbors
+static bool block_swq_merge(block_dev_t *dev, block_swq_t *swq, block_bio_t *bio) {
+    int scanned = 0;
+    for (block_request_t *req = swq->tail; req != NULL && scanned < BLOCK_MERGE_SCAN; req = req->prev, scanned++)
+        if (block_merge_back(dev, req, bio) || block_merge_front(dev, req, bio))
+            return true;
+    return false;
+}
+
+static void block_requeue_append(block_hwq_t *hwq, block_request_t *req) {
+    req->next = NULL;
+    if (hwq->requeue_tail != NULL)
+        hwq->requeue_tail->next = req;
+    else
+        hwq->requeue_head = req;
+    hwq->requeue_tail = req;
+}
+
+//Place a prepared bio in its queue, returns the hardware queue that should be dispatched
+static int block_queue(block_dev_t *dev, block_bio_t *bio) {
+    block_request_t *req = &bio->req;
+    __atomic_add_fetch(&dev->bios, 1, __ATOMIC_RELAXED);
+
+    int cli_state = cli();
+    block_swq_t *swq = block_curswq(dev);
+    block_hwq_t *hwq = &dev->hwqs[swq->hwq];
+    req->hwq = hwq->idx;
+
+    if (bio->op != block_op_read && bio->op != block_op_write) {
+        local_spinlock_lock(&hwq->lock);
+        block_requeue_append(hwq, req);
+        local_spinlock_unlock(&hwq->lock);
+    } else if (dev->scheduled) {
+        req->deadline = timer_timestamp_ns() + (bio->op == block_op_write ? BLOCK_WRITE_EXPIRE_NS : BLOCK_READ_EXPIRE_NS);
+        local_spinlock_lock(&hwq->lock);
+        if (!block_sched_merge(dev, &hwq->sched, bio))
+            block_sched_insert(&hwq->sched, req);
+        local_spinlock_unlock(&hwq->lock);
+    } else {
+        local_spinlock_lock(&swq->lock);
+        if (!block_swq_merge(dev, swq, bio)) {
+            req->next = NULL;
+            req->prev = swq->tail;
+            if (swq->tail != NULL)
+                swq->tail->next = req;
+            else
+                swq->head = req;
+            swq->tail = req;
+            swq->len++;
+        }
+        local_spinlock_unlock(&swq->lock);
+    }
+    sti(cli_state);
+
+    return hwq->idx;
+}
+
+//Next request of one of the software queues feeding hwq, taking turns between them
+static block_request_t *block_swq_pop(block_dev_t *dev, block_hwq_t *hwq) {
+    for (int i = 0; i < hwq->swq_cnt; i++) {
+        int idx = (hwq->swq_rr + i) % hwq->swq_cnt;
+        block_swq_t *swq = &dev->swqs[hwq->swqs[idx]];
+        if (__atomic_load_n(&swq->len, __ATOMIC_RELAXED) == 0)
+            continue;
+
+        local_spinlock_lock(&swq->lock);
+        block_request_t *req = swq->head;
+        if (req != NULL) {
+            swq->head = req->next;
+            if (swq->head != NULL)
+                swq->head->prev = NULL;
+            else
+                swq->tail = NULL;
+            swq->len--;
+        }
+        local_spinlock_unlock(&swq->lock);
+
+        if (req != NULL) {
+            hwq->swq_rr = (idx + 1) % hwq->swq_cnt;
+            return req;
+        }
+    }
+    return NULL;
+}
+
+//Run the callbacks of every bio in the request
+static void block_finish(block_dev_t *dev, block_request_t *req, int status) {
+    __atomic_add_fetch(status == 0 ? &dev->completions : &dev->errors, 1, __ATOMIC_RELAXED);
+
+    //req lives in one of its bios, which may be gone once that bio's callback has run
+    block_bio_t *bio = req->bios;
+    while (bio != NULL) {
+        block_bio_t *next = bio->next;
+        bio->callback(bio, status);
+        bio = next;
+    }
+}
+
+//Hand queued requests to the driver until the hardware queue is full or nothing is left
+static void block_dispatch(block_dev_t *dev, block_hwq_t *hwq) {
+    block_request_t *failed = NULL;
+    int submitted = 0;
+
+    int cli_state = cli();
+    local_spinlock_lock(&hwq->lock);
+    uint64_t now = dev->scheduled ? timer_timestamp_ns() : 0;
+    while (hwq->inflight < dev->desc.queue_depth) {
+        block_request_t *req = hwq->requeue_head;
+        if (req != NULL) {
+            hwq->requeue_head = req->next;
+            if (hwq->requeue_head == NULL)
+                hwq->requeue_tail = NULL;
+        } else if (dev->scheduled)
+            req = block_sched_next(&hwq->sched, now);
+        else
+            req = block_swq_pop(dev, hwq);
+        if (req == NULL)
+            break;
+
+        int ret = dev->desc.ops.submit(dev->desc.state, hwq->idx, req);
+        if (ret == 0) {
+            hwq->inflight++;
+            hwq->dispatched++;
+            submitted++;
+        } else if (ret == -2) {
+            //Goes first once there's room again
+            req->next = hwq->requeue_head;
+            hwq->requeue_head = req;
+            if (hwq->requeue_tail == NULL)
+                hwq->requeue_tail = req;
+            hwq->busy++;
+            break;
+        } else {
+            req->next = failed;
+            failed = req;
+        }
+    }
+    if (submitted != 0 && dev->desc.ops.commit != NULL)
+        dev->desc.ops.commit(dev->desc.state, hwq->idx);
+    local_spinlock_unlock(&hwq->lock);
+    sti(cli_state);
+
+    while (failed != NULL) {
+        block_request_t *next = failed->next;
+        block_finish(dev, failed, -1);
+        failed = next;
+    }
+}
+
+int block_submit(void *block_handle, block_bio_t *bio) {
+    block_dev_t *dev = (block_dev_t *)block_handle;
+    if (block_prepare(dev, bio) != 0)
+        return -1;
+
+    //Nothing to write back
+    if (bio->op == block_op_flush && !(dev->desc.features & block_device_features_flush)) {
+        block_finish(dev, &bio->req, 0);
+        return 0;
+    }
+
+    block_dispatch(dev, &dev->hwqs[block_queue(dev, bio)]);
+    return 0;
+}
+
+int block_submit_batch(void *block_handle, block_bio_t **bios, int cnt) {
+    block_dev_t *dev = (block_dev_t *)block_handle;
+    uint64_t pending[(BLOCK_MAX_HWQS + 63) / 64];
+    memset(pending, 0, sizeof(pending));
+
+    int accepted = 0;
+    for (int i = 0; i < cnt; i++) {
+        if (block_prepare(dev, bios[i]) != 0)
+            continue;
+        accepted++;
+
+        if (bios[i]->op == block_op_flush && !(dev->desc.features & block_device_features_flush)) {
+            block_finish(dev, &bios[i]->req, 0);
+            continue;
+        }
+
+        int h = block_queue(dev, bios[i]);
+        pending[h / 64] |= (1ull << (h % 64));
+    }
+
+    for (int h = 0; h < dev->hwq_cnt; h++)
+        if (pending[h / 64] & (1ull << (h % 64)))
+            block_dispatch(dev, &dev->hwqs[h]);
+    return accepted;
+}
+
+void block_complete(void *block_handle, block_request_t *req, int status) {
+    block_dev_t *dev = (block_dev_t *)block_handle;
+    block_hwq_t *hwq = &dev->hwqs[req->hwq];
+
+    int cli_state = cli();
+    local_spinlock_lock(&hwq->lock);
+    hwq->inflight--;
+    local_spinlock_unlock(&hwq->lock);
+    sti(cli_state);
+
+    //Keep the device busy first, the callbacks may take a while
+    block_dispatch(dev, hwq);
+    block_finish(dev, req, status);
+}
+
+void block_kick(void *block_handle, int hwq) {
+    block_dev_t *dev = (block_dev_t *)block_handle;
+    if (hwq >= 0 && hwq < dev->hwq_cnt)
+        block_dispatch(dev, &dev->hwqs[hwq]);
+}
+
+typedef struct {
+    _Atomic uint32_t done;
+    int status;
+} block_sync_t;
+
+static void block_sync_callback(block_bio_t *bio, int status) {
+    block_sync_t *sync = (block_sync_t *)bio->arg;
+    sync->status = status;
+    __atomic_store_n(&sync->done, 1, __ATOMIC_SEQ_CST);
+    task_wake((uint32_t *)&sync->done, 1);
+}
+
+static int block_sync(void *block_handle, block_op_t op, uint64_t lba, void *addr, uint32_t len) {
+    block_sync_t sync;
+    sync.done = 0;
+    sync.status = 0;
+
+    block_seg_t seg;
+    seg.addr = addr;
+    seg.len = len;
+
+    block_bio_t bio;
+    memset(&bio, 0, sizeof(bio));
+    bio.op = op;
+    bio.lba = lba;
+    bio.segs = (op == block_op_flush) ? NULL : &seg;
+    bio.seg_cnt = (op == block_op_flush) ? 0 : 1;
+    bio.callback = block_sync_callback;
+    bio.arg = &sync;
+
+    if (block_submit(block_handle, &bio) != 0)
+        return -1;
+    while (__atomic_load_n(&sync.done, __ATOMIC_SEQ_CST) == 0)
+        task_wait((uint32_t *)&sync.done, 0);
+    return sync.status;
+}
+
+int block_read(void *block_handle, uint64_t lba, void *addr, uint32_t len) {
+    return block_sync(block_handle, block_op_read, lba, addr, len);
+}
+
+int block_write(void *block_handle, uint64_t lba, void *addr, uint32_t len) {
+    return block_sync(block_handle, block_op_write, lba, addr, len);
+}
+
+int block_flush(void *block_handle) {
+    return block_sync(block_handle, block_op_flush, 0, NULL, 0);
+}
+
+//Per device counters
+int block_stats() {
+    char tmp[20];
+    for (block_dev_t *dev = devs; dev != NULL; dev = dev->next) {
+        uint64_t dispatched = 0;
+        uint64_t busy = 0;
+        for (int h = 0; h < dev->hwq_cnt; h++) {
+            dispatched += dev->hwqs[h].dispatched;
+            busy += dev->hwqs[h].busy;
+        }
+
+        DEBUG_PRINT("[CoreStorage] ");
+        DEBUG_PRINT(dev->desc.name);
+        DEBUG_PRINT(" bios: ");
+        DEBUG_PRINT(ltoa(dev->bios, tmp, 10));
+        DEBUG_PRINT(" merged: ");
+        DEBUG_PRINT(ltoa(dev->merges, tmp, 10));
+        DEBUG_PRINT(" requests: ");
+        DEBUG_PRINT(ltoa(dispatched, tmp, 10));
+        DEBUG_PRINT(" completed: ");
+        DEBUG_PRINT(ltoa(dev->completions, tmp, 10));
+        DEBUG_PRINT(" errors: ");
+        DEBUG_PRINT(ltoa(dev->errors, tmp, 10));
+        DEBUG_PRINT(" busy: ");
+        DEBUG_PRINT(ltoa(busy, tmp, 10));
+        DEBUG_PRINT("\r\n");
+    }
+    return 0;
+}
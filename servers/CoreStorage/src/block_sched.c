@@ -0,0 +1,176 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_priv.h"
+
+// Deadline scheduler for rotational devices.
+// Reads and writes are each kept sorted by sector and in arrival order. Requests go out in batches
+// of BLOCK_SCHED_BATCH, sweeping up the disk from where the last one ended, so the head mostly
+// moves in one direction. Reads are preferred, writes only get a batch of their own once they have
+// been passed over BLOCK_SCHED_WRITES_STARVED times. A batch begins with the oldest request instead
+// of the sweep position whenever that one has waited past its deadline.
+
+PRIVATE void block_sched_init(block_sched_t *s) {
+    memset(s, 0, sizeof(block_sched_t));
+}
+
+static void block_sched_remove(block_sched_t *s, block_request_t *req) {
+    int dir = block_dir(req->op);
+
+    if (s->cursor[dir] == req)
+        s->cursor[dir] = req->next;
+
+    if (req->prev != NULL)
+        req->prev->next = req->next;
+    else
+        s->sort_head[dir] = req->next;
+    if (req->next != NULL)
+        req->next->prev = req->prev;
+    else
+        s->sort_tail[dir] = req->prev;
+
+    if (req->fifo_prev != NULL)
+        req->fifo_prev->fifo_next = req->fifo_next;
+    else
+        s->fifo_head[dir] = req->fifo_next;
+    if (req->fifo_next != NULL)
+        req->fifo_next->fifo_prev = req->fifo_prev;
+    else
+        s->fifo_tail[dir] = req->fifo_prev;
+
+    req->prev = req->next = NULL;
+    req->fifo_prev = req->fifo_next = NULL;
+}
+
+//next has been merged into req, req takes over next's place in the fifo if next was older
+static void block_sched_absorb(block_sched_t *s, block_request_t *req, block_request_t *next) {
+    int dir = block_dir(req->op);
+    block_request_t *after = next->fifo_next;
+    bool older = next->deadline < req->deadline;
+    block_sched_remove(s, next);
+    if (!older)
+        return;
+
+    req->deadline = next->deadline;
+    if (after == req)
+        return;
+
+    //next was ahead of req, so after is too and stays in the list
+    if (req->fifo_prev != NULL)
+        req->fifo_prev->fifo_next = req->fifo_next;
+    else
+        s->fifo_head[dir] = req->fifo_next;
+    if (req->fifo_next != NULL)
+        req->fifo_next->fifo_prev = req->fifo_prev;
+    else
+        s->fifo_tail[dir] = req->fifo_prev;
+
+    req->fifo_next = after;
+    req->fifo_prev = after->fifo_prev;
+    if (req->fifo_prev != NULL)
+        req->fifo_prev->fifo_next = req;
+    else
+        s->fifo_head[dir] = req;
+    after->fifo_prev = req;
+}
+
+//Last request starting at or below lba, the sorted list is searched from the top since submitters
+//mostly move upwards
+static block_request_t *block_sched_floor(block_sched_t *s, int dir, uint64_t lba) {
+    block_request_t *req = s->sort_tail[dir];
+    while (req != NULL && req->lba > lba)
+        req = req->prev;
+    return req;
+}
+
+PRIVATE bool block_sched_merge(block_dev_t *dev, block_sched_t *s, block_bio_t *bio) {
+    int dir = block_dir(bio->op);
+    block_request_t *prev = block_sched_floor(s, dir, bio->lba);
+    block_request_t *next = (prev != NULL) ? prev->next : s->sort_head[dir];
+
+    if (prev != NULL && block_merge_back(dev, prev, bio)) {
+        //The gap to the following request may have just closed
+        if (prev->next != NULL && block_merge_requests(dev, prev, prev->next))
+            block_sched_absorb(s, prev, prev->next);
+        return true;
+    }
+
+    if (next != NULL && block_merge_front(dev, next, bio)) {
+        if (next->prev != NULL && block_merge_requests(dev, next->prev, next))
+            block_sched_absorb(s, next->prev, next);
+        return true;
+    }
+    return false;
+}
+
+PRIVATE void block_sched_insert(block_sched_t *s, block_request_t *req) {
+    int dir = block_dir(req->op);
+
+    block_request_t *prev = block_sched_floor(s, dir, req->lba);
+    req->prev = prev;
+    req->next = (prev != NULL) ? prev->next : s->sort_head[dir];
+    if (req->prev != NULL)
+        req->prev->next = req;
+    else
+        s->sort_head[dir] = req;
+    if (req->next != NULL)
+        req->next->prev = req;
+    else
+        s->sort_tail[dir] = req;
+
+    //Deadlines only grow, so arrival order is deadline order
+    req->fifo_next = NULL;
+    req->fifo_prev = s->fifo_tail[dir];
+    if (s->fifo_tail[dir] != NULL)
+        s->fifo_tail[dir]->fifo_next = req;
+    else
+        s->fifo_head[dir] = req;
+    s->fifo_tail[dir] = req;
+
+    //Still ahead of the head, the sweep picks it up on the way
+    if (req->lba >= s->head_pos[dir] && (s->cursor[dir] == NULL || req->lba < s->cursor[dir]->lba))
+        s->cursor[dir] = req;
+}
+
+PRIVATE block_request_t *block_sched_next(block_sched_t *s, uint64_t now) {
+    int dir = s->batch_dir;
+    block_request_t *req = NULL;
+
+    if (s->batch_left > 0 && s->cursor[dir] != NULL && s->fifo_head[dir]->deadline > now) {
+        req = s->cursor[dir];
+    } else {
+        bool reads = s->fifo_head[0] != NULL;
+        bool writes = s->fifo_head[1] != NULL;
+        if (reads && (!writes || s->writes_starved < BLOCK_SCHED_WRITES_STARVED)) {
+            dir = 0;
+            if (writes)
+                s->writes_starved++;
+        } else if (writes) {
+            dir = 1;
+            s->writes_starved = 0;
+        } else
+            return NULL;
+
+        //Once the sweep runs off the top of the disk, or something expired, start at the oldest
+        req = s->cursor[dir];
+        if (req == NULL || s->fifo_head[dir]->deadline <= now)
+            req = s->fifo_head[dir];
+        s->batch_dir = dir;
+        s->batch_left = BLOCK_SCHED_BATCH;
+    }
+
+    s->batch_left--;
+    s->head_pos[dir] = req->lba + req->sectors;
+    block_request_t *following = req->next;
+    block_sched_remove(s, req);
+    s->cursor[dir] = following;
+    return req;
+}
@@ -5,11 +5,15 @@
  * https://opensource.org/licenses/MIT
  */
 
-//TODO: register/deregister storage devices
+#include "block_priv.h"
+
 //TODO: register file system providers
 //TODO: handle file IO syscalls
 
 int module_init() {
 
+    if (block_init() != 0)
+        PANIC("[CoreStorage] Failed to set up the block layer.");
+
     return 0;
-}
\ No newline at end of file
+}
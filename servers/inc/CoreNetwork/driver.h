@@ -7,9 +7,16 @@
 #define CARDINAL_SEMI_CORENETWORK_DRIVER_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "CoreNetwork/netbuf.h"
 
 typedef enum {
-    network_device_features_checksum_offload = (1 << 0),
+    network_device_features_checksum_offload = (1 << 0),  //Fills in TCP/UDP checksums on transmit
+    network_device_features_tso4 = (1 << 1),              //Segments TCP over IPv4 super-packets up to gso_max_size
+    network_device_features_tso6 = (1 << 2),              //Segments TCP over IPv6 super-packets up to gso_max_size
+    network_device_features_rx_checksum = (1 << 3),       //Marks received packets it verified with NETBUF_F_CSUM_VALID
+    network_device_features_rx_coalesce = (1 << 4),       //Hands received super-packets up as a single netbuf chain
+    network_device_features_loopback = (1 << 5),          //Everything sent is received back, no neighbor resolution needed
 } network_device_features_t;
 
 typedef enum {
@@ -22,10 +29,34 @@ typedef enum {
     network_device_tx_flag_ipv4_csum = (1 << 0),
     network_device_tx_flag_tcpv4_csum = (1 << 1),
     network_device_tx_flag_udpv4_csum = (1 << 2),
+    network_device_tx_flag_tcpv6_csum = (1 << 3),
+    network_device_tx_flag_udpv6_csum = (1 << 4),
+    network_device_tx_flag_tcpv4_tso = (1 << 5),
+    network_device_tx_flag_tcpv6_tso = (1 << 6),
 } network_device_tx_flags_t;
 
+//Offloads are requested per packet through netbuf tx_flags, csum_start, hdr_len and gso_size.
+//For checksum offload the checksum field already holds the folded pseudo-header sum, the device adds
+//in everything from csum_start to the end of the packet. Segmentation implies the TCP checksum.
+//Returns the offset of the checksum field from csum_start, or -1 if no checksum was requested.
+static inline int network_tx_csum_offset(int tx_flags)
+{
+    if (tx_flags & (network_device_tx_flag_tcpv4_csum | network_device_tx_flag_tcpv6_csum | network_device_tx_flag_tcpv4_tso | network_device_tx_flag_tcpv6_tso))
+        return 16;
+    if (tx_flags & (network_device_tx_flag_udpv4_csum | network_device_tx_flag_udpv6_csum))
+        return 6;
+    return -1;
+}
+
+//tx takes ownership of the netbuf chain and frees it once the device is done with it, flags are
+//applied on top of the packet's own tx_flags
+//tx_burst is optional, it posts as many of the cnt packets to the given transmit queue as the ring
+//has room for and notifies the device once for all of them. It returns how many packets it took from
+//the front of nbs, those belong to the device afterwards even if it had to drop them, the rest stay
+//with the caller. The driver may swap an entry for a copy of the same packet before taking it.
 typedef struct {
-    int (*tx)(void *state, void *packet, int len, network_device_tx_flags_t flags);
+    int (*tx)(void *state, netbuf_t *nb, network_device_tx_flags_t flags);
+    int (*tx_burst)(void *state, int queue, netbuf_t **nbs, int cnt, network_device_tx_flags_t flags);
     int (*link_status)(void *state);
 } network_ethernet_handlers_t;
 
@@ -34,7 +65,7 @@ typedef enum {
 } network_ethernet_features_t;
 
 typedef struct {
-    int (*tx)(void *packet, int len, network_device_tx_flags_t flags);
+    int (*tx)(void *state, netbuf_t *nb, network_device_tx_flags_t flags);
     //TODO: add scan handlers
     int (*start_scan)();
     int (*finish_scan)();
@@ -55,6 +86,12 @@ typedef struct {
 
     uint8_t mac[6];
 
+    //Largest packet, link header included, accepted with network_device_features_tso4/6
+    uint32_t gso_max_size;
+
+    //Receive/transmit queue pairs, queue n is serviced on scheduler core n. 0 is treated as 1.
+    int queue_cnt;
+
     union {
         network_ethernet_handlers_t ether;
         network_wifi_handlers_t wifi;
@@ -70,6 +107,23 @@ typedef struct {
 
 int network_register(network_device_desc_t *desc, void **network_handle);
 
-int network_rx_packet(void *interface_handle, void *packet, int len);
+//Takes ownership of nb, drivers hand over the buffer they received into and post a fresh one
+int network_rx_packet(void *interface_handle, netbuf_t *nb);
+
+//Receive polling, the interrupt handler masks the device's receive interrupt and schedules the poll
+//task, which keeps calling poll until the ring is drained and only then calls rearm.
+typedef struct {
+    //Process up to budget received packets and pass them to network_rx_packet, returns how many were processed
+    int (*poll)(void *state, int budget);
+    //Unmask the receive interrupt, returns true if packets arrived after the last poll
+    bool (*rearm)(void *state);
+} network_poll_handlers_t;
+
+//Create a poll task for one receive queue of a registered device, state is passed to the handlers
+//The task is kept on the queue's core whenever the device has more than one queue
+int network_poll_create(void *interface_handle, int queue, network_poll_handlers_t *handlers, void *state, void **poll_handle);
+
+//Safe to call from an interrupt handler, the device's receive interrupt must already be masked
+void network_poll_schedule(void *poll_handle);
 
 #endif
\ No newline at end of file
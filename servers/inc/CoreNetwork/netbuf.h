@@ -0,0 +1,83 @@
+// Copyright (c) 2018 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINAL_SEMI_CORENETWORK_NETBUF_H
+#define CARDINAL_SEMI_CORENETWORK_NETBUF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <types.h>
+
+#define NETBUF_SIZE KiB(2)                          //Backing buffer of a segment, never crosses a page
+#define NETBUF_HEADROOM (128)                       //Reserved in front of received/allocated data for prepended headers
+#define NETBUF_DATA_SIZE (NETBUF_SIZE - NETBUF_HEADROOM)
+
+//netbuf_t.flags
+#define NETBUF_F_CSUM_VALID (1 << 0)    //The device already verified the TCP/UDP checksum of this received packet
+
+typedef struct netbuf
+{
+    uint8_t *buf;               //Start of the backing buffer
+    uintptr_t buf_phys;
+    uint8_t *data;              //First byte of this segment's data
+    uint16_t len;               //Bytes at data in this segment
+    _Atomic uint16_t refcnt;
+    uint32_t tot_len;           //Bytes in the whole chain, only maintained on the head, super-packets exceed 64KiB
+    uint16_t flags;             //NETBUF_F_*
+    uint16_t tx_flags;          //network_device_tx_flags_t offloads this packet needs from the device
+    uint16_t csum_start;        //Offset of the TCP/UDP header from data, used by checksum and segmentation offload
+    uint16_t hdr_len;           //Bytes of headers in front of the payload, used by segmentation offload
+    uint16_t gso_size;          //Payload bytes per segment the device cuts a super-packet into
+    uint32_t hash;              //Flow hash reported by the NIC, 0 if it didn't provide one
+    struct netbuf *next;        //Next segment of a scatter-gather chain
+    struct netbuf *q_next;      //Free for whoever holds the packet to queue it
+    void *interface;            //Receiving interface
+    struct netbuf *parent;      //Set on clones, data points into the parent's buffer which they hold a reference to
+} netbuf_t;
+
+//Returns a single segment with NETBUF_HEADROOM bytes reserved and no data, or NULL if the pool is exhausted
+netbuf_t *netbuf_alloc(void);
+
+//Drop a reference to every segment of the chain, segments return to the pool once unreferenced
+void netbuf_free(netbuf_t *nb);
+
+//Take an additional reference to every segment of the chain
+netbuf_t *netbuf_ref(netbuf_t *nb);
+
+//Prepend len bytes to the head segment, NULL if the headroom is exhausted
+void *netbuf_push(netbuf_t *nb, int len);
+
+//Strip len bytes from the front of the head segment, NULL if the segment is shorter than that
+void *netbuf_pull(netbuf_t *nb, int len);
+
+//Append len bytes to the end of the head segment, NULL if it doesn't fit
+void *netbuf_put(netbuf_t *nb, int len);
+
+//Segment referring to len bytes of nb's data starting at offset, without copying them. Clones are
+//read-only and have no headroom, NULL if the pool is exhausted.
+netbuf_t *netbuf_clone(netbuf_t *nb, int offset, int len);
+
+//Append seg and the segments following it to the chain
+void netbuf_chain(netbuf_t *nb, netbuf_t *seg);
+
+//Copy the chain into dst, returns the number of bytes copied
+int netbuf_copyout(netbuf_t *nb, void *dst, int len);
+
+int netbuf_segcount(netbuf_t *nb);
+
+static inline uintptr_t netbuf_phys(netbuf_t *nb)
+{
+    netbuf_t *owner = (nb->parent != NULL) ? nb->parent : nb;
+    return owner->buf_phys + (uintptr_t)(nb->data - owner->buf);
+}
+
+static inline int netbuf_tailroom(netbuf_t *nb)
+{
+    if (nb->parent != NULL)
+        return 0;
+    return NETBUF_SIZE - (int)(nb->data - nb->buf) - nb->len;
+}
+
+#endif
@@ -0,0 +1,139 @@
+// Copyright (c) 2018 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINALSEMI_CORENETWORK_SOCKET_H
+#define CARDINALSEMI_CORENETWORK_SOCKET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <types.h>
+#include "cs_syscall.h"
+#include "CoreNetwork/netbuf.h"
+
+// Datagrams are delivered into a single-producer/single-consumer ring per endpoint. The ring can
+// be mapped into the consuming task, which then reads datagrams straight out of it: it only
+// enters the kernel to sleep when the ring is empty, by setting waiting and waiting on head.
+// CoreNetwork is the only producer, it wakes head after publishing if waiting was set.
+
+#define NETWORK_RING_SLOTS (512)                     //Power of two
+#define NETWORK_RING_SLOT_SIZE KiB(2)
+#define NETWORK_RING_PAYLOAD ((int)(NETWORK_RING_SLOT_SIZE - 32))
+
+typedef struct {
+    uint8_t addr[16];       //Sender, IPv4 in the ::ffff:a.b.c.d mapped form
+    uint16_t port;          //Sender's port, host order
+    uint16_t len;           //Bytes at data
+    uint32_t rsvd;
+    uint64_t timestamp;     //When the datagram was queued, in timer_timestamp_ns time
+    uint8_t data[NETWORK_RING_PAYLOAD];
+} network_ring_slot_t;
+
+typedef struct {
+    _Atomic uint32_t head;          //Written by the producer, slots before it are readable
+    uint32_t rsvd0[15];
+    _Atomic uint32_t tail;          //Written by the consumer, slots before it are free again
+    _Atomic uint32_t waiting;       //Set by a consumer about to sleep on head
+    uint32_t rsvd1[14];
+    network_ring_slot_t slots[NETWORK_RING_SLOTS];
+} network_ring_t;
+
+#define NETWORK_RING_BYTES ((sizeof(network_ring_t) + KiB(4) - 1) & ~(KiB(4) - 1))
+
+//Datagrams ready to be read
+static inline uint32_t network_ring_avail(network_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+//The n-th unread datagram, n < network_ring_avail
+static inline network_ring_slot_t *network_ring_slot(network_ring_t *ring, uint32_t n) {
+    return &ring->slots[(__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) + n) & (NETWORK_RING_SLOTS - 1)];
+}
+
+//Hand cnt read slots back to the producer
+static inline void network_ring_release(network_ring_t *ring, uint32_t cnt) {
+    __atomic_store_n(&ring->tail, __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) + cnt, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+    uint8_t addr[16];       //IPv6, IPv4 in the ::ffff:a.b.c.d mapped form, all zeroes for any
+    uint16_t port;          //Host order, 0 for any
+} network_sockaddr_t;
+
+typedef struct {
+    network_sockaddr_t addr;    //Destination when sending, sender when receiving
+    void *data;
+    int len;                    //Bytes at data, when receiving the buffer size going in and the datagram's length coming out
+} network_msg_t;
+
+typedef struct udp_endpoint udp_endpoint_t;
+
+udp_endpoint_t *udp_create(void);
+
+//Port 0 picks a free ephemeral port, the chosen one is written back
+int udp_bind(udp_endpoint_t *ep, network_sockaddr_t *local);
+
+//Only accept datagrams from remote and send to it by default, binds an ephemeral port first if needed
+int udp_connect(udp_endpoint_t *ep, const network_sockaddr_t *remote);
+
+//Returns the number of bytes sent, the destination may be left zeroed on connected endpoints
+int udp_sendmsg(udp_endpoint_t *ep, const network_msg_t *msg);
+
+//Returns the number of messages sent, consecutive ones to the same destination are queued together
+int udp_sendmmsg(udp_endpoint_t *ep, const network_msg_t *msgs, int cnt);
+
+//Returns the datagram's length or -1 if none is waiting, datagrams longer than the buffer are truncated
+int udp_recvmsg(udp_endpoint_t *ep, network_msg_t *msg);
+
+//Returns the number of messages received, with wait set blocks until there is at least one
+int udp_recvmmsg(udp_endpoint_t *ep, network_msg_t *msgs, int cnt, bool wait);
+
+//The endpoint's receive ring, for consumers inside CoreNetwork's address space
+network_ring_t *udp_ring(udp_endpoint_t *ep);
+
+//Map the receive ring NETWORK_RING_BYTES long at vaddr in task, it stays mapped until the endpoint is closed
+int udp_ring_map(udp_endpoint_t *ep, cs_id task, intptr_t vaddr);
+
+void udp_close(udp_endpoint_t *ep);
+
+typedef struct tcp_conn tcp_conn_t;
+
+//tcp_send flags
+#define TCP_SEND_MORE (1 << 0)      //More data follows right away, hold back a partial segment
+
+typedef enum {
+    tcp_opt_nodelay = 0,        //Send partial segments while earlier data is unacknowledged, turns off Nagle
+    tcp_opt_cork = 1,           //Hold back partial segments until uncorked
+} tcp_opt_t;
+
+//Passive open, port 0 picks an ephemeral port and writes it back
+tcp_conn_t *tcp_listen(network_sockaddr_t *local, int backlog);
+
+//Next established connection, NULL if there is none and wait isn't set or the listener was closed
+tcp_conn_t *tcp_accept(tcp_conn_t *listener, bool wait);
+
+//Active open, blocks until the connection is established, NULL if it couldn't be
+tcp_conn_t *tcp_connect(const network_sockaddr_t *remote);
+
+//Copy len bytes into the send buffer, blocking while it's full. Returns the bytes queued, -1 once the connection failed.
+int tcp_send(tcp_conn_t *c, const void *data, int len, int flags);
+
+//Queue a netbuf chain without copying it, the connection takes ownership of nb and only keeps references to it
+int tcp_send_netbuf(tcp_conn_t *c, netbuf_t *nb, int flags);
+
+//Returns the bytes read, 0 once the peer closed its side, -1 if nothing is waiting and wait isn't set or on error
+int tcp_recv(tcp_conn_t *c, void *data, int len, bool wait);
+
+int tcp_setopt(tcp_conn_t *c, tcp_opt_t opt, int val);
+
+//Switch congestion control, "newreno" or "cubic"
+int tcp_setcc(tcp_conn_t *c, const char *name);
+
+//Send a FIN once everything queued went out, receiving continues
+int tcp_shutdown(tcp_conn_t *c);
+
+//Shut down and release the connection, it lingers in the stack until the close handshake finishes
+void tcp_close(tcp_conn_t *c);
+
+#endif
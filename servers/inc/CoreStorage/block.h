@@ -0,0 +1,145 @@
+// Copyright (c) 2019 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef CARDINAL_SEMI_CORESTORAGE_BLOCK_H
+#define CARDINAL_SEMI_CORESTORAGE_BLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    block_op_read = 0,
+    block_op_write = 1,
+    block_op_flush = 2,         //Make completed writes durable, carries no data
+    block_op_discard = 3,       //The sectors' contents are no longer needed, carries no data
+    block_op_write_zeroes = 4,  //Zero the sectors without transferring a buffer of zeroes
+} block_op_t;
+
+typedef enum {
+    block_device_features_rotational = (1 << 0),    //Seeks are expensive, requests go through the deadline scheduler
+    block_device_features_flush = (1 << 1),         //Has a volatile write cache that block_op_flush empties
+    block_device_features_discard = (1 << 2),       //Takes block_op_discard, up to max_discard_sectors at a time
+    block_device_features_write_zeroes = (1 << 3),  //Takes block_op_write_zeroes, up to max_write_zeroes_sectors at a time
+} block_device_features_t;
+
+//A piece of kernel virtual memory, it doesn't have to be physically contiguous
+typedef struct {
+    void *addr;
+    uint32_t len;
+} block_seg_t;
+
+struct block_bio;
+struct block_request;
+
+//Runs once the bio has finished, status is 0 on success, usually from the device's interrupt handler
+typedef void (*block_callback_t)(struct block_bio *bio, int status);
+
+//What a driver is handed, one or more bios covering consecutive sectors with the same op.
+//The data is the segments of every bio in the bios chain, in order.
+typedef struct block_request {
+    block_op_t op;
+    uint64_t lba;
+    uint32_t sectors;
+    uint32_t seg_cnt;
+    struct block_bio *bios;
+    struct block_bio *bios_tail;
+
+    //Belongs to the driver from submit until block_complete
+    uintptr_t driver_data;
+
+    //Owned by the block layer
+    struct block_request *prev;
+    struct block_request *next;
+    struct block_request *fifo_prev;
+    struct block_request *fifo_next;
+    uint64_t deadline;
+    int hwq;
+} block_request_t;
+
+//A single transfer as the submitter describes it, owned by the block layer from block_submit until
+//its callback runs
+typedef struct block_bio {
+    block_op_t op;
+    uint64_t lba;               //In device sectors
+    block_seg_t *segs;          //Must stay valid until the callback
+    uint32_t seg_cnt;
+    block_callback_t callback;
+    void *arg;
+
+    //Set by the submitter for discard and write-zeroes, the block layer fills it in from the segments otherwise
+    uint32_t sectors;
+
+    //Filled in by the block layer
+    struct block_bio *next;     //Next bio merged into the same request
+    block_request_t req;        //Used when this bio starts a request of its own
+} block_bio_t;
+
+//submit starts the request on hardware queue hwq and returns 0, -2 if the queue has no room right
+//now, or -1 if the device can't do it. It runs with the queue locked and interrupts off, so it must
+//not call block_complete itself. Requests are never larger than max_sectors/max_segs and never put
+//more than queue_depth of them on one queue at a time.
+//commit is optional, it's called once after a run of submits to the same queue, so a driver can
+//ring the doorbell once for all of them.
+typedef struct {
+    int (*submit)(void *state, int hwq, block_request_t *req);
+    void (*commit)(void *state, int hwq);
+} block_device_ops_t;
+
+typedef struct {
+    char name[32];
+
+    void *state;
+
+    block_device_features_t features;
+
+    uint32_t sector_size;
+    uint64_t sector_cnt;
+
+    //Hardware submission queues and how many requests each one holds. 0 is treated as 1.
+    int hwq_cnt;
+    int queue_depth;
+
+    //Largest request the device takes
+    uint32_t max_sectors;
+    uint32_t max_segs;
+    uint32_t max_discard_sectors;
+    uint32_t max_write_zeroes_sectors;
+
+    //Every segment but the first must start on this boundary and every one but the last must end on
+    //it, 0 if the device takes arbitrary segments. Only used when deciding whether bios can merge.
+    uint32_t seg_boundary;
+
+    block_device_ops_t ops;
+} block_device_desc_t;
+
+int block_register(block_device_desc_t *desc, void **block_handle);
+
+//Finds a registered device by name, NULL if there is none
+void *block_find(const char *name);
+
+//Device parameters, as registered
+block_device_desc_t *block_getdesc(void *block_handle);
+
+//Queue a bio, 0 once it has been accepted, after which its callback always runs exactly once.
+//-1 if it's malformed or larger than the device takes.
+int block_submit(void *block_handle, block_bio_t *bio);
+
+//Queue several bios before dispatching any of them, which gives adjacent ones a chance to merge.
+//Returns how many were accepted, the rest are malformed.
+int block_submit_batch(void *block_handle, block_bio_t **bios, int cnt);
+
+//Called by the driver once a request has finished, safe from an interrupt handler
+void block_complete(void *block_handle, block_request_t *req, int status);
+
+//Called by the driver when a queue it reported busy has room again for reasons the block layer
+//doesn't see, e.g. a command it issued on its own finished
+void block_kick(void *block_handle, int hwq);
+
+//Synchronous helpers, wait for the transfer to finish
+int block_read(void *block_handle, uint64_t lba, void *addr, uint32_t len);
+int block_write(void *block_handle, uint64_t lba, void *addr, uint32_t len);
+int block_flush(void *block_handle);
+
+#endif